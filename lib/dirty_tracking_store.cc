@@ -0,0 +1,168 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/dirty_tracking_store.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+DirtyTrackingStore::DirtyTrackingStore(RlzValueStore* store, AccessType access)
+    : store_(store), access_(access), modified_(false) {
+}
+
+DirtyTrackingStore::~DirtyTrackingStore() {
+}
+
+bool DirtyTrackingStore::HasAccess(AccessType type) {
+  if (type == kWriteAccess && access_ != kWriteAccess)
+    return false;
+  return store_->HasAccess(type);
+}
+
+bool DirtyTrackingStore::WritePingTime(Product product, int64 time) {
+  if (!CanWrite())
+    return false;
+  int64 current_time;
+  if (store_->ReadPingTime(product, &current_time) && current_time == time)
+    return true;
+  modified_ = true;
+  return store_->WritePingTime(product, time);
+}
+
+bool DirtyTrackingStore::ReadPingTime(Product product, int64* time) {
+  return store_->ReadPingTime(product, time);
+}
+
+bool DirtyTrackingStore::ClearPingTime(Product product) {
+  if (!CanWrite())
+    return false;
+  int64 current_time;
+  if (!store_->ReadPingTime(product, &current_time))
+    return true;
+  modified_ = true;
+  return store_->ClearPingTime(product);
+}
+
+
+bool DirtyTrackingStore::WriteAccessPointRlz(AccessPoint access_point,
+                                             const char* new_rlz) {
+  if (!CanWrite())
+    return false;
+  char current_rlz[kMaxRlzLength + 1];
+  if (store_->ReadAccessPointRlz(access_point, current_rlz,
+                                 arraysize(current_rlz)) &&
+      strcmp(current_rlz, new_rlz) == 0)
+    return true;
+  modified_ = true;
+  return store_->WriteAccessPointRlz(access_point, new_rlz);
+}
+
+bool DirtyTrackingStore::ReadAccessPointRlz(AccessPoint access_point,
+                                            char* rlz,
+                                            size_t rlz_size) {
+  return store_->ReadAccessPointRlz(access_point, rlz, rlz_size);
+}
+
+bool DirtyTrackingStore::ClearAccessPointRlz(AccessPoint access_point) {
+  if (!CanWrite())
+    return false;
+  char current_rlz[kMaxRlzLength + 1];
+  if (store_->ReadAccessPointRlz(access_point, current_rlz,
+                                 arraysize(current_rlz)) &&
+      current_rlz[0] == '\0')
+    return true;
+  modified_ = true;
+  return store_->ClearAccessPointRlz(access_point);
+}
+
+
+bool DirtyTrackingStore::AddProductEvent(Product product,
+                                         const char* event_rlz) {
+  if (!CanWrite())
+    return false;
+  if (HasProductEvent(product, event_rlz))
+    return true;
+  modified_ = true;
+  return store_->AddProductEvent(product, event_rlz);
+}
+
+bool DirtyTrackingStore::ReadProductEvents(Product product,
+                                           std::vector<std::string>* events) {
+  return store_->ReadProductEvents(product, events);
+}
+
+bool DirtyTrackingStore::ClearProductEvent(Product product,
+                                           const char* event_rlz) {
+  if (!CanWrite())
+    return false;
+  if (!HasProductEvent(product, event_rlz))
+    return true;
+  modified_ = true;
+  return store_->ClearProductEvent(product, event_rlz);
+}
+
+bool DirtyTrackingStore::ClearAllProductEvents(Product product) {
+  if (!CanWrite())
+    return false;
+  std::vector<std::string> events;
+  if (store_->ReadProductEvents(product, &events) && events.empty())
+    return true;
+  modified_ = true;
+  return store_->ClearAllProductEvents(product);
+}
+
+
+bool DirtyTrackingStore::AddStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  if (!CanWrite())
+    return false;
+  if (store_->IsStatefulEvent(product, event_rlz))
+    return true;
+  modified_ = true;
+  return store_->AddStatefulEvent(product, event_rlz);
+}
+
+bool DirtyTrackingStore::IsStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  return store_->IsStatefulEvent(product, event_rlz);
+}
+
+bool DirtyTrackingStore::ClearAllStatefulEvents(Product product) {
+  if (!CanWrite())
+    return false;
+  // RlzValueStore can't tell whether there are any stateful events.
+  modified_ = true;
+  return store_->ClearAllStatefulEvents(product);
+}
+
+
+void DirtyTrackingStore::CollectGarbage() {
+  if (!CanWrite())
+    return;
+  modified_ = true;
+  store_->CollectGarbage();
+}
+
+bool DirtyTrackingStore::CanWrite() {
+  if (access_ == kWriteAccess)
+    return true;
+  ASSERT_STRING("DirtyTrackingStore: Write through a read lock");
+  return false;
+}
+
+bool DirtyTrackingStore::HasProductEvent(Product product,
+                                         const char* event_rlz) {
+  std::vector<std::string> events;
+  if (!store_->ReadProductEvents(product, &events))
+    return false;
+  return std::find(events.begin(), events.end(), event_rlz) != events.end();
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,75 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LIB_DIRTY_TRACKING_STORE_H_
+#define RLZ_LIB_DIRTY_TRACKING_STORE_H_
+
+#include "base/compiler_specific.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+// Wraps the store of a ScopedRlzValueStoreLock and remembers whether any call
+// changed it. Writes that wouldn't change the stored value, like setting an
+// RLZ to its current value or clearing an event that isn't recorded, are
+// dropped before they reach the wrapped store. The factory then only needs to
+// write the store back if modified() is true, so scopes that only read cost
+// no disk writes.
+//
+// The store of a read lock is only wrapped for |access| kReadAccess. It
+// denies write access and fails all writes.
+class DirtyTrackingStore : public RlzValueStore {
+ public:
+  // Doesn't take ownership of |store|.
+  DirtyTrackingStore(RlzValueStore* store, AccessType access);
+  virtual ~DirtyTrackingStore();
+
+  RlzValueStore* store() const { return store_; }
+  bool modified() const { return modified_; }
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+ private:
+  // Returns false, and asserts, if the store is read only.
+  bool CanWrite();
+
+  // Returns whether |event_rlz| is one of |product|'s events.
+  bool HasProductEvent(Product product, const char* event_rlz);
+
+  RlzValueStore* store_;
+  AccessType access_;
+  bool modified_;
+
+  DISALLOW_COPY_AND_ASSIGN(DirtyTrackingStore);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_DIRTY_TRACKING_STORE_H_
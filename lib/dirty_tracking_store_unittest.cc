@@ -0,0 +1,137 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/dirty_tracking_store.h"
+
+#include <string>
+#include <vector>
+
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// A memory store factory that remembers how its store was released.
+class RecordingStoreFactory : public rlz_lib::MemoryStoreFactory {
+ public:
+  RecordingStoreFactory() : releases_(0), modified_(false) {}
+
+  virtual void ReleaseStore(rlz_lib::RlzValueStore* store,
+                            rlz_lib::RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+    ++releases_;
+    modified_ = modified;
+    rlz_lib::MemoryStoreFactory::ReleaseStore(store, access, modified);
+  }
+
+  int releases() const { return releases_; }
+  bool modified() const { return modified_; }
+
+ private:
+  int releases_;
+  bool modified_;
+};
+
+}  // namespace
+
+TEST(DirtyTrackingStoreTest, AccessPointRlz) {
+  rlz_lib::RlzValueStoreMemory memory_store;
+  {
+    rlz_lib::DirtyTrackingStore store(&memory_store,
+                                      rlz_lib::RlzValueStore::kWriteAccess);
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    EXPECT_TRUE(store.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+    EXPECT_TRUE(store.ClearAccessPointRlz(rlz_lib::IETB_SEARCH_BOX));
+    EXPECT_FALSE(store.modified());
+    EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                          "TbRlzValue"));
+    EXPECT_TRUE(store.modified());
+  }
+  {
+    rlz_lib::DirtyTrackingStore store(&memory_store,
+                                      rlz_lib::RlzValueStore::kWriteAccess);
+    EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                          "TbRlzValue"));
+    EXPECT_FALSE(store.modified());
+    EXPECT_TRUE(store.ClearAccessPointRlz(rlz_lib::IETB_SEARCH_BOX));
+    EXPECT_TRUE(store.modified());
+  }
+}
+
+TEST(DirtyTrackingStoreTest, PingTimeAndEvents) {
+  rlz_lib::RlzValueStoreMemory memory_store;
+  EXPECT_TRUE(memory_store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(memory_store.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(memory_store.AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+
+  rlz_lib::DirtyTrackingStore store(&memory_store,
+                                    rlz_lib::RlzValueStore::kWriteAccess);
+  EXPECT_TRUE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store.ClearPingTime(rlz_lib::DESKTOP));
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(store.ClearProductEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_TRUE(store.ClearAllProductEvents(rlz_lib::DESKTOP));
+  EXPECT_TRUE(store.AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_FALSE(store.modified());
+
+  EXPECT_TRUE(store.ClearProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(store.modified());
+  std::vector<std::string> events;
+  EXPECT_TRUE(memory_store.ReadProductEvents(rlz_lib::CHROME, &events));
+  EXPECT_TRUE(events.empty());
+}
+
+TEST(DirtyTrackingStoreTest, ReadOnly) {
+  rlz_lib::RlzValueStoreMemory memory_store;
+  rlz_lib::DirtyTrackingStore store(&memory_store,
+                                    rlz_lib::RlzValueStore::kReadAccess);
+  EXPECT_TRUE(store.HasAccess(rlz_lib::RlzValueStore::kReadAccess));
+  EXPECT_FALSE(store.HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+
+  rlz_lib::SetExpectedAssertion(
+      "DirtyTrackingStore: Write through a read lock");
+  EXPECT_FALSE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  EXPECT_FALSE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_FALSE(store.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_FALSE(store.AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+  rlz_lib::SetExpectedAssertion("");
+  EXPECT_FALSE(store.modified());
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                       rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+}
+
+TEST(DirtyTrackingStoreTest, ReleasesUnmodifiedStores) {
+  // The second test pass holds a lock for the lifetime of its supplementary
+  // brand, and the factory can't be changed while a lock is held.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  RecordingStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  EXPECT_EQ(1, factory.releases());
+  EXPECT_TRUE(factory.modified());
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+  EXPECT_EQ(2, factory.releases());
+  EXPECT_FALSE(factory.modified());
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  EXPECT_EQ(3, factory.releases());
+  EXPECT_FALSE(factory.modified());
+
+  rlz_lib::SetRlzValueStoreFactory(NULL);
+}
@@ -0,0 +1,207 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/event_buffer.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// How long the thread waits before it writes events again that it failed to
+// write, so that it doesn't spin on a store it can't lock.
+const int kRetryDelayMs = 1000;
+
+base::LazyInstance<EventBuffer>::Leaky g_event_buffer =
+    LAZY_INSTANCE_INITIALIZER;
+
+// Returns whether the store of |product| can be written.
+bool IsWritable(Product product) {
+  ScopedRlzValueStoreLock lock("EventBuffer",
+                               StoreShards::ForProduct(product));
+  RlzValueStore* store = lock.GetStore();
+  return store && store->HasAccess(RlzValueStore::kWriteAccess);
+}
+
+// Doesn't depend on an AtExitManager, which the embedder may not have.
+void FlushAtExit() {
+  GetEventBuffer()->Flush();
+}
+
+}  // namespace
+
+EventBuffer::EventBuffer()
+    : max_events_(0),
+      thread_started_(false),
+      changed_(&lock_) {
+}
+
+bool EventBuffer::SetLimits(size_t max_events, base::TimeDelta max_delay) {
+  base::AutoLock auto_lock(lock_);
+  if (max_events > 0 && !thread_started_) {
+    // The thread lives as long as the process, like this object.
+    thread_started_ = base::PlatformThread::CreateNonJoinable(0, this);
+    if (!thread_started_) {
+      LOG(ERROR) << "Failed to start the RLZ event buffer";
+      return false;
+    }
+    atexit(&FlushAtExit);
+  }
+  max_events_ = max_events;
+  max_delay_ = max_delay;
+  retry_time_ = base::TimeTicks();
+  writable_products_.clear();
+  changed_.Broadcast();
+  return true;
+}
+
+bool EventBuffer::Add(Product product, const char* event_value) {
+  bool checked;
+  {
+    base::AutoLock auto_lock(lock_);
+    if (max_events_ == 0)
+      return false;
+    checked = writable_products_.count(product) != 0;
+  }
+
+  // An event that can't be written isn't buffered, so that the caller fails
+  // as it does without buffering, instead of every later flush.
+  if (!checked && !IsWritable(product))
+    return false;
+
+  base::AutoLock auto_lock(lock_);
+  if (max_events_ == 0)
+    return false;
+  writable_products_.insert(product);
+
+  Event event(product, event_value);
+  if (!event_set_.insert(event).second)
+    return true;
+
+  if (events_.empty())
+    oldest_ = base::TimeTicks::Now();
+  events_.push_back(event);
+  // The thread waits for the first event, and for a full buffer.
+  if (events_.size() == 1 || events_.size() >= max_events_)
+    changed_.Broadcast();
+  return true;
+}
+
+bool EventBuffer::Flush() {
+  if (IsStoreLockHeld())
+    return true;
+
+  base::AutoLock flush_lock(flush_lock_);
+  std::vector<Event> events;
+  {
+    base::AutoLock auto_lock(lock_);
+    events.swap(events_);
+    event_set_.clear();
+  }
+  if (events.empty())
+    return true;
+
+  StoreShards shards = StoreShards::ForProduct(events[0].first);
+  for (size_t i = 1; i < events.size(); ++i)
+    shards = shards | StoreShards::ForProduct(events[i].first);
+
+  bool success = false;
+  bool writable = true;
+  {
+    ScopedRlzValueStoreLock lock("FlushBufferedEvents", shards);
+    RlzValueStore* store = lock.GetStore();
+    writable = !store || store->HasAccess(RlzValueStore::kWriteAccess);
+    if (store && writable) {
+      success = true;
+      for (size_t i = 0; i < events.size(); ++i) {
+        // Like RecordProductEvent(), skip events that are stateful.
+        const char* value = events[i].second.c_str();
+        if (!store->IsStatefulEvent(events[i].first, value))
+          success &= store->AddProductEvent(events[i].first, value);
+      }
+    }
+  }
+
+  if (!writable) {
+    // The store lost its write access since the events were buffered.
+    LOG(ERROR) << "Dropping " << events.size() << " RLZ events that can't be "
+               << "written";
+    base::AutoLock auto_lock(lock_);
+    writable_products_.clear();
+  } else if (!success) {
+    Restore(events);
+  }
+  return success;
+}
+
+void EventBuffer::ThreadMain() {
+  base::PlatformThread::SetName("RlzEventBuffer");
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    if (max_events_ == 0 || events_.empty()) {
+      changed_.Wait();
+      continue;
+    }
+
+    base::TimeTicks now = base::TimeTicks::Now();
+    base::TimeTicks due =
+        events_.size() >= max_events_ ? now : oldest_ + max_delay_;
+    due = std::max(due, retry_time_);
+    if (due > now) {
+      changed_.TimedWait(due - now);
+      continue;
+    }
+
+    bool flushed;
+    {
+      base::AutoUnlock auto_unlock(lock_);
+      flushed = Flush();
+    }
+    if (!flushed) {
+      retry_time_ = base::TimeTicks::Now() +
+          base::TimeDelta::FromMilliseconds(kRetryDelayMs);
+    }
+  }
+}
+
+void EventBuffer::Restore(const std::vector<Event>& events) {
+  base::AutoLock auto_lock(lock_);
+  if (events_.empty())
+    oldest_ = base::TimeTicks::Now();
+
+  std::vector<Event> restored;
+  for (size_t i = 0; i < events.size(); ++i) {
+    if (event_set_.insert(events[i]).second)
+      restored.push_back(events[i]);
+  }
+  events_.insert(events_.begin(), restored.begin(), restored.end());
+}
+
+EventBuffer* GetEventBuffer() {
+  return g_event_buffer.Pointer();
+}
+
+bool SetEventBuffering(int max_events, int max_delay_ms) {
+  EventBuffer* buffer = GetEventBuffer();
+  if (!buffer->SetLimits(std::max(0, max_events),
+                         base::TimeDelta::FromMilliseconds(
+                             std::max(0, max_delay_ms)))) {
+    return false;
+  }
+  return max_events > 0 || buffer->Flush();
+}
+
+bool FlushBufferedEvents() {
+  return GetEventBuffer()->Flush();
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,97 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The process wide buffer of product events that RecordProductEvent() writes
+// behind. See SetEventBuffering() in rlz_lib.h.
+
+#ifndef RLZ_LIB_EVENT_BUFFER_H_
+#define RLZ_LIB_EVENT_BUFFER_H_
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/compiler_specific.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/platform_thread.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+// Buffers events and writes them to the store on a thread of its own once
+// they exceed the limits. Thread-safe.
+class EventBuffer : public base::PlatformThread::Delegate {
+ public:
+  EventBuffer();
+
+  // Buffers up to |max_events| for up to |max_delay|. A |max_events| of 0
+  // turns buffering off, but doesn't write the buffered events. Returns false
+  // if the thread that writes them can't be started.
+  bool SetLimits(size_t max_events, base::TimeDelta max_delay);
+
+  // Buffers the event that is stored as |event_value| for |product|. Returns
+  // false if buffering is off, or if the store of |product| can't be written,
+  // in which case the caller must write it. The store is checked with the
+  // lock for the first event of each product after the limits were set.
+  bool Add(Product product, const char* event_value);
+
+  // Writes the buffered events to the store with one lock. Doesn't write
+  // anything if the calling thread holds the lock already: the events it
+  // buffered were written before it took the lock. Returns false if the
+  // events can't be written. They stay buffered if the store can't be locked,
+  // and are dropped if it can't be written, as they would never be.
+  bool Flush();
+
+  // base::PlatformThread::Delegate:
+  virtual void ThreadMain() OVERRIDE;
+
+ private:
+  // A buffered event and the product it was recorded for.
+  typedef std::pair<Product, std::string> Event;
+
+  // Buffers |events|, which were taken from the buffer but not written, in
+  // front of the events buffered since.
+  void Restore(const std::vector<Event>& events);
+
+  // Held while the buffered events are written, so that a Flush() doesn't
+  // return before events another thread took from the buffer are written.
+  // Taken before |lock_|, and before the lock that protects the store.
+  base::Lock flush_lock_;
+
+  base::Lock lock_;
+
+  // The following are guarded by |lock_|.
+  size_t max_events_;
+  base::TimeDelta max_delay_;
+  bool thread_started_;
+
+  // The buffered events in the order they were recorded, the same events for
+  // looking them up, and when the oldest of them was recorded.
+  std::vector<Event> events_;
+  std::set<Event> event_set_;
+  base::TimeTicks oldest_;
+
+  // The products whose store was found writable, see Add().
+  std::set<Product> writable_products_;
+
+  // After the thread failed to write the buffer, when it tries again.
+  base::TimeTicks retry_time_;
+
+  // Signaled when the limits change, and when the buffer gets its first
+  // event or reaches |max_events_|.
+  base::ConditionVariable changed_;
+
+  DISALLOW_COPY_AND_ASSIGN(EventBuffer);
+};
+
+// Returns the process wide EventBuffer.
+EventBuffer* GetEventBuffer();
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_EVENT_BUFFER_H_
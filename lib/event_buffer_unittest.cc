@@ -0,0 +1,213 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for event buffering. They use a MemoryStoreFactory, so they
+// don't depend on the store the library is built with.
+
+#include "rlz/lib/event_buffer.h"
+
+#include <string>
+#include <vector>
+
+#include "base/compiler_specific.h"
+#include "base/threading/platform_thread.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// A store that can be read but not written.
+class ReadOnlyStore : public rlz_lib::RlzValueStoreMemory {
+ public:
+  virtual bool HasAccess(AccessType type) OVERRIDE {
+    return type == kReadAccess;
+  }
+};
+
+class ReadOnlyStoreFactory : public rlz_lib::RlzValueStoreFactory {
+ public:
+  virtual rlz_lib::RlzValueStore* AcquireStore(
+      const rlz_lib::StoreShards& shards,
+      rlz_lib::RlzValueStore::AccessType access) OVERRIDE {
+    return &store_;
+  }
+  virtual void ReleaseStore(rlz_lib::RlzValueStore* store,
+                            rlz_lib::RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+  }
+  virtual ReaderLocking GetReaderLocking() OVERRIDE {
+    return kExclusiveReaders;
+  }
+
+ private:
+  ReadOnlyStore store_;
+};
+
+class EventBufferTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    // The second test pass holds a lock for the lifetime of its supplementary
+    // brand, so nothing is buffered, and the factory can't be changed.
+    in_supplementary_pass_ =
+        !rlz_lib::SupplementaryBranding::GetBrand().empty();
+    if (!in_supplementary_pass_)
+      rlz_lib::SetRlzValueStoreFactory(&factory_);
+  }
+
+  virtual void TearDown() OVERRIDE {
+    if (!in_supplementary_pass_) {
+      EXPECT_TRUE(rlz_lib::SetEventBuffering(0, 0));
+      rlz_lib::SetRlzValueStoreFactory(NULL);
+    }
+  }
+
+  // Returns how many events are stored for TOOLBAR_NOTIFIER, without writing
+  // the buffered ones.
+  size_t StoredEvents() {
+    rlz_lib::ScopedRlzValueStoreLock lock(
+        "Test", rlz_lib::StoreShards::ForProduct(rlz_lib::TOOLBAR_NOTIFIER),
+        rlz_lib::RlzValueStore::kReadAccess);
+    std::vector<std::string> events;
+    EXPECT_TRUE(lock.GetStore()->ReadProductEvents(rlz_lib::TOOLBAR_NOTIFIER,
+                                                   &events));
+    return events.size();
+  }
+
+  // Waits up to 5 seconds for |count| events to be stored.
+  bool WaitForStoredEvents(size_t count) {
+    base::TimeTicks deadline =
+        base::TimeTicks::Now() + base::TimeDelta::FromSeconds(5);
+    while (StoredEvents() < count) {
+      if (base::TimeTicks::Now() > deadline)
+        return false;
+      base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(5));
+    }
+    return true;
+  }
+
+  rlz_lib::MemoryStoreFactory factory_;
+  bool in_supplementary_pass_;
+};
+
+}  // namespace
+
+TEST_F(EventBufferTest, ReadsWriteTheBuffer) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 60000));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_EQ(0u, StoredEvents());
+
+  char cgi[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             cgi, arraysize(cgi)));
+  EXPECT_STREQ("events=I7S,W1I", cgi);
+  EXPECT_EQ(2u, StoredEvents());
+
+  // Invalid events are rejected right away.
+  EXPECT_FALSE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::NO_ACCESS_POINT, rlz_lib::INSTALL));
+}
+
+TEST_F(EventBufferTest, ClearsBufferedEvents) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 60000));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+
+  char cgi[50];
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi, arraysize(cgi)));
+}
+
+TEST_F(EventBufferTest, WritesFullBuffer) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(2, 60000));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(50));
+  EXPECT_EQ(0u, StoredEvents());
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(WaitForStoredEvents(2));
+}
+
+TEST_F(EventBufferTest, WritesOldEvents) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 50));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(WaitForStoredEvents(1));
+}
+
+TEST_F(EventBufferTest, TurningBufferingOffWritesTheBuffer) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 60000));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::SetEventBuffering(0, 0));
+  EXPECT_EQ(1u, StoredEvents());
+
+  // Without buffering, events are written right away.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_EQ(2u, StoredEvents());
+}
+
+TEST_F(EventBufferTest, DoesntBufferInsideLock) {
+  if (in_supplementary_pass_)
+    return;
+
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 60000));
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock("Test");
+    EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+        rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+    // The buffer can't be written inside the lock, and has nothing to write.
+    EXPECT_TRUE(rlz_lib::FlushBufferedEvents());
+  }
+  EXPECT_EQ(1u, StoredEvents());
+}
+
+TEST_F(EventBufferTest, DoesntBufferForReadOnlyStore) {
+  if (in_supplementary_pass_)
+    return;
+
+  ReadOnlyStoreFactory read_only_factory;
+  rlz_lib::SetRlzValueStoreFactory(&read_only_factory);
+  ASSERT_TRUE(rlz_lib::SetEventBuffering(100, 60000));
+
+  // Like without buffering, the event is rejected, and reads still work.
+  EXPECT_FALSE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::FlushBufferedEvents());
+  char cgi[50];
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              cgi, arraysize(cgi)));
+  rlz_lib::SetRlzValueStoreFactory(&factory_);
+}
@@ -22,6 +22,10 @@
 #include "base/time.h"
 #endif
 
+#if defined(OS_LINUX)
+#include "rlz/linux/lib/event_ring_linux.h"
+#endif
+
 #if defined(RLZ_NETWORK_IMPLEMENTATION_WIN_INET)
 
 #include <windows.h>
@@ -95,7 +99,18 @@ bool FinancialPing::FormRequest(Product product,
 
   request->clear();
 
-  ScopedRlzValueStoreLock lock;
+  // The request reports the buffered events too, and those in the ring.
+  if (!FlushBufferedEvents())
+    return false;
+#if defined(OS_LINUX)
+  if (!DrainEventRingForProduct(product))
+    return false;
+#endif
+
+  ScopedRlzValueStoreLock lock("FinancialPing::FormRequest",
+                               StoreShards::ForProduct(product) |
+                               StoreShards::AccessPoints(),
+                               RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
@@ -181,7 +196,7 @@ net::URLRequestContextGetter* g_context;
 
 bool FinancialPing::SetURLRequestContext(
     net::URLRequestContextGetter* context) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzValueStoreLock lock("SetURLRequestContext");
   RlzValueStore* store = lock.GetStore();
   if (!store)
     return false;
@@ -305,7 +320,17 @@ bool FinancialPing::PingServer(const char* request, std::string* response) {
 }
 
 bool FinancialPing::IsPingTime(Product product, bool no_delay) {
-  ScopedRlzValueStoreLock lock;
+  // Buffered events count as unreported events, and so do those in the ring.
+  if (!FlushBufferedEvents())
+    return false;
+#if defined(OS_LINUX)
+  if (!DrainEventRingForProduct(product))
+    return false;
+#endif
+
+  ScopedRlzValueStoreLock lock("FinancialPing::IsPingTime",
+                               StoreShards::ForProduct(product),
+                               RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
@@ -333,7 +358,8 @@ bool FinancialPing::IsPingTime(Product product, bool no_delay) {
 
 
 bool FinancialPing::UpdateLastPingTime(Product product) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzValueStoreLock lock("FinancialPing::UpdateLastPingTime",
+                               StoreShards::ForProduct(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
@@ -344,7 +370,8 @@ bool FinancialPing::UpdateLastPingTime(Product product) {
 
 
 bool FinancialPing::ClearLastPingTime(Product product) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzValueStoreLock lock("FinancialPing::ClearLastPingTime",
+                               StoreShards::ForProduct(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
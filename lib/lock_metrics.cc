@@ -0,0 +1,175 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/lock_metrics.h"
+
+#include <algorithm>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+
+namespace rlz_lib {
+
+namespace {
+
+base::LazyInstance<LockMetrics>::Leaky g_lock_metrics =
+    LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+LockStats::LockStats()
+    : acquisitions(0),
+      failures(0),
+      busy_failures(0),
+      total_wait_us(0),
+      max_wait_us(0),
+      total_hold_us(0),
+      max_hold_us(0) {
+  std::fill(wait_histogram, wait_histogram + kLockStatsBuckets, 0);
+  std::fill(hold_histogram, hold_histogram + kLockStatsBuckets, 0);
+}
+
+LockMetrics::LockMetrics()
+    : watchdog_started_(false),
+      watchdog_changed_(&lock_) {
+}
+
+void LockMetrics::OnAcquire(const void* holder,
+                            const char* entry_point,
+                            base::TimeDelta wait,
+                            bool acquired,
+                            bool busy) {
+  base::TimeTicks now = base::TimeTicks::Now();
+  base::AutoLock auto_lock(lock_);
+  LockStats* stats = StatsFor(entry_point);
+  int64 wait_us = wait.InMicroseconds();
+  stats->total_wait_us += wait_us;
+  stats->max_wait_us = std::max(stats->max_wait_us, wait_us);
+  AddToHistogram(wait, stats->wait_histogram);
+
+  if (!acquired) {
+    ++stats->failures;
+    if (busy)
+      ++stats->busy_failures;
+    return;
+  }
+
+  ++stats->acquisitions;
+  Holder& record = holders_[holder];
+  record.entry_point = entry_point;
+  record.since = now;
+  record.reported = false;
+}
+
+void LockMetrics::OnRelease(const void* holder) {
+  base::TimeTicks now = base::TimeTicks::Now();
+  base::AutoLock auto_lock(lock_);
+  HolderMap::iterator it = holders_.find(holder);
+  if (it == holders_.end())
+    return;
+
+  base::TimeDelta hold = now - it->second.since;
+  LockStats* stats = StatsFor(it->second.entry_point);
+  int64 hold_us = hold.InMicroseconds();
+  stats->total_hold_us += hold_us;
+  stats->max_hold_us = std::max(stats->max_hold_us, hold_us);
+  AddToHistogram(hold, stats->hold_histogram);
+
+  if (it->second.reported ||
+      (watchdog_threshold_ > base::TimeDelta() &&
+       hold > watchdog_threshold_)) {
+    LOG(WARNING) << "RLZ store lock released by " << it->second.entry_point
+                 << " after " << hold.InMilliseconds() << " ms";
+  }
+  holders_.erase(it);
+}
+
+void LockMetrics::GetStats(std::vector<LockStats>* stats) {
+  base::AutoLock auto_lock(lock_);
+  stats->clear();
+  for (std::map<std::string, LockStats>::const_iterator it = stats_.begin();
+       it != stats_.end(); ++it) {
+    stats->push_back(it->second);
+  }
+}
+
+void LockMetrics::Reset() {
+  base::AutoLock auto_lock(lock_);
+  // Locks that are held still count when they are released.
+  stats_.clear();
+}
+
+void LockMetrics::SetWatchdogThreshold(base::TimeDelta threshold) {
+  base::AutoLock auto_lock(lock_);
+  watchdog_threshold_ = threshold;
+  if (watchdog_threshold_ > base::TimeDelta() && !watchdog_started_) {
+    // The thread lives as long as the process, like this object.
+    watchdog_started_ = base::PlatformThread::CreateNonJoinable(0, this);
+    if (!watchdog_started_)
+      LOG(ERROR) << "Failed to start the RLZ lock watchdog";
+  }
+  watchdog_changed_.Broadcast();
+}
+
+void LockMetrics::ThreadMain() {
+  base::PlatformThread::SetName("RlzLockWatchdog");
+  base::AutoLock auto_lock(lock_);
+  while (true) {
+    if (watchdog_threshold_ <= base::TimeDelta()) {
+      watchdog_changed_.Wait();
+      continue;
+    }
+
+    // Checking twice per threshold reports holders at most 1.5 thresholds
+    // after they took the lock.
+    base::TimeTicks now = base::TimeTicks::Now();
+    for (HolderMap::iterator it = holders_.begin(); it != holders_.end();
+         ++it) {
+      base::TimeDelta hold = now - it->second.since;
+      if (!it->second.reported && hold > watchdog_threshold_) {
+        LOG(WARNING) << "RLZ store lock held by " << it->second.entry_point
+                     << " for " << hold.InMilliseconds() << " ms";
+        it->second.reported = true;
+      }
+    }
+    watchdog_changed_.TimedWait(watchdog_threshold_ / 2);
+  }
+}
+
+// static
+void LockMetrics::AddToHistogram(base::TimeDelta time, int64* histogram) {
+  int64 limit_us = 10;
+  int bucket = 0;
+  while (bucket < kLockStatsBuckets - 1 && time.InMicroseconds() >= limit_us) {
+    limit_us *= 10;
+    ++bucket;
+  }
+  ++histogram[bucket];
+}
+
+LockStats* LockMetrics::StatsFor(const char* entry_point) {
+  LockStats& stats = stats_[entry_point];
+  if (stats.entry_point.empty())
+    stats.entry_point = entry_point;
+  return &stats;
+}
+
+LockMetrics* GetLockMetrics() {
+  return g_lock_metrics.Pointer();
+}
+
+void GetLockStats(std::vector<LockStats>* stats) {
+  GetLockMetrics()->GetStats(stats);
+}
+
+void ResetLockStats() {
+  GetLockMetrics()->Reset();
+}
+
+void SetLockHoldWatchdog(int threshold_ms) {
+  GetLockMetrics()->SetWatchdogThreshold(
+      base::TimeDelta::FromMilliseconds(std::max(0, threshold_ms)));
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,89 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Counters and histograms for the lock that protects the RLZ store, and a
+// watchdog for long-held locks. See GetLockStats() in rlz_lib.h.
+
+#ifndef RLZ_LIB_LOCK_METRICS_H_
+#define RLZ_LIB_LOCK_METRICS_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/compiler_specific.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/platform_thread.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// Collects the metrics of the outermost ScopedRlzValueStoreLocks of all
+// threads, keyed by the public function that took the lock. Thread-safe.
+class LockMetrics : public base::PlatformThread::Delegate {
+ public:
+  LockMetrics();
+
+  // Records that |holder| was done waiting for the lock for |entry_point|
+  // after |wait|. If |acquired|, |holder| holds the lock until
+  // OnRelease(). Otherwise |busy| tells whether the lock was busy.
+  void OnAcquire(const void* holder,
+                 const char* entry_point,
+                 base::TimeDelta wait,
+                 bool acquired,
+                 bool busy);
+
+  // Records that |holder| released the lock it acquired.
+  void OnRelease(const void* holder);
+
+  void GetStats(std::vector<LockStats>* stats);
+  void Reset();
+
+  // Logs holders that keep the lock for longer than |threshold|. A zero
+  // |threshold| turns the watchdog off.
+  void SetWatchdogThreshold(base::TimeDelta threshold);
+
+  // base::PlatformThread::Delegate:
+  virtual void ThreadMain() OVERRIDE;
+
+ private:
+  // The lock a holder took.
+  struct Holder {
+    const char* entry_point;
+    base::TimeTicks since;
+
+    // Whether the watchdog logged the holder already.
+    bool reported;
+  };
+
+  typedef std::map<const void*, Holder> HolderMap;
+
+  static void AddToHistogram(base::TimeDelta time, int64* histogram);
+
+  // Returns the statistics for |entry_point|, creating them if needed.
+  LockStats* StatsFor(const char* entry_point);
+
+  base::Lock lock_;
+
+  // The following are guarded by |lock_|.
+  std::map<std::string, LockStats> stats_;
+  HolderMap holders_;
+  base::TimeDelta watchdog_threshold_;
+  bool watchdog_started_;
+
+  // Signaled when |watchdog_threshold_| changes.
+  base::ConditionVariable watchdog_changed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LockMetrics);
+};
+
+// Returns the process wide LockMetrics.
+LockMetrics* GetLockMetrics();
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_LOCK_METRICS_H_
@@ -0,0 +1,85 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for LockMetrics. They use their own LockMetrics object, so they
+// don't see the locks the other tests take.
+
+#include "rlz/lib/lock_metrics.h"
+
+#include <vector>
+
+#include "base/threading/platform_thread.h"
+#include "base/time.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+const rlz_lib::LockStats* FindStats(
+    const std::vector<rlz_lib::LockStats>& stats, const char* entry_point) {
+  for (size_t i = 0; i < stats.size(); ++i) {
+    if (stats[i].entry_point == entry_point)
+      return &stats[i];
+  }
+  return NULL;
+}
+
+}  // namespace
+
+TEST(LockMetricsTest, CountsPerEntryPoint) {
+  rlz_lib::LockMetrics metrics;
+  int first, second, third;
+  metrics.OnAcquire(&first, "RecordProductEvent",
+                    base::TimeDelta::FromMicroseconds(5), true, false);
+  metrics.OnRelease(&first);
+  metrics.OnAcquire(&second, "RecordProductEvent",
+                    base::TimeDelta::FromMilliseconds(20), false, true);
+  metrics.OnAcquire(&third, "ParsePingResponse",
+                    base::TimeDelta::FromMicroseconds(50), false, false);
+
+  std::vector<rlz_lib::LockStats> stats;
+  metrics.GetStats(&stats);
+  ASSERT_EQ(2u, stats.size());
+
+  const rlz_lib::LockStats* record = FindStats(stats, "RecordProductEvent");
+  ASSERT_TRUE(record);
+  EXPECT_EQ(1, record->acquisitions);
+  EXPECT_EQ(1, record->failures);
+  EXPECT_EQ(1, record->busy_failures);
+  EXPECT_EQ(20005, record->total_wait_us);
+  EXPECT_EQ(20000, record->max_wait_us);
+  EXPECT_EQ(1, record->wait_histogram[0]);  // Less than 10 us.
+  EXPECT_EQ(1, record->wait_histogram[4]);  // 10 to 100 ms.
+  int64 holds = 0;
+  for (int i = 0; i < rlz_lib::kLockStatsBuckets; ++i)
+    holds += record->hold_histogram[i];
+  EXPECT_EQ(1, holds);
+
+  const rlz_lib::LockStats* parse = FindStats(stats, "ParsePingResponse");
+  ASSERT_TRUE(parse);
+  EXPECT_EQ(0, parse->acquisitions);
+  EXPECT_EQ(1, parse->failures);
+  EXPECT_EQ(0, parse->busy_failures);
+  EXPECT_EQ(1, parse->wait_histogram[1]);  // 10 to 100 us.
+
+  metrics.Reset();
+  metrics.GetStats(&stats);
+  EXPECT_TRUE(stats.empty());
+}
+
+TEST(LockMetricsTest, CountsHoldsThatOutliveReset) {
+  rlz_lib::LockMetrics metrics;
+  int holder;
+  metrics.OnAcquire(&holder, "SupplementaryBranding", base::TimeDelta(),
+                    true, false);
+  metrics.Reset();
+  base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(2));
+  metrics.OnRelease(&holder);
+
+  std::vector<rlz_lib::LockStats> stats;
+  metrics.GetStats(&stats);
+  ASSERT_EQ(1u, stats.size());
+  EXPECT_EQ(0, stats[0].acquisitions);
+  EXPECT_GE(stats[0].max_hold_us, 2000);
+  EXPECT_EQ(stats[0].max_hold_us, stats[0].total_hold_us);
+}
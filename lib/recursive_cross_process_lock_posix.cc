@@ -0,0 +1,534 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/recursive_cross_process_lock_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/logging.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+
+#if defined(OS_LINUX)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "base/file_util.h"
+#include "base/string_number_conversions.h"
+#include "base/string_split.h"
+#endif
+
+#if defined(OS_MACOSX)
+#include <sys/sysctl.h>
+#endif
+
+namespace rlz_lib {
+
+// Identifies the process that holds the cross-process lock, also across pid
+// reuse and reboots. All zero if no process holds the lock.
+struct LockOwner {
+  int32 pid;
+
+  // When the process started, in an OS specific unit.
+  uint64 start_time;
+
+  // Only used on linux, where they are read from /proc.
+  char boot_id[36];
+  uint64 pid_namespace;
+};
+
+#if defined(OS_LINUX)
+const uint32 kLockFileMagic = 0x4b4c5a52;  // "RZLK"
+const uint32 kLockFileVersion = 2;
+
+// The layout of the lock file on linux. A file with a different magic or
+// version is initialized again.
+struct CrossProcessLockFile {
+  // Set last by the process that initializes the file.
+  uint32 magic;
+  uint32 version;
+
+  // Robust and process-shared. The kernel only recovers it from owners that
+  // die while it keeps running, not across a crash or reboot.
+  pthread_mutex_t mutex;
+
+  // Guarded by |mutex|.
+  LockOwner owner;
+};
+#endif
+
+namespace {
+
+// Bounds for the number of times a waiter tries a busy lock before it sleeps.
+const int kMinSpins = 1;
+const int kMaxSpins = 128;
+
+// Retries a busy lock a few times before the caller goes to sleep. Holders
+// often keep the lock only for a moment, and a waiter that gets it while
+// spinning is spared the wakeup. Like glibc's adaptive mutexes, the number of
+// tries grows while spinning pays off and shrinks while it doesn't. |limit|
+// is the spin limit of the lock, and must only be used with its in-process
+// lock held.
+class Spinner {
+ public:
+  explicit Spinner(int* limit) : limit_(limit), tries_(0) {}
+
+  // Returns whether the caller should try the lock again.
+  bool ShouldRetry() {
+    if (tries_ >= *limit_) {
+      *limit_ = std::max(kMinSpins, *limit_ / 2);
+      return false;
+    }
+    ++tries_;
+    sched_yield();
+    return true;
+  }
+
+  // Called when a try got the lock.
+  void Acquired() {
+    if (tries_ > 0)
+      *limit_ = std::min(kMaxSpins, *limit_ * 2);
+  }
+
+ private:
+  int* limit_;
+  int tries_;
+
+  DISALLOW_COPY_AND_ASSIGN(Spinner);
+};
+
+#if defined(OS_LINUX)
+
+// Reads the start time of process |pid|, in clock ticks since boot.
+bool GetProcessStartTime(pid_t pid, uint64* start_time) {
+  std::string stat;
+  if (!file_util::ReadFileToString(
+          FilePath(base::StringPrintf("/proc/%d/stat", static_cast<int>(pid))),
+          &stat)) {
+    return false;
+  }
+
+  // The start time is the 22nd field. The second one is the executable name
+  // in parentheses, which may contain spaces, so count from after it.
+  size_t name_end = stat.rfind(')');
+  if (name_end == std::string::npos)
+    return false;
+  std::vector<std::string> fields;
+  base::SplitString(stat.substr(name_end + 2), ' ', &fields);
+  const size_t kStartTimeField = 22 - 3;
+  return fields.size() > kStartTimeField &&
+      base::StringToUint64(fields[kStartTimeField], start_time);
+}
+
+void ReadCurrentOwner(LockOwner* owner) {
+  memset(owner, 0, sizeof(*owner));
+  owner->pid = getpid();
+  GetProcessStartTime(owner->pid, &owner->start_time);
+
+  std::string boot_id;
+  if (file_util::ReadFileToString(
+          FilePath("/proc/sys/kernel/random/boot_id"), &boot_id)) {
+    memcpy(owner->boot_id, boot_id.data(),
+           std::min(boot_id.size(), sizeof(owner->boot_id)));
+  }
+  struct stat info;
+  if (stat("/proc/self/ns/pid", &info) == 0)
+    owner->pid_namespace = info.st_ino;
+}
+
+#elif defined(OS_MACOSX)
+
+// Reads the start time of process |pid|, in microseconds since the epoch.
+bool GetProcessStartTime(pid_t pid, uint64* start_time) {
+  int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, pid };
+  struct kinfo_proc info;
+  size_t size = sizeof(info);
+  if (sysctl(name, arraysize(name), &info, &size, NULL, 0) != 0 || size == 0)
+    return false;
+  const struct timeval& start = info.kp_proc.p_starttime;
+  *start_time = start.tv_sec * 1000000ULL + start.tv_usec;
+  return true;
+}
+
+void ReadCurrentOwner(LockOwner* owner) {
+  memset(owner, 0, sizeof(*owner));
+  owner->pid = getpid();
+  GetProcessStartTime(owner->pid, &owner->start_time);
+}
+
+#else
+
+bool GetProcessStartTime(pid_t /* pid */, uint64* /* start_time */) {
+  return false;
+}
+
+void ReadCurrentOwner(LockOwner* owner) {
+  memset(owner, 0, sizeof(*owner));
+  owner->pid = getpid();
+}
+
+#endif
+
+// Returns this process as a lock owner. Reading it takes a few system calls,
+// so it is cached until the pid changes in a forked child. The cache is
+// shared by all locks.
+LockOwner CurrentOwner() {
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static LockOwner owner;
+  pthread_mutex_lock(&lock);
+  if (owner.pid != getpid())
+    ReadCurrentOwner(&owner);
+  LockOwner result = owner;
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+// Returns whether the process |owner| describes is gone. Returns false if
+// that can't be told, including if |owner| is empty.
+bool IsOwnerGone(const LockOwner& owner) {
+  if (owner.pid == 0)
+    return false;
+
+  LockOwner current = CurrentOwner();
+  if (memcmp(owner.boot_id, current.boot_id, sizeof(owner.boot_id)) != 0)
+    return true;  // The owner ran before a reboot.
+  if (owner.pid_namespace != current.pid_namespace)
+    return false;  // The owner's pid means something else here.
+
+  if (kill(owner.pid, 0) != 0 && errno == ESRCH)
+    return true;
+  // The pid may have been reused by a newer process.
+  uint64 start_time = 0;
+  return owner.start_time != 0 &&
+      GetProcessStartTime(owner.pid, &start_time) &&
+      start_time != owner.start_time;
+}
+
+std::string DescribeOwner(const LockOwner& owner) {
+  if (owner.pid == 0)
+    return "an unknown process";
+  return base::StringPrintf("process %d%s", static_cast<int>(owner.pid),
+                            IsOwnerGone(owner) ? ", which is gone" : "");
+}
+
+#if defined(OS_LINUX)
+
+bool IsInitialized(const CrossProcessLockFile& file) {
+  return file.magic == kLockFileMagic && file.version == kLockFileVersion;
+}
+
+void InitializeMutex(CrossProcessLockFile* file) {
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&file->mutex, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  memset(&file->owner, 0, sizeof(file->owner));
+}
+
+CrossProcessLockFile* MapLockFile(int fd) {
+  void* memory = mmap(NULL, sizeof(CrossProcessLockFile),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (memory == MAP_FAILED)
+    return NULL;
+  return static_cast<CrossProcessLockFile*>(memory);
+}
+
+void UnmapLockFile(CrossProcessLockFile* file) {
+  if (file)
+    munmap(file, sizeof(CrossProcessLockFile));
+}
+
+// Maps the lock file |fd|, and initializes it if no process did so yet.
+// Returns NULL on failure.
+CrossProcessLockFile* OpenLockFile(int fd, const FilePath& path) {
+  CrossProcessLockFile* file = NULL;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size == sizeof(CrossProcessLockFile))
+    file = MapLockFile(fd);
+  if (file && IsInitialized(*file))
+    return file;
+
+  // The file is new, or its creator died before it finished initializing it.
+  // The flock() only keeps processes from initializing it at the same time.
+  if (HANDLE_EINTR(flock(fd, LOCK_EX)) != 0) {
+    PLOG(ERROR) << "flock " << path.value();
+    UnmapLockFile(file);
+    return NULL;
+  }
+
+  if (!file) {
+    // A file of the wrong size is recreated zero-filled, unless another
+    // process fixed it in the meantime.
+    bool sized = fstat(fd, &info) == 0 &&
+        (info.st_size == sizeof(CrossProcessLockFile) ||
+         (HANDLE_EINTR(ftruncate(fd, 0)) == 0 &&
+          HANDLE_EINTR(ftruncate(fd, sizeof(CrossProcessLockFile))) == 0));
+    if (sized)
+      file = MapLockFile(fd);
+    if (!file)
+      PLOG(ERROR) << "map " << path.value();
+  }
+
+  if (file && !IsInitialized(*file)) {
+    InitializeMutex(file);
+    file->version = kLockFileVersion;
+    file->magic = kLockFileMagic;
+  }
+
+  ignore_result(HANDLE_EINTR(flock(fd, LOCK_UN)));
+  return file;
+}
+
+// Returns whether |owner| held the lock before the system last booted. The
+// kernel recovers the mutex from owners that die while it keeps running, see
+// EOWNERDEAD, but not from those.
+bool IsOwnerFromEarlierBoot(const LockOwner& owner) {
+  if (owner.pid == 0)
+    return false;
+  LockOwner current = CurrentOwner();
+  return memcmp(owner.boot_id, current.boot_id, sizeof(owner.boot_id)) != 0;
+}
+
+// Replaces the mutex in |file|, which |owner| held before a reboot, with an
+// unlocked one if |owner| still holds it, and tries to lock it. Returns the
+// result of pthread_mutex_trylock(), or EBUSY if the mutex wasn't replaced.
+// On success the caller is the owner before other waiters can check it.
+int BreakStaleLock(int fd,
+                   CrossProcessLockFile* file,
+                   const LockOwner& owner,
+                   const FilePath& path) {
+  // Other waiters may have seen the same owner, so they take turns. Replacing
+  // the mutex clears the owner, and the mutex is never held by an owner from
+  // an earlier boot afterwards, so only the first of them replaces it.
+  if (HANDLE_EINTR(flock(fd, LOCK_EX)) != 0)
+    return EBUSY;
+  int result = EBUSY;
+  if (memcmp(&file->owner, &owner, sizeof(owner)) == 0) {
+    LOG(WARNING) << "Breaking RLZ lock " << path.value() << " held by "
+                 << DescribeOwner(owner);
+    InitializeMutex(file);
+    result = pthread_mutex_trylock(&file->mutex);
+    if (result == 0)
+      file->owner = CurrentOwner();
+  }
+  ignore_result(HANDLE_EINTR(flock(fd, LOCK_UN)));
+  return result;
+}
+
+// Returns the time on the clock of pthread_mutex_timedlock() that is
+// |deadline|.
+struct timespec ToRealtime(base::TimeTicks deadline) {
+  struct timeval realtime =
+      (base::Time::Now() + (deadline - base::TimeTicks::Now())).ToTimeVal();
+  struct timespec result = {
+    realtime.tv_sec,
+    realtime.tv_usec * base::Time::kNanosecondsPerMicrosecond
+  };
+  return result;
+}
+
+// Locks the mutex in the lock file |fd|, mapped at |file|, giving up at
+// |deadline|. Takes over the mutex if its owner died, or held it before a
+// reboot. |spin_limit| is the lock's, see Spinner.
+bool LockFile(int fd,
+              CrossProcessLockFile* file,
+              const FilePath& path,
+              base::TimeTicks deadline,
+              int* spin_limit) {
+  Spinner spinner(spin_limit);
+  int result;
+  while ((result = pthread_mutex_trylock(&file->mutex)) == EBUSY &&
+         base::TimeTicks::Now() < deadline && spinner.ShouldRetry()) {
+  }
+  if (result == EBUSY) {
+    // The kernel doesn't know owners from before a reboot, so check the owner
+    // before waiting for it. The owner is only written with the mutex held,
+    // so a waiter may read a torn copy, which doesn't match the owner that
+    // BreakStaleLock() compares it with.
+    LockOwner owner = file->owner;
+    if (IsOwnerFromEarlierBoot(owner))
+      result = BreakStaleLock(fd, file, owner, path);
+  } else {
+    spinner.Acquired();
+  }
+  if (result == EBUSY) {
+    struct timespec realtime_deadline = ToRealtime(deadline);
+    result = pthread_mutex_timedlock(&file->mutex, &realtime_deadline);
+  }
+
+  if (result == EOWNERDEAD) {
+    // Stores only ever replace their files atomically or write small slots,
+    // so the data is usable even if the owner died in the middle of a write.
+    LOG(WARNING) << "Recovering RLZ lock " << path.value() << " from "
+                 << DescribeOwner(file->owner);
+    result = pthread_mutex_consistent(&file->mutex);
+  }
+  if (result == ETIMEDOUT || result == EBUSY) {
+    ScopedLockTimeout::SetLockBusy();
+    LockOwner owner = file->owner;
+    LOG(ERROR) << "Timed out waiting for " << path.value() << " held by "
+               << DescribeOwner(owner);
+    return false;
+  }
+  if (result != 0) {
+    LOG(ERROR) << "Failed to lock " << path.value() << ": " << result;
+    return false;
+  }
+  file->owner = CurrentOwner();
+  return true;
+}
+
+void UnlockFile(CrossProcessLockFile* file) {
+  memset(&file->owner, 0, sizeof(file->owner));
+  pthread_mutex_unlock(&file->mutex);
+}
+
+#else
+
+// Records this process as the owner of the lock file |fd|, for waiters that
+// time out. The kernel releases an flock() when its owner dies, so the owner
+// is never stale.
+void WriteOwner(int fd) {
+  LockOwner owner = CurrentOwner();
+  ignore_result(HANDLE_EINTR(pwrite(fd, &owner, sizeof(owner), 0)));
+}
+
+// Locks the lock file |fd|, giving up at |deadline|. flock() can't time
+// out, so a busy lock is polled, backing off from kMinPollMicroseconds to
+// kMaxPollMicroseconds. |spin_limit| is the lock's, see Spinner.
+bool LockFile(int fd,
+              const FilePath& path,
+              base::TimeTicks deadline,
+              int* spin_limit) {
+  const int kMinPollMicroseconds = 100;
+  const int kMaxPollMicroseconds = 10000;
+
+  Spinner spinner(spin_limit);
+  int result;
+  while ((result = HANDLE_EINTR(flock(fd, LOCK_EX | LOCK_NB))) != 0 &&
+         errno == EWOULDBLOCK && base::TimeTicks::Now() < deadline &&
+         spinner.ShouldRetry()) {
+  }
+  if (result == 0) {
+    spinner.Acquired();
+    WriteOwner(fd);
+    return true;
+  }
+
+  int poll_microseconds = kMinPollMicroseconds;
+  bool busy = errno == EWOULDBLOCK;
+  while (busy && base::TimeTicks::Now() < deadline) {
+    usleep(std::min<int64>(
+        poll_microseconds,
+        (deadline - base::TimeTicks::Now()).InMicroseconds() + 1));
+    poll_microseconds = std::min(kMaxPollMicroseconds, poll_microseconds * 2);
+    if (HANDLE_EINTR(flock(fd, LOCK_EX | LOCK_NB)) == 0) {
+      WriteOwner(fd);
+      return true;
+    }
+    busy = errno == EWOULDBLOCK;
+  }
+
+  if (busy) {
+    ScopedLockTimeout::SetLockBusy();
+    LockOwner owner;
+    memset(&owner, 0, sizeof(owner));
+    ignore_result(HANDLE_EINTR(pread(fd, &owner, sizeof(owner), 0)));
+    LOG(ERROR) << "Timed out waiting for " << path.value() << " held by "
+               << DescribeOwner(owner);
+  } else {
+    PLOG(ERROR) << "flock lock " << path.value();
+  }
+  return false;
+}
+
+#endif
+
+}  // namespace
+
+bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
+    const FilePath& lock_filename) {
+  bool just_got_lock = false;
+
+  // Emulate a recursive mutex with a non-recursive one.
+  if (pthread_mutex_trylock(&recursive_lock_) == EBUSY) {
+    if (pthread_equal(pthread_self(), locking_thread_) == 0) {
+      // Some other thread has the lock, wait for it.
+      pthread_mutex_lock(&recursive_lock_);
+      CHECK(locking_thread_ == 0);
+      just_got_lock = true;
+    }
+  } else {
+    just_got_lock = true;
+  }
+
+  locking_thread_ = pthread_self();
+
+  // Try to acquire file lock.
+  if (just_got_lock) {
+    CHECK_EQ(-1, file_lock_);
+    int fd = HANDLE_EINTR(open(lock_filename.value().c_str(),
+                               O_RDWR | O_CREAT, 0666));
+    if (fd == -1) {
+      PLOG(ERROR) << "open lock " << lock_filename.value();
+      return false;
+    }
+
+#if defined(OS_LINUX)
+    CrossProcessLockFile* file = OpenLockFile(fd, lock_filename);
+    if (!file || !LockFile(fd, file, lock_filename, GetStoreLockDeadline(),
+                           &spin_limit_)) {
+      UnmapLockFile(file);
+      ignore_result(HANDLE_EINTR(close(fd)));
+      return false;
+    }
+    lock_file_ = file;
+#else
+    if (!LockFile(fd, lock_filename, GetStoreLockDeadline(), &spin_limit_)) {
+      ignore_result(HANDLE_EINTR(close(fd)));
+      return false;
+    }
+#endif
+    file_lock_ = fd;
+    return true;
+  } else {
+    return file_lock_ != -1;
+  }
+}
+
+void RecursiveCrossProcessLock::ReleaseLock() {
+  if (file_lock_ != -1) {
+#if defined(OS_LINUX)
+    UnlockFile(lock_file_);
+    UnmapLockFile(lock_file_);
+    lock_file_ = NULL;
+#else
+    ignore_result(HANDLE_EINTR(flock(file_lock_, LOCK_UN)));
+#endif
+    ignore_result(HANDLE_EINTR(close(file_lock_)));
+    file_lock_ = -1;
+  }
+
+  locking_thread_ = 0;
+  pthread_mutex_unlock(&recursive_lock_);
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,65 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LIB_RECURSIVE_CROSS_PROCESS_LOCK_POSIX_H_
+#define RLZ_LIB_RECURSIVE_CROSS_PROCESS_LOCK_POSIX_H_
+
+#include <pthread.h>
+
+class FilePath;
+
+namespace rlz_lib {
+
+struct CrossProcessLockFile;
+
+// Creating a recursive cross-process mutex on windows is one line. On posix,
+// there's no primitive for that, so this lock is emulated by an in-process
+// mutex to get the recursive part, followed by a cross-process lock for the
+// cross-process part.
+//
+// On linux, the cross-process part is a robust process-shared mutex that
+// lives in the lock file. Waiters sleep on a futex and are woken as soon as
+// the holder unlocks, and the kernel hands the mutex on if the holder dies.
+// Elsewhere it is an flock() on the lock file, which the kernel also releases
+// if the holder dies, but which can't time out, so waiters poll it.
+//
+// Either way, waiters spin briefly before they sleep, and give up at the
+// store's lock deadline, see GetStoreLockDeadline(). If the lock was busy
+// until then, they report that with ScopedLockTimeout::SetLockBusy().
+//
+// This is a struct so that it doesn't need a static initializer.
+struct RecursiveCrossProcessLock {
+  // Tries to acquire a recursive cross-process lock. Note that this _always_
+  // acquires the in-process lock (if it wasn't already acquired). The parent
+  // directory of |lock_file| must exist.
+  bool TryGetCrossProcessLock(const FilePath& lock_filename);
+
+  // Releases the lock. Should always be called, even if
+  // TryGetCrossProcessLock() returns false.
+  void ReleaseLock();
+
+  pthread_mutex_t recursive_lock_;
+  pthread_t locking_thread_;
+
+  // The lock file while the cross-process lock is held, otherwise -1.
+  int file_lock_;
+
+  // The mapping of the lock file while the cross-process lock is held. Only
+  // used on linux.
+  CrossProcessLockFile* lock_file_;
+
+  // How often waiters try the busy cross-process lock before they sleep.
+  // Adapts to how long the lock is held. Guarded by |recursive_lock_|.
+  int spin_limit_;
+};
+
+// PTHREAD_RECURSIVE_MUTEX_INITIALIZER doesn't exist before 10.7 and is buggy
+// on 10.7 (http://gcc.gnu.org/bugzilla/show_bug.cgi?id=51906#c34), so emulate
+// recursive locking with a normal non-recursive mutex.
+#define RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER \
+    { PTHREAD_MUTEX_INITIALIZER, 0, -1, NULL, 1 }
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_RECURSIVE_CROSS_PROCESS_LOCK_POSIX_H_
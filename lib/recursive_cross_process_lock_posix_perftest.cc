@@ -0,0 +1,117 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Measures how long a process waiting for RecursiveCrossProcessLock takes to
+// get the lock after its holder released it, and what an uncontended lock
+// costs.
+
+#include "rlz/lib/recursive_cross_process_lock_posix.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/basictypes.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/logging.h"
+#include "base/perftimer.h"
+#include "base/scoped_temp_dir.h"
+#include "base/time.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+const int kHandoffs = 100;
+const int kUncontendedLocks = 10000;
+
+// How long the holder keeps the lock, so that the waiter is asleep by the
+// time it is released.
+const int kHoldMicroseconds = 5000;
+
+// Takes the lock kHandoffs times after reading a byte from |go|, and writes
+// the time it got the lock to |acquired|.
+void RunWaiter(const FilePath& lock_path, int go, int acquired) {
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  for (int i = 0; i < kHandoffs; ++i) {
+    char c;
+    CHECK_EQ(1, HANDLE_EINTR(read(go, &c, 1)));
+    CHECK(lock.TryGetCrossProcessLock(lock_path));
+    int64 now = base::TimeTicks::Now().ToInternalValue();
+    lock.ReleaseLock();
+    CHECK_EQ(static_cast<ssize_t>(sizeof(now)),
+             HANDLE_EINTR(write(acquired, &now, sizeof(now))));
+  }
+}
+
+}  // namespace
+
+TEST(RecursiveCrossProcessLockPerfTest, Handoff) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath lock_path = temp_dir.path().Append("lockfile");
+
+  int go[2];
+  int acquired[2];
+  ASSERT_EQ(0, pipe(go));
+  ASSERT_EQ(0, pipe(acquired));
+
+  // Fork before this process takes the lock, so that the child starts out
+  // with an unlocked copy.
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    RunWaiter(lock_path, go[0], acquired[1]);
+    _exit(0);
+  }
+
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  base::TimeDelta total;
+  base::TimeDelta longest;
+  for (int i = 0; i < kHandoffs; ++i) {
+    ASSERT_TRUE(lock.TryGetCrossProcessLock(lock_path));
+    ASSERT_EQ(1, HANDLE_EINTR(write(go[1], "g", 1)));
+    usleep(kHoldMicroseconds);
+    base::TimeTicks released = base::TimeTicks::Now();
+    lock.ReleaseLock();
+
+    int64 now = 0;
+    ASSERT_EQ(static_cast<ssize_t>(sizeof(now)),
+              HANDLE_EINTR(read(acquired[0], &now, sizeof(now))));
+    base::TimeDelta handoff =
+        base::TimeTicks::FromInternalValue(now) - released;
+    total += handoff;
+    longest = std::max(longest, handoff);
+  }
+
+  int status = 0;
+  EXPECT_EQ(pid, HANDLE_EINTR(waitpid(pid, &status, 0)));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  for (int i = 0; i < 2; ++i) {
+    ignore_result(HANDLE_EINTR(close(go[i])));
+    ignore_result(HANDLE_EINTR(close(acquired[i])));
+  }
+
+  LogPerfResult("lock_handoff_mean",
+                total.InMicroseconds() / static_cast<double>(kHandoffs),
+                "us");
+  LogPerfResult("lock_handoff_max", longest.InMicroseconds(), "us");
+}
+
+TEST(RecursiveCrossProcessLockPerfTest, Uncontended) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath lock_path = temp_dir.path().Append("lockfile");
+
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  PerfTimeLogger timer("uncontended_locks");
+  for (int i = 0; i < kUncontendedLocks; ++i) {
+    ASSERT_TRUE(lock.TryGetCrossProcessLock(lock_path));
+    lock.ReleaseLock();
+  }
+}
@@ -0,0 +1,179 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for RecursiveCrossProcessLock. The other process is a forked
+// child with its own copy of the lock.
+
+#include "rlz/lib/recursive_cross_process_lock_posix.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/compiler_specific.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/scoped_temp_dir.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+class RecursiveCrossProcessLockTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    ASSERT_EQ(0, pipe(pipe_));
+  }
+
+  virtual void TearDown() OVERRIDE {
+    ignore_result(HANDLE_EINTR(close(pipe_[0])));
+    ignore_result(HANDLE_EINTR(close(pipe_[1])));
+  }
+
+  FilePath LockPath() {
+    return temp_dir_.path().Append("lockfile");
+  }
+
+  // Forks a child that takes the lock, writes 'l' to the pipe and sleeps
+  // for |hold_ms|. It then writes 'r' to the pipe and releases the lock if
+  // |release| is true, or exits holding it otherwise.
+  pid_t ForkHolder(int hold_ms, bool release) {
+    pid_t pid = fork();
+    if (pid != 0)
+      return pid;
+
+    rlz_lib::RecursiveCrossProcessLock lock =
+        RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+    if (!lock.TryGetCrossProcessLock(LockPath()))
+      _exit(1);
+    ignore_result(HANDLE_EINTR(write(pipe_[1], "l", 1)));
+    usleep(hold_ms * 1000);
+    if (release) {
+      ignore_result(HANDLE_EINTR(write(pipe_[1], "r", 1)));
+      lock.ReleaseLock();
+    }
+    _exit(0);
+  }
+
+  char ReadPipe() {
+    char c = 0;
+    EXPECT_EQ(1, HANDLE_EINTR(read(pipe_[0], &c, 1)));
+    return c;
+  }
+
+  void WaitForChild(pid_t pid) {
+    int status = 0;
+    EXPECT_EQ(pid, HANDLE_EINTR(waitpid(pid, &status, 0)));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  ScopedTempDir temp_dir_;
+  int pipe_[2];
+};
+
+}  // namespace
+
+TEST_F(RecursiveCrossProcessLockTest, ExcludesOtherProcesses) {
+  pid_t pid = ForkHolder(100, true);
+  ASSERT_NE(-1, pid);
+  EXPECT_EQ('l', ReadPipe());
+
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+
+  // The child said it releases the lock before it did.
+  ASSERT_EQ(0, fcntl(pipe_[0], F_SETFL, O_NONBLOCK));
+  EXPECT_EQ('r', ReadPipe());
+
+  // Taking the lock again on the same thread is recursive.
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  lock.ReleaseLock();
+  WaitForChild(pid);
+}
+
+TEST_F(RecursiveCrossProcessLockTest, ReleasedWhenHolderDies) {
+  pid_t pid = ForkHolder(0, false);
+  ASSERT_NE(-1, pid);
+  EXPECT_EQ('l', ReadPipe());
+  WaitForChild(pid);
+
+  // The lock is handed on right away instead of after the timeout.
+  base::TimeTicks start = base::TimeTicks::Now();
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  EXPECT_LT(base::TimeTicks::Now() - start, base::TimeDelta::FromSeconds(1));
+  lock.ReleaseLock();
+
+  // And works as before afterwards.
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  lock.ReleaseLock();
+}
+
+#if defined(OS_LINUX)
+TEST_F(RecursiveCrossProcessLockTest, StaleLockIsBroken) {
+  pid_t pid = ForkHolder(100, true);
+  ASSERT_NE(-1, pid);
+  EXPECT_EQ('l', ReadPipe());
+
+  // Keep a copy of the lock file while the child holds the lock, and restore
+  // it after the child is gone, with the owner from another boot. That is
+  // what the file looks like after the machine crashed with the lock held:
+  // no kernel marks the mutex as owned by a dead process.
+  std::string held;
+  ASSERT_TRUE(file_util::ReadFileToString(LockPath(), &held));
+  EXPECT_EQ('r', ReadPipe());
+  WaitForChild(pid);
+  std::string boot_id;
+  ASSERT_TRUE(file_util::ReadFileToString(
+      FilePath("/proc/sys/kernel/random/boot_id"), &boot_id));
+  size_t boot_id_offset = held.find(boot_id.substr(0, 36));
+  ASSERT_NE(std::string::npos, boot_id_offset);
+  held[boot_id_offset] = held[boot_id_offset] == '0' ? '1' : '0';
+  ASSERT_EQ(static_cast<int>(held.size()),
+            file_util::WriteFile(LockPath(), held.data(), held.size()));
+
+  // The recorded owner is gone, so the lock is taken over right away.
+  base::TimeTicks start = base::TimeTicks::Now();
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  EXPECT_LT(base::TimeTicks::Now() - start, base::TimeDelta::FromSeconds(1));
+  lock.ReleaseLock();
+
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  lock.ReleaseLock();
+}
+#endif
+
+TEST_F(RecursiveCrossProcessLockTest, ZeroTimeoutDoesntWait) {
+  pid_t pid = ForkHolder(500, true);
+  ASSERT_NE(-1, pid);
+  EXPECT_EQ('l', ReadPipe());
+
+  rlz_lib::RecursiveCrossProcessLock lock =
+      RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+  {
+    rlz_lib::ScopedLockTimeout timeout(0);
+    base::TimeTicks start = base::TimeTicks::Now();
+    EXPECT_FALSE(lock.TryGetCrossProcessLock(LockPath()));
+    EXPECT_LT(base::TimeTicks::Now() - start,
+              base::TimeDelta::FromMilliseconds(250));
+    EXPECT_TRUE(timeout.lock_busy());
+    lock.ReleaseLock();
+  }
+
+  // The default timeout waits for the child.
+  EXPECT_TRUE(lock.TryGetCrossProcessLock(LockPath()));
+  lock.ReleaseLock();
+  EXPECT_EQ('r', ReadPipe());
+  WaitForChild(pid);
+}
@@ -11,11 +11,17 @@
 #include "base/stringprintf.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/crc32.h"
+#include "rlz/lib/event_buffer.h"
 #include "rlz/lib/financial_ping.h"
 #include "rlz/lib/lib_values.h"
 #include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/store_keys.h"
 #include "rlz/lib/string_utils.h"
 
+#if defined(OS_LINUX)
+#include "rlz/linux/lib/event_ring_linux.h"
+#endif
+
 namespace {
 
 // Event information returned from ping response.
@@ -142,25 +148,65 @@ void GetEventsFromResponseString(
 }
 
 // Event storage functions.
-bool RecordStatefulEvent(rlz_lib::Product product, rlz_lib::AccessPoint point,
-                         rlz_lib::Event event) {
-  rlz_lib::ScopedRlzValueStoreLock lock;
-  rlz_lib::RlzValueStore* store = lock.GetStore();
-  if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
-    return false;
+
+// Returns the interned value |event| at |point| is stored as, or NULL if
+// there is none.
+const char* GetEventValue(rlz_lib::AccessPoint point, rlz_lib::Event event) {
+  const rlz_lib::StoreKey* key = rlz_lib::GetEventKey(point, event);
+  return key ? key->name : NULL;
+}
+
+bool AddProductEvent(rlz_lib::RlzValueStore* store,
+                     rlz_lib::Product product,
+                     const char* event_value) {
+  // Check whether this event is a stateful event. If so, don't record it.
+  if (store->IsStatefulEvent(product, event_value)) {
+    // For a stateful event we skip recording, this function is also
+    // considered successful.
+    return true;
+  }
 
   // Write the new event to the value store.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
+  return store->AddProductEvent(product, event_value);
+}
+
+// RLZ storage functions.
+
+// Returns whether |new_rlz| can be stored for |point|, and asserts if not.
+bool IsRlzValid(rlz_lib::AccessPoint point, const char* new_rlz) {
+  if (!new_rlz) {
+    ASSERT_STRING("SetAccessPointRlz: Invalid buffer");
+    return false;
+  }
+
+  // Return false if the access point is not set to Google.
+  if (!IsAccessPointSupported(point)) {
+    ASSERT_STRING(("SetAccessPointRlz: "
+                "Cannot set RLZ for unsupported access point."));
     return false;
+  }
 
-  if (!point_name[0] || !event_name[0])
+  // Verify the RLZ length.
+  size_t rlz_length = strlen(new_rlz);
+  if (rlz_length > rlz_lib::kMaxRlzLength) {
+    ASSERT_STRING("SetAccessPointRlz: RLZ length is exceeds max allowed.");
     return false;
+  }
+  return true;
+}
+
+// Stores |new_rlz|, which must be valid, for |point|.
+bool WriteAccessPointRlz(rlz_lib::RlzValueStore* store,
+                         rlz_lib::AccessPoint point,
+                         const char* new_rlz) {
+  char normalized_rlz[rlz_lib::kMaxRlzLength + 1];
+  NormalizeRlz(new_rlz, normalized_rlz);
+  VERIFY(strlen(new_rlz) == strlen(normalized_rlz));
 
-  std::string new_event_value;
-  base::StringAppendF(&new_event_value, "%s%s", point_name, event_name);
-  return store->AddStatefulEvent(product, new_event_value.c_str());
+  // Setting RLZ to empty == clearing.
+  if (normalized_rlz[0] == 0)
+    return store->ClearAccessPointRlz(point);
+  return store->WriteAccessPointRlz(point, normalized_rlz);
 }
 
 bool GetProductEventsAsCgiHelper(rlz_lib::Product product, char* cgi,
@@ -222,7 +268,16 @@ bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size) {
 
   cgi[0] = 0;
 
-  ScopedRlzValueStoreLock lock;
+  if (!FlushBufferedEvents())
+    return false;
+#if defined(OS_LINUX)
+  if (!DrainEventRingForProduct(product))
+    return false;
+#endif
+
+  ScopedRlzValueStoreLock lock("GetProductEventsAsCgi",
+                               StoreShards::ForProduct(product),
+                               RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
@@ -241,52 +296,48 @@ bool GetProductEventsAsCgi(Product product, char* cgi, size_t cgi_size) {
 }
 
 bool RecordProductEvent(Product product, AccessPoint point, Event event) {
-  ScopedRlzValueStoreLock lock;
-  RlzValueStore* store = lock.GetStore();
-  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
-    return false;
-
   // Get this event's value.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
+  const char* new_event_value = GetEventValue(point, event);
+  if (!new_event_value)
+    return false;
+
+  // Inside a lock, the event is written with the lock, for example under the
+  // supplementary brand.
+  if (!IsStoreLockHeld()) {
+    if (GetEventBuffer()->Add(product, new_event_value))
+      return true;
+#if defined(OS_LINUX)
+    if (PushToEventRing(product, point, event))
+      return true;
+#endif
+  }
 
-  if (!point_name[0] || !event_name[0])
+  ScopedRlzValueStoreLock lock("RecordProductEvent",
+                               StoreShards::ForProduct(product));
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
-  std::string new_event_value;
-  base::StringAppendF(&new_event_value, "%s%s", point_name, event_name);
-
-  // Check whether this event is a stateful event. If so, don't record it.
-  if (store->IsStatefulEvent(product, new_event_value.c_str())) {
-    // For a stateful event we skip recording, this function is also
-    // considered successful.
-    return true;
-  }
-
-  // Write the new event to the value store.
-  return store->AddProductEvent(product, new_event_value.c_str());
+  return AddProductEvent(store, product, new_event_value);
 }
 
 bool ClearProductEvent(Product product, AccessPoint point, Event event) {
-  ScopedRlzValueStoreLock lock;
+  // A buffered event must be written before it can be cleared.
+  if (!FlushBufferedEvents())
+    return false;
+
+  ScopedRlzValueStoreLock lock("ClearProductEvent",
+                               StoreShards::ForProduct(product));
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
   // Get the event's value store value and delete it.
-  const char* point_name = GetAccessPointName(point);
-  const char* event_name = GetEventName(event);
-  if (!point_name || !event_name)
-    return false;
-
-  if (!point_name[0] || !event_name[0])
+  const char* event_value = GetEventValue(point, event);
+  if (!event_value)
     return false;
 
-  std::string event_value;
-  base::StringAppendF(&event_value, "%s%s", point_name, event_name);
-  return store->ClearProductEvent(product, event_value.c_str());
+  return store->ClearProductEvent(product, event_value);
 }
 
 // RLZ storage functions.
@@ -299,7 +350,9 @@ bool GetAccessPointRlz(AccessPoint point, char* rlz, size_t rlz_size) {
 
   rlz[0] = 0;
 
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzValueStoreLock lock("GetAccessPointRlz",
+                               StoreShards::AccessPoints(),
+                               RlzValueStore::kReadAccess);
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
     return false;
@@ -311,38 +364,127 @@ bool GetAccessPointRlz(AccessPoint point, char* rlz, size_t rlz_size) {
 }
 
 bool SetAccessPointRlz(AccessPoint point, const char* new_rlz) {
-  ScopedRlzValueStoreLock lock;
+  ScopedRlzValueStoreLock lock("SetAccessPointRlz",
+                               StoreShards::AccessPoints());
   RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
     return false;
 
-  if (!new_rlz) {
-    ASSERT_STRING("SetAccessPointRlz: Invalid buffer");
+  if (!IsRlzValid(point, new_rlz))
     return false;
-  }
 
-  // Return false if the access point is not set to Google.
-  if (!IsAccessPointSupported(point)) {
-    ASSERT_STRING(("SetAccessPointRlz: "
-                "Cannot set RLZ for unsupported access point."));
+  return WriteAccessPointRlz(store, point, new_rlz);
+}
+
+// Transactions.
+
+RlzTransaction::RlzTransaction() : entry_point_("RlzTransaction") {
+}
+
+RlzTransaction::RlzTransaction(const char* entry_point)
+    : entry_point_(entry_point) {
+}
+
+RlzTransaction::~RlzTransaction() {
+}
+
+bool RlzTransaction::SetAccessPointRlz(AccessPoint point,
+                                       const char* new_rlz) {
+  if (!IsRlzValid(point, new_rlz))
     return false;
+
+  Change change;
+  change.type = Change::SET_ACCESS_POINT_RLZ;
+  change.point = point;
+  change.value = new_rlz;
+  changes_.push_back(change);
+  return true;
+}
+
+bool RlzTransaction::RecordProductEvent(Product product, AccessPoint point,
+                                        Event event_id) {
+  return QueueEvent(Change::RECORD_PRODUCT_EVENT, product, point, event_id);
+}
+
+bool RlzTransaction::ClearProductEvent(Product product, AccessPoint point,
+                                       Event event_id) {
+  return QueueEvent(Change::CLEAR_PRODUCT_EVENT, product, point, event_id);
+}
+
+bool RlzTransaction::RecordStatefulEvent(Product product, AccessPoint point,
+                                         Event event_id) {
+  return QueueEvent(Change::RECORD_STATEFUL_EVENT, product, point, event_id);
+}
+
+bool RlzTransaction::Commit() {
+  return CommitChanges(NULL);
+}
+
+bool RlzTransaction::CommitChanges(const Product* access_product) {
+  if (changes_.empty() && !access_product)
+    return true;
+
+  // Lock only the shards the changes touch, or those of |access_product| if
+  // there are none.
+  StoreShards shards = StoreShards::ForProduct(
+      changes_.empty() ? *access_product : changes_[0].product);
+  if (!changes_.empty() && changes_[0].type == Change::SET_ACCESS_POINT_RLZ)
+    shards = StoreShards::AccessPoints();
+  for (size_t i = 1; i < changes_.size(); ++i) {
+    if (changes_[i].type == Change::SET_ACCESS_POINT_RLZ)
+      shards = shards | StoreShards::AccessPoints();
+    else
+      shards = shards | StoreShards::ForProduct(changes_[i].product);
   }
 
-  // Verify the RLZ length.
-  size_t rlz_length = strlen(new_rlz);
-  if (rlz_length > kMaxRlzLength) {
-    ASSERT_STRING("SetAccessPointRlz: RLZ length is exceeds max allowed.");
+  // Events buffered before the transaction are older than its changes.
+  if (!changes_.empty() && !FlushBufferedEvents())
     return false;
+
+  ScopedRlzValueStoreLock lock(entry_point_, shards);
+  RlzValueStore* store = lock.GetStore();
+  if (!store || !store->HasAccess(RlzValueStore::kWriteAccess))
+    return false;
+
+  // The changes are only taken off the queue once they can be applied.
+  std::vector<Change> changes;
+  changes.swap(changes_);
+
+  bool success = true;
+  for (size_t i = 0; i < changes.size(); ++i) {
+    const Change& change = changes[i];
+    const char* value = change.value.c_str();
+    switch (change.type) {
+      case Change::SET_ACCESS_POINT_RLZ:
+        success &= WriteAccessPointRlz(store, change.point, value);
+        break;
+      case Change::RECORD_PRODUCT_EVENT:
+        success &= AddProductEvent(store, change.product, value);
+        break;
+      case Change::CLEAR_PRODUCT_EVENT:
+        success &= store->ClearProductEvent(change.product, value);
+        break;
+      case Change::RECORD_STATEFUL_EVENT:
+        success &= store->AddStatefulEvent(change.product, value);
+        break;
+    }
   }
+  return success;
+}
 
-  char normalized_rlz[kMaxRlzLength + 1];
-  NormalizeRlz(new_rlz, normalized_rlz);
-  VERIFY(strlen(new_rlz) == rlz_length);
+bool RlzTransaction::QueueEvent(Change::Type type, Product product,
+                                AccessPoint point, Event event_id) {
+  Change change;
+  const char* value = GetEventValue(point, event_id);
+  if (!value)
+    return false;
+  change.value = value;
 
-  // Setting RLZ to empty == clearing.
-  if (normalized_rlz[0] == 0)
-    return store->ClearAccessPointRlz(point);
-  return store->WriteAccessPointRlz(point, normalized_rlz);
+  change.type = type;
+  change.product = product;
+  change.point = point;
+  changes_.push_back(change);
+  return true;
 }
 
 // Financial Server pinging functions.
@@ -496,18 +638,18 @@ bool SendFinancialPing(Product product, const AccessPoint* access_points,
 // TODO: Use something like RSA to make sure the response is
 // from a Google server.
 bool ParsePingResponse(Product product, const char* response) {
-  rlz_lib::ScopedRlzValueStoreLock lock;
-  rlz_lib::RlzValueStore* store = lock.GetStore();
-  if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
-    return false;
-
   std::string response_string(response);
   int response_length = -1;
   if (!IsPingResponseValid(response, &response_length))
     return false;
 
+  // The response is parsed without the lock, and all the changes it makes
+  // are applied at once. Callers that can't write the store learn that even
+  // if the response changes nothing.
+  RlzTransaction transaction("ParsePingResponse");
+
   if (0 == response_length)
-    return true;  // Empty response - no parsing.
+    return transaction.CommitChanges(&product);  // Empty response.
 
   std::string events_variable;
   std::string stateful_events_variable;
@@ -558,15 +700,17 @@ bool ParsePingResponse(Product product, const char* response) {
       if (rlz_length > kMaxRlzLength)
         continue;  // Too long.
 
-      if (IsAccessPointSupported(point))
-        SetAccessPointRlz(point, rlz_value.substr(0, rlz_length).c_str());
+      if (IsAccessPointSupported(point)) {
+        transaction.SetAccessPointRlz(
+            point, rlz_value.substr(0, rlz_length).c_str());
+      }
     } else if (StartsWithASCII(response_line, events_variable, true)) {
       // Clear events which server parsed.
       std::vector<ReturnedEvent> event_array;
       GetEventsFromResponseString(response_line, events_variable, &event_array);
       for (size_t i = 0; i < event_array.size(); ++i) {
-        ClearProductEvent(product, event_array[i].access_point,
-                          event_array[i].event_type);
+        transaction.ClearProductEvent(product, event_array[i].access_point,
+                                      event_array[i].event_type);
       }
     } else if (StartsWithASCII(response_line, stateful_events_variable, true)) {
       // Record any stateful events the server send over.
@@ -574,18 +718,20 @@ bool ParsePingResponse(Product product, const char* response) {
       GetEventsFromResponseString(response_line, stateful_events_variable,
                                   &event_array);
       for (size_t i = 0; i < event_array.size(); ++i) {
-        RecordStatefulEvent(product, event_array[i].access_point,
-                            event_array[i].event_type);
+        transaction.RecordStatefulEvent(product, event_array[i].access_point,
+                                        event_array[i].event_type);
       }
     }
   } while (line_end_index >= 0);
 
+  bool committed = transaction.CommitChanges(&product);
+
 #if defined(OS_WIN)
-  // Update the DCC in registry if needed.
+  // Update the DCC in registry if needed, also if some changes failed.
   SetMachineDealCodeFromPingResponse(response);
 #endif
 
-  return true;
+  return committed;
 }
 
 bool GetPingParams(Product product, const AccessPoint* access_points,
@@ -611,7 +757,9 @@ bool GetPingParams(Product product, const AccessPoint* access_points,
   {
     // Now add each of the RLZ's. Keep the lock during all GetAccessPointRlz()
     // calls below.
-    ScopedRlzValueStoreLock lock;
+    ScopedRlzValueStoreLock lock("GetPingParams",
+                                 StoreShards::AccessPoints(),
+                                 RlzValueStore::kReadAccess);
     RlzValueStore* store = lock.GetStore();
     if (!store || !store->HasAccess(RlzValueStore::kReadAccess))
       return false;
@@ -14,7 +14,9 @@
 
 #include <stdio.h>
 #include <string>
+#include <vector>
 
+#include "base/basictypes.h"
 #include "build/build_config.h"
 
 #include "rlz/lib/rlz_enums.h"
@@ -83,7 +85,8 @@ bool RLZ_LIB_API GetProductEventsAsCgi(Product product, char* unescaped_cgi,
 // Some events can be product-independent (e.g: First search from home page),
 // and some can be access point independent (e.g. Pack installed). However,
 // product independent events must still include the product which cares about
-// that information being reported.
+// that information being reported. With event buffering, see
+// SetEventBuffering(), the event may only be buffered.
 // Access: HKCU write.
 bool RLZ_LIB_API RecordProductEvent(Product product, AccessPoint point,
                                     Event event_id);
@@ -254,6 +257,75 @@ bool RLZ_LIB_API GetPingParams(Product product,
                                const AccessPoint* access_points,
                                char* unescaped_cgi, size_t unescaped_cgi_size);
 
+// Batches changes to the RLZ store. Each of the RLZ storage functions takes
+// the lock on the store, and may write the store back, on its own. A
+// transaction queues any number of changes instead and applies them all in
+// Commit(), which takes the lock and writes the store back only once:
+//
+//   rlz_lib::RlzTransaction transaction;
+//   transaction.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "1T4_____en__1");
+//   transaction.ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+//                                 rlz_lib::IETB_SEARCH_BOX,
+//                                 rlz_lib::INSTALL);
+//   if (!transaction.Commit())
+//     ...
+//
+// The queuing methods check their arguments like the functions of the same
+// name, and return false without queuing anything if they are invalid.
+// A transaction is not thread-safe. Changes that are not committed when it is
+// destroyed are dropped.
+class RlzTransaction {
+ public:
+  RlzTransaction();
+  ~RlzTransaction();
+
+  bool SetAccessPointRlz(AccessPoint point, const char* new_rlz);
+  bool RecordProductEvent(Product product, AccessPoint point, Event event_id);
+  bool ClearProductEvent(Product product, AccessPoint point, Event event_id);
+  // Records an event that the server reported as stateful, see
+  // ParsePingResponse().
+  bool RecordStatefulEvent(Product product, AccessPoint point, Event event_id);
+
+  // Applies the queued changes in the order they were queued, and empties
+  // the queue. Returns false if the store can't be locked for writing, in
+  // which case nothing is applied and the queue is kept, so that Commit()
+  // can be retried. Also returns false if any change fails.
+  bool Commit();
+
+ private:
+  // Names the transaction in the lock statistics, see GetLockStats().
+  explicit RlzTransaction(const char* entry_point);
+  friend bool RLZ_LIB_API ParsePingResponse(Product product,
+                                            const char* response);
+
+  // Like Commit(). If nothing is queued and |access_product| isn't NULL,
+  // still locks the store of that product to return whether it can be
+  // written.
+  bool CommitChanges(const Product* access_product);
+
+  struct Change {
+    enum Type {
+      SET_ACCESS_POINT_RLZ,
+      RECORD_PRODUCT_EVENT,
+      CLEAR_PRODUCT_EVENT,
+      RECORD_STATEFUL_EVENT,
+    };
+
+    Type type;
+    // Not set for SET_ACCESS_POINT_RLZ.
+    Product product;
+    AccessPoint point;
+    // The RLZ or the event's stored value.
+    std::string value;
+  };
+
+  bool QueueEvent(Change::Type type, Product product, AccessPoint point,
+                  Event event_id);
+
+  const char* entry_point_;
+  std::vector<Change> changes_;
+};
+
 #if defined(OS_WIN)
 // OEM Deal confirmation storage functions. OEM Deals are windows-only.
 
@@ -319,17 +391,240 @@ bool RLZ_LIB_API SetMachineDealCodeFromPingResponse(const char* response);
 // scoped to a supplementary brand will be recorded again when scoped to a
 // different supplementary brand (or not scoped at all).  In the latter case,
 // the time skip check is specific to each supplementary brand.
+//
+// The brand only applies to the thread that created the SupplementaryBranding.
+// Other threads wait for the RLZ store while it exists, except for reads of
+// stores that are read without a lock, which don't see the brand.
 class SupplementaryBranding {
  public:
   SupplementaryBranding(const char* brand);
   ~SupplementaryBranding();
 
+  // The brand of the current thread, or an empty string if there is none.
   static const std::string& GetBrand();
 
  private:
   ScopedRlzValueStoreLock* lock_;
+  std::string brand_;
 };
 
+// How long RLZ library calls wait for the lock by default. Matches windows.
+const int kDefaultLockTimeoutMs = 5000;
+
+// Limits how long RLZ library calls on the current thread wait for the lock
+// that protects the RLZ store. By default, a call waits up to
+// kDefaultLockTimeoutMs for other threads and processes to release it, and
+// fails afterwards. A timeout of 0 only tries the lock once, so that the call
+// fails right away if the lock is busy.
+//
+// A failed call doesn't tell why it failed. lock_busy() tells whether a call
+// in the scope of the ScopedLockTimeout failed because the lock was busy, in
+// which case it can be retried later, for example on a background thread:
+//
+//  {
+//    rlz_lib::ScopedLockTimeout timeout(0);
+//    if (!rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+//                                     rlz_lib::CHROME_OMNIBOX,
+//                                     rlz_lib::FIRST_SEARCH) &&
+//        timeout.lock_busy()) {
+//      // Post the call to a background thread.
+//    }
+//  }
+//
+// ScopedLockTimeouts may be nested; the innermost one applies. They only
+// affect calls that take the lock, not calls nested inside the scope of a
+// lock that is already held, like the one of a SupplementaryBranding.
+class ScopedLockTimeout {
+ public:
+  explicit ScopedLockTimeout(int timeout_ms);
+  ~ScopedLockTimeout();
+
+  // The timeout of the innermost ScopedLockTimeout of the current thread, or
+  // kDefaultLockTimeoutMs if there is none.
+  static int GetTimeoutMs();
+
+  // Records that a call in the scope of the innermost ScopedLockTimeout of
+  // the current thread failed because the lock was busy.
+  static void SetLockBusy();
+
+  bool lock_busy() const { return lock_busy_; }
+
+ private:
+  int timeout_ms_;
+  bool lock_busy_;
+  ScopedLockTimeout* outer_;
+};
+
+#if defined(OS_LINUX)
+// Reports changes to the RLZ store without polling it. Every change to an
+// access point RLZ, product event or ping time is reported, whichever process
+// makes it, including the current one. Only the store in the default
+// directory is watched.
+//
+// The watcher can be added to the caller's event loop:
+//
+//   rlz_lib::RlzStoreWatcher watcher;
+//   if (watcher.Init())
+//     AddToEpoll(watcher.fd());
+//   ...
+//   // When watcher.fd() is readable:
+//   if (watcher.ConsumeChanges())
+//     rlz_lib::GetAccessPointRlz(rlz_lib::CHROME_OMNIBOX, rlz, rlz_size);
+//
+// A change may be reported although the value the caller reads didn't change,
+// and several changes may be reported as one.
+class RlzStoreWatcher {
+ public:
+  RlzStoreWatcher();
+  ~RlzStoreWatcher();
+
+  // Starts watching the store. Returns false if it can't be watched.
+  bool Init();
+
+  // A file descriptor that is readable while changes are pending. Owned by
+  // the watcher.
+  int fd() const { return fd_; }
+
+  // Returns whether the store changed since Init() or the last call. Doesn't
+  // block.
+  bool ConsumeChanges();
+
+  // Waits up to |timeout_ms| for the store to change. Returns whether it did.
+  bool WaitForChange(int timeout_ms);
+
+ private:
+  int fd_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzStoreWatcher);
+};
+
+// Event ring.
+// By default, RecordProductEvent() waits for the lock that protects the RLZ
+// store, like every other process that records events. With the event ring
+// turned on, it pushes the event onto a ring in a file that all processes
+// map instead, which takes a few atomic operations and never waits, unless
+// the calling thread already holds the lock. Whichever process next takes
+// the lock to change the product's events moves the events from the ring to
+// the store, and functions that read events, like GetProductEventsAsCgi()
+// and SendFinancialPing(), take the lock for that first. So pings report the
+// same events as without the ring, in every process, whether or not it
+// turned the ring on. A process that didn't turn it on looks for the ring at
+// most once a second until some process creates it, so right after that its
+// pings may miss events from the ring; they are reported in a later ping.
+//
+// When the ring of a product is full, events are recorded with the lock as
+// before. Only the default store has a ring. While SetRlzValueStoreFactory()
+// installed another factory, events are recorded with the lock, and the
+// ring is left alone. Returns false if the ring can't be mapped.
+bool RLZ_LIB_API EnableEventRing(bool enabled);
+
+// Async persistence.
+// The stores that are written as a whole file, see CreateLinuxStoreFactory(),
+// replace their file before a call that changed them returns, but don't sync
+// it to disk, so a crash of the machine can lose changes. With async
+// persistence, each such write also syncs the file and its directory. Where
+// io_uring is available, the write, the rename over the old file and the
+// syncs are submitted to the kernel together, and a call only waits for the
+// rename, which doesn't wait for the disk. Otherwise the store is written and
+// synced before the call returns.
+//
+// Returns whether the stores are written through io_uring. Turning async
+// persistence off waits for the outstanding syncs.
+bool RLZ_LIB_API SetAsyncPersistence(bool enabled);
+
+// Returns the token of the last store write of this process with async
+// persistence, or 0 if there was none. Tokens increase with each write.
+int64 RLZ_LIB_API GetPersistToken();
+
+// Return whether the store write of |token| is on disk, either itself or
+// through a later write of the same file. A write that failed, or whose sync
+// failed, isn't. IsPersisted() doesn't block, WaitForPersisted() waits until
+// the writes up to |token| completed.
+bool RLZ_LIB_API IsPersisted(int64 token);
+bool RLZ_LIB_API WaitForPersisted(int64 token);
+#endif  // defined(OS_LINUX)
+
+// Group commit.
+// Each call that changes the store writes the whole store back when it
+// releases the lock. With a group commit window, a call that changed the
+// store keeps it for up to |window_ms| instead, and calls of other threads
+// that arrive in the meantime change the same store, one at a time. The store
+// is then written back once for all of them. Calls that changed the store
+// return only after it was written back, so they still don't return before
+// their change is persisted. Calls of other processes wait for the window to
+// close. A window of 0, the default, turns group commit off.
+void RLZ_LIB_API SetGroupCommitWindow(int window_ms);
+
+// Event buffering.
+// By default, RecordProductEvent() takes the lock and writes the store. With
+// event buffering, it only adds the event to a buffer of the process and
+// returns, unless the calling thread already holds the lock, like in the scope
+// of a SupplementaryBranding. An event that is buffered already isn't added
+// again. The buffer is written to the store with one lock when it holds
+// |max_events| events, when its oldest event is |max_delay_ms| old, before any
+// function reads or clears events, like GetProductEventsAsCgi(),
+// SendFinancialPing() or ClearProductEvent(), and when the process exits.
+// So this process sees the same events as without buffering, but other
+// processes only see them once they are written. Events that can't be written
+// because the store can't be locked stay buffered. Where the store can't be
+// written at all, RecordProductEvent() fails as without buffering.
+//
+// A |max_events| of 0, the default, turns buffering off and writes the
+// buffered events. Returns false if buffering can't be turned on, or if the
+// buffered events can't be written when it is turned off.
+bool RLZ_LIB_API SetEventBuffering(int max_events, int max_delay_ms);
+
+// Writes the buffered events to the store. Returns false if they can't be
+// written, in which case they stay buffered, unless the store can't be
+// written at all.
+bool RLZ_LIB_API FlushBufferedEvents();
+
+// Lock metrics.
+// The library keeps statistics about how long the lock that protects the RLZ
+// store is waited for and held, for each public function that takes it.
+// Functions that are called by other public functions, like
+// ClearAllProductEvents() by ClearProductState(), only count when they take
+// the lock themselves. So does a SupplementaryBranding, for its lifetime.
+
+// The number of buckets of the histograms in LockStats. Bucket i counts the
+// times that took less than 10^(i+1) microseconds, and no less than the times
+// counted by bucket i - 1. The last bucket counts all longer times.
+const int kLockStatsBuckets = 8;
+
+struct LockStats {
+  LockStats();
+
+  // The function that took the lock, like "RecordProductEvent".
+  std::string entry_point;
+
+  // How often the lock was acquired, and how often that failed. Busy
+  // failures gave up because another thread or process held the lock, see
+  // ScopedLockTimeout.
+  int64 acquisitions;
+  int64 failures;
+  int64 busy_failures;
+
+  // Times in microseconds. Waits include failed ones, holds only count locks
+  // that were released.
+  int64 total_wait_us;
+  int64 max_wait_us;
+  int64 wait_histogram[kLockStatsBuckets];
+  int64 total_hold_us;
+  int64 max_hold_us;
+  int64 hold_histogram[kLockStatsBuckets];
+};
+
+// Replaces |stats| with the statistics of all functions that took the lock
+// since the process started or since ResetLockStats().
+void RLZ_LIB_API GetLockStats(std::vector<LockStats>* stats);
+
+void RLZ_LIB_API ResetLockStats();
+
+// Logs a warning whenever the lock is held for longer than |threshold_ms|,
+// while it is still held and again when it is released. A threshold of 0,
+// the default, turns the warnings off.
+void RLZ_LIB_API SetLockHoldWatchdog(int threshold_ms);
+
 }  // namespace rlz_lib
 
 #endif  // RLZ_LIB_RLZ_LIB_H_
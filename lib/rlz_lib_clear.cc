@@ -11,13 +11,19 @@
 #include "rlz/lib/rlz_lib.h"
 
 #include "base/lazy_instance.h"
+#include "base/threading/thread_local.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/rlz_value_store.h"
 
 namespace rlz_lib {
 
 bool ClearAllProductEvents(Product product) {
-  rlz_lib::ScopedRlzValueStoreLock lock;
+  // Buffered events must be written before they can be cleared.
+  if (!FlushBufferedEvents())
+    return false;
+
+  rlz_lib::ScopedRlzValueStoreLock lock(
+      "ClearAllProductEvents", rlz_lib::StoreShards::ForProduct(product));
   rlz_lib::RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
     return false;
@@ -29,7 +35,13 @@ bool ClearAllProductEvents(Product product) {
 }
 
 void ClearProductState(Product product, const AccessPoint* access_points) {
-  rlz_lib::ScopedRlzValueStoreLock lock;
+  if (!FlushBufferedEvents())
+    return;
+
+  rlz_lib::ScopedRlzValueStoreLock lock(
+      "ClearProductState",
+      rlz_lib::StoreShards::ForProduct(product) |
+      rlz_lib::StoreShards::AccessPoints());
   rlz_lib::RlzValueStore* store = lock.GetStore();
   if (!store || !store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess))
     return;
@@ -48,14 +60,25 @@ void ClearProductState(Product product, const AccessPoint* access_points) {
   store->CollectGarbage();
 }
 
-static base::LazyInstance<std::string>::Leaky g_supplemental_branding;
+// The brand of the SupplementaryBranding of each thread. Other threads wait
+// for the store while it exists, except readers of snapshots, which must not
+// see the brand.
+static base::LazyInstance<base::ThreadLocalPointer<const std::string> >::Leaky
+    g_supplemental_branding = LAZY_INSTANCE_INITIALIZER;
+
+static base::LazyInstance<std::string>::Leaky g_no_branding =
+    LAZY_INSTANCE_INITIALIZER;
 
 SupplementaryBranding::SupplementaryBranding(const char* brand)
-    : lock_(new ScopedRlzValueStoreLock) {
+    : lock_(NULL) {
+  // Buffered events were recorded without the brand. If they can't be
+  // written now, they are written without it later.
+  FlushBufferedEvents();
+  lock_ = new ScopedRlzValueStoreLock("SupplementaryBranding");
   if (!lock_->GetStore())
     return;
 
-  if (!g_supplemental_branding.Get().empty()) {
+  if (g_supplemental_branding.Get().Get()) {
     ASSERT_STRING("ProductBranding: existing brand is not empty");
     return;
   }
@@ -65,18 +88,20 @@ SupplementaryBranding::SupplementaryBranding(const char* brand)
     return;
   }
 
-  g_supplemental_branding.Get() = brand;
+  brand_ = brand;
+  g_supplemental_branding.Get().Set(&brand_);
 }
 
 SupplementaryBranding::~SupplementaryBranding() {
-  if (lock_->GetStore())
-    g_supplemental_branding.Get().clear();
+  if (g_supplemental_branding.Get().Get() == &brand_)
+    g_supplemental_branding.Get().Set(NULL);
   delete lock_;
 }
 
 // static
 const std::string& SupplementaryBranding::GetBrand() {
-  return g_supplemental_branding.Get();
+  const std::string* brand = g_supplemental_branding.Get().Get();
+  return brand ? *brand : g_no_branding.Get();
 }
 
 }  // namespace rlz_lib
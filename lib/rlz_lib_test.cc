@@ -13,11 +13,14 @@
 // The "GGLA" brand is used to test the normal code flow of the code, and the
 // "TEST" brand is used to test the supplementary brand code code flow.
 
+#include <vector>
+
 #include "base/logging.h"
 #include "base/memory/scoped_ptr.h"
 #include "testing/gmock/include/gmock/gmock.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
+#include "rlz/lib/assert.h"
 #include "rlz/lib/rlz_lib.h"
 #include "rlz/test/rlz_test_helpers.h"
 
@@ -414,6 +417,68 @@ TEST_F(RlzLibTest, ParsePingResponseWithStatefulEvents) {
   EXPECT_STREQ("events=W1I", value);
 }
 
+TEST_F(RlzLibTest, Transaction) {
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "IeTbRlz"));
+
+  rlz_lib::RlzTransaction transaction;
+  EXPECT_TRUE(transaction.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, ""));
+  EXPECT_TRUE(transaction.SetAccessPointRlz(rlz_lib::IE_DEFAULT_SEARCH,
+                                            "1T4_____en__252"));
+  EXPECT_TRUE(transaction.ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(transaction.RecordStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(transaction.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_HOME_PAGE, rlz_lib::INSTALL));
+  EXPECT_TRUE(transaction.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::IE_DEFAULT_SEARCH, rlz_lib::FIRST_SEARCH));
+
+  // Invalid changes are rejected right away.
+  rlz_lib::SetExpectedAssertion("SetAccessPointRlz: Invalid buffer");
+  EXPECT_FALSE(transaction.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, NULL));
+  rlz_lib::SetExpectedAssertion("");
+  EXPECT_FALSE(transaction.RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+      rlz_lib::NO_ACCESS_POINT, rlz_lib::INSTALL));
+
+  // Nothing changes before the commit.
+  char value[50];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, value, 50));
+  EXPECT_STREQ("IeTbRlz", value);
+
+  rlz_lib::ResetLockStats();
+  EXPECT_TRUE(transaction.Commit());
+
+  // The changes are applied in order, with one lock.
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, value, 50));
+  EXPECT_STREQ("", value);
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IE_DEFAULT_SEARCH, value,
+                                         50));
+  EXPECT_STREQ("1T4_____en__252", value);
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             value, 50));
+  EXPECT_STREQ("events=I7F", value);
+
+  std::vector<rlz_lib::LockStats> stats;
+  rlz_lib::GetLockStats(&stats);
+  bool found = false;
+  for (size_t i = 0; i < stats.size(); ++i) {
+    if (stats[i].entry_point == "RlzTransaction") {
+      EXPECT_EQ(1, stats[i].acquisitions);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+
+  // Committed changes are not applied again.
+  EXPECT_TRUE(rlz_lib::ClearAllProductEvents(rlz_lib::TOOLBAR_NOTIFIER));
+  EXPECT_TRUE(transaction.Commit());
+  EXPECT_FALSE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                              value, 50));
+}
+
 TEST_F(RlzLibTest, SendFinancialPing) {
   // We don't really check a value or result in this test. All this does is
   // attempt to ping the financial server, which you can verify in Fiddler.
@@ -0,0 +1,471 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The platform independent part of ScopedRlzValueStoreLock. The store itself
+// and the cross-process lock come from an RlzValueStoreFactory.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#include <algorithm>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread_local.h"
+#include "rlz/lib/dirty_tracking_store.h"
+#include "rlz/lib/lock_metrics.h"
+#include "rlz/lib/rlz_lib.h"
+
+#if defined(OS_LINUX)
+#include "rlz/linux/lib/event_ring_linux.h"
+#endif
+
+namespace rlz_lib {
+
+namespace {
+
+// The factory set with SetRlzValueStoreFactory(), or NULL.
+RlzValueStoreFactory* g_factory = NULL;
+
+RlzValueStoreFactory* GetFactory() {
+  return g_factory ? g_factory : GetDefaultRlzValueStoreFactory();
+}
+
+// Serializes the threads of this process. It is held by the outermost
+// ScopedRlzValueStoreLock of a thread. Any number of readers can hold it at
+// the same time if the factory shares the lock between readers, otherwise it
+// is exclusive. Waiting writers hold off new readers, so that a steady stream
+// of readers can't starve them. Readers of snapshots don't wait at all; they
+// are only counted so that the factory isn't changed under them.
+//
+// With a group commit window, see SetGroupCommitWindow(), a writer that
+// modified the store keeps the store and its cross-process lock for the
+// window, and lets other threads join its group: they take this lock, one
+// at a time, and use the same store instead of acquiring their own. When the
+// window closes, the writer that opened the group persists the store once
+// for all of them, and writers that modified the store wait until then. The
+// thread that acquired the store must release it, because cross-process
+// locks belong to threads on some platforms.
+class StoreLock {
+ public:
+  StoreLock()
+      : changed_(&lock_),
+        snapshot_readers_(0),
+        readers_(0),
+        writer_(false),
+        waiting_writers_(0),
+        group_store_(NULL),
+        group_shards_(StoreShards::All()),
+        group_closing_(false),
+        group_modified_(false),
+        group_commits_(0) {
+  }
+
+  // Blocks until the calling thread may use the factory for |access| and
+  // |shards|, or returns false if that's not the case by |deadline|. Sets
+  // |reader_locking| to how the factory locks readers, which must be passed
+  // to Release(). If the thread joined an open group, sets |group_store| to
+  // the group's store, which it must use instead of acquiring one, and must
+  // call LeaveGroup() instead of Release(). Otherwise sets it to NULL.
+  bool Acquire(RlzValueStore::AccessType access,
+               const StoreShards& shards,
+               base::TimeTicks deadline,
+               RlzValueStoreFactory::ReaderLocking* reader_locking,
+               RlzValueStore** group_store) {
+    base::AutoLock auto_lock(lock_);
+    *reader_locking = GetFactory()->GetReaderLocking();
+    *group_store = NULL;
+    RlzValueStoreFactory::ReaderLocking mode = Mode(access, *reader_locking);
+    if (mode == RlzValueStoreFactory::kSnapshotReaders) {
+      ++snapshot_readers_;
+      return true;
+    }
+
+    if (mode == RlzValueStoreFactory::kExclusiveReaders)
+      ++waiting_writers_;
+    while (true) {
+      if (group_store_) {
+        // Members of a group take turns, readers too, because stores aren't
+        // thread-safe. Locks that the group's store doesn't cover wait for
+        // the group to be committed.
+        if (!group_closing_ && group_shards_.Contains(shards) &&
+            !writer_ && readers_ == 0) {
+          writer_ = true;
+          *group_store = group_store_;
+          break;
+        }
+      } else if (mode == RlzValueStoreFactory::kSharedReaders) {
+        if (!writer_ && waiting_writers_ == 0) {
+          ++readers_;
+          break;
+        }
+      } else if (!writer_ && readers_ == 0) {
+        writer_ = true;
+        break;
+      }
+
+      if (!WaitUntil(deadline)) {
+        if (mode == RlzValueStoreFactory::kExclusiveReaders) {
+          // Readers may be waiting for this writer.
+          --waiting_writers_;
+          changed_.Broadcast();
+        }
+        return false;
+      }
+    }
+    if (mode == RlzValueStoreFactory::kExclusiveReaders)
+      --waiting_writers_;
+    return true;
+  }
+
+  void Release(RlzValueStore::AccessType access,
+               RlzValueStoreFactory::ReaderLocking reader_locking) {
+    base::AutoLock auto_lock(lock_);
+    switch (Mode(access, reader_locking)) {
+      case RlzValueStoreFactory::kSnapshotReaders:
+        DCHECK_GT(snapshot_readers_, 0);
+        --snapshot_readers_;
+        // Nobody waits for snapshot readers except SetFactory(), which
+        // doesn't wait.
+        return;
+      case RlzValueStoreFactory::kSharedReaders:
+        DCHECK_GT(readers_, 0);
+        --readers_;
+        break;
+      case RlzValueStoreFactory::kExclusiveReaders:
+        DCHECK(writer_);
+        writer_ = false;
+        break;
+    }
+    changed_.Broadcast();
+  }
+
+  void SetFactory(RlzValueStoreFactory* factory) {
+    base::AutoLock auto_lock(lock_);
+    CHECK(!writer_ && readers_ == 0 && snapshot_readers_ == 0 &&
+          !group_store_)
+        << "Store factory changed while a lock is held";
+    g_factory = factory;
+  }
+
+  void SetGroupCommitWindow(base::TimeDelta window) {
+    base::AutoLock auto_lock(lock_);
+    group_window_ = window;
+  }
+
+  // Called by a writer that holds the lock and modified |store|, which it
+  // acquired for |shards|, instead of releasing the store. Returns false if
+  // there is no group commit window. Otherwise opens a group with |store|,
+  // lets other threads join it for the window, and returns once they all
+  // left. Then the caller must persist the store if |modified| is true, set
+  // to whether any member modified it, release the store and call
+  // CommitGroup(). The caller no longer holds the lock.
+  bool RunGroup(RlzValueStore* store, const StoreShards& shards,
+                bool* modified) {
+    base::AutoLock auto_lock(lock_);
+    DCHECK(writer_ && !group_store_);
+    if (group_window_ <= base::TimeDelta())
+      return false;
+
+    group_store_ = store;
+    group_shards_ = shards;
+    group_modified_ = true;
+    writer_ = false;
+    changed_.Broadcast();
+
+    base::TimeTicks close_time = base::TimeTicks::Now() + group_window_;
+    while (WaitUntil(close_time)) {
+    }
+
+    // Members that are still waiting to join wait for the next group.
+    group_closing_ = true;
+    while (writer_ || readers_ > 0)
+      changed_.Wait();
+    *modified = group_modified_;
+    return true;
+  }
+
+  // Called by the thread that ran the group after it released the store.
+  void CommitGroup() {
+    base::AutoLock auto_lock(lock_);
+    DCHECK(group_store_ && group_closing_);
+    group_store_ = NULL;
+    group_closing_ = false;
+    ++group_commits_;
+    changed_.Broadcast();
+  }
+
+  // Called by a member of a group, which must not use the group's store
+  // anymore, instead of Release(). Waits until the group is committed if
+  // the member |modified| the store.
+  void LeaveGroup(bool modified) {
+    base::AutoLock auto_lock(lock_);
+    DCHECK(writer_ && group_store_);
+    writer_ = false;
+    group_modified_ |= modified;
+    changed_.Broadcast();
+
+    int64 group = group_commits_;
+    while (modified && group_commits_ == group)
+      changed_.Wait();
+  }
+
+ private:
+  // Waits for the state to change, or returns false if |deadline| passed.
+  bool WaitUntil(base::TimeTicks deadline) {
+    base::TimeDelta remaining = deadline - base::TimeTicks::Now();
+    if (remaining <= base::TimeDelta())
+      return false;
+    changed_.TimedWait(remaining);
+    return true;
+  }
+
+  // Writers always hold the lock exclusively.
+  static RlzValueStoreFactory::ReaderLocking Mode(
+      RlzValueStore::AccessType access,
+      RlzValueStoreFactory::ReaderLocking reader_locking) {
+    return access == RlzValueStore::kReadAccess ?
+        reader_locking : RlzValueStoreFactory::kExclusiveReaders;
+  }
+
+  base::Lock lock_;
+  base::ConditionVariable changed_;
+
+  int snapshot_readers_;
+  int readers_;
+  bool writer_;
+  int waiting_writers_;
+
+  // Zero unless SetGroupCommitWindow() was called.
+  base::TimeDelta group_window_;
+
+  // The store of the open group, or NULL if there is none, and the shards
+  // it was acquired for.
+  RlzValueStore* group_store_;
+  StoreShards group_shards_;
+
+  // Whether the window of the open group is over, so no thread can join it
+  // anymore.
+  bool group_closing_;
+
+  // Whether any member of the open group modified its store.
+  bool group_modified_;
+
+  // The number of groups committed so far.
+  int64 group_commits_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoreLock);
+};
+
+base::LazyInstance<StoreLock>::Leaky g_store_lock = LAZY_INSTANCE_INITIALIZER;
+
+// Stores keep their data in memory and may only write it to disk when the
+// outermost ScopedRlzValueStoreLock goes out of scope. Hence, if several
+// ScopedRlzValueStoreLocks are nested, they all need to use the same store
+// object. This is the outermost lock of each thread, which owns that store.
+base::LazyInstance<base::ThreadLocalPointer<ScopedRlzValueStoreLock> >::Leaky
+    g_outermost_lock = LAZY_INSTANCE_INITIALIZER;
+
+// The innermost ScopedLockTimeout of each thread.
+base::LazyInstance<base::ThreadLocalPointer<ScopedLockTimeout> >::Leaky
+    g_lock_timeout = LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+void SetRlzValueStoreFactory(RlzValueStoreFactory* factory) {
+  g_store_lock.Get().SetFactory(factory);
+}
+
+bool UsesDefaultRlzValueStoreFactory() {
+  return g_factory == NULL;
+}
+
+void SetGroupCommitWindow(int window_ms) {
+  g_store_lock.Get().SetGroupCommitWindow(
+      base::TimeDelta::FromMilliseconds(std::max(0, window_ms)));
+}
+
+base::TimeTicks GetStoreLockDeadline() {
+  ScopedRlzValueStoreLock* outermost = g_outermost_lock.Get().Get();
+  if (outermost)
+    return outermost->deadline_;
+  return base::TimeTicks::Now() +
+      base::TimeDelta::FromMilliseconds(ScopedLockTimeout::GetTimeoutMs());
+}
+
+bool IsStoreLockHeld() {
+  return g_outermost_lock.Get().Get() != NULL;
+}
+
+ScopedLockTimeout::ScopedLockTimeout(int timeout_ms)
+    : timeout_ms_(std::max(0, timeout_ms)),
+      lock_busy_(false),
+      outer_(g_lock_timeout.Get().Get()) {
+  g_lock_timeout.Get().Set(this);
+}
+
+ScopedLockTimeout::~ScopedLockTimeout() {
+  DCHECK_EQ(this, g_lock_timeout.Get().Get());
+  g_lock_timeout.Get().Set(outer_);
+  // The calls in this scope are in the scope of the outer timeout too.
+  if (outer_ && lock_busy_)
+    outer_->lock_busy_ = true;
+}
+
+// static
+int ScopedLockTimeout::GetTimeoutMs() {
+  ScopedLockTimeout* timeout = g_lock_timeout.Get().Get();
+  return timeout ? timeout->timeout_ms_ : kDefaultLockTimeoutMs;
+}
+
+// static
+void ScopedLockTimeout::SetLockBusy() {
+  ScopedLockTimeout* timeout = g_lock_timeout.Get().Get();
+  if (timeout)
+    timeout->lock_busy_ = true;
+  ScopedRlzValueStoreLock* outermost = g_outermost_lock.Get().Get();
+  if (outermost)
+    outermost->busy_ = true;
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock()
+    : store_(NULL),
+      entry_point_("Unnamed"),
+      shards_(StoreShards::All()),
+      access_(RlzValueStore::kWriteAccess),
+      locked_(false),
+      reader_locking_(RlzValueStoreFactory::kExclusiveReaders),
+      busy_(false),
+      in_group_(false) {
+  Init();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(const char* entry_point)
+    : store_(NULL),
+      entry_point_(entry_point),
+      shards_(StoreShards::All()),
+      access_(RlzValueStore::kWriteAccess),
+      locked_(false),
+      reader_locking_(RlzValueStoreFactory::kExclusiveReaders),
+      busy_(false),
+      in_group_(false) {
+  Init();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(const char* entry_point,
+                                                 const StoreShards& shards)
+    : store_(NULL),
+      entry_point_(entry_point),
+      shards_(shards),
+      access_(RlzValueStore::kWriteAccess),
+      locked_(false),
+      reader_locking_(RlzValueStoreFactory::kExclusiveReaders),
+      busy_(false),
+      in_group_(false) {
+  Init();
+}
+
+ScopedRlzValueStoreLock::ScopedRlzValueStoreLock(
+    const char* entry_point,
+    const StoreShards& shards,
+    RlzValueStore::AccessType access)
+    : store_(NULL),
+      entry_point_(entry_point),
+      shards_(shards),
+      access_(access),
+      locked_(false),
+      reader_locking_(RlzValueStoreFactory::kExclusiveReaders),
+      busy_(false),
+      in_group_(false) {
+  Init();
+}
+
+void ScopedRlzValueStoreLock::Init() {
+  ScopedRlzValueStoreLock* outermost = g_outermost_lock.Get().Get();
+  if (outermost) {
+    // Reuse the already existing store object. It's NULL if the outermost
+    // lock failed, which callers must not take recursively.
+    CHECK(outermost->shards_.Contains(shards_))
+        << "Nested lock needs shards the outermost lock doesn't hold";
+    CHECK(access_ == RlzValueStore::kReadAccess ||
+          outermost->access_ == RlzValueStore::kWriteAccess)
+        << "Nested write lock inside a read lock";
+    store_ = outermost->store_;
+    return;
+  }
+
+  g_outermost_lock.Get().Set(this);
+  base::TimeTicks start = base::TimeTicks::Now();
+  deadline_ = start +
+      base::TimeDelta::FromMilliseconds(ScopedLockTimeout::GetTimeoutMs());
+  RlzValueStore* group_store = NULL;
+  locked_ = g_store_lock.Get().Acquire(access_, shards_, deadline_,
+                                       &reader_locking_, &group_store);
+  if (!locked_) {
+    // Another thread of this process holds the lock.
+    ScopedLockTimeout::SetLockBusy();
+  } else if (group_store) {
+    // Another thread holds the store, and persists it for this one too.
+    in_group_ = true;
+    store_ = new DirtyTrackingStore(group_store, access_);
+  } else {
+    RlzValueStore* store = GetFactory()->AcquireStore(shards_, access_);
+    if (store)
+      store_ = new DirtyTrackingStore(store, access_);
+  }
+#if defined(OS_LINUX)
+  // Events other processes recorded without the lock go to the store now.
+  // Only the default store has a ring.
+  if (store_ && access_ == RlzValueStore::kWriteAccess &&
+      UsesDefaultRlzValueStoreFactory() &&
+      store_->HasAccess(RlzValueStore::kWriteAccess)) {
+    DrainEventRing(store_, shards_);
+  }
+#endif
+  GetLockMetrics()->OnAcquire(this, entry_point_,
+                              base::TimeTicks::Now() - start,
+                              store_ != NULL, busy_);
+}
+
+ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
+  if (g_outermost_lock.Get().Get() != this) {
+    // The outermost lock is still using store_.
+    return;
+  }
+
+  if (in_group_) {
+    bool modified = store_->modified();
+    delete store_;
+    GetLockMetrics()->OnRelease(this);
+    g_store_lock.Get().LeaveGroup(modified);
+    g_outermost_lock.Get().Set(NULL);
+    return;
+  }
+
+  if (store_) {
+    RlzValueStore* store = store_->store();
+    bool modified = store_->modified();
+    delete store_;
+    if (modified &&
+        g_store_lock.Get().RunGroup(store, shards_, &modified)) {
+      // RunGroup() released the in-process lock.
+      locked_ = false;
+      GetFactory()->ReleaseStore(store, access_, modified);
+      g_store_lock.Get().CommitGroup();
+    } else {
+      GetFactory()->ReleaseStore(store, access_, modified);
+    }
+    GetLockMetrics()->OnRelease(this);
+  }
+  if (locked_)
+    g_store_lock.Get().Release(access_, reader_locking_);
+  g_outermost_lock.Get().Set(NULL);
+}
+
+RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
+  return store_;
+}
+
+}  // namespace rlz_lib
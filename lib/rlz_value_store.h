@@ -6,13 +6,9 @@
 #define RLZ_VALUE_STORE_H_
 
 #include "base/basictypes.h"
-#include "base/memory/scoped_ptr.h"
+#include "base/time.h"
 #include "rlz/lib/rlz_enums.h"
 
-#if defined(OS_WIN)
-#include "rlz/win/lib/lib_mutex.h"
-#endif
-
 #if defined(OS_MACOSX)
 #include "base/mac/scoped_nsautorelease_pool.h"
 #endif
@@ -25,8 +21,11 @@ class FilePath;
 
 namespace rlz_lib {
 
+class DirtyTrackingStore;
+
 // Abstracts away rlz's key value store. On windows, this usually writes to
-// the registry. On mac, it writes to an NSDefaults object.
+// the registry. On mac, it writes to an NSDefaults object. On linux, it writes
+// to a JSON file.
 class RlzValueStore {
  public:
   virtual ~RlzValueStore() {}
@@ -72,21 +71,151 @@ class RlzValueStore {
   virtual void CollectGarbage() = 0;
 };
 
+// A set of store shards. The access point RLZs form one shard, and the ping
+// time and events of each product form one shard per product. Backends that
+// keep shards apart only lock the shards a ScopedRlzValueStoreLock asks for,
+// so that unrelated products don't wait for each other. Other backends lock
+// everything.
+class StoreShards {
+ public:
+  static StoreShards All() { return StoreShards(~0u); }
+  static StoreShards AccessPoints() { return StoreShards(1u); }
+  static StoreShards ForProduct(Product product) {
+    return StoreShards(1u << product);
+  }
+
+  StoreShards operator|(const StoreShards& other) const {
+    return StoreShards(bits_ | other.bits_);
+  }
+
+  bool Contains(const StoreShards& other) const {
+    return (bits_ & other.bits_) == other.bits_;
+  }
+  bool HasAccessPoints() const { return Contains(AccessPoints()); }
+  bool HasProduct(Product product) const {
+    return Contains(ForProduct(product));
+  }
+
+ private:
+  explicit StoreShards(uint32 bits) : bits_(bits) {}
+
+  // Bit 0 is the access point shard, bit p the shard of product p.
+  uint32 bits_;
+};
+
+COMPILE_ASSERT(PARTNER < 32, too_many_products_for_store_shards);
+
+// Creates the RlzValueStore used by ScopedRlzValueStoreLock and owns the
+// cross-process lock that protects it. Each platform has a default factory
+// that uses the platform's store; embedders and tests can install their own
+// with SetRlzValueStoreFactory() to pick a different backend or lock.
+//
+// ScopedRlzValueStoreLock serializes the threads of a process itself and
+// shares one store between nested locks, so AcquireStore() and
+// ReleaseStore() are only called for the outermost lock of a thread. They are
+// never called concurrently, except for readers if GetReaderLocking() doesn't
+// return kExclusiveReaders.
+class RlzValueStoreFactory {
+ public:
+  // How readers are kept apart from other readers and from writers.
+  enum ReaderLocking {
+    // Readers hold the lock exclusively, like writers.
+    kExclusiveReaders,
+    // Readers share the lock with each other, and wait for writers.
+    // AcquireStore() and ReleaseStore() must be thread-safe for kReadAccess.
+    kSharedReaders,
+    // Readers take no lock at all. They load a snapshot of the store that
+    // writers only ever replace atomically, so a reader sees either the old
+    // or the new store. AcquireStore() and ReleaseStore() must be thread-safe
+    // for kReadAccess, also while a writer holds a store.
+    kSnapshotReaders,
+  };
+
+  virtual ~RlzValueStoreFactory() {}
+
+  // Acquires the cross-process lock for |shards| and returns the store it
+  // protects. The store only needs to support access to |shards|, and is
+  // only read if |access| is kReadAccess. Readers may share the lock with
+  // other readers, or take none at all, see GetReaderLocking(). Returns NULL,
+  // without holding the lock, if either fails. Gives up on the lock at
+  // GetStoreLockDeadline(), and calls ScopedLockTimeout::SetLockBusy() then
+  // if another thread or process held it.
+  // The returned store stays owned by the factory.
+  virtual RlzValueStore* AcquireStore(const StoreShards& shards,
+                                      RlzValueStore::AccessType access) = 0;
+
+  // Persists |store|, which was returned by AcquireStore() for |access|, and
+  // releases the cross-process lock. |store| must not be used afterwards.
+  // |modified| is false if no call changed |store|, in which case it needn't
+  // be persisted.
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) = 0;
+
+  // Returns how readers of the factory's stores are locked.
+  virtual ReaderLocking GetReaderLocking() { return kExclusiveReaders; }
+};
+
+// Makes ScopedRlzValueStoreLock use |factory| instead of the platform's
+// default factory. Passing NULL restores the default. Doesn't take ownership;
+// |factory| must outlive its use. Must not be called while any
+// ScopedRlzValueStoreLock is alive.
+void SetRlzValueStoreFactory(RlzValueStoreFactory* factory);
+
+// Returns the platform's default factory. Implemented next to the platform's
+// store.
+RlzValueStoreFactory* GetDefaultRlzValueStoreFactory();
+
+// Returns whether ScopedRlzValueStoreLock uses the default factory, that is
+// whether SetRlzValueStoreFactory() installed none.
+bool UsesDefaultRlzValueStoreFactory();
+
+// Returns when the locks that protect the store stop being waited for on the
+// current thread. For the outermost ScopedRlzValueStoreLock, that's when it
+// was created plus the ScopedLockTimeout, so that all locks it takes share
+// one deadline. Outside of one, it's now plus the ScopedLockTimeout.
+base::TimeTicks GetStoreLockDeadline();
+
+// Returns whether the current thread is in the scope of a
+// ScopedRlzValueStoreLock, whether or not it got the lock.
+bool IsStoreLockHeld();
+
 // All methods of RlzValueStore must stays consistent even when accessed from
 // multiple threads in multiple processes. To enforce this through the type
 // system, the only way to access the RlzValueStore is through a
 // ScopedRlzValueStoreLock, which is a cross-process lock. It is active while
 // it is in scope. If the class fails to acquire a lock, its GetStore() method
-// returns NULL. If the lock fails to be acquired, it must not be taken
+// returns NULL. It waits for the lock for the ScopedLockTimeout of the
+// thread. If the lock fails to be acquired, it must not be taken
 // recursively. That is, all user code should look like this:
-//   ScopedRlzValueStoreLock lock;
+//   ScopedRlzValueStoreLock lock("Function", StoreShards::ForProduct(product));
 //   RlzValueStore* store = lock.GetStore();
 //   if (!store)
 //     return some_error_code;
 //   ...
+// The store may only be used for the shards the lock was taken for. A nested
+// lock must not ask for shards its outermost lock doesn't cover.
+//
+// A lock taken for kReadAccess is a read lock. Its store rejects all writes,
+// and read locks of several threads and processes may be held at the same
+// time if the factory allows it. If the factory's readers read snapshots, a
+// read lock doesn't lock anything and doesn't wait for writers. A nested lock
+// inside a read lock must be a read lock too.
+//
+// |entry_point| names the public function that takes the lock. The outermost
+// lock of a thread records its wait and hold times under it, see
+// GetLockStats(). It must be a string literal. Locks without one are recorded
+// under "Unnamed".
 class ScopedRlzValueStoreLock {
  public:
+  // Locks all shards for writing.
   ScopedRlzValueStoreLock();
+  explicit ScopedRlzValueStoreLock(const char* entry_point);
+  // Locks |shards| for writing.
+  ScopedRlzValueStoreLock(const char* entry_point, const StoreShards& shards);
+  ScopedRlzValueStoreLock(const char* entry_point,
+                          const StoreShards& shards,
+                          RlzValueStore::AccessType access);
   ~ScopedRlzValueStoreLock();
 
   // Returns a RlzValueStore protected by a cross-process lock, or NULL if the
@@ -95,20 +224,46 @@ class ScopedRlzValueStoreLock {
   RlzValueStore* GetStore();
 
  private:
-  scoped_ptr<RlzValueStore> store_;
-#if defined(OS_WIN)
-  LibMutex lock_;
-#else
+  friend base::TimeTicks GetStoreLockDeadline();
+  friend class ScopedLockTimeout;
+
+#if defined(OS_MACOSX)
   base::mac::ScopedNSAutoreleasePool autorelease_pool_;
 #endif
+  void Init();
+
+  // Owned by the outermost lock, and wraps a store owned by the
+  // RlzValueStoreFactory that created it.
+  DirtyTrackingStore* store_;
+  const char* entry_point_;
+  StoreShards shards_;
+  RlzValueStore::AccessType access_;
+
+  // When the outermost lock gives up on the locks it takes.
+  base::TimeTicks deadline_;
+
+  // Whether the outermost lock got the in-process lock, and how the factory
+  // locked it if it is a read lock.
+  bool locked_;
+  RlzValueStoreFactory::ReaderLocking reader_locking_;
+
+  // Whether the outermost lock failed because a lock was busy.
+  bool busy_;
+
+  // Whether the outermost lock joined the group commit of another thread,
+  // see SetGroupCommitWindow(), and uses that thread's store.
+  bool in_group_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedRlzValueStoreLock);
 };
 
-#if defined(OS_MACOSX)
+#if defined(OS_POSIX)
 namespace testing {
 // Prefix |directory| to the path where the RLZ data file lives, for tests.
+// On linux, the data file lives directly in |directory|.
 void SetRlzStoreDirectory(const FilePath& directory);
 }  // namespace testing
-#endif  // defined(OS_MACOSX)
+#endif  // defined(OS_POSIX)
 
 
 }  // namespace rlz_lib
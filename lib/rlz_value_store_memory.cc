@@ -0,0 +1,391 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/rlz_value_store_memory.h"
+
+#include <string.h>
+
+#include "base/logging.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/store_codec.h"
+
+namespace rlz_lib {
+
+// Fills the maps of a store directly from DecodeStore().
+class RlzValueStoreMemory::Loader : public StoreVisitor {
+ public:
+  explicit Loader(BrandMap* brands) : brands_(brands), brand_(NULL) {}
+
+  virtual void OnBrand(const base::StringPiece& brand) OVERRIDE {
+    brand_ = &(*brands_)[brand.as_string()];
+  }
+
+  virtual void OnAccessPointRlz(AccessPoint point,
+                                const base::StringPiece& rlz) OVERRIDE {
+    rlz.CopyToString(&brand_->access_point_rlzs[point]);
+  }
+
+  virtual void OnPingTime(Product product, int64 time) OVERRIDE {
+    ProductState& state = brand_->products[product];
+    state.has_ping_time = true;
+    state.ping_time = time;
+  }
+
+  virtual void OnProductEvent(Product product,
+                              const base::StringPiece& event_rlz) OVERRIDE {
+    brand_->products[product].events.insert(event_rlz.as_string());
+  }
+
+  virtual void OnStatefulEvent(Product product,
+                               const base::StringPiece& event_rlz) OVERRIDE {
+    brand_->products[product].stateful_events.insert(event_rlz.as_string());
+  }
+
+ private:
+  BrandMap* brands_;
+  BrandState* brand_;
+
+  DISALLOW_COPY_AND_ASSIGN(Loader);
+};
+
+namespace {
+
+// Whether |section| still has to be decoded. Decoded sections keep their
+// entry, without data.
+bool IsPending(const StoreSection& section) {
+  return !section.data.empty();
+}
+
+}  // namespace
+
+bool RlzValueStoreMemory::BrandState::empty() const {
+  if (!access_point_rlzs.empty())
+    return false;
+  for (std::map<int, StoreSection>::const_iterator i =
+           pending_sections.begin();
+       i != pending_sections.end(); ++i) {
+    if (IsPending(i->second))
+      return false;
+  }
+  for (std::map<Product, ProductState>::const_iterator i = products.begin();
+       i != products.end(); ++i) {
+    if (i->second.has_ping_time || !i->second.events.empty() ||
+        !i->second.stateful_events.empty())
+      return false;
+  }
+  return true;
+}
+
+RlzValueStoreMemory::RlzValueStoreMemory() {
+}
+
+RlzValueStoreMemory::~RlzValueStoreMemory() {
+}
+
+bool RlzValueStoreMemory::HasAccess(AccessType type) {
+  return true;
+}
+
+bool RlzValueStoreMemory::WritePingTime(Product product, int64 time) {
+  ProductState& state = WorkingProduct(product);
+  state.has_ping_time = true;
+  state.ping_time = time;
+  return true;
+}
+
+bool RlzValueStoreMemory::ReadPingTime(Product product, int64* time) {
+  const ProductState* state = FindProduct(product);
+  if (!state || !state->has_ping_time)
+    return false;
+  *time = state->ping_time;
+  return true;
+}
+
+bool RlzValueStoreMemory::ClearPingTime(Product product) {
+  WorkingProduct(product).has_ping_time = false;
+  return true;
+}
+
+
+bool RlzValueStoreMemory::WriteAccessPointRlz(AccessPoint access_point,
+                                              const char* new_rlz) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  WorkingAccessPointRlzs()[access_point] = new_rlz;
+  return true;
+}
+
+bool RlzValueStoreMemory::ReadAccessPointRlz(AccessPoint access_point,
+                                             char* rlz,
+                                             size_t rlz_size) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  // Reading a non-existent access point counts as success.
+  const std::map<AccessPoint, std::string>* rlzs = FindAccessPointRlzs();
+  const std::string* value = NULL;
+  if (rlzs) {
+    std::map<AccessPoint, std::string>::const_iterator i =
+        rlzs->find(access_point);
+    if (i != rlzs->end())
+      value = &i->second;
+  }
+  if (!value) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  if (value->size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, value->c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreMemory::ClearAccessPointRlz(AccessPoint access_point) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  WorkingAccessPointRlzs().erase(access_point);
+  return true;
+}
+
+
+bool RlzValueStoreMemory::AddProductEvent(Product product,
+                                          const char* event_rlz) {
+  WorkingProduct(product).events.insert(event_rlz);
+  return true;
+}
+
+bool RlzValueStoreMemory::ReadProductEvents(Product product,
+                                            std::vector<std::string>* events) {
+  if (const ProductState* state = FindProduct(product))
+    events->insert(events->end(), state->events.begin(), state->events.end());
+  return true;
+}
+
+bool RlzValueStoreMemory::ClearProductEvent(Product product,
+                                            const char* event_rlz) {
+  WorkingProduct(product).events.erase(event_rlz);
+  return true;
+}
+
+bool RlzValueStoreMemory::ClearAllProductEvents(Product product) {
+  WorkingProduct(product).events.clear();
+  return true;
+}
+
+
+bool RlzValueStoreMemory::AddStatefulEvent(Product product,
+                                           const char* event_rlz) {
+  WorkingProduct(product).stateful_events.insert(event_rlz);
+  return true;
+}
+
+bool RlzValueStoreMemory::IsStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  const ProductState* state = FindProduct(product);
+  return state && state->stateful_events.count(event_rlz) > 0;
+}
+
+bool RlzValueStoreMemory::ClearAllStatefulEvents(Product product) {
+  WorkingProduct(product).stateful_events.clear();
+  return true;
+}
+
+
+void RlzValueStoreMemory::CollectGarbage() {
+  for (BrandMap::iterator i = brands_.begin(); i != brands_.end(); ) {
+    if (i->second.empty())
+      brands_.erase(i++);
+    else
+      ++i;
+  }
+}
+
+void RlzValueStoreMemory::Serialize(std::string* data) const {
+  StoreEncoder encoder(data);
+  for (BrandMap::const_iterator brand = brands_.begin();
+       brand != brands_.end(); ++brand) {
+    if (brand->second.empty())
+      continue;
+
+    encoder.BeginBrand(brand->first);
+    const std::map<int, StoreSection>& pending =
+        brand->second.pending_sections;
+    std::map<int, StoreSection>::const_iterator section = pending.begin();
+    while (section != pending.end() && !IsPending(section->second))
+      ++section;
+    if (section != pending.end() && section->first == 0) {
+      encoder.AddEncodedSection(section->second);
+      do {
+        ++section;
+      } while (section != pending.end() && !IsPending(section->second));
+    } else {
+      const std::map<AccessPoint, std::string>& rlzs =
+          brand->second.access_point_rlzs;
+      for (std::map<AccessPoint, std::string>::const_iterator i = rlzs.begin();
+           i != rlzs.end(); ++i) {
+        encoder.AddAccessPointRlz(i->first, i->second);
+      }
+    }
+
+    // Decoded and pending products are written in the order of their ids,
+    // so that a store nobody changed is written unchanged. The product of a
+    // pending section is empty.
+    const std::map<Product, ProductState>& products = brand->second.products;
+    std::map<Product, ProductState>::const_iterator i = products.begin();
+    while (i != products.end() || section != pending.end()) {
+      if (section != pending.end() &&
+          (i == products.end() || section->first <= i->first)) {
+        encoder.AddEncodedSection(section->second);
+        do {
+          ++section;
+        } while (section != pending.end() && !IsPending(section->second));
+      } else {
+        EncodeProduct(i->first, i->second, &encoder);
+        ++i;
+      }
+    }
+    encoder.EndBrand();
+  }
+  encoder.AddIndex();
+}
+
+bool RlzValueStoreMemory::Deserialize(const base::StringPiece& data,
+                                      int* damaged_sections) {
+  brands_.clear();
+  Loader loader(&brands_);
+  if (!DecodeStore(data, &loader, damaged_sections)) {
+    brands_.clear();
+    return false;
+  }
+  return true;
+}
+
+bool RlzValueStoreMemory::DeserializeLazily(const base::StringPiece& data,
+                                            int* damaged_sections) {
+  std::vector<StoreSection> sections;
+  if (!DecodeStoreIndex(data, &sections))
+    return Deserialize(data, damaged_sections);
+
+  brands_.clear();
+  BrandState* brand = NULL;
+  for (size_t i = 0; i < sections.size(); ++i) {
+    // Sections of a brand follow each other.
+    if (i == 0 || sections[i].brand != sections[i - 1].brand)
+      brand = &brands_[sections[i].brand.as_string()];
+    int product = sections[i].product;
+    brand->pending_sections[product] = sections[i];
+    if (product != 0)
+      brand->products[static_cast<Product>(product)];
+  }
+  if (damaged_sections)
+    *damaged_sections = 0;
+  return true;
+}
+
+// static
+void RlzValueStoreMemory::EncodeProduct(Product product,
+                                        const ProductState& state,
+                                        StoreEncoder* encoder) {
+  if (!state.has_ping_time && state.events.empty() &&
+      state.stateful_events.empty())
+    return;
+
+  encoder->BeginProduct(product);
+  if (state.has_ping_time)
+    encoder->AddPingTime(state.ping_time);
+  for (std::set<std::string>::const_iterator event = state.events.begin();
+       event != state.events.end(); ++event) {
+    encoder->AddProductEvent(*event);
+  }
+  for (std::set<std::string>::const_iterator event =
+           state.stateful_events.begin();
+       event != state.stateful_events.end(); ++event) {
+    encoder->AddStatefulEvent(*event);
+  }
+  encoder->EndProduct();
+}
+
+void RlzValueStoreMemory::LoadSection(BrandState* brand, int product) {
+  std::map<int, StoreSection>::iterator i =
+      brand->pending_sections.find(product);
+  if (i == brand->pending_sections.end())
+    return;
+
+  // The section only fills its own product, or the access points, which were
+  // added when the store was deserialized.
+  base::AutoLock lock(decode_lock_);
+  if (!IsPending(i->second))
+    return;
+  Loader loader(&brands_);
+  if (!DecodeStoreSection(i->second, &loader))
+    LOG(WARNING) << "Dropped a damaged section of the rlz store";
+  i->second.data.clear();
+}
+
+std::map<AccessPoint, std::string>&
+RlzValueStoreMemory::WorkingAccessPointRlzs() {
+  BrandState& brand = brands_[SupplementaryBranding::GetBrand()];
+  LoadSection(&brand, 0);
+  return brand.access_point_rlzs;
+}
+
+RlzValueStoreMemory::ProductState& RlzValueStoreMemory::WorkingProduct(
+    Product product) {
+  BrandState& brand = brands_[SupplementaryBranding::GetBrand()];
+  LoadSection(&brand, product);
+  return brand.products[product];
+}
+
+const std::map<AccessPoint, std::string>*
+RlzValueStoreMemory::FindAccessPointRlzs() {
+  BrandMap::iterator brand = brands_.find(SupplementaryBranding::GetBrand());
+  if (brand == brands_.end())
+    return NULL;
+  LoadSection(&brand->second, 0);
+  return &brand->second.access_point_rlzs;
+}
+
+const RlzValueStoreMemory::ProductState* RlzValueStoreMemory::FindProduct(
+    Product product) {
+  BrandMap::iterator brand = brands_.find(SupplementaryBranding::GetBrand());
+  if (brand == brands_.end())
+    return NULL;
+  LoadSection(&brand->second, product);
+  std::map<Product, ProductState>::const_iterator i =
+      brand->second.products.find(product);
+  return i == brand->second.products.end() ? NULL : &i->second;
+}
+
+
+MemoryStoreFactory::MemoryStoreFactory() {
+}
+
+MemoryStoreFactory::~MemoryStoreFactory() {
+}
+
+RlzValueStore* MemoryStoreFactory::AcquireStore(
+    const StoreShards& shards, RlzValueStore::AccessType access) {
+  return &store_;
+}
+
+void MemoryStoreFactory::ReleaseStore(RlzValueStore* store,
+                                      RlzValueStore::AccessType access,
+                                      bool modified) {
+  DCHECK_EQ(static_cast<RlzValueStore*>(&store_), store);
+}
+
+RlzValueStoreFactory::ReaderLocking MemoryStoreFactory::GetReaderLocking() {
+  return kSharedReaders;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,162 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LIB_RLZ_VALUE_STORE_MEMORY_H_
+#define RLZ_LIB_RLZ_VALUE_STORE_MEMORY_H_
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/string_piece.h"
+#include "base/synchronization/lock.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/store_codec.h"
+
+namespace rlz_lib {
+
+// An implementation of RlzValueStore that keeps all data in memory. Nothing
+// is persisted and nothing is shared with other processes. Useful for
+// embedders that manage persistence themselves, for tests, and to measure
+// the library's overhead independent of disk I/O.
+//
+// Reads don't change the store, except to decode lazily loaded sections,
+// which is serialized internally, so any number of threads may read it at
+// the same time. Writes need exclusive access.
+class RlzValueStoreMemory : public RlzValueStore {
+ public:
+  RlzValueStoreMemory();
+  virtual ~RlzValueStoreMemory();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  // Drops supplementary brands without data.
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Appends all brands to |data| in the binary store format, see
+  // store_codec.h.
+  void Serialize(std::string* data) const;
+
+  // Replaces all data with the store encoded in |data|. Damaged sections are
+  // dropped and counted in |damaged_sections| if it isn't NULL. Returns false,
+  // and leaves the store empty, if |data| isn't a store at all.
+  bool Deserialize(const base::StringPiece& data, int* damaged_sections);
+
+  // Like Deserialize(), but if |data| has an index only the index is read. A
+  // section is decoded when a call first touches its brand's access points or
+  // its product, and Serialize() copies the sections no call touched. |data|
+  // must stay valid until the store is destroyed or deserialized again.
+  // Damaged sections are dropped when they are decoded, so only damage that
+  // is found right away is counted in |damaged_sections|.
+  bool DeserializeLazily(const base::StringPiece& data, int* damaged_sections);
+
+ private:
+  class Loader;
+  friend class Loader;
+
+  struct ProductState {
+    ProductState() : has_ping_time(false), ping_time(0) {}
+
+    bool has_ping_time;
+    int64 ping_time;
+    std::set<std::string> events;
+    std::set<std::string> stateful_events;
+  };
+
+  struct BrandState {
+    bool empty() const;
+
+    std::map<AccessPoint, std::string> access_point_rlzs;
+    std::map<Product, ProductState> products;
+
+    // The sections of the brand that DeserializeLazily() found, by product,
+    // see StoreSection. Decoded sections stay in the map with empty data, and
+    // their products are in |products| from the start, so decoding doesn't
+    // change the structure of the maps that readers share. The data is
+    // guarded by |decode_lock_|.
+    std::map<int, StoreSection> pending_sections;
+  };
+
+  typedef std::map<std::string, BrandState> BrandMap;
+
+  static void EncodeProduct(Product product,
+                            const ProductState& state,
+                            StoreEncoder* encoder);
+
+  // Decodes the pending section of |product|, 0 for the access points, if
+  // there is one. Safe to call from concurrent readers.
+  void LoadSection(BrandState* brand, int product);
+
+  // Return the data of the current supplementary brand for writing, adding
+  // it if needed, and decoding it first.
+  std::map<AccessPoint, std::string>& WorkingAccessPointRlzs();
+  ProductState& WorkingProduct(Product product);
+
+  // Return the data of the current supplementary brand for reading, decoding
+  // it first, or NULL if there is none. Don't add entries.
+  const std::map<AccessPoint, std::string>* FindAccessPointRlzs();
+  const ProductState* FindProduct(Product product);
+
+  BrandMap brands_;
+
+  // Serializes the decoding of pending sections by readers.
+  base::Lock decode_lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreMemory);
+};
+
+// A factory that always hands out the same RlzValueStoreMemory, so data
+// lives as long as the factory. The in-process lock of ScopedRlzValueStoreLock
+// is the only lock, and readers share the store. For example, to run rlz
+// without touching the disk:
+//   rlz_lib::MemoryStoreFactory factory;
+//   rlz_lib::SetRlzValueStoreFactory(&factory);
+class MemoryStoreFactory : public RlzValueStoreFactory {
+ public:
+  MemoryStoreFactory();
+  virtual ~MemoryStoreFactory();
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE;
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE;
+  virtual ReaderLocking GetReaderLocking() OVERRIDE;
+
+  RlzValueStoreMemory* store() { return &store_; }
+
+ private:
+  RlzValueStoreMemory store_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryStoreFactory);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_RLZ_VALUE_STORE_MEMORY_H_
@@ -0,0 +1,87 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/rlz_value_store_memory.h"
+
+#include "rlz/lib/rlz_lib.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+TEST(RlzValueStoreMemoryTest, AccessPointRlz) {
+  rlz_lib::RlzValueStoreMemory store;
+  EXPECT_TRUE(store.HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                       rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+
+  EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        "TbRlzValue"));
+  EXPECT_TRUE(store.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                       rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  EXPECT_TRUE(store.ClearAccessPointRlz(rlz_lib::IETB_SEARCH_BOX));
+  EXPECT_TRUE(store.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                       rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+}
+
+TEST(RlzValueStoreMemoryTest, PingTimeAndEvents) {
+  rlz_lib::RlzValueStoreMemory store;
+
+  int64 time = 0;
+  EXPECT_FALSE(store.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_TRUE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_TRUE(store.ClearProductEvent(rlz_lib::CHROME, "C1I"));
+  std::vector<std::string> events;
+  EXPECT_TRUE(store.ReadProductEvents(rlz_lib::CHROME, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("C1F", events[0]);
+
+  EXPECT_TRUE(store.AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_TRUE(store.IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_FALSE(store.IsStatefulEvent(rlz_lib::DESKTOP, "C1F"));
+  EXPECT_TRUE(store.ClearAllStatefulEvents(rlz_lib::CHROME));
+  EXPECT_FALSE(store.IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+}
+
+TEST(RlzValueStoreMemoryTest, Factory) {
+  // The second test pass holds a lock for the lifetime of its supplementary
+  // brand, and the factory can't be changed while a lock is held.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  rlz_lib::MemoryStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock("Test");
+    ASSERT_TRUE(lock.GetStore());
+    EXPECT_TRUE(lock.GetStore()->WritePingTime(rlz_lib::CHROME,
+                                               1234567890123LL));
+  }
+
+  rlz_lib::SetRlzValueStoreFactory(NULL);
+
+  // The data stays in the factory's store.
+  EXPECT_TRUE(factory.store()->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                                  rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  int64 time = 0;
+  EXPECT_TRUE(factory.store()->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+}
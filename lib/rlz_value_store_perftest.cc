@@ -0,0 +1,178 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Measures how readers of the default store scale with the number of threads
+// and processes reading at the same time. Each reader takes a read lock, or
+// for comparison a write lock, and reads an access point RLZ. Also measures
+// the throughput of writer threads, each of which changes the store, with
+// and without a group commit window.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#include <vector>
+
+#include "base/compiler_specific.h"
+#include "base/logging.h"
+#include "base/memory/scoped_vector.h"
+#include "base/perftimer.h"
+#include "base/stringprintf.h"
+#include "base/threading/simple_thread.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#if defined(OS_POSIX)
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#endif
+
+namespace {
+
+const int kReadsPerReader = 500;
+const int kReaderCounts[] = { 1, 2, 4, 8 };
+const int kWritesPerWriter = 50;
+const int kWriterCounts[] = { 1, 2, 4, 8, 16, 32, 64 };
+const int kGroupCommitWindowMs = 2;
+
+const char* AccessName(rlz_lib::RlzValueStore::AccessType access) {
+  return access == rlz_lib::RlzValueStore::kReadAccess ? "read" : "write";
+}
+
+// Reads the RLZ of IETB_SEARCH_BOX kReadsPerReader times, each time under a
+// new lock for |access|.
+void ReadRlzs(rlz_lib::RlzValueStore::AccessType access) {
+  for (int i = 0; i < kReadsPerReader; ++i) {
+    rlz_lib::ScopedRlzValueStoreLock lock(
+        "Reader", rlz_lib::StoreShards::AccessPoints(), access);
+    rlz_lib::RlzValueStore* store = lock.GetStore();
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    CHECK(store && store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                             rlz, arraysize(rlz)));
+  }
+}
+
+class Reader : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit Reader(rlz_lib::RlzValueStore::AccessType access)
+      : access_(access) {
+  }
+
+  virtual void Run() OVERRIDE {
+    ReadRlzs(access_);
+  }
+
+ private:
+  rlz_lib::RlzValueStore::AccessType access_;
+
+  DISALLOW_COPY_AND_ASSIGN(Reader);
+};
+
+// Records and clears an event kWritesPerWriter times, so every call changes
+// the store.
+class Writer : public base::DelegateSimpleThread::Delegate {
+ public:
+  Writer() {}
+
+  virtual void Run() OVERRIDE {
+    for (int i = 0; i < kWritesPerWriter; i += 2) {
+      CHECK(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                        rlz_lib::IE_DEFAULT_SEARCH,
+                                        rlz_lib::INSTALL));
+      CHECK(rlz_lib::ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                       rlz_lib::IE_DEFAULT_SEARCH,
+                                       rlz_lib::INSTALL));
+    }
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(Writer);
+};
+
+class RlzValueStorePerfTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    RlzLibTestNoMachineState::SetUp();
+    ASSERT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "1C1GGLD_enUS123US456"));
+  }
+
+  void RunThreads(int thread_count,
+                  rlz_lib::RlzValueStore::AccessType access) {
+    Reader reader(access);
+    ScopedVector<base::DelegateSimpleThread> threads;
+    PerfTimeLogger timer(base::StringPrintf(
+        "%s_locks_%d_threads", AccessName(access), thread_count).c_str());
+    for (int i = 0; i < thread_count; ++i) {
+      threads.push_back(new base::DelegateSimpleThread(&reader, "reader"));
+      threads.back()->Start();
+    }
+    for (int i = 0; i < thread_count; ++i)
+      threads[i]->Join();
+  }
+
+  void RunWriterThreads(int thread_count, int window_ms) {
+    rlz_lib::SetGroupCommitWindow(window_ms);
+    Writer writer;
+    ScopedVector<base::DelegateSimpleThread> threads;
+    PerfTimeLogger timer(base::StringPrintf(
+        "writes_%dms_window_%d_threads", window_ms, thread_count).c_str());
+    for (int i = 0; i < thread_count; ++i) {
+      threads.push_back(new base::DelegateSimpleThread(&writer, "writer"));
+      threads.back()->Start();
+    }
+    for (int i = 0; i < thread_count; ++i)
+      threads[i]->Join();
+    rlz_lib::SetGroupCommitWindow(0);
+  }
+
+#if defined(OS_POSIX)
+  void RunProcesses(int process_count,
+                    rlz_lib::RlzValueStore::AccessType access) {
+    PerfTimeLogger timer(base::StringPrintf(
+        "%s_locks_%d_processes", AccessName(access), process_count).c_str());
+    std::vector<pid_t> children;
+    for (int i = 0; i < process_count; ++i) {
+      pid_t pid = fork();
+      ASSERT_NE(-1, pid);
+      if (pid == 0) {
+        ReadRlzs(access);
+        _exit(0);
+      }
+      children.push_back(pid);
+    }
+    for (size_t i = 0; i < children.size(); ++i) {
+      int status = 0;
+      EXPECT_EQ(children[i], HANDLE_EINTR(waitpid(children[i], &status, 0)));
+      EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+  }
+#endif
+};
+
+}  // namespace
+
+TEST_F(RlzValueStorePerfTest, ReaderThreads) {
+  for (size_t i = 0; i < arraysize(kReaderCounts); ++i) {
+    RunThreads(kReaderCounts[i], rlz_lib::RlzValueStore::kReadAccess);
+    RunThreads(kReaderCounts[i], rlz_lib::RlzValueStore::kWriteAccess);
+  }
+}
+
+TEST_F(RlzValueStorePerfTest, WriterThreads) {
+  for (size_t i = 0; i < arraysize(kWriterCounts); ++i) {
+    RunWriterThreads(kWriterCounts[i], 0);
+    RunWriterThreads(kWriterCounts[i], kGroupCommitWindowMs);
+  }
+}
+
+#if defined(OS_POSIX)
+TEST_F(RlzValueStorePerfTest, ReaderProcesses) {
+  for (size_t i = 0; i < arraysize(kReaderCounts); ++i) {
+    RunProcesses(kReaderCounts[i], rlz_lib::RlzValueStore::kReadAccess);
+    RunProcesses(kReaderCounts[i], rlz_lib::RlzValueStore::kWriteAccess);
+  }
+}
+#endif
@@ -0,0 +1,393 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for ScopedRlzValueStoreLock. They use a MemoryStoreFactory, so
+// they don't depend on the store the library is built with.
+
+#include "rlz/lib/rlz_value_store.h"
+
+#include <string.h>
+
+#include "base/compiler_specific.h"
+#include "base/memory/scoped_vector.h"
+#include "base/synchronization/lock.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/threading/simple_thread.h"
+#include "base/time.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// Holds a lock for |access| until |release| is signaled.
+class LockHolder : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit LockHolder(rlz_lib::RlzValueStore::AccessType access)
+      : locked(false, false),
+        release(false, false),
+        done(false, false),
+        access_(access) {
+  }
+
+  virtual void Run() OVERRIDE {
+    {
+      rlz_lib::ScopedRlzValueStoreLock lock(
+          "LockHolder", rlz_lib::StoreShards::AccessPoints(), access_);
+      locked.Signal();
+      release.TimedWait(base::TimeDelta::FromSeconds(10));
+    }
+    done.Signal();
+  }
+
+  base::WaitableEvent locked;
+  base::WaitableEvent release;
+  base::WaitableEvent done;
+
+ private:
+  rlz_lib::RlzValueStore::AccessType access_;
+};
+
+// Writes the access point rlz of a supplementary brand, and keeps the brand
+// until |release| is signaled.
+class BrandingHolder : public base::DelegateSimpleThread::Delegate {
+ public:
+  BrandingHolder() : branded(false, false), release(false, false) {
+  }
+
+  virtual void Run() OVERRIDE {
+    rlz_lib::SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "Branded"));
+    branded.Signal();
+    release.TimedWait(base::TimeDelta::FromSeconds(10));
+  }
+
+  base::WaitableEvent branded;
+  base::WaitableEvent release;
+};
+
+// A MemoryStoreFactory whose readers don't lock anything. Only good for tests
+// that don't touch the store while another thread writes it.
+class SnapshotMemoryStoreFactory : public rlz_lib::MemoryStoreFactory {
+ public:
+  virtual ReaderLocking GetReaderLocking() OVERRIDE {
+    return kSnapshotReaders;
+  }
+};
+
+// A MemoryStoreFactory that counts how often a modified store is persisted.
+class CountingMemoryStoreFactory : public rlz_lib::MemoryStoreFactory {
+ public:
+  CountingMemoryStoreFactory() : writes_(0) {
+  }
+
+  virtual void ReleaseStore(rlz_lib::RlzValueStore* store,
+                            rlz_lib::RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+    MemoryStoreFactory::ReleaseStore(store, access, modified);
+    base::AutoLock auto_lock(lock_);
+    if (modified)
+      ++writes_;
+  }
+
+  int writes() {
+    base::AutoLock auto_lock(lock_);
+    return writes_;
+  }
+
+ private:
+  base::Lock lock_;
+  int writes_;
+};
+
+// Records |event| once |start| is signaled, and how often |factory| persisted
+// the store by the time the call returned.
+class EventWriter : public base::DelegateSimpleThread::Delegate {
+ public:
+  EventWriter(CountingMemoryStoreFactory* factory,
+              base::WaitableEvent* start,
+              rlz_lib::Event event)
+      : recorded(false),
+        writes_on_return(0),
+        factory_(factory),
+        start_(start),
+        event_(event) {
+  }
+
+  virtual void Run() OVERRIDE {
+    start_->Wait();
+    recorded = rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                           rlz_lib::IE_DEFAULT_SEARCH,
+                                           event_);
+    writes_on_return = factory_->writes();
+  }
+
+  bool recorded;
+  int writes_on_return;
+
+ private:
+  CountingMemoryStoreFactory* factory_;
+  base::WaitableEvent* start_;
+  rlz_lib::Event event_;
+};
+
+class ScopedRlzValueStoreLockTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    // The second test pass holds a lock for the lifetime of its supplementary
+    // brand, and the factory can't be changed while a lock is held.
+    in_supplementary_pass_ =
+        !rlz_lib::SupplementaryBranding::GetBrand().empty();
+    if (!in_supplementary_pass_)
+      rlz_lib::SetRlzValueStoreFactory(&factory_);
+  }
+
+  virtual void TearDown() OVERRIDE {
+    if (!in_supplementary_pass_)
+      rlz_lib::SetRlzValueStoreFactory(NULL);
+  }
+
+  rlz_lib::MemoryStoreFactory factory_;
+  bool in_supplementary_pass_;
+};
+
+}  // namespace
+
+TEST_F(ScopedRlzValueStoreLockTest, ReadLockRejectsWrites) {
+  if (in_supplementary_pass_)
+    return;
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+
+  rlz_lib::ScopedRlzValueStoreLock lock("Test",
+                                        rlz_lib::StoreShards::AccessPoints(),
+                                        rlz_lib::RlzValueStore::kReadAccess);
+  rlz_lib::RlzValueStore* store = lock.GetStore();
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kReadAccess));
+  EXPECT_FALSE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+
+  rlz_lib::SetExpectedAssertion(
+      "DirtyTrackingStore: Write through a read lock");
+  EXPECT_FALSE(store->ClearAccessPointRlz(rlz_lib::IETB_SEARCH_BOX));
+  rlz_lib::SetExpectedAssertion("");
+
+  // Nested read locks share the store.
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, ReadLocksAreShared) {
+  if (in_supplementary_pass_)
+    return;
+
+  LockHolder reader(rlz_lib::RlzValueStore::kReadAccess);
+  base::DelegateSimpleThread thread(&reader, "reader");
+  thread.Start();
+  reader.locked.Wait();
+
+  // The reader thread still holds its read lock, which doesn't keep this one
+  // from being taken.
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock(
+        "Test", rlz_lib::StoreShards::AccessPoints(),
+        rlz_lib::RlzValueStore::kReadAccess);
+    EXPECT_TRUE(lock.GetStore());
+    EXPECT_FALSE(reader.done.IsSignaled());
+  }
+
+  reader.release.Signal();
+  thread.Join();
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, SnapshotReadersDontWaitForWriters) {
+  if (in_supplementary_pass_)
+    return;
+
+  SnapshotMemoryStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+
+  LockHolder writer(rlz_lib::RlzValueStore::kWriteAccess);
+  base::DelegateSimpleThread thread(&writer, "writer");
+  thread.Start();
+  writer.locked.Wait();
+
+  {
+    rlz_lib::ScopedRlzValueStoreLock lock(
+        "Test", rlz_lib::StoreShards::AccessPoints(),
+        rlz_lib::RlzValueStore::kReadAccess);
+    EXPECT_TRUE(lock.GetStore());
+    EXPECT_FALSE(writer.done.IsSignaled());
+  }
+
+  writer.release.Signal();
+  thread.Join();
+  rlz_lib::SetRlzValueStoreFactory(&factory_);
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, SnapshotReadersDontSeeOtherBrands) {
+  if (in_supplementary_pass_)
+    return;
+
+  SnapshotMemoryStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "NoBrand"));
+
+  BrandingHolder holder;
+  base::DelegateSimpleThread thread(&holder, "branding");
+  thread.Start();
+  holder.branded.Wait();
+
+  // The brand of the other thread doesn't apply to this one.
+  EXPECT_TRUE(rlz_lib::SupplementaryBranding::GetBrand().empty());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           rlz, arraysize(rlz)));
+    EXPECT_STREQ("NoBrand", rlz);
+  }
+
+  holder.release.Signal();
+  thread.Join();
+
+  {
+    rlz_lib::SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           rlz, arraysize(rlz)));
+    EXPECT_STREQ("Branded", rlz);
+  }
+  rlz_lib::SetRlzValueStoreFactory(&factory_);
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, LockTimeoutReportsBusyLock) {
+  if (in_supplementary_pass_)
+    return;
+
+  LockHolder writer(rlz_lib::RlzValueStore::kWriteAccess);
+  base::DelegateSimpleThread thread(&writer, "writer");
+  thread.Start();
+  writer.locked.Wait();
+
+  {
+    rlz_lib::ScopedLockTimeout timeout(0);
+    base::TimeTicks start = base::TimeTicks::Now();
+    EXPECT_FALSE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                             rlz_lib::IE_DEFAULT_SEARCH,
+                                             rlz_lib::SET_TO_GOOGLE));
+    EXPECT_LT(base::TimeTicks::Now() - start,
+              base::TimeDelta::FromSeconds(1));
+    EXPECT_TRUE(timeout.lock_busy());
+  }
+
+  writer.release.Signal();
+  thread.Join();
+
+  // Without a busy lock, the call succeeds and the lock isn't reported busy.
+  rlz_lib::ScopedLockTimeout timeout(0);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                          rlz_lib::IE_DEFAULT_SEARCH,
+                                          rlz_lib::SET_TO_GOOGLE));
+  EXPECT_FALSE(timeout.lock_busy());
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, BusyLockKeepsTransactionChanges) {
+  if (in_supplementary_pass_)
+    return;
+
+  rlz_lib::RlzTransaction transaction;
+  EXPECT_TRUE(transaction.SetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                            "Deferred"));
+
+  LockHolder writer(rlz_lib::RlzValueStore::kWriteAccess);
+  base::DelegateSimpleThread thread(&writer, "writer");
+  thread.Start();
+  writer.locked.Wait();
+
+  {
+    rlz_lib::ScopedLockTimeout timeout(0);
+    EXPECT_FALSE(transaction.Commit());
+    EXPECT_TRUE(timeout.lock_busy());
+  }
+
+  writer.release.Signal();
+  thread.Join();
+
+  // The retry applies the changes that the failed commit kept.
+  EXPECT_TRUE(transaction.Commit());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+  EXPECT_STREQ("Deferred", rlz);
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, LockTimeoutsNest) {
+  EXPECT_EQ(rlz_lib::kDefaultLockTimeoutMs,
+            rlz_lib::ScopedLockTimeout::GetTimeoutMs());
+  rlz_lib::ScopedLockTimeout outer(100);
+  {
+    rlz_lib::ScopedLockTimeout inner(0);
+    EXPECT_EQ(0, rlz_lib::ScopedLockTimeout::GetTimeoutMs());
+    rlz_lib::ScopedLockTimeout::SetLockBusy();
+    EXPECT_TRUE(inner.lock_busy());
+  }
+  EXPECT_EQ(100, rlz_lib::ScopedLockTimeout::GetTimeoutMs());
+  EXPECT_TRUE(outer.lock_busy());
+}
+
+TEST_F(ScopedRlzValueStoreLockTest, GroupCommitPersistsOnceForAllWriters) {
+  if (in_supplementary_pass_)
+    return;
+
+  CountingMemoryStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+  rlz_lib::SetGroupCommitWindow(500);
+
+  const rlz_lib::Event kEvents[] = {
+    rlz_lib::INSTALL, rlz_lib::SET_TO_GOOGLE, rlz_lib::FIRST_SEARCH,
+    rlz_lib::ACTIVATE
+  };
+  base::WaitableEvent start(true, false);
+  ScopedVector<EventWriter> writers;
+  ScopedVector<base::DelegateSimpleThread> threads;
+  for (size_t i = 0; i < arraysize(kEvents); ++i) {
+    writers.push_back(new EventWriter(&factory, &start, kEvents[i]));
+    threads.push_back(new base::DelegateSimpleThread(writers[i], "writer"));
+    threads[i]->Start();
+  }
+  start.Signal();
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i]->Join();
+  rlz_lib::SetGroupCommitWindow(0);
+
+  // The writers share fewer writes than there are writers, and none returns
+  // before its event was persisted.
+  for (size_t i = 0; i < writers.size(); ++i) {
+    EXPECT_TRUE(writers[i]->recorded);
+    EXPECT_GE(writers[i]->writes_on_return, 1);
+  }
+  EXPECT_LT(factory.writes(), static_cast<int>(arraysize(kEvents)));
+
+  char events[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::TOOLBAR_NOTIFIER,
+                                             events, arraysize(events)));
+  // The writers ran in any order.
+  const char* kEventRlzs[] = { "I7I", "I7S", "I7F", "I7A" };
+  for (size_t i = 0; i < arraysize(kEventRlzs); ++i)
+    EXPECT_TRUE(strstr(events, kEventRlzs[i])) << kEventRlzs[i];
+
+  // Without a window, every write is persisted on its own.
+  int writes = factory.writes();
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::TOOLBAR_NOTIFIER,
+                                          rlz_lib::IE_HOME_PAGE,
+                                          rlz_lib::INSTALL));
+  EXPECT_EQ(writes + 1, factory.writes());
+
+  rlz_lib::SetRlzValueStoreFactory(&factory_);
+}
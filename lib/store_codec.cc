@@ -0,0 +1,540 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/store_codec.h"
+
+#include "base/logging.h"
+#include "rlz/lib/crc32.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// These are written to disk and should not be changed.
+const char kStoreMagic[] = "RLZB";
+const size_t kStoreMagicSize = 4;
+
+// Section and record tags. Brand and product tags are sections, all others
+// are records.
+enum RecordTag {
+  kBrandTag = 1,
+  kAccessPointTag = 2,
+  kProductTag = 3,
+  kPingTimeTag = 4,
+  kProductEventTag = 5,
+  kStatefulEventTag = 6,
+  kIndexTag = 7,
+};
+
+const size_t kFixed32Size = 4;
+
+// The length and checksum of a section.
+const size_t kSectionHeaderSize = 2 * kFixed32Size;
+
+const size_t kMaxVarintSize = 10;
+
+// Writes |value| as a little endian base 128 varint to |buffer|, which must
+// hold kMaxVarintSize bytes. Returns the number of bytes written.
+size_t EncodeVarint(uint64 value, char* buffer) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    buffer[size++] = static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  buffer[size++] = static_cast<char>(value);
+  return size;
+}
+
+void AppendVarint(uint64 value, std::string* output) {
+  char buffer[kMaxVarintSize];
+  output->append(buffer, EncodeVarint(value, buffer));
+}
+
+void WriteFixed32(uint32 value, char* buffer) {
+  for (size_t i = 0; i < kFixed32Size; ++i)
+    buffer[i] = static_cast<char>(value >> (8 * i));
+}
+
+uint32 Checksum(const char* data, size_t size) {
+  return static_cast<uint32>(Crc32(reinterpret_cast<const unsigned char*>(data),
+                                   static_cast<int>(size)));
+}
+
+// Reads encoded values from the front of a buffer.
+class Reader {
+ public:
+  explicit Reader(const base::StringPiece& data) : data_(data) {}
+
+  bool empty() const { return data_.empty(); }
+
+  // The data that hasn't been read yet.
+  const base::StringPiece& rest() const { return data_; }
+
+  bool ReadVarint(uint64* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (data_.empty())
+        return false;
+      uint8 byte = static_cast<uint8>(data_[0]);
+      data_.remove_prefix(1);
+      *value |= static_cast<uint64>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  bool ReadFixed32(uint32* value) {
+    base::StringPiece bytes;
+    if (!ReadBytes(kFixed32Size, &bytes))
+      return false;
+    *value = 0;
+    for (size_t i = 0; i < kFixed32Size; ++i)
+      *value |= static_cast<uint32>(static_cast<uint8>(bytes[i])) << (8 * i);
+    return true;
+  }
+
+  bool ReadBytes(uint64 size, base::StringPiece* bytes) {
+    if (size > data_.size())
+      return false;
+    *bytes = base::StringPiece(data_.data(), static_cast<size_t>(size));
+    data_.remove_prefix(static_cast<size_t>(size));
+    return true;
+  }
+
+  // Reads a varint prefixed string, like a brand name.
+  bool ReadString(base::StringPiece* value) {
+    uint64 size;
+    return ReadVarint(&size) && ReadBytes(size, value);
+  }
+
+  bool ReadRecord(uint64* tag, base::StringPiece* value) {
+    return ReadVarint(tag) && ReadString(value);
+  }
+
+ private:
+  base::StringPiece data_;
+};
+
+bool IsKnownProduct(uint64 id) {
+  return id >= IE_TOOLBAR && id <= PARTNER;
+}
+
+// Reads the value of an access point record.
+bool DecodeAccessPoint(const base::StringPiece& value, StoreVisitor* visitor) {
+  Reader reader(value);
+  uint64 id;
+  if (!reader.ReadVarint(&id))
+    return false;
+  if (id > NO_ACCESS_POINT && id < LAST_ACCESS_POINT)
+    visitor->OnAccessPointRlz(static_cast<AccessPoint>(id), reader.rest());
+  return true;
+}
+
+// Reads the records of a product, up to the end of |reader|.
+bool DecodeProduct(Product product, Reader* reader, StoreVisitor* visitor) {
+  while (!reader->empty()) {
+    uint64 tag;
+    base::StringPiece value;
+    if (!reader->ReadRecord(&tag, &value))
+      return false;
+
+    switch (tag) {
+      case kPingTimeTag: {
+        Reader value_reader(value);
+        uint64 time;
+        if (!value_reader.ReadVarint(&time))
+          return false;
+        visitor->OnPingTime(product, static_cast<int64>(time));
+        break;
+      }
+      case kProductEventTag:
+        visitor->OnProductEvent(product, value);
+        break;
+      case kStatefulEventTag:
+        visitor->OnStatefulEvent(product, value);
+        break;
+    }
+  }
+  return true;
+}
+
+// Reads the value of a verified version 2 section.
+bool DecodeSection(uint64 tag, const base::StringPiece& value,
+                   StoreVisitor* visitor, base::StringPiece* brand) {
+  Reader reader(value);
+  base::StringPiece name;
+  if (!reader.ReadString(&name))
+    return false;
+  if (brand->data() == NULL || name != *brand) {
+    visitor->OnBrand(name);
+    *brand = name;
+  }
+
+  if (tag == kBrandTag) {
+    while (!reader.empty()) {
+      uint64 record_tag;
+      base::StringPiece record;
+      if (!reader.ReadRecord(&record_tag, &record))
+        return false;
+      if (record_tag == kAccessPointTag && !DecodeAccessPoint(record, visitor))
+        return false;
+    }
+    return true;
+  }
+
+  uint64 id;
+  if (!reader.ReadVarint(&id))
+    return false;
+  return !IsKnownProduct(id) ||
+      DecodeProduct(static_cast<Product>(id), &reader, visitor);
+}
+
+void DecodeVersion2(Reader* reader, StoreVisitor* visitor,
+                    int* damaged_sections) {
+  // The brand the visitor was last told about, NULL before the first one.
+  base::StringPiece brand;
+
+  while (!reader->empty()) {
+    uint64 tag;
+    uint32 length, checksum;
+    base::StringPiece value;
+    if (!reader->ReadVarint(&tag) || !reader->ReadFixed32(&length) ||
+        !reader->ReadFixed32(&checksum) || !reader->ReadBytes(length, &value)) {
+      // The framing is broken, there is no way to find the next section.
+      ++*damaged_sections;
+      return;
+    }
+    if (tag != kBrandTag && tag != kProductTag)
+      continue;
+
+    if (Checksum(value.data(), value.size()) != checksum ||
+        !DecodeSection(tag, value, visitor, &brand))
+      ++*damaged_sections;
+  }
+}
+
+// Reads and checks the magic and version of a store.
+bool ReadStoreHeader(Reader* reader, uint64* version) {
+  base::StringPiece magic;
+  return reader->ReadBytes(kStoreMagicSize, &magic) &&
+      magic == base::StringPiece(kStoreMagic, kStoreMagicSize) &&
+      reader->ReadVarint(version) && *version >= 1 &&
+      *version <= kStoreFormatVersion;
+}
+
+// Version 1 brands hold their access point records and product sections,
+// which have a fixed size length and no checksum.
+bool DecodeBrandVersion1(const base::StringPiece& value,
+                         StoreVisitor* visitor) {
+  Reader reader(value);
+  base::StringPiece name;
+  if (!reader.ReadString(&name))
+    return false;
+  visitor->OnBrand(name);
+
+  while (!reader.empty()) {
+    uint64 tag;
+    base::StringPiece record;
+    if (!reader.ReadVarint(&tag))
+      return false;
+    if (tag == kProductTag) {
+      uint32 length;
+      if (!reader.ReadFixed32(&length) || !reader.ReadBytes(length, &record))
+        return false;
+
+      Reader product_reader(record);
+      uint64 id;
+      if (!product_reader.ReadVarint(&id))
+        return false;
+      if (IsKnownProduct(id) &&
+          !DecodeProduct(static_cast<Product>(id), &product_reader, visitor))
+        return false;
+    } else {
+      if (!reader.ReadString(&record))
+        return false;
+      if (tag == kAccessPointTag && !DecodeAccessPoint(record, visitor))
+        return false;
+    }
+  }
+  return true;
+}
+
+void DecodeVersion1(Reader* reader, StoreVisitor* visitor,
+                    int* damaged_sections) {
+  while (!reader->empty()) {
+    uint64 tag;
+    base::StringPiece value;
+    if (!reader->ReadVarint(&tag)) {
+      ++*damaged_sections;
+      return;
+    }
+    if (tag == kBrandTag) {
+      uint32 length;
+      if (!reader->ReadFixed32(&length) || !reader->ReadBytes(length, &value)) {
+        ++*damaged_sections;
+        return;
+      }
+      if (!DecodeBrandVersion1(value, visitor))
+        ++*damaged_sections;
+    } else if (!reader->ReadString(&value)) {
+      ++*damaged_sections;
+      return;
+    }
+  }
+}
+
+}  // namespace
+
+StoreEncoder::StoreEncoder(std::string* output)
+    : output_(output),
+      sections_offset_(0),
+      in_brand_(false),
+      brand_section_started_(false),
+      open_section_(kNoSection),
+      section_start_(0),
+      section_product_(0),
+      section_offset_(0) {
+  output_->append(kStoreMagic, kStoreMagicSize);
+  AppendVarint(kStoreFormatVersion, output_);
+  sections_offset_ = output_->size();
+}
+
+StoreEncoder::~StoreEncoder() {
+  DCHECK(!in_brand_);
+}
+
+void StoreEncoder::BeginBrand(const base::StringPiece& brand) {
+  DCHECK(!in_brand_);
+  in_brand_ = true;
+  brand.CopyToString(&brand_);
+  brand_section_started_ = false;
+}
+
+void StoreEncoder::EndBrand() {
+  DCHECK(in_brand_);
+  DCHECK_NE(kProductSection, open_section_);
+  BeginBrandSection();
+  if (open_section_ == kBrandSection)
+    EndSection();
+  in_brand_ = false;
+}
+
+void StoreEncoder::AddAccessPointRlz(AccessPoint point,
+                                     const base::StringPiece& rlz) {
+  DCHECK(in_brand_);
+  BeginBrandSection();
+  DCHECK_EQ(kBrandSection, open_section_);
+  // The varint of an access point is a single byte.
+  COMPILE_ASSERT(LAST_ACCESS_POINT < 0x80, access_point_varint_too_long);
+  AppendVarint(kAccessPointTag, output_);
+  AppendVarint(1 + rlz.size(), output_);
+  AppendVarint(point, output_);
+  output_->append(rlz.data(), rlz.size());
+}
+
+void StoreEncoder::BeginProduct(Product product) {
+  DCHECK(in_brand_);
+  DCHECK_NE(kProductSection, open_section_);
+  BeginBrandSection();
+  if (open_section_ == kBrandSection)
+    EndSection();
+  BeginSection(kProductTag, product);
+  open_section_ = kProductSection;
+  AppendVarint(product, output_);
+}
+
+void StoreEncoder::EndProduct() {
+  DCHECK_EQ(kProductSection, open_section_);
+  EndSection();
+}
+
+void StoreEncoder::AddPingTime(int64 time) {
+  DCHECK_EQ(kProductSection, open_section_);
+  char buffer[kMaxVarintSize];
+  size_t size = EncodeVarint(static_cast<uint64>(time), buffer);
+  WriteRecord(kPingTimeTag, base::StringPiece(buffer, size));
+}
+
+void StoreEncoder::AddProductEvent(const base::StringPiece& event_rlz) {
+  DCHECK_EQ(kProductSection, open_section_);
+  WriteRecord(kProductEventTag, event_rlz);
+}
+
+void StoreEncoder::AddStatefulEvent(const base::StringPiece& event_rlz) {
+  DCHECK_EQ(kProductSection, open_section_);
+  WriteRecord(kStatefulEventTag, event_rlz);
+}
+
+void StoreEncoder::AddEncodedSection(const StoreSection& section) {
+  DCHECK(in_brand_);
+  DCHECK_EQ(brand_, section.brand);
+  DCHECK_NE(kProductSection, open_section_);
+  if (section.product == 0) {
+    DCHECK(!brand_section_started_);
+    brand_section_started_ = true;
+  } else {
+    BeginBrandSection();
+    if (open_section_ == kBrandSection)
+      EndSection();
+  }
+  AddIndexEntry(section.product, output_->size(), section.data.size());
+  output_->append(section.data.data(), section.data.size());
+}
+
+void StoreEncoder::AddIndex() {
+  DCHECK(!in_brand_);
+  std::string section;
+  AppendVarint(kIndexTag, &section);
+  char header[kSectionHeaderSize];
+  WriteFixed32(static_cast<uint32>(index_.size()), header);
+  WriteFixed32(Checksum(index_.data(), index_.size()), header + kFixed32Size);
+  section.append(header, kSectionHeaderSize);
+  section.append(index_);
+  output_->insert(sections_offset_, section);
+  index_.clear();
+}
+
+void StoreEncoder::WriteRecord(uint32 tag, const base::StringPiece& value) {
+  AppendVarint(tag, output_);
+  AppendVarint(value.size(), output_);
+  output_->append(value.data(), value.size());
+}
+
+void StoreEncoder::BeginBrandSection() {
+  if (brand_section_started_)
+    return;
+  brand_section_started_ = true;
+  BeginSection(kBrandTag, 0);
+  open_section_ = kBrandSection;
+}
+
+void StoreEncoder::BeginSection(uint32 tag, int product) {
+  section_start_ = output_->size();
+  section_product_ = product;
+  AppendVarint(tag, output_);
+  section_offset_ = output_->size();
+  output_->append(kSectionHeaderSize, '\0');
+  AppendVarint(brand_.size(), output_);
+  output_->append(brand_);
+}
+
+void StoreEncoder::EndSection() {
+  DCHECK_NE(kNoSection, open_section_);
+  size_t value_offset = section_offset_ + kSectionHeaderSize;
+  size_t length = output_->size() - value_offset;
+  char header[kSectionHeaderSize];
+  WriteFixed32(static_cast<uint32>(length), header);
+  WriteFixed32(Checksum(output_->data() + value_offset, length),
+               header + kFixed32Size);
+  output_->replace(section_offset_, kSectionHeaderSize, header,
+                   kSectionHeaderSize);
+  AddIndexEntry(section_product_, section_start_,
+                output_->size() - section_start_);
+  open_section_ = kNoSection;
+}
+
+void StoreEncoder::AddIndexEntry(int product, size_t offset, size_t size) {
+  AppendVarint(product, &index_);
+  AppendVarint(brand_.size(), &index_);
+  index_.append(brand_);
+  AppendVarint(offset - sections_offset_, &index_);
+  AppendVarint(size, &index_);
+}
+
+bool DecodeStore(const base::StringPiece& data,
+                 StoreVisitor* visitor,
+                 int* damaged_sections) {
+  Reader reader(data);
+  uint64 version;
+  if (!ReadStoreHeader(&reader, &version))
+    return false;
+
+  int damaged = 0;
+  if (version == 1)
+    DecodeVersion1(&reader, visitor, &damaged);
+  else
+    DecodeVersion2(&reader, visitor, &damaged);
+
+  if (damaged_sections)
+    *damaged_sections = damaged;
+  return true;
+}
+
+bool IsNewerStore(const base::StringPiece& data) {
+  Reader reader(data);
+  base::StringPiece magic;
+  uint64 version;
+  return reader.ReadBytes(kStoreMagicSize, &magic) &&
+      magic == base::StringPiece(kStoreMagic, kStoreMagicSize) &&
+      reader.ReadVarint(&version) && version > kStoreFormatVersion;
+}
+
+bool DecodeStoreIndex(const base::StringPiece& data,
+                      std::vector<StoreSection>* sections) {
+  sections->clear();
+  Reader reader(data);
+  uint64 version, tag;
+  uint32 length, checksum;
+  base::StringPiece index;
+  if (!ReadStoreHeader(&reader, &version) || version < 2 ||
+      !reader.ReadVarint(&tag) || tag != kIndexTag ||
+      !reader.ReadFixed32(&length) || !reader.ReadFixed32(&checksum) ||
+      !reader.ReadBytes(length, &index) ||
+      Checksum(index.data(), index.size()) != checksum)
+    return false;
+
+  base::StringPiece body = reader.rest();
+  Reader index_reader(index);
+  uint64 end = 0;
+  while (!index_reader.empty()) {
+    StoreSection section;
+    uint64 product, offset, size;
+    if (!index_reader.ReadVarint(&product) ||
+        product > static_cast<uint64>(kint32max) ||
+        !index_reader.ReadString(&section.brand) ||
+        !index_reader.ReadVarint(&offset) || !index_reader.ReadVarint(&size) ||
+        offset != end || size > body.size() - offset) {
+      sections->clear();
+      return false;
+    }
+    section.product = static_cast<int>(product);
+    section.data = base::StringPiece(body.data() + offset,
+                                     static_cast<size_t>(size));
+    sections->push_back(section);
+    end = offset + size;
+  }
+  if (end != body.size()) {
+    sections->clear();
+    return false;
+  }
+  return true;
+}
+
+bool DecodeStoreSection(const StoreSection& section, StoreVisitor* visitor) {
+  Reader reader(section.data);
+  uint64 tag;
+  uint32 length, checksum;
+  base::StringPiece value;
+  if (!reader.ReadVarint(&tag) ||
+      tag != (section.product == 0 ? kBrandTag : kProductTag) ||
+      !reader.ReadFixed32(&length) || !reader.ReadFixed32(&checksum) ||
+      !reader.ReadBytes(length, &value) || !reader.empty() ||
+      Checksum(value.data(), value.size()) != checksum)
+    return false;
+
+  // The section must be the one its index entry lists.
+  Reader value_reader(value);
+  base::StringPiece name;
+  uint64 product;
+  if (!value_reader.ReadString(&name) || name != section.brand ||
+      (tag == kProductTag && (!value_reader.ReadVarint(&product) ||
+                              product != static_cast<uint64>(section.product))))
+    return false;
+
+  base::StringPiece brand;
+  return DecodeSection(tag, value, visitor, &brand);
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,210 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A compact, versioned binary encoding of the complete RLZ store: all brands
+// with their access point RLZs, and per product the ping time, the product
+// events and the stateful events. Encoding and decoding are streaming; the
+// encoder is driven by the caller's data structures and the decoder reports
+// each value to a visitor, so no intermediate dictionaries are built.
+//
+// The format is a header followed by checksummed sections, which hold
+// tag-length-value records:
+//
+//   store   := "RLZB" varint(version) section*
+//   section := varint(tag) fixed32(length) fixed32(crc32 of value) value
+//   record  := varint(tag) varint(length) value
+//
+// Fixed size numbers are little endian. Every section belongs to a brand. A
+// brand section holds the brand's access point RLZs, and is followed by one
+// section per product:
+//
+//   brand section   := varint(name size) name record*   (access points)
+//   product section := varint(name size) name varint(Product) record*
+//   access point    := varint(AccessPoint) rlz
+//   ping time       := varint(time)
+//   event           := event name
+//
+// The checksum of a section is verified when the decoder reaches it, and a
+// section that doesn't match is dropped by itself. A damaged byte so costs
+// the RLZs of one brand or the data of one product, not the whole store.
+//
+// A store may start with an index section, which lists the brand and product
+// of every other section with its position, so that readers can decode only
+// the sections they need:
+//
+//   index section := varint(tag) fixed32(length) fixed32(crc32 of value)
+//                    entry*
+//   entry         := varint(Product, 0 for the brand section)
+//                    varint(name size) name varint(offset) varint(length)
+//
+// Offsets count from the end of the index section. The sections of an index
+// follow each other without gaps, up to the end of the store, so a store
+// that was changed without updating its index is noticed.
+//
+// Decoders skip records and sections with unknown tags, so new types can be
+// added without changing the version. Readers of the whole store skip the
+// index that way. Incompatible changes must bump the version. Version 1
+// stores, which nest product sections in brand sections and have no
+// checksums, are still read.
+
+#ifndef RLZ_LIB_STORE_CODEC_H_
+#define RLZ_LIB_STORE_CODEC_H_
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/string_piece.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+// A section of an indexed store, as listed by DecodeStoreIndex().
+struct StoreSection {
+  StoreSection() : product(0) {}
+
+  base::StringPiece brand;
+
+  // The section's Product, or 0 for the brand section with the access point
+  // RLZs.
+  int product;
+
+  // The encoded section, including its tag and checksum.
+  base::StringPiece data;
+};
+
+// The version written by StoreEncoder. Stores with a higher version are
+// rejected by DecodeStore().
+const uint32 kStoreFormatVersion = 2;
+
+// Appends an encoded store to a string. Calls must follow the store layout:
+//   StoreEncoder encoder(&data);
+//   encoder.BeginBrand("");
+//   encoder.AddAccessPointRlz(CHROME_OMNIBOX, "1C1GGLD_enUS123");
+//   encoder.BeginProduct(CHROME);
+//   encoder.AddPingTime(time);
+//   encoder.AddProductEvent("C1I");
+//   encoder.EndProduct();
+//   encoder.EndBrand();
+//   encoder.AddIndex();
+class StoreEncoder {
+ public:
+  // Writes the header to |output|, which must outlive the encoder.
+  explicit StoreEncoder(std::string* output);
+  ~StoreEncoder();
+
+  void BeginBrand(const base::StringPiece& brand);
+  void EndBrand();
+
+  // Must be called between BeginBrand() and EndBrand(), before the brand's
+  // first product.
+  void AddAccessPointRlz(AccessPoint point, const base::StringPiece& rlz);
+
+  void BeginProduct(Product product);
+  void EndProduct();
+
+  // Must be called between BeginProduct() and EndProduct().
+  void AddPingTime(int64 time);
+  void AddProductEvent(const base::StringPiece& event_rlz);
+  void AddStatefulEvent(const base::StringPiece& event_rlz);
+
+  // Copies |section| of the current brand, taken from another store, without
+  // decoding it. A brand section must be added right after BeginBrand(), and
+  // product sections where BeginProduct() could be called.
+  void AddEncodedSection(const StoreSection& section);
+
+  // Inserts the index of all sections after the header. Must be called last,
+  // and is optional; stores without an index are decoded as a whole.
+  void AddIndex();
+
+ private:
+  enum OpenSection {
+    kNoSection,
+    kBrandSection,
+    kProductSection,
+  };
+
+  void WriteRecord(uint32 tag, const base::StringPiece& value);
+
+  // Starts the current brand's section, unless it was started already.
+  void BeginBrandSection();
+
+  // Starts a section of the current brand, with the index key |product|.
+  void BeginSection(uint32 tag, int product);
+  void EndSection();
+
+  // Lists the section of the current brand at |offset| in the index.
+  void AddIndexEntry(int product, size_t offset, size_t size);
+
+  std::string* output_;
+
+  // The offset of the first section.
+  size_t sections_offset_;
+
+  // The name of the current brand, whether BeginBrand() was called, and
+  // whether the brand's section was started.
+  std::string brand_;
+  bool in_brand_;
+  bool brand_section_started_;
+
+  // The open section, its offset and index key, and the offset of its length
+  // field.
+  OpenSection open_section_;
+  size_t section_start_;
+  int section_product_;
+  size_t section_offset_;
+
+  // The index entries of the sections written so far.
+  std::string index_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoreEncoder);
+};
+
+// Receives the values of an encoded store from DecodeStore(), in the order
+// they were encoded.
+class StoreVisitor {
+ public:
+  virtual ~StoreVisitor() {}
+
+  // All values up to the next OnBrand() call belong to |brand|. The empty
+  // brand is the store without supplementary branding.
+  virtual void OnBrand(const base::StringPiece& brand) = 0;
+
+  virtual void OnAccessPointRlz(AccessPoint point,
+                                const base::StringPiece& rlz) = 0;
+  virtual void OnPingTime(Product product, int64 time) = 0;
+  virtual void OnProductEvent(Product product,
+                              const base::StringPiece& event_rlz) = 0;
+  virtual void OnStatefulEvent(Product product,
+                               const base::StringPiece& event_rlz) = 0;
+};
+
+// Decodes |data| and reports its values to |visitor|. Access points and
+// products this version doesn't know are skipped. So are damaged sections,
+// which are counted in |damaged_sections| if it isn't NULL; damage that
+// leaves the rest of |data| unreadable counts as one section. Returns false
+// only if |data| is not a store of a supported version.
+bool DecodeStore(const base::StringPiece& data,
+                 StoreVisitor* visitor,
+                 int* damaged_sections);
+
+// Returns whether |data| is a store of a version newer than this one, which
+// DecodeStore() rejects and which must not be overwritten.
+bool IsNewerStore(const base::StringPiece& data);
+
+// Reads the index of |data| into |sections|, in store order, without looking
+// at the sections themselves. Returns false if |data| has no index, or its
+// index is damaged; such stores must be decoded with DecodeStore().
+bool DecodeStoreIndex(const base::StringPiece& data,
+                      std::vector<StoreSection>* sections);
+
+// Decodes one section listed by DecodeStoreIndex() and reports its values to
+// |visitor|, starting with its brand. Returns false if the section is damaged
+// or doesn't match its index entry, in which case some of its values may have
+// been reported.
+bool DecodeStoreSection(const StoreSection& section, StoreVisitor* visitor);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_STORE_CODEC_H_
@@ -0,0 +1,304 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Compares the binary store format with the dictionary based formats the
+// stores used before: JSON on linux and, on mac, the XML property list, and
+// with the compressed binary format. All formats hold the same data, laid out
+// like the mac store.
+
+#include "rlz/lib/store_codec.h"
+
+#include <string>
+
+#include "base/json/json_reader.h"
+#include "base/json/json_writer.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/perftimer.h"
+#include "base/stringprintf.h"
+#include "base/values.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "rlz/lib/store_compression.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#if defined(OS_MACOSX)
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "base/mac/scoped_cftyperef.h"
+#include "base/sys_string_conversions.h"
+#endif
+
+namespace {
+
+const int kIterations = 2000;
+const int kBrandCounts[] = { 1, 10, 50, 200 };
+
+const rlz_lib::Product kProducts[] = {
+  rlz_lib::CHROME, rlz_lib::DESKTOP, rlz_lib::IE_TOOLBAR, rlz_lib::PARTNER
+};
+const rlz_lib::AccessPoint kAccessPoints[] = {
+  rlz_lib::CHROME_OMNIBOX, rlz_lib::CHROME_HOME_PAGE,
+  rlz_lib::IETB_SEARCH_BOX, rlz_lib::GD_DESKBAND
+};
+const char* kEvents[] = { "I", "S", "F" };
+
+std::string BrandName(int brand) {
+  return brand == 0 ? std::string() : base::StringPrintf("B%03d", brand);
+}
+
+std::string EventName(rlz_lib::AccessPoint point, const char* event) {
+  return std::string(rlz_lib::GetAccessPointName(point)) + event;
+}
+
+// Fills |store| with |brands| brands worth of typical data.
+void FillMemoryStore(int brands, rlz_lib::RlzValueStoreMemory* store) {
+  std::string data;
+  rlz_lib::StoreEncoder encoder(&data);
+  for (int b = 0; b < brands; ++b) {
+    encoder.BeginBrand(BrandName(b));
+    for (size_t i = 0; i < arraysize(kAccessPoints); ++i)
+      encoder.AddAccessPointRlz(kAccessPoints[i], "1C1GGLD_enUS123US456");
+    for (size_t p = 0; p < arraysize(kProducts); ++p) {
+      encoder.BeginProduct(kProducts[p]);
+      encoder.AddPingTime(12345678901234567LL);
+      for (size_t i = 0; i < arraysize(kAccessPoints); ++i) {
+        for (size_t e = 0; e < arraysize(kEvents); ++e) {
+          std::string event = EventName(kAccessPoints[i], kEvents[e]);
+          encoder.AddProductEvent(event);
+          encoder.AddStatefulEvent(event);
+        }
+      }
+      encoder.EndProduct();
+    }
+    encoder.EndBrand();
+  }
+  CHECK(store->Deserialize(data, NULL));
+}
+
+// Builds the same data as FillMemoryStore() in the dictionary layout of the
+// mac and linux stores.
+base::DictionaryValue* BuildDictionary(int brands) {
+  base::DictionaryValue* root = new base::DictionaryValue;
+  for (int b = 0; b < brands; ++b) {
+    base::DictionaryValue* brand = root;
+    if (b > 0) {
+      brand = new base::DictionaryValue;
+      root->Set("brand_" + BrandName(b), brand);
+    }
+
+    base::DictionaryValue* rlzs = new base::DictionaryValue;
+    for (size_t i = 0; i < arraysize(kAccessPoints); ++i) {
+      rlzs->SetString(rlz_lib::GetAccessPointName(kAccessPoints[i]),
+                      "1C1GGLD_enUS123US456");
+    }
+    brand->Set("accessPoints", rlzs);
+
+    for (size_t p = 0; p < arraysize(kProducts); ++p) {
+      base::DictionaryValue* product = new base::DictionaryValue;
+      product->SetString("pingTime", "12345678901234567");
+      base::DictionaryValue* events = new base::DictionaryValue;
+      base::DictionaryValue* stateful_events = new base::DictionaryValue;
+      for (size_t i = 0; i < arraysize(kAccessPoints); ++i) {
+        for (size_t e = 0; e < arraysize(kEvents); ++e) {
+          std::string event = EventName(kAccessPoints[i], kEvents[e]);
+          events->SetBoolean(event, true);
+          stateful_events->SetBoolean(event, true);
+        }
+      }
+      product->Set("productEvents", events);
+      product->Set("statefulEvents", stateful_events);
+      brand->Set(rlz_lib::GetProductName(kProducts[p]), product);
+    }
+  }
+  return root;
+}
+
+#if defined(OS_MACOSX)
+// Converts a dictionary built by BuildDictionary() to a property list.
+CFMutableDictionaryRef ToPropertyList(base::DictionaryValue* dict) {
+  CFMutableDictionaryRef plist = CFDictionaryCreateMutable(
+      NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+      &kCFTypeDictionaryValueCallBacks);
+  for (base::DictionaryValue::key_iterator key = dict->begin_keys();
+       key != dict->end_keys(); ++key) {
+    base::mac::ScopedCFTypeRef<CFStringRef> cf_key(
+        base::SysUTF8ToCFStringRef(*key));
+    base::Value* value = NULL;
+    dict->GetWithoutPathExpansion(*key, &value);
+
+    base::mac::ScopedCFTypeRef<CFTypeRef> cf_value;
+    base::DictionaryValue* child = NULL;
+    std::string string_value;
+    if (value->GetAsDictionary(&child)) {
+      cf_value.reset(ToPropertyList(child));
+    } else if (value->GetAsString(&string_value)) {
+      cf_value.reset(base::SysUTF8ToCFStringRef(string_value));
+    } else {
+      cf_value.reset(CFRetain(kCFBooleanTrue));
+    }
+    CFDictionarySetValue(plist, cf_key, cf_value);
+  }
+  return plist;
+}
+#endif
+
+}  // namespace
+
+TEST(StoreCodecPerfTest, Binary) {
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    rlz_lib::RlzValueStoreMemory store;
+    FillMemoryStore(kBrandCounts[i], &store);
+    std::string data;
+    store.Serialize(&data);
+    LOG(INFO) << kBrandCounts[i] << " brands: " << data.size() << " bytes";
+
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "binary_encode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        std::string output;
+        store.Serialize(&output);
+      }
+    }
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "binary_decode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        rlz_lib::RlzValueStoreMemory copy;
+        EXPECT_TRUE(copy.Deserialize(data, NULL));
+      }
+    }
+  }
+}
+
+// A lock scope that reads one value, and one that changes one product,
+// decoding only the sections they touch.
+TEST(StoreCodecPerfTest, Lazy) {
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    rlz_lib::RlzValueStoreMemory store;
+    FillMemoryStore(kBrandCounts[i], &store);
+    std::string data;
+    store.Serialize(&data);
+
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "lazy_read_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        rlz_lib::RlzValueStoreMemory copy;
+        EXPECT_TRUE(copy.DeserializeLazily(data, NULL));
+        int64 time;
+        EXPECT_TRUE(copy.ReadPingTime(rlz_lib::CHROME, &time));
+      }
+    }
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "lazy_update_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        rlz_lib::RlzValueStoreMemory copy;
+        EXPECT_TRUE(copy.DeserializeLazily(data, NULL));
+        EXPECT_TRUE(copy.AddProductEvent(rlz_lib::CHROME, "C2I"));
+        std::string output;
+        copy.Serialize(&output);
+      }
+    }
+  }
+}
+
+// Saving encodes and compresses the store, loading inflates and decodes it,
+// like the compressed linux store does.
+TEST(StoreCodecPerfTest, Compressed) {
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    rlz_lib::RlzValueStoreMemory store;
+    FillMemoryStore(kBrandCounts[i], &store);
+    std::string encoded;
+    store.Serialize(&encoded);
+    std::string data;
+    rlz_lib::CompressStore(encoded, &data);
+    LOG(INFO) << kBrandCounts[i] << " brands: " << data.size() << " bytes, "
+              << encoded.size() << " uncompressed";
+
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "compressed_encode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        std::string uncompressed;
+        store.Serialize(&uncompressed);
+        std::string output;
+        rlz_lib::CompressStore(uncompressed, &output);
+      }
+    }
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "compressed_decode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        std::string uncompressed;
+        EXPECT_TRUE(rlz_lib::DecompressStore(data, &uncompressed));
+        rlz_lib::RlzValueStoreMemory copy;
+        EXPECT_TRUE(copy.Deserialize(uncompressed, NULL));
+      }
+    }
+  }
+}
+
+TEST(StoreCodecPerfTest, Json) {
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    scoped_ptr<base::DictionaryValue> dict(BuildDictionary(kBrandCounts[i]));
+    std::string data;
+    base::JSONWriter::Write(dict.get(), &data);
+    LOG(INFO) << kBrandCounts[i] << " brands: " << data.size() << " bytes";
+
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "json_encode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        std::string output;
+        base::JSONWriter::Write(dict.get(), &output);
+      }
+    }
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "json_decode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        scoped_ptr<base::Value> value(base::JSONReader::Read(data));
+        EXPECT_TRUE(value.get());
+      }
+    }
+  }
+}
+
+#if defined(OS_MACOSX)
+TEST(StoreCodecPerfTest, Plist) {
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    scoped_ptr<base::DictionaryValue> dict(BuildDictionary(kBrandCounts[i]));
+    base::mac::ScopedCFTypeRef<CFMutableDictionaryRef> plist(
+        ToPropertyList(dict.get()));
+    base::mac::ScopedCFTypeRef<CFDataRef> data(CFPropertyListCreateData(
+        NULL, plist, kCFPropertyListXMLFormat_v1_0, 0, NULL));
+    LOG(INFO) << kBrandCounts[i] << " brands: " << CFDataGetLength(data)
+              << " bytes";
+
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "plist_encode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        base::mac::ScopedCFTypeRef<CFDataRef> output(CFPropertyListCreateData(
+            NULL, plist, kCFPropertyListXMLFormat_v1_0, 0, NULL));
+      }
+    }
+    {
+      PerfTimeLogger timer(base::StringPrintf(
+          "plist_decode_%d_brands", kBrandCounts[i]).c_str());
+      for (int n = 0; n < kIterations; ++n) {
+        base::mac::ScopedCFTypeRef<CFPropertyListRef> value(
+            CFPropertyListCreateWithData(NULL, data,
+                                         kCFPropertyListMutableContainers,
+                                         NULL, NULL));
+        EXPECT_TRUE(value.get());
+      }
+    }
+  }
+}
+#endif
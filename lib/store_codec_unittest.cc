@@ -0,0 +1,420 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the binary store format.
+
+#include "rlz/lib/store_codec.h"
+
+#include <string>
+#include <vector>
+
+#include "base/atomicops.h"
+#include "base/memory/scoped_vector.h"
+#include "base/string_number_conversions.h"
+#include "base/threading/simple_thread.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// Records the decoded values as strings.
+class RecordingVisitor : public rlz_lib::StoreVisitor {
+ public:
+  virtual void OnBrand(const base::StringPiece& brand) OVERRIDE {
+    values.push_back("brand " + brand.as_string());
+  }
+
+  virtual void OnAccessPointRlz(rlz_lib::AccessPoint point,
+                                const base::StringPiece& rlz) OVERRIDE {
+    values.push_back("rlz " + base::IntToString(point) + " " +
+                     rlz.as_string());
+  }
+
+  virtual void OnPingTime(rlz_lib::Product product, int64 time) OVERRIDE {
+    values.push_back("ping " + base::IntToString(product) + " " +
+                     base::Int64ToString(time));
+  }
+
+  virtual void OnProductEvent(rlz_lib::Product product,
+                              const base::StringPiece& event_rlz) OVERRIDE {
+    values.push_back("event " + base::IntToString(product) + " " +
+                     event_rlz.as_string());
+  }
+
+  virtual void OnStatefulEvent(rlz_lib::Product product,
+                               const base::StringPiece& event_rlz) OVERRIDE {
+    values.push_back("stateful " + base::IntToString(product) + " " +
+                     event_rlz.as_string());
+  }
+
+  std::vector<std::string> values;
+};
+
+// The magic and a one byte version.
+const size_t kHeaderSize = 5;
+
+std::string EncodeSampleStore(bool indexed) {
+  std::string data;
+  rlz_lib::StoreEncoder encoder(&data);
+  encoder.BeginBrand("");
+  encoder.AddAccessPointRlz(rlz_lib::IETB_SEARCH_BOX, "TbRlzValue");
+  encoder.BeginProduct(rlz_lib::CHROME);
+  encoder.AddPingTime(1234567890123LL);
+  encoder.AddProductEvent("C1I");
+  encoder.AddStatefulEvent("C1F");
+  encoder.EndProduct();
+  encoder.EndBrand();
+  encoder.BeginBrand("TEST");
+  encoder.BeginProduct(rlz_lib::DESKTOP);
+  encoder.AddProductEvent("D2S");
+  encoder.EndProduct();
+  encoder.EndBrand();
+  if (indexed)
+    encoder.AddIndex();
+  return data;
+}
+
+}  // namespace
+
+TEST(StoreCodecTest, RoundTrip) {
+  RecordingVisitor visitor;
+  int damaged_sections = -1;
+  EXPECT_TRUE(rlz_lib::DecodeStore(EncodeSampleStore(false), &visitor,
+                                   &damaged_sections));
+  EXPECT_EQ(0, damaged_sections);
+
+  const char* kExpected[] = {
+    "brand ",
+    "rlz 3 TbRlzValue",
+    "ping 5 1234567890123",
+    "event 5 C1I",
+    "stateful 5 C1F",
+    "brand TEST",
+    "event 4 D2S",
+  };
+  ASSERT_EQ(arraysize(kExpected), visitor.values.size());
+  for (size_t i = 0; i < arraysize(kExpected); ++i)
+    EXPECT_EQ(kExpected[i], visitor.values[i]);
+}
+
+TEST(StoreCodecTest, RejectsUnsupportedData) {
+  std::string data = EncodeSampleStore(false);
+
+  RecordingVisitor visitor;
+  for (size_t size = 0; size < kHeaderSize; ++size) {
+    EXPECT_FALSE(rlz_lib::DecodeStore(base::StringPiece(data.data(), size),
+                                      &visitor, NULL));
+  }
+
+  std::string bad_magic(data);
+  bad_magic[0] = 'X';
+  EXPECT_FALSE(rlz_lib::DecodeStore(bad_magic, &visitor, NULL));
+
+  std::string newer_version(data);
+  newer_version[4] = static_cast<char>(rlz_lib::kStoreFormatVersion + 1);
+  EXPECT_FALSE(rlz_lib::DecodeStore(newer_version, &visitor, NULL));
+  EXPECT_TRUE(visitor.values.empty());
+  EXPECT_TRUE(rlz_lib::IsNewerStore(newer_version));
+  EXPECT_FALSE(rlz_lib::IsNewerStore(data));
+  EXPECT_FALSE(rlz_lib::IsNewerStore(bad_magic));
+
+  // A store can be empty.
+  EXPECT_TRUE(rlz_lib::DecodeStore(data.substr(0, kHeaderSize), &visitor,
+                                   NULL));
+  EXPECT_TRUE(visitor.values.empty());
+}
+
+TEST(StoreCodecTest, DropsDamagedSections) {
+  std::string data = EncodeSampleStore(false);
+
+  // A damaged event costs the data of its product only.
+  std::string damaged(data);
+  damaged[damaged.find("C1I")] = 'X';
+  RecordingVisitor visitor;
+  int damaged_sections = 0;
+  EXPECT_TRUE(rlz_lib::DecodeStore(damaged, &visitor, &damaged_sections));
+  EXPECT_EQ(1, damaged_sections);
+  const char* kExpected[] = {
+    "brand ",
+    "rlz 3 TbRlzValue",
+    "brand TEST",
+    "event 4 D2S",
+  };
+  ASSERT_EQ(arraysize(kExpected), visitor.values.size());
+  for (size_t i = 0; i < arraysize(kExpected); ++i)
+    EXPECT_EQ(kExpected[i], visitor.values[i]);
+
+  // A truncated store keeps all complete sections.
+  RecordingVisitor truncated_visitor;
+  EXPECT_TRUE(rlz_lib::DecodeStore(
+      base::StringPiece(data.data(), data.size() - 1), &truncated_visitor,
+      &damaged_sections));
+  EXPECT_EQ(1, damaged_sections);
+  ASSERT_EQ(6u, truncated_visitor.values.size());
+  EXPECT_EQ("brand TEST", truncated_visitor.values.back());
+}
+
+TEST(StoreCodecTest, SkipsUnknownSections) {
+  std::string sample = EncodeSampleStore(false);
+
+  // A section with tag 100 and a 3 byte value. Its checksum isn't checked.
+  std::string unknown("\x64\x03\0\0\0\0\0\0\0xyz", 12);
+  std::string data = sample.substr(0, kHeaderSize) + unknown +
+      sample.substr(kHeaderSize);
+
+  RecordingVisitor visitor;
+  int damaged_sections = -1;
+  EXPECT_TRUE(rlz_lib::DecodeStore(data, &visitor, &damaged_sections));
+  EXPECT_EQ(0, damaged_sections);
+  EXPECT_EQ(7u, visitor.values.size());
+}
+
+TEST(StoreCodecTest, ReadsIndex) {
+  // Decoders of the whole store skip the index.
+  std::string data = EncodeSampleStore(true);
+  RecordingVisitor visitor;
+  int damaged_sections = -1;
+  EXPECT_TRUE(rlz_lib::DecodeStore(data, &visitor, &damaged_sections));
+  EXPECT_EQ(0, damaged_sections);
+  EXPECT_EQ(7u, visitor.values.size());
+
+  std::vector<rlz_lib::StoreSection> sections;
+  ASSERT_TRUE(rlz_lib::DecodeStoreIndex(data, &sections));
+  ASSERT_EQ(4u, sections.size());
+  EXPECT_EQ("", sections[0].brand);
+  EXPECT_EQ(0, sections[0].product);
+  EXPECT_EQ("", sections[1].brand);
+  EXPECT_EQ(rlz_lib::CHROME, sections[1].product);
+  EXPECT_EQ("TEST", sections[2].brand);
+  EXPECT_EQ(0, sections[2].product);
+  EXPECT_EQ("TEST", sections[3].brand);
+  EXPECT_EQ(rlz_lib::DESKTOP, sections[3].product);
+
+  // Each section decodes by itself.
+  RecordingVisitor section_visitor;
+  EXPECT_TRUE(rlz_lib::DecodeStoreSection(sections[1], &section_visitor));
+  const char* kExpected[] = {
+    "brand ",
+    "ping 5 1234567890123",
+    "event 5 C1I",
+    "stateful 5 C1F",
+  };
+  ASSERT_EQ(arraysize(kExpected), section_visitor.values.size());
+  for (size_t i = 0; i < arraysize(kExpected); ++i)
+    EXPECT_EQ(kExpected[i], section_visitor.values[i]);
+
+  // A section must match its index entry.
+  rlz_lib::StoreSection other_product = sections[1];
+  other_product.product = rlz_lib::DESKTOP;
+  EXPECT_FALSE(rlz_lib::DecodeStoreSection(other_product, &section_visitor));
+  rlz_lib::StoreSection other_brand = sections[3];
+  other_brand.brand = "";
+  EXPECT_FALSE(rlz_lib::DecodeStoreSection(other_brand, &section_visitor));
+
+  // Damage in a section is found when it is decoded.
+  std::string damaged(data);
+  damaged[damaged.find("C1I")] = 'X';
+  ASSERT_TRUE(rlz_lib::DecodeStoreIndex(damaged, &sections));
+  EXPECT_FALSE(rlz_lib::DecodeStoreSection(sections[1], &section_visitor));
+  EXPECT_TRUE(rlz_lib::DecodeStoreSection(sections[3], &section_visitor));
+}
+
+TEST(StoreCodecTest, RejectsInvalidIndex) {
+  std::vector<rlz_lib::StoreSection> sections;
+  EXPECT_FALSE(rlz_lib::DecodeStoreIndex(EncodeSampleStore(false), &sections));
+  EXPECT_FALSE(rlz_lib::DecodeStoreIndex("garbage", &sections));
+
+  // A damaged index.
+  std::string data = EncodeSampleStore(true);
+  std::string damaged(data);
+  damaged[kHeaderSize + 10] ^= 1;
+  EXPECT_FALSE(rlz_lib::DecodeStoreIndex(damaged, &sections));
+  EXPECT_TRUE(sections.empty());
+
+  // Sections the index doesn't list, or that are missing.
+  EXPECT_FALSE(rlz_lib::DecodeStoreIndex(data + data.substr(kHeaderSize),
+                                         &sections));
+  EXPECT_FALSE(rlz_lib::DecodeStoreIndex(data.substr(0, data.size() - 1),
+                                         &sections));
+  EXPECT_TRUE(sections.empty());
+}
+
+TEST(StoreCodecTest, ReadsVersion1) {
+  // A brand with an access point RLZ and a product section with a ping time.
+  std::string product("\x05\x04\x01\x07", 4);
+  std::string brand = std::string(1, '\0') + "\x02\x03\x03Tb" + "\x03" +
+      std::string("\x04\0\0\0", 4) + product;
+  std::string data = std::string("RLZB\x01\x01", 6) +
+      static_cast<char>(brand.size()) + std::string(3, '\0') + brand;
+
+  RecordingVisitor visitor;
+  int damaged_sections = -1;
+  EXPECT_TRUE(rlz_lib::DecodeStore(data, &visitor, &damaged_sections));
+  EXPECT_EQ(0, damaged_sections);
+  const char* kExpected[] = {
+    "brand ",
+    "rlz 3 Tb",
+    "ping 5 7",
+  };
+  ASSERT_EQ(arraysize(kExpected), visitor.values.size());
+  for (size_t i = 0; i < arraysize(kExpected); ++i)
+    EXPECT_EQ(kExpected[i], visitor.values[i]);
+}
+
+TEST(StoreCodecTest, MemoryStoreRoundTrip) {
+  rlz_lib::RlzValueStoreMemory store;
+  EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        "TbRlzValue"));
+  EXPECT_TRUE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(store.AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+
+  std::string data;
+  store.Serialize(&data);
+
+  rlz_lib::RlzValueStoreMemory copy;
+  ASSERT_TRUE(copy.Deserialize(data, NULL));
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(copy.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                      rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  int64 time = 0;
+  EXPECT_TRUE(copy.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  std::vector<std::string> events;
+  EXPECT_TRUE(copy.ReadProductEvents(rlz_lib::CHROME, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("C1I", events[0]);
+  EXPECT_TRUE(copy.IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+
+  std::string copy_data;
+  copy.Serialize(&copy_data);
+  EXPECT_EQ(data, copy_data);
+
+  EXPECT_FALSE(copy.Deserialize("garbage", NULL));
+  EXPECT_FALSE(copy.ReadPingTime(rlz_lib::CHROME, &time));
+}
+
+TEST(StoreCodecTest, MemoryStoreDecodesLazily) {
+  rlz_lib::RlzValueStoreMemory store;
+  EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        "TbRlzValue"));
+  EXPECT_TRUE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::DESKTOP, "D2S"));
+  std::string data;
+  store.Serialize(&data);
+
+  // A store nobody touched is written unchanged.
+  rlz_lib::RlzValueStoreMemory copy;
+  ASSERT_TRUE(copy.DeserializeLazily(data, NULL));
+  std::string copy_data;
+  copy.Serialize(&copy_data);
+  EXPECT_EQ(data, copy_data);
+
+  // Changes to one product keep the sections nobody touched.
+  int64 time = 0;
+  EXPECT_TRUE(copy.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  EXPECT_TRUE(copy.AddProductEvent(rlz_lib::CHROME, "C1I"));
+  copy.CollectGarbage();
+  copy_data.clear();
+  copy.Serialize(&copy_data);
+
+  rlz_lib::RlzValueStoreMemory decoded;
+  ASSERT_TRUE(decoded.Deserialize(copy_data, NULL));
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(decoded.ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  EXPECT_TRUE(decoded.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  std::vector<std::string> events;
+  EXPECT_TRUE(decoded.ReadProductEvents(rlz_lib::CHROME, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("C1I", events[0]);
+  events.clear();
+  EXPECT_TRUE(decoded.ReadProductEvents(rlz_lib::DESKTOP, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("D2S", events[0]);
+
+  // Stores without an index are decoded right away.
+  std::string unindexed = EncodeSampleStore(false);
+  ASSERT_TRUE(copy.DeserializeLazily(unindexed, NULL));
+  EXPECT_TRUE(copy.ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_FALSE(copy.DeserializeLazily("garbage", NULL));
+}
+
+namespace {
+
+// Reads every value of a lazily decoded store, like a shared reader would.
+class LazyReader : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit LazyReader(rlz_lib::RlzValueStoreMemory* store)
+      : store_(store), failures_(0) {}
+
+  virtual void Run() OVERRIDE {
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    if (!store_->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                    rlz, arraysize(rlz)) ||
+        std::string("TbRlzValue") != rlz) {
+      base::subtle::NoBarrier_AtomicIncrement(&failures_, 1);
+    }
+    int64 time = 0;
+    if (!store_->ReadPingTime(rlz_lib::CHROME, &time) ||
+        time != 1234567890123LL) {
+      base::subtle::NoBarrier_AtomicIncrement(&failures_, 1);
+    }
+    std::vector<std::string> events;
+    if (!store_->ReadProductEvents(rlz_lib::DESKTOP, &events) ||
+        events.size() != 1 || events[0] != "D2S") {
+      base::subtle::NoBarrier_AtomicIncrement(&failures_, 1);
+    }
+    // Products that aren't in the store aren't added by reading them.
+    if (store_->ReadPingTime(rlz_lib::PINYIN_IME, &time))
+      base::subtle::NoBarrier_AtomicIncrement(&failures_, 1);
+  }
+
+  int failures() const { return base::subtle::NoBarrier_Load(&failures_); }
+
+ private:
+  rlz_lib::RlzValueStoreMemory* store_;
+  base::subtle::Atomic32 failures_;
+
+  DISALLOW_COPY_AND_ASSIGN(LazyReader);
+};
+
+}  // namespace
+
+TEST(StoreCodecTest, MemoryStoreDecodesLazilyForSharedReaders) {
+  rlz_lib::RlzValueStoreMemory store;
+  EXPECT_TRUE(store.WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        "TbRlzValue"));
+  EXPECT_TRUE(store.WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store.AddProductEvent(rlz_lib::DESKTOP, "D2S"));
+  std::string data;
+  store.Serialize(&data);
+
+  for (int round = 0; round < 20; ++round) {
+    rlz_lib::RlzValueStoreMemory copy;
+    ASSERT_TRUE(copy.DeserializeLazily(data, NULL));
+
+    const int kReaders = 4;
+    LazyReader reader(&copy);
+    ScopedVector<base::DelegateSimpleThread> threads;
+    for (int i = 0; i < kReaders; ++i) {
+      threads.push_back(new base::DelegateSimpleThread(&reader, "reader"));
+      threads.back()->Start();
+    }
+    for (int i = 0; i < kReaders; ++i)
+      threads[i]->Join();
+    EXPECT_EQ(0, reader.failures());
+
+    // Decoding for the readers doesn't change what is written.
+    std::string copy_data;
+    copy.Serialize(&copy_data);
+    EXPECT_EQ(data, copy_data);
+  }
+}
@@ -0,0 +1,120 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/store_compression.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "base/basictypes.h"
+#include "base/logging.h"
+#include "third_party/zlib/zlib.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// Written to disk and should not be changed.
+const char kCompressedMagic[] = "RLZZ";
+const size_t kCompressedMagicSize = 4;
+
+const size_t kFixed32Size = 4;
+const size_t kHeaderSize = kCompressedMagicSize + kFixed32Size;
+
+// zlib produces and consumes data in chunks of this size, so that neither
+// direction needs a second buffer of the whole store.
+const size_t kChunkSize = 16 * 1024;
+
+// Stores are a few kilobytes even with many brands. A size above this is
+// damage, and isn't allocated.
+const uint32 kMaxStoreSize = 64 * 1024 * 1024;
+
+}  // namespace
+
+bool IsCompressedStore(const base::StringPiece& data) {
+  return data.starts_with(base::StringPiece(kCompressedMagic,
+                                            kCompressedMagicSize));
+}
+
+void CompressStore(const base::StringPiece& store, std::string* output) {
+  output->append(kCompressedMagic, kCompressedMagicSize);
+  uint32 size = static_cast<uint32>(store.size());
+  for (size_t i = 0; i < kFixed32Size; ++i)
+    output->push_back(static_cast<char>(size >> (8 * i)));
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // The default level compresses stores about as well as the best one, in
+  // half the time.
+  CHECK_EQ(Z_OK, deflateInit(&stream, Z_DEFAULT_COMPRESSION));
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(store.data()));
+  stream.avail_in = static_cast<uInt>(store.size());
+
+  int result;
+  do {
+    size_t offset = output->size();
+    output->resize(offset + kChunkSize);
+    stream.next_out = reinterpret_cast<Bytef*>(&(*output)[offset]);
+    stream.avail_out = kChunkSize;
+    result = deflate(&stream, Z_FINISH);
+    DCHECK(result == Z_OK || result == Z_STREAM_END);
+    output->resize(offset + kChunkSize - stream.avail_out);
+  } while (result == Z_OK);
+  deflateEnd(&stream);
+}
+
+bool DecompressStore(const base::StringPiece& data, std::string* store) {
+  store->clear();
+  if (data.size() < kHeaderSize || !IsCompressedStore(data))
+    return false;
+
+  uint32 size = 0;
+  for (size_t i = 0; i < kFixed32Size; ++i) {
+    size |= static_cast<uint32>(
+        static_cast<uint8>(data[kCompressedMagicSize + i])) << (8 * i);
+  }
+  if (size > kMaxStoreSize)
+    return false;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return false;
+  stream.next_in =
+      reinterpret_cast<Bytef*>(const_cast<char*>(data.data() + kHeaderSize));
+  stream.avail_in = static_cast<uInt>(data.size() - kHeaderSize);
+
+  // The store grows a chunk at a time, up to the size the header promises,
+  // so that a damaged header can't make this allocate more than the data
+  // inflates to.
+  int result = Z_OK;
+  while (result == Z_OK) {
+    size_t offset = store->size();
+    size_t chunk = std::min<size_t>(kChunkSize, size - offset);
+    if (chunk == 0) {
+      // All of the store was inflated, only the end of the stream is left.
+      chunk = 1;
+    }
+    store->resize(offset + chunk);
+    stream.next_out = reinterpret_cast<Bytef*>(&(*store)[offset]);
+    stream.avail_out = static_cast<uInt>(chunk);
+    result = inflate(&stream, Z_NO_FLUSH);
+    store->resize(offset + chunk - stream.avail_out);
+    if (store->size() > size)
+      result = Z_DATA_ERROR;
+  }
+  inflateEnd(&stream);
+
+  // Z_STREAM_END means the stream's checksum matched.
+  if (result != Z_STREAM_END || store->size() != size ||
+      stream.avail_in != 0) {
+    store->clear();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace rlz_lib
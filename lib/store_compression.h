@@ -0,0 +1,36 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// zlib compression of encoded stores, see store_codec.h. Stores with many
+// supplementary brands repeat the same access points, products and events
+// for each brand, which compresses well. A compressed store is a header
+// followed by the zlib stream of the encoded store:
+//
+//   compressed store := "RLZZ" fixed32(size of the encoded store) zlib
+//
+// The zlib stream carries a checksum of the encoded store, so damage is
+// detected before the store is decoded.
+
+#ifndef RLZ_LIB_STORE_COMPRESSION_H_
+#define RLZ_LIB_STORE_COMPRESSION_H_
+
+#include <string>
+
+#include "base/string_piece.h"
+
+namespace rlz_lib {
+
+// Returns whether |data| starts like a compressed store.
+bool IsCompressedStore(const base::StringPiece& data);
+
+// Appends |store| compressed to |output|.
+void CompressStore(const base::StringPiece& store, std::string* output);
+
+// Sets |store| to the encoded store that |data| holds compressed. Returns
+// false if |data| isn't a compressed store, or is damaged.
+bool DecompressStore(const base::StringPiece& data, std::string* store);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_STORE_COMPRESSION_H_
@@ -0,0 +1,93 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for store compression.
+
+#include "rlz/lib/store_compression.h"
+
+#include <string>
+
+#include "base/stringprintf.h"
+#include "rlz/lib/store_codec.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// Encodes a store with |brands| brands that have the same RLZs and events.
+std::string EncodeStore(int brands) {
+  std::string data;
+  rlz_lib::StoreEncoder encoder(&data);
+  for (int b = 0; b < brands; ++b) {
+    encoder.BeginBrand(b == 0 ? std::string() : base::StringPrintf("B%03d", b));
+    encoder.AddAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "1C1GGLD_enUS123US456");
+    encoder.BeginProduct(rlz_lib::CHROME);
+    encoder.AddPingTime(12345678901234567LL);
+    encoder.AddProductEvent("C1I");
+    encoder.AddStatefulEvent("C1F");
+    encoder.EndProduct();
+    encoder.EndBrand();
+  }
+  return data;
+}
+
+}  // namespace
+
+TEST(StoreCompressionTest, RoundTrip) {
+  const int kBrandCounts[] = { 0, 1, 1000 };
+  for (size_t i = 0; i < arraysize(kBrandCounts); ++i) {
+    std::string store = EncodeStore(kBrandCounts[i]);
+    std::string compressed;
+    rlz_lib::CompressStore(store, &compressed);
+    EXPECT_TRUE(rlz_lib::IsCompressedStore(compressed));
+    EXPECT_FALSE(rlz_lib::IsCompressedStore(store));
+
+    std::string decompressed;
+    EXPECT_TRUE(rlz_lib::DecompressStore(compressed, &decompressed));
+    EXPECT_EQ(store, decompressed);
+  }
+
+  // Brands repeat the same records, and stores with many of them spend
+  // several chunks.
+  std::string store = EncodeStore(1000);
+  std::string compressed;
+  rlz_lib::CompressStore(store, &compressed);
+  EXPECT_LT(compressed.size() * 5, store.size());
+  EXPECT_LT(16u * 1024, store.size());
+}
+
+TEST(StoreCompressionTest, RejectsDamage) {
+  std::string compressed;
+  rlz_lib::CompressStore(EncodeStore(10), &compressed);
+  std::string store;
+
+  // Not compressed.
+  EXPECT_FALSE(rlz_lib::DecompressStore(EncodeStore(10), &store));
+  EXPECT_FALSE(rlz_lib::DecompressStore("RLZZ", &store));
+
+  // Truncated.
+  EXPECT_FALSE(rlz_lib::DecompressStore(
+      compressed.substr(0, compressed.size() - 1), &store));
+  EXPECT_TRUE(store.empty());
+
+  // Trailing data.
+  EXPECT_FALSE(rlz_lib::DecompressStore(compressed + "x", &store));
+
+  // Damaged data, caught by the stream's checksum.
+  std::string damaged = compressed;
+  damaged[damaged.size() / 2] ^= 1;
+  EXPECT_FALSE(rlz_lib::DecompressStore(damaged, &store));
+
+  // A size that doesn't match what the stream inflates to, in either
+  // direction.
+  for (int delta = -1; delta <= 1; delta += 2) {
+    damaged = compressed;
+    damaged[4] = static_cast<char>(damaged[4] + delta);
+    EXPECT_FALSE(rlz_lib::DecompressStore(damaged, &store));
+  }
+
+  // A huge size isn't allocated.
+  damaged = compressed;
+  damaged[7] = '\x7f';
+  EXPECT_FALSE(rlz_lib::DecompressStore(damaged, &store));
+}
@@ -0,0 +1,83 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/store_generation_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/logging.h"
+
+namespace rlz_lib {
+
+StoreGeneration::StoreGeneration() : counter_(NULL), writable_(false) {
+}
+
+StoreGeneration::~StoreGeneration() {
+  Close();
+}
+
+bool StoreGeneration::Open(const FilePath& path) {
+  Close();
+  path_ = path;
+
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDWR | O_CREAT, 0666));
+  writable_ = fd != -1;
+  if (!writable_)
+    fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+  if (fd == -1) {
+    // The store's directory may not have been created yet.
+    if (errno != ENOENT)
+      PLOG(ERROR) << "open " << path.value();
+    return false;
+  }
+
+  // A new file is zero-filled, which is generation 0. Processes that create
+  // it at the same time all truncate it to the same size.
+  struct stat info;
+  bool sized = fstat(fd, &info) == 0 &&
+      (info.st_size >= static_cast<off_t>(sizeof(*counter_)) ||
+       (writable_ && HANDLE_EINTR(ftruncate(fd, sizeof(*counter_))) == 0));
+  void* memory = MAP_FAILED;
+  if (sized) {
+    memory = mmap(NULL, sizeof(*counter_),
+                  writable_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                  fd, 0);
+  }
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "map " << path.value();
+    return false;
+  }
+  counter_ = static_cast<volatile base::subtle::Atomic32*>(memory);
+  return true;
+}
+
+uint32 StoreGeneration::Get() const {
+  DCHECK(counter_);
+  return static_cast<uint32>(base::subtle::Acquire_Load(counter_));
+}
+
+bool StoreGeneration::Increment(uint32* generation) {
+  DCHECK(counter_);
+  if (!writable_)
+    return false;
+  *generation = static_cast<uint32>(
+      base::subtle::Barrier_AtomicIncrement(counter_, 1));
+  return true;
+}
+
+void StoreGeneration::Close() {
+  if (counter_) {
+    munmap(const_cast<base::subtle::Atomic32*>(counter_), sizeof(*counter_));
+    counter_ = NULL;
+  }
+  writable_ = false;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,58 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// A counter that all processes share, which writers of a store bump so that
+// readers can tell cheaply whether a copy of the store they keep is current.
+
+#ifndef RLZ_LIB_STORE_GENERATION_POSIX_H_
+#define RLZ_LIB_STORE_GENERATION_POSIX_H_
+
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/file_path.h"
+
+namespace rlz_lib {
+
+// The generation of a store, kept in a small file next to it that every
+// process maps. Reading it is a load from memory, so checking a cached copy
+// of the store costs no system call.
+//
+// All writers of the store must bump the generation after they replaced the
+// store, while they still hold the store's cross-process lock. Readers must
+// read the generation before they read the store, so that a copy is never
+// newer than its generation says. The counter wraps around, which only
+// matters to a reader that misses exactly 2^32 writes.
+class StoreGeneration {
+ public:
+  StoreGeneration();
+  ~StoreGeneration();
+
+  // Maps the generation file |path|, creating it if needed. If the file
+  // can't be written, it is mapped read-only and Increment() fails. Returns
+  // false if the file can't be mapped at all.
+  bool Open(const FilePath& path);
+
+  const FilePath& path() const { return path_; }
+
+  // Returns the current generation. Must only be called after Open()
+  // succeeded.
+  uint32 Get() const;
+
+  // Bumps the generation and sets |generation| to the new one. Returns false
+  // if the file is read-only.
+  bool Increment(uint32* generation);
+
+ private:
+  void Close();
+
+  FilePath path_;
+  volatile base::subtle::Atomic32* counter_;
+  bool writable_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoreGeneration);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_STORE_GENERATION_POSIX_H_
@@ -0,0 +1,68 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/store_generation_posix.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/file_path.h"
+#include "base/scoped_temp_dir.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+TEST(StoreGenerationTest, StartsAtZero) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+
+  rlz_lib::StoreGeneration generation;
+  ASSERT_TRUE(generation.Open(temp_dir.path().Append("generation")));
+  EXPECT_EQ(0u, generation.Get());
+}
+
+TEST(StoreGenerationTest, IsShared) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath path = temp_dir.path().Append("generation");
+
+  rlz_lib::StoreGeneration writer;
+  rlz_lib::StoreGeneration reader;
+  ASSERT_TRUE(writer.Open(path));
+  ASSERT_TRUE(reader.Open(path));
+
+  uint32 bumped = 0;
+  EXPECT_TRUE(writer.Increment(&bumped));
+  EXPECT_EQ(1u, bumped);
+  EXPECT_EQ(1u, reader.Get());
+
+  EXPECT_TRUE(reader.Increment(&bumped));
+  EXPECT_EQ(2u, writer.Get());
+
+  // Opening the file again keeps the generation.
+  rlz_lib::StoreGeneration later;
+  ASSERT_TRUE(later.Open(path));
+  EXPECT_EQ(2u, later.Get());
+}
+
+TEST(StoreGenerationTest, ReadOnly) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath path = temp_dir.path().Append("generation");
+
+  rlz_lib::StoreGeneration generation;
+  EXPECT_FALSE(generation.Open(temp_dir.path().Append("missing")
+                                   .Append("generation")));
+
+  uint32 bumped = 0;
+  ASSERT_TRUE(generation.Open(path));
+  EXPECT_TRUE(generation.Increment(&bumped));
+  ASSERT_EQ(0, chmod(path.value().c_str(), 0444));
+
+  rlz_lib::StoreGeneration reader;
+  ASSERT_TRUE(reader.Open(path));
+  EXPECT_EQ(1u, reader.Get());
+  // root can write anyway.
+  if (geteuid() != 0) {
+    EXPECT_FALSE(reader.Increment(&bumped));
+  }
+}
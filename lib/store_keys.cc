@@ -0,0 +1,169 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/store_keys.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+
+namespace rlz_lib {
+
+namespace {
+
+const int kProductCount = PARTNER + 1;
+const int kEventCount = LAST_ACCESS_POINT * LAST_EVENT;
+
+// An event key and the event it names, for FindEventKey().
+struct EventEntry {
+  const StoreKey* key;
+  AccessPoint point;
+  Event event;
+};
+
+bool EventEntryLess(const EventEntry& a, const EventEntry& b) {
+  return strcmp(a.key->name, b.key->name) < 0;
+}
+
+bool EventEntryNameLess(const EventEntry& entry, const char* name) {
+  return strcmp(entry.key->name, name) < 0;
+}
+
+// Fills |key| with the forms of |name|, which is ASCII.
+void InitKey(const char* name, StoreKey* key) {
+  size_t size = strlen(name);
+  CHECK_LT(size, kMaxStoreKeySize);
+  memcpy(key->name, name, size + 1);
+#if defined(OS_WIN)
+  for (size_t i = 0; i <= size; ++i)
+    key->wide_name[i] = static_cast<wchar_t>(name[i]);
+#elif defined(OS_MACOSX)
+  key->native_name = CFStringCreateWithCString(kCFAllocatorDefault, name,
+                                               kCFStringEncodingASCII);
+  CHECK(key->native_name);
+#endif
+}
+
+// The interned keys. Built once, and never changed or freed.
+class KeyPool {
+ public:
+  KeyPool();
+
+  const StoreKey* product(Product product) const {
+    return &products_[product];
+  }
+
+  const StoreKey* access_point(AccessPoint point) const {
+    return &access_points_[point];
+  }
+
+  const StoreKey* event(AccessPoint point, Event event) const {
+    return &events_[point][event];
+  }
+
+  const EventEntry* FindEvent(const char* event_rlz) const;
+
+ private:
+  StoreKey products_[kProductCount];
+  StoreKey access_points_[LAST_ACCESS_POINT];
+  StoreKey events_[LAST_ACCESS_POINT][LAST_EVENT];
+
+  // The events with a name, sorted by name.
+  EventEntry sorted_events_[kEventCount];
+  size_t sorted_event_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(KeyPool);
+};
+
+KeyPool::KeyPool() : sorted_event_count_(0) {
+  InitKey("", &products_[0]);
+  for (int i = IE_TOOLBAR; i < kProductCount; ++i)
+    InitKey(GetProductName(static_cast<Product>(i)), &products_[i]);
+
+  for (int i = NO_ACCESS_POINT; i < LAST_ACCESS_POINT; ++i) {
+    AccessPoint point = static_cast<AccessPoint>(i);
+    const char* point_name = GetAccessPointName(point);
+    InitKey(point_name, &access_points_[i]);
+
+    for (int j = INVALID_EVENT; j < LAST_EVENT; ++j) {
+      Event event = static_cast<Event>(j);
+      const char* event_name = GetEventName(event);
+      if (!point_name[0] || !event_name[0]) {
+        InitKey("", &events_[i][j]);
+        continue;
+      }
+
+      InitKey((std::string(point_name) + event_name).c_str(), &events_[i][j]);
+      EventEntry entry = { &events_[i][j], point, event };
+      sorted_events_[sorted_event_count_++] = entry;
+    }
+  }
+  std::sort(sorted_events_, sorted_events_ + sorted_event_count_,
+            EventEntryLess);
+}
+
+const EventEntry* KeyPool::FindEvent(const char* event_rlz) const {
+  const EventEntry* end = sorted_events_ + sorted_event_count_;
+  const EventEntry* entry =
+      std::lower_bound(sorted_events_, end, event_rlz, EventEntryNameLess);
+  if (entry == end || strcmp(entry->key->name, event_rlz) != 0)
+    return NULL;
+  return entry;
+}
+
+base::LazyInstance<KeyPool>::Leaky g_key_pool = LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+const StoreKey* GetProductKey(Product product) {
+  if (product < IE_TOOLBAR || product >= kProductCount) {
+    ASSERT_STRING("GetProductKey: Unknown Product");
+    return NULL;
+  }
+  return g_key_pool.Get().product(product);
+}
+
+const StoreKey* GetAccessPointKey(AccessPoint point) {
+  if (point < NO_ACCESS_POINT || point >= LAST_ACCESS_POINT) {
+    ASSERT_STRING("GetAccessPointKey: Unknown Access Point");
+    return NULL;
+  }
+  return g_key_pool.Get().access_point(point);
+}
+
+const StoreKey* GetEventKey(AccessPoint point, Event event) {
+  if (!GetAccessPointKey(point))
+    return NULL;
+  if (event < INVALID_EVENT || event >= LAST_EVENT) {
+    ASSERT_STRING("GetEventKey: Unknown Event");
+    return NULL;
+  }
+
+  const StoreKey* key = g_key_pool.Get().event(point, event);
+  return key->name[0] ? key : NULL;
+}
+
+const StoreKey* FindEventKey(const char* event_rlz,
+                             AccessPoint* point,
+                             Event* event) {
+  if (!event_rlz)
+    return NULL;
+
+  const EventEntry* entry = g_key_pool.Get().FindEvent(event_rlz);
+  if (!entry)
+    return NULL;
+  if (point)
+    *point = entry->point;
+  if (event)
+    *event = entry->event;
+  return entry->key;
+}
+
+}  // namespace rlz_lib
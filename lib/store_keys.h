@@ -0,0 +1,56 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The names stores keep values under: products, access points, and events,
+// which are stored as the access point name followed by the event name, like
+// "C1I". Every name is interned once per process, along with the forms the
+// platform stores use, so store calls don't build key strings.
+
+#ifndef RLZ_LIB_STORE_KEYS_H_
+#define RLZ_LIB_STORE_KEYS_H_
+
+#include "base/basictypes.h"
+#include "build/build_config.h"
+#include "rlz/lib/rlz_enums.h"
+
+#if defined(OS_MACOSX)
+#include <CoreFoundation/CoreFoundation.h>
+#endif
+
+namespace rlz_lib {
+
+// Holds the longest name, an event, and its terminator.
+const size_t kMaxStoreKeySize = 4;
+
+// The interned forms of a name. A key lives as long as the process.
+struct StoreKey {
+  char name[kMaxStoreKeySize];
+#if defined(OS_WIN)
+  // For registry key and value names.
+  wchar_t wide_name[kMaxStoreKeySize];
+#elif defined(OS_MACOSX)
+  // For property list keys, toll-free bridged to NSString.
+  CFStringRef native_name;
+#endif
+};
+
+// Return the key of |product| or |point|, or NULL, and assert, if there is
+// no such product or access point. The name of NO_ACCESS_POINT is empty.
+const StoreKey* GetProductKey(Product product);
+const StoreKey* GetAccessPointKey(AccessPoint point);
+
+// Returns the key |event| at |point| is stored as, or NULL if either of them
+// is invalid or has no name.
+const StoreKey* GetEventKey(AccessPoint point, Event event);
+
+// Returns the key of the event stored as |event_rlz|, and sets |point| and
+// |event|, if they aren't NULL. Returns NULL if |event_rlz| isn't the name of
+// an event.
+const StoreKey* FindEventKey(const char* event_rlz,
+                             AccessPoint* point,
+                             Event* event);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LIB_STORE_KEYS_H_
@@ -0,0 +1,94 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the interned store keys.
+
+#include "rlz/lib/store_keys.h"
+
+#include <string>
+
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+#if defined(OS_WIN)
+#include "base/utf_string_conversions.h"
+#endif
+
+TEST(StoreKeysTest, ProductAndAccessPointKeys) {
+  for (int i = rlz_lib::IE_TOOLBAR; i <= rlz_lib::PARTNER; ++i) {
+    rlz_lib::Product product = static_cast<rlz_lib::Product>(i);
+    const rlz_lib::StoreKey* key = rlz_lib::GetProductKey(product);
+    ASSERT_TRUE(key);
+    EXPECT_STREQ(rlz_lib::GetProductName(product), key->name);
+    EXPECT_EQ(key, rlz_lib::GetProductKey(product));
+  }
+
+  for (int i = rlz_lib::NO_ACCESS_POINT; i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    rlz_lib::AccessPoint point = static_cast<rlz_lib::AccessPoint>(i);
+    const rlz_lib::StoreKey* key = rlz_lib::GetAccessPointKey(point);
+    ASSERT_TRUE(key);
+    EXPECT_STREQ(rlz_lib::GetAccessPointName(point), key->name);
+#if defined(OS_WIN)
+    EXPECT_EQ(ASCIIToWide(key->name), key->wide_name);
+#endif
+  }
+
+  rlz_lib::SetExpectedAssertion("GetProductKey: Unknown Product");
+  EXPECT_FALSE(rlz_lib::GetProductKey(static_cast<rlz_lib::Product>(0)));
+  rlz_lib::SetExpectedAssertion("GetAccessPointKey: Unknown Access Point");
+  EXPECT_FALSE(rlz_lib::GetAccessPointKey(rlz_lib::LAST_ACCESS_POINT));
+  rlz_lib::SetExpectedAssertion("");
+}
+
+TEST(StoreKeysTest, EventKeys) {
+  for (int i = rlz_lib::NO_ACCESS_POINT; i < rlz_lib::LAST_ACCESS_POINT; ++i) {
+    rlz_lib::AccessPoint point = static_cast<rlz_lib::AccessPoint>(i);
+    for (int j = rlz_lib::INVALID_EVENT; j < rlz_lib::LAST_EVENT; ++j) {
+      rlz_lib::Event event = static_cast<rlz_lib::Event>(j);
+      const rlz_lib::StoreKey* key = rlz_lib::GetEventKey(point, event);
+      if (point == rlz_lib::NO_ACCESS_POINT ||
+          event == rlz_lib::INVALID_EVENT) {
+        EXPECT_FALSE(key);
+        continue;
+      }
+
+      ASSERT_TRUE(key);
+      EXPECT_EQ(std::string(rlz_lib::GetAccessPointName(point)) +
+                rlz_lib::GetEventName(event), key->name);
+#if defined(OS_WIN)
+      EXPECT_EQ(ASCIIToWide(key->name), key->wide_name);
+#endif
+
+      // Finding the name yields the same key and the event it names.
+      rlz_lib::AccessPoint found_point = rlz_lib::NO_ACCESS_POINT;
+      rlz_lib::Event found_event = rlz_lib::INVALID_EVENT;
+      EXPECT_EQ(key, rlz_lib::FindEventKey(key->name, &found_point,
+                                           &found_event));
+      EXPECT_EQ(point, found_point);
+      EXPECT_EQ(event, found_event);
+      EXPECT_EQ(key, rlz_lib::FindEventKey(key->name, NULL, NULL));
+    }
+  }
+
+  rlz_lib::SetExpectedAssertion("GetEventKey: Unknown Event");
+  EXPECT_FALSE(rlz_lib::GetEventKey(rlz_lib::CHROME_OMNIBOX,
+                                    rlz_lib::LAST_EVENT));
+  rlz_lib::SetExpectedAssertion("");
+}
+
+TEST(StoreKeysTest, FindUnknownEvent) {
+  EXPECT_FALSE(rlz_lib::FindEventKey(NULL, NULL, NULL));
+  EXPECT_FALSE(rlz_lib::FindEventKey("", NULL, NULL));
+  EXPECT_FALSE(rlz_lib::FindEventKey("C1", NULL, NULL));
+  EXPECT_FALSE(rlz_lib::FindEventKey("C1I ", NULL, NULL));
+  EXPECT_FALSE(rlz_lib::FindEventKey("XXX", NULL, NULL));
+
+  // The outputs aren't touched.
+  rlz_lib::AccessPoint point = rlz_lib::CHROME_HOME_PAGE;
+  rlz_lib::Event event = rlz_lib::FIRST_SEARCH;
+  EXPECT_FALSE(rlz_lib::FindEventKey("c1i", &point, &event));
+  EXPECT_EQ(rlz_lib::CHROME_HOME_PAGE, point);
+  EXPECT_EQ(rlz_lib::FIRST_SEARCH, event);
+}
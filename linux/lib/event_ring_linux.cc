@@ -0,0 +1,350 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/event_ring_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/memory/scoped_vector.h"
+#include "base/synchronization/lock.h"
+#include "base/time.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/store_keys.h"
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The ring file in the store's directory.
+const char kEventRingFile[] = "event_ring";
+
+// Products index the rings, like the store shards.
+const int kMaxProducts = 32;
+
+// Events are packed into one word.
+base::subtle::Atomic32 PackEvent(AccessPoint point, Event event) {
+  return (point << 8) | event;
+}
+
+bool UnpackEvent(base::subtle::Atomic32 entry, AccessPoint* point,
+                 Event* event) {
+  int point_value = (entry >> 8) & 0xff;
+  int event_value = entry & 0xff;
+  if (point_value <= NO_ACCESS_POINT || point_value >= LAST_ACCESS_POINT ||
+      event_value <= INVALID_EVENT || event_value >= LAST_EVENT) {
+    return false;
+  }
+  *point = static_cast<AccessPoint>(point_value);
+  *event = static_cast<Event>(event_value);
+  return true;
+}
+
+}  // namespace
+
+// The file starts out zero-filled. Positions count pushes and pops; the slot
+// of position p is p % kSlots, and its lap is p - p % kSlots. A slot whose
+// sequence is its lap is free for the push of that lap, one whose sequence
+// is its lap + 1 holds the event for the pop of that lap. A pop sets the
+// sequence to the next lap. Positions and sequences wrap around together.
+struct EventRing::Layout {
+  struct Slot {
+    base::subtle::Atomic32 sequence;
+    base::subtle::Atomic32 entry;
+  };
+
+  struct Ring {
+    // The next positions to push and pop.
+    base::subtle::Atomic32 tail;
+    base::subtle::Atomic32 head;
+    Slot slots[kSlots];
+  };
+
+  Ring rings[kMaxProducts];
+};
+
+COMPILE_ASSERT((EventRing::kSlots & (EventRing::kSlots - 1)) == 0,
+               event_ring_slots_must_be_a_power_of_two);
+COMPILE_ASSERT(LAST_ACCESS_POINT <= 0xff && LAST_EVENT <= 0xff,
+               events_must_fit_in_ring_entries);
+
+EventRing::EventRing() : layout_(NULL) {
+}
+
+EventRing::~EventRing() {
+  Close();
+}
+
+bool EventRing::Open(const FilePath& path, bool create) {
+  Close();
+  path_ = path;
+
+  int flags = create ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDWR | O_CLOEXEC;
+  int fd = HANDLE_EINTR(open(path.value().c_str(), flags, 0600));
+  if (fd == -1) {
+    if (errno != ENOENT)
+      PLOG(ERROR) << "open " << path.value();
+    return false;
+  }
+
+  // Processes that create the file at the same time all truncate it to the
+  // same size, and all-zero is an empty ring.
+  struct stat info;
+  bool sized = fstat(fd, &info) == 0 &&
+      (info.st_size >= static_cast<off_t>(sizeof(Layout)) ||
+       HANDLE_EINTR(ftruncate(fd, sizeof(Layout))) == 0);
+  void* memory = MAP_FAILED;
+  if (sized) {
+    memory = mmap(NULL, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+  }
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "map " << path.value();
+    return false;
+  }
+  layout_ = static_cast<Layout*>(memory);
+  return true;
+}
+
+bool EventRing::Push(Product product, AccessPoint point, Event event) {
+  DCHECK(layout_);
+  if (product < 0 || product >= kMaxProducts)
+    return false;
+
+  Layout::Ring* ring = &layout_->rings[product];
+  uint32 position = base::subtle::NoBarrier_Load(&ring->tail);
+  while (true) {
+    Layout::Slot* slot = &ring->slots[position % kSlots];
+    uint32 lap = position - position % kSlots;
+    int32 state = static_cast<int32>(
+        base::subtle::Acquire_Load(&slot->sequence) - lap);
+    if (state < 0)
+      return false;  // The pop of the previous lap is still due.
+
+    if (state == 0) {
+      uint32 claimed = base::subtle::NoBarrier_CompareAndSwap(
+          &ring->tail, position, position + 1);
+      if (claimed == position) {
+        base::subtle::NoBarrier_Store(&slot->entry, PackEvent(point, event));
+        base::subtle::Release_Store(&slot->sequence, lap + 1);
+        return true;
+      }
+      position = claimed;
+    } else {
+      // Another pusher took the slot.
+      position = base::subtle::NoBarrier_Load(&ring->tail);
+    }
+  }
+}
+
+bool EventRing::HasEvents(Product product) {
+  DCHECK(layout_);
+  if (product < 0 || product >= kMaxProducts)
+    return false;
+
+  Layout::Ring* ring = &layout_->rings[product];
+  return base::subtle::Acquire_Load(&ring->head) !=
+      base::subtle::Acquire_Load(&ring->tail);
+}
+
+void EventRing::Pop(Product product,
+                    std::vector<std::pair<AccessPoint, Event> >* events) {
+  DCHECK(layout_);
+  if (product < 0 || product >= kMaxProducts)
+    return;
+
+  Layout::Ring* ring = &layout_->rings[product];
+  uint32 position = base::subtle::NoBarrier_Load(&ring->head);
+  // Bounded, so that pushers that keep up can't keep the caller here.
+  for (int popped = 0; popped < kSlots;) {
+    Layout::Slot* slot = &ring->slots[position % kSlots];
+    uint32 lap = position - position % kSlots;
+    int32 state = static_cast<int32>(
+        base::subtle::Acquire_Load(&slot->sequence) - (lap + 1));
+    if (state < 0)
+      return;  // Empty, or the push of this position isn't done yet.
+
+    if (state == 0) {
+      uint32 claimed = base::subtle::NoBarrier_CompareAndSwap(
+          &ring->head, position, position + 1);
+      if (claimed == position) {
+        base::subtle::Atomic32 entry =
+            base::subtle::NoBarrier_Load(&slot->entry);
+        base::subtle::Release_Store(&slot->sequence, lap + kSlots);
+        AccessPoint point;
+        Event event;
+        if (UnpackEvent(entry, &point, &event))
+          events->push_back(std::make_pair(point, event));
+        ++popped;
+        position = claimed + 1;
+        continue;
+      }
+      position = claimed;
+    } else {
+      // Another process popped the slot.
+      position = base::subtle::NoBarrier_Load(&ring->head);
+    }
+  }
+}
+
+void EventRing::Close() {
+  if (layout_) {
+    munmap(layout_, sizeof(Layout));
+    layout_ = NULL;
+  }
+}
+
+namespace {
+
+// How often a process looks for a ring that no process created yet.
+const int kOpenRetrySeconds = 1;
+
+// The ring RecordProductEvent() pushes to, or 0 if the ring is off.
+base::subtle::AtomicWord g_push_ring = 0;
+
+// The ring of the default store's directory, which pushes and drains of this
+// process share. Opened once, and again when the directory changes, which
+// only tests do.
+class SharedRing {
+ public:
+  SharedRing() : ring_(NULL) {}
+
+  // Opens the ring for pushing, creating it if needed. Returns NULL if that
+  // fails.
+  EventRing* OpenForPush() {
+    base::AutoLock auto_lock(lock_);
+    return Get(true);
+  }
+
+  void Drain(RlzValueStore* store, const StoreShards& shards) {
+    base::AutoLock auto_lock(lock_);
+    EventRing* ring = Get(false);
+    if (!ring)
+      return;
+
+    for (int product = 0; product < kMaxProducts; ++product) {
+      Product typed_product = static_cast<Product>(product);
+      if (!shards.HasProduct(typed_product) ||
+          !ring->HasEvents(typed_product)) {
+        continue;
+      }
+
+      std::vector<std::pair<AccessPoint, Event> > events;
+      ring->Pop(typed_product, &events);
+      for (size_t i = 0; i < events.size(); ++i) {
+        const StoreKey* key = GetEventKey(events[i].first, events[i].second);
+        if (!key)
+          continue;
+        // Like RecordProductEvent(), skip events that are stateful.
+        if (!store->IsStatefulEvent(typed_product, key->name))
+          VERIFY(store->AddProductEvent(typed_product, key->name));
+      }
+    }
+  }
+
+  bool HasEvents(Product product) {
+    base::AutoLock auto_lock(lock_);
+    EventRing* ring = Get(false);
+    return ring && ring->HasEvents(product);
+  }
+
+ private:
+  // Returns the ring, or NULL if it can't be opened. If |create|, creates
+  // it if needed. Otherwise, while no process created it, it is only looked
+  // for every kOpenRetrySeconds, to spare the lock holders a failing open().
+  EventRing* Get(bool create) {
+    FilePath directory = GetRlzStoreDirectoryPath();
+    if (directory != directory_) {
+      // The ring of the old directory may still be pushed to, so it is kept.
+      if (ring_)
+        old_rings_.push_back(ring_);
+      ring_ = NULL;
+      directory_ = directory;
+      next_open_ = base::TimeTicks();
+    }
+    if (ring_)
+      return ring_;
+    if (!create && base::TimeTicks::Now() < next_open_)
+      return NULL;
+
+    if (create)
+      file_util::CreateDirectory(directory);
+    scoped_ptr<EventRing> ring(new EventRing);
+    if (!ring->Open(directory.Append(kEventRingFile), create)) {
+      next_open_ = base::TimeTicks::Now() +
+          base::TimeDelta::FromSeconds(kOpenRetrySeconds);
+      return NULL;
+    }
+    ring_ = ring.release();
+    return ring_;
+  }
+
+  base::Lock lock_;
+  FilePath directory_;
+  EventRing* ring_;
+  base::TimeTicks next_open_;
+
+  // The rings of directories used before. Never closed, because other
+  // threads may still push to them.
+  ScopedVector<EventRing> old_rings_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedRing);
+};
+
+base::LazyInstance<SharedRing>::Leaky g_shared_ring =
+    LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+bool PushToEventRing(Product product, AccessPoint point, Event event) {
+  EventRing* ring = reinterpret_cast<EventRing*>(
+      base::subtle::Acquire_Load(&g_push_ring));
+  return ring && UsesDefaultRlzValueStoreFactory() &&
+      ring->Push(product, point, event);
+}
+
+void DrainEventRing(RlzValueStore* store, const StoreShards& shards) {
+  g_shared_ring.Get().Drain(store, shards);
+}
+
+bool DrainEventRingForProduct(Product product) {
+  if (IsStoreLockHeld() || !UsesDefaultRlzValueStoreFactory() ||
+      !g_shared_ring.Get().HasEvents(product)) {
+    return true;
+  }
+
+  // The lock drains the ring when it gets the store.
+  ScopedRlzValueStoreLock lock("DrainEventRing",
+                               StoreShards::ForProduct(product));
+  return lock.GetStore() != NULL;
+}
+
+bool EnableEventRing(bool enabled) {
+  if (!enabled) {
+    base::subtle::Release_Store(&g_push_ring, 0);
+    return true;
+  }
+
+  EventRing* ring = g_shared_ring.Get().OpenForPush();
+  if (!ring)
+    return false;
+  base::subtle::Release_Store(&g_push_ring,
+                              reinterpret_cast<base::subtle::AtomicWord>(ring));
+  return true;
+}
+
+}  // namespace rlz_lib
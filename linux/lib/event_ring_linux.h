@@ -0,0 +1,92 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Product events that processes record without the store lock, in a ring that
+// the next holder of the lock moves to the store. See EnableEventRing() in
+// rlz_lib.h.
+
+#ifndef RLZ_LINUX_LIB_EVENT_RING_LINUX_H_
+#define RLZ_LINUX_LIB_EVENT_RING_LINUX_H_
+
+#include <utility>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/file_path.h"
+#include "rlz/lib/rlz_enums.h"
+
+namespace rlz_lib {
+
+class RlzValueStore;
+class StoreShards;
+
+// A ring of events for each product in a file that every process maps. Any
+// number of processes and threads push and pop at the same time; pushing
+// and popping are a few atomic operations on the mapping, and never wait.
+//
+// Each slot of a ring carries a sequence number that says whether it is free
+// for the next push or holds an event for the next pop, so that a pusher can
+// claim a slot and fill it in two steps without a lock. A process that dies
+// between the two steps leaves the slot claimed for good, and the ring stops
+// at it: pops return nothing and pushes fail once the ring is full, so that
+// events are recorded with the lock again.
+class EventRing {
+ public:
+  // How many events the ring of each product holds.
+  static const int kSlots = 64;
+
+  EventRing();
+  ~EventRing();
+
+  // Maps the ring file |path|. If |create|, creates it if needed, else
+  // fails if it doesn't exist. Returns false if the file can't be mapped for
+  // writing.
+  bool Open(const FilePath& path, bool create);
+
+  const FilePath& path() const { return path_; }
+
+  // Adds |event| at |point| for |product|. Returns false if the ring of
+  // |product| is full.
+  bool Push(Product product, AccessPoint point, Event event);
+
+  // Returns whether the ring of |product| holds events. Only a hint when
+  // others push or pop at the same time.
+  bool HasEvents(Product product);
+
+  // Removes the events of |product| from the ring and appends them to
+  // |events|, oldest first.
+  void Pop(Product product,
+           std::vector<std::pair<AccessPoint, Event> >* events);
+
+ private:
+  struct Layout;
+
+  void Close();
+
+  FilePath path_;
+  Layout* layout_;
+
+  DISALLOW_COPY_AND_ASSIGN(EventRing);
+};
+
+// Pushes |event| onto the ring of the default store, if EnableEventRing()
+// turned it on and the default factory is in use. Returns false if it didn't,
+// in which case the caller records the event with the lock.
+bool PushToEventRing(Product product, AccessPoint point, Event event);
+
+// Moves the events of the products in |shards| from the ring of the default
+// store to |store|, which must be a store of the default factory. Called by
+// the outermost write lock of a thread when it got the store, so that every
+// process drains the ring.
+void DrainEventRing(RlzValueStore* store, const StoreShards& shards);
+
+// Takes the write lock for |product| if its ring holds events, so that
+// readers of its events see them. Does nothing if the calling thread holds
+// the lock already, or if the default factory isn't in use. Returns false if
+// the lock can't be taken.
+bool DrainEventRingForProduct(Product product);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_EVENT_RING_LINUX_H_
@@ -0,0 +1,252 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/event_ring_linux.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/compiler_specific.h"
+#include "base/eintr_wrapper.h"
+#include "base/memory/scoped_vector.h"
+#include "base/scoped_temp_dir.h"
+#include "base/threading/simple_thread.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+typedef std::vector<std::pair<rlz_lib::AccessPoint, rlz_lib::Event> >
+    EventVector;
+
+const int kPushesPerPusher = 1000;
+
+// Pushes kPushesPerPusher events, retrying while the ring is full.
+class Pusher : public base::DelegateSimpleThread::Delegate {
+ public:
+  explicit Pusher(rlz_lib::EventRing* ring) : ring_(ring) {}
+
+  virtual void Run() OVERRIDE {
+    for (int i = 0; i < kPushesPerPusher; ++i) {
+      while (!ring_->Push(rlz_lib::CHROME, rlz_lib::CHROME_OMNIBOX,
+                          rlz_lib::FIRST_SEARCH)) {
+        base::PlatformThread::YieldCurrentThread();
+      }
+    }
+  }
+
+ private:
+  rlz_lib::EventRing* ring_;
+
+  DISALLOW_COPY_AND_ASSIGN(Pusher);
+};
+
+class EventRingTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    path_ = temp_dir_.path().Append("event_ring");
+  }
+
+  ScopedTempDir temp_dir_;
+  FilePath path_;
+};
+
+// Returns how many events are stored for CHROME, without draining the ring.
+size_t StoredEvents() {
+  rlz_lib::ScopedRlzValueStoreLock lock(
+      "Test", rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME),
+      rlz_lib::RlzValueStore::kReadAccess);
+  std::vector<std::string> events;
+  EXPECT_TRUE(lock.GetStore()->ReadProductEvents(rlz_lib::CHROME, &events));
+  return events.size();
+}
+
+class EventRingLibTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void TearDown() OVERRIDE {
+    EXPECT_TRUE(rlz_lib::EnableEventRing(false));
+    RlzLibTestNoMachineState::TearDown();
+  }
+};
+
+}  // namespace
+
+TEST_F(EventRingTest, PopsInPushOrder) {
+  rlz_lib::EventRing ring;
+  EXPECT_FALSE(ring.Open(path_, false));
+  ASSERT_TRUE(ring.Open(path_, true));
+  EXPECT_FALSE(ring.HasEvents(rlz_lib::CHROME));
+
+  EXPECT_TRUE(ring.Push(rlz_lib::CHROME, rlz_lib::CHROME_OMNIBOX,
+                        rlz_lib::INSTALL));
+  EXPECT_TRUE(ring.Push(rlz_lib::CHROME, rlz_lib::CHROME_HOME_PAGE,
+                        rlz_lib::SET_TO_GOOGLE));
+  EXPECT_TRUE(ring.Push(rlz_lib::TOOLBAR_NOTIFIER, rlz_lib::IE_HOME_PAGE,
+                        rlz_lib::FIRST_SEARCH));
+  EXPECT_TRUE(ring.HasEvents(rlz_lib::CHROME));
+
+  EventVector events;
+  ring.Pop(rlz_lib::CHROME, &events);
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ(rlz_lib::CHROME_OMNIBOX, events[0].first);
+  EXPECT_EQ(rlz_lib::INSTALL, events[0].second);
+  EXPECT_EQ(rlz_lib::CHROME_HOME_PAGE, events[1].first);
+  EXPECT_EQ(rlz_lib::SET_TO_GOOGLE, events[1].second);
+  EXPECT_FALSE(ring.HasEvents(rlz_lib::CHROME));
+
+  // Each product has a ring of its own.
+  EXPECT_TRUE(ring.HasEvents(rlz_lib::TOOLBAR_NOTIFIER));
+}
+
+TEST_F(EventRingTest, FullRingRejectsPushes) {
+  rlz_lib::EventRing ring;
+  ASSERT_TRUE(ring.Open(path_, true));
+
+  // Several laps, so that the positions wrap around the slots.
+  for (int lap = 0; lap < 3; ++lap) {
+    for (int i = 0; i < rlz_lib::EventRing::kSlots; ++i) {
+      EXPECT_TRUE(ring.Push(rlz_lib::CHROME, rlz_lib::CHROME_OMNIBOX,
+                            rlz_lib::INSTALL));
+    }
+    EXPECT_FALSE(ring.Push(rlz_lib::CHROME, rlz_lib::CHROME_OMNIBOX,
+                           rlz_lib::INSTALL));
+
+    EventVector events;
+    ring.Pop(rlz_lib::CHROME, &events);
+    EXPECT_EQ(static_cast<size_t>(rlz_lib::EventRing::kSlots),
+              events.size());
+    EXPECT_FALSE(ring.HasEvents(rlz_lib::CHROME));
+  }
+}
+
+TEST_F(EventRingTest, IsShared) {
+  rlz_lib::EventRing pusher;
+  rlz_lib::EventRing popper;
+  ASSERT_TRUE(pusher.Open(path_, true));
+  ASSERT_TRUE(popper.Open(path_, false));
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool pushed = pusher.Push(rlz_lib::CHROME, rlz_lib::CHROME_OMNIBOX,
+                              rlz_lib::FIRST_SEARCH);
+    _exit(pushed ? 0 : 1);
+  }
+  ASSERT_NE(-1, pid);
+  int status = 0;
+  ASSERT_EQ(pid, HANDLE_EINTR(waitpid(pid, &status, 0)));
+  EXPECT_EQ(0, status);
+
+  EventVector events;
+  popper.Pop(rlz_lib::CHROME, &events);
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ(rlz_lib::FIRST_SEARCH, events[0].second);
+}
+
+TEST_F(EventRingTest, ConcurrentPushers) {
+  rlz_lib::EventRing ring;
+  ASSERT_TRUE(ring.Open(path_, true));
+
+  const int kPushers = 4;
+  Pusher pusher(&ring);
+  ScopedVector<base::DelegateSimpleThread> threads;
+  for (int i = 0; i < kPushers; ++i) {
+    threads.push_back(new base::DelegateSimpleThread(&pusher, "pusher"));
+    threads.back()->Start();
+  }
+
+  // Every event that is pushed is popped once.
+  size_t popped = 0;
+  while (popped < static_cast<size_t>(kPushers * kPushesPerPusher)) {
+    EventVector events;
+    ring.Pop(rlz_lib::CHROME, &events);
+    popped += events.size();
+    for (size_t i = 0; i < events.size(); ++i)
+      ASSERT_EQ(rlz_lib::FIRST_SEARCH, events[i].second);
+  }
+  for (int i = 0; i < kPushers; ++i)
+    threads[i]->Join();
+  EXPECT_FALSE(ring.HasEvents(rlz_lib::CHROME));
+}
+
+TEST_F(EventRingLibTest, LockHoldersDrainTheRing) {
+  // The second test pass holds the lock for its supplementary brand, so
+  // events aren't pushed.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  ASSERT_TRUE(rlz_lib::EnableEventRing(true));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_OMNIBOX, rlz_lib::FIRST_SEARCH));
+  EXPECT_EQ(0u, StoredEvents());
+
+  // Another process pushes too.
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool recorded = rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+        rlz_lib::CHROME_HOME_PAGE, rlz_lib::INSTALL);
+    _exit(recorded ? 0 : 1);
+  }
+  ASSERT_NE(-1, pid);
+  int status = 0;
+  ASSERT_EQ(pid, HANDLE_EINTR(waitpid(pid, &status, 0)));
+  EXPECT_EQ(0, status);
+  EXPECT_EQ(0u, StoredEvents());
+
+  // Readers see the events.
+  char cgi[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::CHROME, cgi,
+                                             arraysize(cgi)));
+  EXPECT_TRUE(strstr(cgi, "C1F") != NULL);
+  EXPECT_TRUE(strstr(cgi, "C2I") != NULL);
+  EXPECT_EQ(2u, StoredEvents());
+
+  // So do writers, which drain the ring before they change the events.
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_OMNIBOX, rlz_lib::INSTALL));
+  EXPECT_TRUE(rlz_lib::ClearProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_OMNIBOX, rlz_lib::INSTALL));
+  EXPECT_EQ(2u, StoredEvents());
+
+  // Without the ring, events are written right away.
+  EXPECT_TRUE(rlz_lib::EnableEventRing(false));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_OMNIBOX, rlz_lib::INSTALL));
+  EXPECT_EQ(3u, StoredEvents());
+}
+
+TEST_F(EventRingLibTest, OtherFactoriesDontUseTheRing) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  ASSERT_TRUE(rlz_lib::EnableEventRing(true));
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_OMNIBOX, rlz_lib::FIRST_SEARCH));
+
+  // The event in the ring belongs to the default store. Events for another
+  // factory's store go to it right away.
+  rlz_lib::MemoryStoreFactory factory;
+  rlz_lib::SetRlzValueStoreFactory(&factory);
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+      rlz_lib::CHROME_HOME_PAGE, rlz_lib::INSTALL));
+  char cgi[50];
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::CHROME, cgi,
+                                             arraysize(cgi)));
+  EXPECT_TRUE(strstr(cgi, "C1F") == NULL);
+  EXPECT_TRUE(strstr(cgi, "C2I") != NULL);
+  rlz_lib::SetRlzValueStoreFactory(NULL);
+
+  EXPECT_TRUE(rlz_lib::GetProductEventsAsCgi(rlz_lib::CHROME, cgi,
+                                             arraysize(cgi)));
+  EXPECT_TRUE(strstr(cgi, "C1F") != NULL);
+  EXPECT_TRUE(strstr(cgi, "C2I") == NULL);
+}
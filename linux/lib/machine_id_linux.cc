@@ -0,0 +1,15 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/lib/machine_id.h"
+
+namespace rlz_lib {
+
+bool GetRawMachineId(string16* data, int* more_data) {
+  // There is no machine id on linux yet. GetMachineId() fails, and financial
+  // pings are sent without the id parameter.
+  return false;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,132 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_binary.h"
+
+#include <unistd.h>
+
+#include <string>
+
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/store_codec.h"
+#include "rlz/lib/store_compression.h"
+#include "rlz/linux/lib/snapshot_file.h"
+#include "rlz/linux/lib/store_writer_linux.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The file name is written to disk and should not be changed.
+const char kBinaryStoreFile[] = "RlzStore.bin";
+
+}  // namespace
+
+// static
+RlzValueStoreBinary* RlzValueStoreBinary::Open(const FilePath& directory,
+                                               bool compressed) {
+  scoped_ptr<RlzValueStoreBinary> store(
+      new RlzValueStoreBinary(directory.Append(kBinaryStoreFile), compressed));
+
+  // Create an empty file if none exists yet.
+  if (!file_util::PathExists(store->store_path_)) {
+    if (!store->Persist())
+      return NULL;
+    return store.release();
+  }
+
+  if (!file_util::ReadFileToString(store->store_path_, &store->data_)) {
+    LOG(ERROR) << "Can't read rlz store " << store->store_path_.value();
+    return NULL;
+  }
+
+  // Damaged parts of the store are dropped, and rewritten empty once a call
+  // touched them and the store is persisted, instead of failing every call
+  // until the file is removed.
+  int damaged_sections = 0;
+  if (!store->DeserializeFile(store->data_, &damaged_sections)) {
+    // |data_| is decompressed if the file was compressed.
+    if (IsNewerStore(store->data_)) {
+      LOG(WARNING) << "Not writing rlz store of a newer version "
+                   << store->store_path_.value();
+      store->newer_version_ = true;
+    } else {
+      LOG(WARNING) << "Resetting invalid rlz store "
+                   << store->store_path_.value();
+    }
+  } else if (damaged_sections > 0) {
+    LOG(WARNING) << "Dropped " << damaged_sections
+                 << " damaged sections of rlz store "
+                 << store->store_path_.value();
+  }
+  return store.release();
+}
+
+// static
+RlzValueStoreBinary* RlzValueStoreBinary::OpenSnapshot(
+    const FilePath& directory) {
+  // Readers never write, so the encoding they would write doesn't matter.
+  scoped_ptr<RlzValueStoreBinary> store(
+      new RlzValueStoreBinary(directory.Append(kBinaryStoreFile), false));
+
+  if (!SnapshotFile::Get(store->store_path_, &store->snapshot_))
+    return NULL;
+  if (store->snapshot_)
+    store->DeserializeFile(store->snapshot_->data(), NULL);
+  return store.release();
+}
+
+RlzValueStoreBinary::RlzValueStoreBinary(const FilePath& store_path,
+                                         bool compressed)
+    : store_path_(store_path), compressed_(compressed), newer_version_(false) {
+}
+
+RlzValueStoreBinary::~RlzValueStoreBinary() {
+}
+
+bool RlzValueStoreBinary::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:
+      // A snapshot of a store that doesn't exist yet is empty.
+      return access(store_path_.value().c_str(), R_OK) == 0 ||
+          !file_util::PathExists(store_path_);
+    case kWriteAccess:
+      return !newer_version_ &&
+          access(store_path_.value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreBinary::Persist() {
+  if (newer_version_)
+    return false;
+
+  std::string data;
+  Serialize(&data);
+  if (compressed_) {
+    std::string compressed_data;
+    CompressStore(data, &compressed_data);
+    data.swap(compressed_data);
+  }
+  return ReplaceStoreFile(store_path_, data);
+}
+
+bool RlzValueStoreBinary::DeserializeFile(const base::StringPiece& data,
+                                          int* damaged_sections) {
+  if (!IsCompressedStore(data))
+    return DeserializeLazily(data, damaged_sections);
+
+  // The zlib stream is checksummed as a whole, so a damaged byte loses the
+  // whole store instead of the section it is in. |data| may be |data_|, which
+  // is only replaced once it was inflated.
+  std::string store;
+  if (!DecompressStore(data, &store))
+    return false;
+  data_.swap(store);
+  return DeserializeLazily(data_, damaged_sections);
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,78 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_BINARY_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_BINARY_H_
+
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/memory/ref_counted.h"
+#include "rlz/lib/rlz_value_store_memory.h"
+
+namespace rlz_lib {
+
+class SnapshotFile;
+
+// An implementation of RlzValueStore for linux that keeps its data in a file
+// in the binary store format of store_codec.h, optionally compressed, see
+// store_compression.h. Opening the store only reads the file's index; each
+// section is decoded into the RlzValueStoreMemory when a call first needs it.
+// Persisting encodes the sections that were decoded, and copies the others.
+class RlzValueStoreBinary : public RlzValueStoreMemory {
+ public:
+  // Reads the store in |directory|, creating an empty one if it doesn't exist
+  // yet. Damaged sections of the store are dropped; a file that isn't a store
+  // at all is treated as empty. A store of a newer format version reads as
+  // empty and can't be written, so that it isn't lost. Returns NULL if the
+  // file can't be read. Must be called with the store's cross-process lock
+  // held.
+  //
+  // Compressed and uncompressed files are both read. Persist() writes the
+  // file |compressed| or not, so a store switches formats the next time it is
+  // changed.
+  static RlzValueStoreBinary* Open(const FilePath& directory, bool compressed);
+
+  // Decodes the store in |directory| straight from a mapping of the file,
+  // without any lock, which works because Persist() replaces the file
+  // atomically. Compressed files are inflated first. A store that doesn't
+  // exist yet reads as empty, and damaged sections are dropped silently; the
+  // next writer reports and repairs them. Returns NULL if the file can't be
+  // mapped. The returned store must only be read.
+  static RlzValueStoreBinary* OpenSnapshot(const FilePath& directory);
+
+  virtual ~RlzValueStoreBinary();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  // Writes the store back to disk, replacing the file atomically. Fails
+  // without writing if the file is of a newer format version.
+  bool Persist();
+
+ private:
+  RlzValueStoreBinary(const FilePath& store_path, bool compressed);
+
+  // Decodes the store file |data|, which may be compressed and must outlive
+  // the store. Returns false if it isn't a store, see Deserialize().
+  bool DeserializeFile(const base::StringPiece& data, int* damaged_sections);
+
+  FilePath store_path_;
+  bool compressed_;
+
+  // Set if the file is of a newer format version, which must not be
+  // overwritten.
+  bool newer_version_;
+
+  // The data that sections are decoded from: the file or its mapping, or the
+  // file decompressed.
+  std::string data_;
+  scoped_refptr<SnapshotFile> snapshot_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreBinary);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_BINARY_H_
@@ -0,0 +1,245 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the binary store. They use the store directly, independent
+// of the store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_binary.h"
+
+#include <string>
+#include <vector>
+
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/store_codec.h"
+#include "rlz/lib/store_compression.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzValueStoreBinaryTest : public RlzLibTestNoMachineState {
+ protected:
+  rlz_lib::RlzValueStoreBinary* OpenStore() {
+    return rlz_lib::RlzValueStoreBinary::Open(temp_dir_.path(), false);
+  }
+
+  rlz_lib::RlzValueStoreBinary* OpenCompressedStore() {
+    return rlz_lib::RlzValueStoreBinary::Open(temp_dir_.path(), true);
+  }
+
+  FilePath StorePath() {
+    return temp_dir_.path().Append("RlzStore.bin");
+  }
+
+  // Writes a store with an access point RLZ and a ping time.
+  void WriteSampleStore() {
+    scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "TbRlzValue"));
+    EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+    EXPECT_TRUE(store->Persist());
+  }
+};
+
+TEST_F(RlzValueStoreBinaryTest, Persists) {
+  WriteSampleStore();
+
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+}
+
+TEST_F(RlzValueStoreBinaryTest, DropsDamagedSections) {
+  WriteSampleStore();
+
+  // Damage the RLZ, which lives in the brand's section.
+  std::string data;
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &data));
+  size_t offset = data.find("TbRlzValue");
+  ASSERT_NE(std::string::npos, offset);
+  data[offset] = 'X';
+  int size = static_cast<int>(data.size());
+  ASSERT_EQ(size, file_util::WriteFile(StorePath(), data.data(), size));
+
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+}
+
+TEST_F(RlzValueStoreBinaryTest, CopiesUntouchedSections) {
+  WriteSampleStore();
+  std::string data;
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &data));
+
+  // Sections no call touched are written back as they were.
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->Persist());
+  std::string persisted;
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &persisted));
+  EXPECT_EQ(data, persisted);
+
+  EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "C1I"));
+  EXPECT_TRUE(store->Persist());
+  store.reset(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::CHROME, &events));
+  EXPECT_EQ(1u, events.size());
+}
+
+TEST_F(RlzValueStoreBinaryTest, ResetsInvalidFile) {
+  const char kGarbage[] = "not a store";
+  int size = static_cast<int>(arraysize(kGarbage));
+  ASSERT_EQ(size, file_util::WriteFile(StorePath(), kGarbage, size));
+
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store->Persist());
+
+  store.reset(OpenStore());
+  ASSERT_TRUE(store.get());
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+}
+
+TEST_F(RlzValueStoreBinaryTest, KeepsNewerVersions) {
+  // A store header of the next version, which this version can't decode.
+  std::string newer_store("RLZB");
+  newer_store.push_back(static_cast<char>(rlz_lib::kStoreFormatVersion + 1));
+  newer_store.append("future data");
+  for (int compressed = 0; compressed < 2; ++compressed) {
+    std::string data;
+    if (compressed)
+      rlz_lib::CompressStore(newer_store, &data);
+    else
+      data = newer_store;
+    int size = static_cast<int>(data.size());
+    ASSERT_EQ(size, file_util::WriteFile(StorePath(), data.data(), size));
+
+    scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_FALSE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+    EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+    EXPECT_FALSE(store->Persist());
+
+    std::string file;
+    ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &file));
+    EXPECT_EQ(data, file);
+  }
+}
+
+TEST_F(RlzValueStoreBinaryTest, SnapshotSeesPersistedData) {
+  // A store that doesn't exist yet reads as empty, and readers don't create
+  // it.
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> snapshot(
+      rlz_lib::RlzValueStoreBinary::OpenSnapshot(temp_dir_.path()));
+  ASSERT_TRUE(snapshot.get());
+  EXPECT_TRUE(snapshot->HasAccess(rlz_lib::RlzValueStore::kReadAccess));
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(snapshot->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+  EXPECT_FALSE(file_util::PathExists(StorePath()));
+
+  WriteSampleStore();
+
+  // Changes a writer hasn't persisted yet aren't visible.
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "NewRlzValue"));
+  snapshot.reset(rlz_lib::RlzValueStoreBinary::OpenSnapshot(temp_dir_.path()));
+  ASSERT_TRUE(snapshot.get());
+  EXPECT_TRUE(snapshot->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  EXPECT_TRUE(store->Persist());
+  snapshot.reset(rlz_lib::RlzValueStoreBinary::OpenSnapshot(temp_dir_.path()));
+  ASSERT_TRUE(snapshot.get());
+  EXPECT_TRUE(snapshot->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           rlz, arraysize(rlz)));
+  EXPECT_STREQ("NewRlzValue", rlz);
+}
+
+TEST_F(RlzValueStoreBinaryTest, SwitchesToCompression) {
+  WriteSampleStore();
+
+  // The uncompressed file is read, and written back compressed.
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenCompressedStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                         "ChromeRlzValue"));
+  EXPECT_TRUE(store->Persist());
+  std::string data;
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &data));
+  EXPECT_TRUE(rlz_lib::IsCompressedStore(data));
+  EXPECT_EQ(std::string::npos, data.find("TbRlzValue"));
+
+  // Both kinds of stores read the compressed file, and so do readers.
+  for (int compressed = 0; compressed < 2; ++compressed) {
+    store.reset(compressed ? OpenCompressedStore() : OpenStore());
+    ASSERT_TRUE(store.get());
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                          rlz, arraysize(rlz)));
+    EXPECT_STREQ("TbRlzValue", rlz);
+    EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                          rlz, arraysize(rlz)));
+    EXPECT_STREQ("ChromeRlzValue", rlz);
+  }
+  store.reset(rlz_lib::RlzValueStoreBinary::OpenSnapshot(temp_dir_.path()));
+  ASSERT_TRUE(store.get());
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+
+  // A store that isn't compressed writes the file uncompressed again.
+  store.reset(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->Persist());
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &data));
+  EXPECT_FALSE(rlz_lib::IsCompressedStore(data));
+}
+
+TEST_F(RlzValueStoreBinaryTest, ResetsDamagedCompressedFile) {
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(OpenCompressedStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store->Persist());
+
+  std::string data;
+  ASSERT_TRUE(file_util::ReadFileToString(StorePath(), &data));
+  data[data.size() - 1] ^= 1;
+  int size = static_cast<int>(data.size());
+  ASSERT_EQ(size, file_util::WriteFile(StorePath(), data.data(), size));
+
+  store.reset(OpenCompressedStore());
+  ASSERT_TRUE(store.get());
+  int64 time = 0;
+  EXPECT_FALSE(store->ReadPingTime(rlz_lib::CHROME, &time));
+}
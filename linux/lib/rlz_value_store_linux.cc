@@ -0,0 +1,504 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+
+#include <unistd.h>
+
+#include "base/file_util.h"
+#include "base/json/json_value_serializer.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/string_number_conversions.h"
+#include "base/values.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/recursive_cross_process_lock_posix.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_binary.h"
+#include "rlz/linux/lib/rlz_value_store_log.h"
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+#include "rlz/linux/lib/rlz_value_store_sharded.h"
+#include "rlz/linux/lib/rlz_value_store_shm.h"
+#include "rlz/linux/lib/snapshot_file.h"
+#include "rlz/linux/lib/store_watcher_linux.h"
+#include "rlz/linux/lib/store_writer_linux.h"
+
+namespace rlz_lib {
+
+// These are written to disk and should not be changed. They are the same keys
+// that the mac store uses.
+const char kPingTimeKey[] = "pingTime";
+const char kAccessPointKey[] = "accessPoints";
+const char kProductEventKey[] = "productEvents";
+const char kStatefulEventKey[] = "statefulEvents";
+
+namespace {
+
+const char kRlzStoreFile[] = "RlzStore.json";
+
+// Retrieves a subdictionary in |p| for key |k|, creating it if necessary.
+// If the dictionary contains an object for |k| that is not a dictionary, that
+// object is replaced with an empty dictionary.
+base::DictionaryValue* GetOrCreateDict(base::DictionaryValue* p,
+                                       const std::string& k) {
+  base::DictionaryValue* d = NULL;
+  if (!p->GetDictionaryWithoutPathExpansion(k, &d)) {
+    d = new base::DictionaryValue;
+    p->SetWithoutPathExpansion(k, d);
+  }
+  return d;
+}
+
+// Returns the subdictionary in |p| for key |k|, or NULL if there is none.
+base::DictionaryValue* GetDict(base::DictionaryValue* p,
+                               const std::string& k) {
+  base::DictionaryValue* d = NULL;
+  if (!p->GetDictionaryWithoutPathExpansion(k, &d))
+    return NULL;
+  return d;
+}
+
+// Writes |dict| to |path|, see ReplaceStoreFile().
+bool WriteStoreFile(const FilePath& path, const base::DictionaryValue& dict) {
+  std::string json;
+  JSONStringValueSerializer serializer(&json);
+  if (!serializer.Serialize(dict))
+    return false;
+  return ReplaceStoreFile(path, json);
+}
+
+// Parses the store in |json|. Returns NULL if it doesn't contain a
+// dictionary.
+base::DictionaryValue* ParseStore(std::string* json) {
+  JSONStringValueSerializer serializer(json);
+  scoped_ptr<base::Value> value(serializer.Deserialize(NULL, NULL));
+  if (!value.get() || !value->IsType(base::Value::TYPE_DICTIONARY))
+    return NULL;
+  return static_cast<base::DictionaryValue*>(value.release());
+}
+
+// Reads the store at |path|. Returns NULL if the file can't be read or
+// doesn't contain a dictionary.
+base::DictionaryValue* ReadStoreFile(const FilePath& path) {
+  std::string json;
+  if (!file_util::ReadFileToString(path, &json))
+    return NULL;
+  return ParseStore(&json);
+}
+
+}  // namespace
+
+// static
+RlzValueStoreLinux* RlzValueStoreLinux::Open(const FilePath& directory) {
+  return OpenFile(directory.Append(kRlzStoreFile));
+}
+
+// static
+RlzValueStoreLinux* RlzValueStoreLinux::OpenFile(const FilePath& store_path) {
+  // Create an empty file if none exists yet.
+  if (!file_util::PathExists(store_path))
+    WriteStoreFile(store_path, base::DictionaryValue());
+
+  base::DictionaryValue* dict = ReadStoreFile(store_path);
+  VERIFY(dict);
+  if (!dict)
+    return NULL;
+  return new RlzValueStoreLinux(dict, store_path);
+}
+
+// static
+RlzValueStoreLinux* RlzValueStoreLinux::OpenSnapshot(
+    const FilePath& directory) {
+  FilePath store_path = directory.Append(kRlzStoreFile);
+  scoped_refptr<SnapshotFile> snapshot;
+  if (!SnapshotFile::Get(store_path, &snapshot))
+    return NULL;
+
+  base::DictionaryValue* dict = NULL;
+  if (snapshot) {
+    std::string json = snapshot->data().as_string();
+    dict = ParseStore(&json);
+  } else {
+    dict = new base::DictionaryValue;
+  }
+  VERIFY(dict);
+  if (!dict)
+    return NULL;
+  return new RlzValueStoreLinux(dict, store_path);
+}
+
+RlzValueStoreLinux::RlzValueStoreLinux(base::DictionaryValue* dict,
+                                       const FilePath& store_path)
+  : dict_(dict), store_path_(store_path) {
+}
+
+RlzValueStoreLinux::~RlzValueStoreLinux() {
+}
+
+bool RlzValueStoreLinux::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:
+      // A snapshot of a store that doesn't exist yet is empty.
+      return access(store_path_.value().c_str(), R_OK) == 0 ||
+          !file_util::PathExists(store_path_);
+    case kWriteAccess:
+      return access(store_path_.value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreLinux::WritePingTime(Product product, int64 time) {
+  // DictionaryValue has no 64 bit integers, so the time is kept as a string.
+  ProductDict(product)->SetWithoutPathExpansion(
+      kPingTimeKey, base::Value::CreateStringValue(base::Int64ToString(time)));
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadPingTime(Product product, int64* time) {
+  std::string s;
+  if (ProductDict(product)->GetStringWithoutPathExpansion(kPingTimeKey, &s))
+    return base::StringToInt64(s, time);
+  return false;
+}
+
+bool RlzValueStoreLinux::ClearPingTime(Product product) {
+  ProductDict(product)->RemoveWithoutPathExpansion(kPingTimeKey, NULL);
+  return true;
+}
+
+
+bool RlzValueStoreLinux::WriteAccessPointRlz(AccessPoint access_point,
+                                             const char* new_rlz) {
+  const char* access_point_name = GetAccessPointName(access_point);
+  if (!access_point_name)
+    return false;
+
+  base::DictionaryValue* d = GetOrCreateDict(WorkingDict(), kAccessPointKey);
+  d->SetWithoutPathExpansion(access_point_name,
+                             base::Value::CreateStringValue(new_rlz));
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadAccessPointRlz(AccessPoint access_point,
+                                            char* rlz,
+                                            size_t rlz_size) {
+  const char* access_point_name = GetAccessPointName(access_point);
+  if (!access_point_name)
+    return false;
+
+  // Reading a non-existent access point counts as success.
+  std::string s;
+  base::DictionaryValue* d = GetDict(WorkingDict(), kAccessPointKey);
+  if (!d || !d->GetStringWithoutPathExpansion(access_point_name, &s)) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  if (s.size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, s.c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreLinux::ClearAccessPointRlz(AccessPoint access_point) {
+  const char* access_point_name = GetAccessPointName(access_point);
+  if (!access_point_name)
+    return false;
+
+  if (base::DictionaryValue* d = GetDict(WorkingDict(), kAccessPointKey))
+    d->RemoveWithoutPathExpansion(access_point_name, NULL);
+  return true;
+}
+
+
+bool RlzValueStoreLinux::AddProductEvent(Product product,
+                                         const char* event_rlz) {
+  GetOrCreateDict(ProductDict(product), kProductEventKey)->
+      SetWithoutPathExpansion(event_rlz, base::Value::CreateBooleanValue(true));
+  return true;
+}
+
+bool RlzValueStoreLinux::ReadProductEvents(Product product,
+                                           std::vector<std::string>* events) {
+  if (base::DictionaryValue* d = GetDict(ProductDict(product),
+                                         kProductEventKey)) {
+    for (base::DictionaryValue::key_iterator i = d->begin_keys();
+         i != d->end_keys(); ++i) {
+      events->push_back(*i);
+    }
+  }
+  return true;
+}
+
+bool RlzValueStoreLinux::ClearProductEvent(Product product,
+                                           const char* event_rlz) {
+  if (base::DictionaryValue* d = GetDict(ProductDict(product),
+                                         kProductEventKey)) {
+    d->RemoveWithoutPathExpansion(event_rlz, NULL);
+    return true;
+  }
+  return false;
+}
+
+bool RlzValueStoreLinux::ClearAllProductEvents(Product product) {
+  ProductDict(product)->RemoveWithoutPathExpansion(kProductEventKey, NULL);
+  return true;
+}
+
+
+bool RlzValueStoreLinux::AddStatefulEvent(Product product,
+                                          const char* event_rlz) {
+  GetOrCreateDict(ProductDict(product), kStatefulEventKey)->
+      SetWithoutPathExpansion(event_rlz, base::Value::CreateBooleanValue(true));
+  return true;
+}
+
+bool RlzValueStoreLinux::IsStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  if (base::DictionaryValue* d = GetDict(ProductDict(product),
+                                         kStatefulEventKey)) {
+    return d->HasKey(event_rlz);
+  }
+  return false;
+}
+
+bool RlzValueStoreLinux::ClearAllStatefulEvents(Product product) {
+  ProductDict(product)->RemoveWithoutPathExpansion(kStatefulEventKey, NULL);
+  return true;
+}
+
+
+void RlzValueStoreLinux::CollectGarbage() {
+  NOTIMPLEMENTED();
+}
+
+bool RlzValueStoreLinux::Persist() {
+  return WriteStoreFile(store_path_, *dict_);
+}
+
+base::DictionaryValue* RlzValueStoreLinux::WorkingDict() {
+  std::string brand(SupplementaryBranding::GetBrand());
+  if (brand.empty())
+    return dict_.get();
+
+  return GetOrCreateDict(dict_.get(), "brand_" + brand);
+}
+
+base::DictionaryValue* RlzValueStoreLinux::ProductDict(Product p) {
+  return GetOrCreateDict(WorkingDict(), GetProductName(p));
+}
+
+
+namespace {
+
+RecursiveCrossProcessLock g_recursive_lock =
+    RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
+
+// This is set during test execution, to write RLZ files into a temporary
+// directory instead of the user's home directory.
+base::LazyInstance<FilePath>::Leaky g_test_folder;
+
+}  // namespace
+
+FilePath GetRlzStoreDirectory() {
+  FilePath folder = GetRlzStoreDirectoryPath();
+  file_util::CreateDirectory(folder);
+  return folder;
+}
+
+FilePath GetRlzStoreDirectoryPath() {
+  FilePath folder = g_test_folder.Get();
+  if (folder.empty())
+    folder = file_util::GetHomeDir().Append(".rlz");
+  return folder;
+}
+
+// Hands out stores of one type, guarded by an flock on the lock file next to
+// them. Readers of stores that are replaced atomically read a snapshot
+// instead and don't lock anything.
+class FileStoreFactory : public RlzValueStoreFactory {
+ public:
+  FileStoreFactory(LinuxStoreType type, const FilePath& directory)
+    : type_(type), directory_(directory) {
+  }
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE {
+    FilePath directory = Directory();
+    if (ReadsSnapshot(access)) {
+      if (type_ == kBinaryStore || type_ == kCompressedStore)
+        return RlzValueStoreBinary::OpenSnapshot(directory);
+      return RlzValueStoreLinux::OpenSnapshot(directory);
+    }
+
+    const char kRlzLockFile[] = "lockfile";
+    if (!g_recursive_lock.TryGetCrossProcessLock(
+            directory.Append(kRlzLockFile))) {
+      g_recursive_lock.ReleaseLock();
+      return NULL;
+    }
+
+    RlzValueStore* store = NULL;
+    switch (type_) {
+      case kJsonStore: store = RlzValueStoreLinux::Open(directory); break;
+      case kMmapStore: store = RlzValueStoreMmap::Open(directory); break;
+      case kLogStore:  store = RlzValueStoreLog::Open(directory); break;
+      case kBinaryStore:
+        store = RlzValueStoreBinary::Open(directory, false);
+        break;
+      case kCompressedStore:
+        store = RlzValueStoreBinary::Open(directory, true);
+        break;
+      case kShmStore:
+      case kShardedStore:
+        NOTREACHED();
+        break;
+    }
+    if (!store)
+      g_recursive_lock.ReleaseLock();
+    return store;
+  }
+
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+    if (ReadsSnapshot(access)) {
+      delete store;
+      return;
+    }
+
+    switch (type_) {
+      case kJsonStore:
+        VERIFY(Persist<RlzValueStoreLinux>(store, modified));
+        break;
+      case kMmapStore:
+        VERIFY(Persist<RlzValueStoreMmap>(store, modified));
+        break;
+      case kLogStore:
+        VERIFY(Persist<RlzValueStoreLog>(store, modified));
+        break;
+      case kBinaryStore:
+      case kCompressedStore:
+        VERIFY(Persist<RlzValueStoreBinary>(store, modified));
+        break;
+      case kShmStore:
+      case kShardedStore:
+        NOTREACHED();
+        break;
+    }
+    if (modified)
+      NotifyStoreChanged(Directory());
+
+    CHECK_NE(-1, g_recursive_lock.file_lock_);
+    g_recursive_lock.ReleaseLock();
+  }
+
+  virtual ReaderLocking GetReaderLocking() OVERRIDE {
+    // The json and binary stores are rewritten to a temporary file that is
+    // renamed over the store. The other stores change their files in place,
+    // or process wide state.
+    if (type_ == kJsonStore || type_ == kBinaryStore ||
+        type_ == kCompressedStore) {
+      return kSnapshotReaders;
+    }
+    return kExclusiveReaders;
+  }
+
+ private:
+  // Returns the directory of the store, and creates it if needed.
+  FilePath Directory() {
+    if (directory_.empty())
+      return GetRlzStoreDirectory();
+    file_util::CreateDirectory(directory_);
+    return directory_;
+  }
+
+  bool ReadsSnapshot(RlzValueStore::AccessType access) {
+    return access == RlzValueStore::kReadAccess &&
+        GetReaderLocking() == kSnapshotReaders;
+  }
+
+  // Writes |store| back to disk if it was |modified| and deletes it.
+  // The stores' destructors are private to their factories, so the store is
+  // deleted here rather than by a scoped_ptr.
+  template <class Store>
+  static bool Persist(RlzValueStore* store, bool modified) {
+    Store* typed_store = static_cast<Store*>(store);
+    bool persisted = !modified || typed_store->Persist();
+    delete typed_store;
+    return persisted;
+  }
+
+  LinuxStoreType type_;
+  FilePath directory_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileStoreFactory);
+};
+
+RlzValueStoreFactory* CreateLinuxStoreFactory(LinuxStoreType type,
+                                              const FilePath& directory) {
+  if (type == kShmStore) {
+    return new ShmStoreFactory(
+        directory, base::TimeDelta::FromSeconds(kDefaultShmFlushSeconds));
+  }
+  if (type == kShardedStore)
+    return new ShardedStoreFactory(directory);
+  return new FileStoreFactory(type, directory);
+}
+
+namespace {
+
+// Creates the factory that GetDefaultRlzValueStoreFactory() returns. It is
+// never destroyed, so a shared memory store is detached, and persisted if no
+// other process uses it, at exit.
+RlzValueStoreFactory* CreateDefaultStoreFactory(LinuxStoreType type) {
+  if (type != kShmStore)
+    return CreateLinuxStoreFactory(type, FilePath());
+
+  ShmStoreFactory* factory = new ShmStoreFactory(
+      FilePath(), base::TimeDelta::FromSeconds(kDefaultShmFlushSeconds));
+  factory->DetachAtExit();
+  return factory;
+}
+
+}  // namespace
+
+RlzValueStoreFactory* GetDefaultRlzValueStoreFactory() {
+  // The default backend is picked at build time, see rlz_linux_store in
+  // rlz.gyp.
+#if defined(RLZ_LINUX_STORE_MMAP)
+  const LinuxStoreType kDefaultType = kMmapStore;
+#elif defined(RLZ_LINUX_STORE_LOG)
+  const LinuxStoreType kDefaultType = kLogStore;
+#elif defined(RLZ_LINUX_STORE_SHM)
+  const LinuxStoreType kDefaultType = kShmStore;
+#elif defined(RLZ_LINUX_STORE_SHARDED)
+  const LinuxStoreType kDefaultType = kShardedStore;
+#elif defined(RLZ_LINUX_STORE_BINARY)
+  const LinuxStoreType kDefaultType = kBinaryStore;
+#elif defined(RLZ_LINUX_STORE_COMPRESSED)
+  const LinuxStoreType kDefaultType = kCompressedStore;
+#else
+  const LinuxStoreType kDefaultType = kJsonStore;
+#endif
+  // First called with ScopedRlzValueStoreLock's in-process lock held.
+  static RlzValueStoreFactory* factory =
+      CreateDefaultStoreFactory(kDefaultType);
+  return factory;
+}
+
+namespace testing {
+
+void SetRlzStoreDirectory(const FilePath& directory) {
+  g_test_folder.Get() = directory;
+}
+
+}  // namespace testing
+
+}  // namespace rlz_lib
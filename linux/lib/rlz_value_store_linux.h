@@ -0,0 +1,121 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace base {
+class DictionaryValue;
+}
+
+namespace rlz_lib {
+
+// An implementation of RlzValueStore for linux. It stores information in a
+// JSON file in the user's home directory. The layout of the data matches the
+// plist used on mac.
+class RlzValueStoreLinux : public RlzValueStore {
+ public:
+  // Reads the JSON store in |directory|, creating an empty one if it doesn't
+  // exist yet. Returns NULL if the store can't be read. Must be called with
+  // the store's cross-process lock held.
+  static RlzValueStoreLinux* Open(const FilePath& directory);
+
+  // Like Open(), but for the JSON file at |store_path|.
+  static RlzValueStoreLinux* OpenFile(const FilePath& store_path);
+
+  // Reads the JSON store in |directory| without any lock, which works because
+  // Persist() replaces the file atomically. A store that doesn't exist yet
+  // reads as empty. Returns NULL if the store can't be read. The returned
+  // store must only be read.
+  static RlzValueStoreLinux* OpenSnapshot(const FilePath& directory);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Writes the store back to disk. Called when the outermost
+  // ScopedRlzValueStoreLock goes away.
+  bool Persist();
+
+ private:
+  // Takes ownership of |dict|, the dictionary that backs all data.
+  // |store_path| is the name of the JSON file it is written back to.
+  RlzValueStoreLinux(base::DictionaryValue* dict, const FilePath& store_path);
+  virtual ~RlzValueStoreLinux();
+  friend class FileStoreFactory;
+  friend class RlzValueStoreSharded;
+
+  // Returns the dictionary to which all data should be written. Usually, this
+  // is just |dict_|, but if supplementary branding is used, it's a
+  // subdictionary at key "brand_<supplementary branding code>", like on mac.
+  base::DictionaryValue* WorkingDict();
+
+  // Returns the subdictionary of |WorkingDict()| used to store data for
+  // product p.
+  base::DictionaryValue* ProductDict(Product p);
+
+  scoped_ptr<base::DictionaryValue> dict_;
+  FilePath store_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreLinux);
+};
+
+// The stores available on linux.
+enum LinuxStoreType {
+  kJsonStore,        // RlzValueStoreLinux
+  kMmapStore,        // RlzValueStoreMmap
+  kLogStore,         // RlzValueStoreLog
+  kShmStore,         // ShmStoreFactory
+  kShardedStore,     // RlzValueStoreSharded
+  kBinaryStore,      // RlzValueStoreBinary
+  kCompressedStore,  // RlzValueStoreBinary, compressed with zlib
+};
+
+// Returns a new factory for stores of |type| in |directory|, guarded by an
+// flock on a lock file in the same directory. An empty |directory| means the
+// default location, ~/.rlz. Pass the result to SetRlzValueStoreFactory() to
+// pick a store at runtime instead of the one rlz was built with. The caller
+// owns the factory.
+RlzValueStoreFactory* CreateLinuxStoreFactory(LinuxStoreType type,
+                                              const FilePath& directory);
+
+// Returns the directory the rlz files live in by default, also creates it if
+// it doesn't exist.
+FilePath GetRlzStoreDirectory();
+
+// Like GetRlzStoreDirectory(), but doesn't touch the disk.
+FilePath GetRlzStoreDirectoryPath();
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_LINUX_H_
@@ -0,0 +1,470 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_log.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/crc32.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// The log format below is written to disk and should not be changed without
+// bumping kLogVersion.
+//
+// The log starts with kLogMagic and kLogVersion. Every record that follows is
+//   uint32 payload size
+//   uint32 crc32 of the payload
+//   payload: op, brand length, brand, product or access point, value
+// All integers are little endian. The value of ping time records is an int64,
+// for all other records it's the string that is set, added or cleared.
+const char kLogMagic[] = "RLZL";
+const uint32 kLogVersion = 1;
+
+const size_t kLogHeaderSize = 4 + sizeof(uint32);
+const size_t kRecordHeaderSize = 2 * sizeof(uint32);
+
+// Logs smaller than this are never compacted automatically.
+const int64 kCompactionThreshold = 64 * 1024;
+
+// Brand lengths, products and access points are stored in a single byte.
+const size_t kMaxBrandSize = 255;
+COMPILE_ASSERT(LAST_ACCESS_POINT < 256, too_many_access_points);
+COMPILE_ASSERT(PARTNER < 256, too_many_products);
+
+namespace {
+
+enum RecordOp {
+  kSetPingTime = 'P',
+  kClearPingTime = 'p',
+  kSetAccessPointRlz = 'R',
+  kClearAccessPointRlz = 'r',
+  kAddProductEvent = 'E',
+  kClearProductEvent = 'e',
+  kClearAllProductEvents = 'x',
+  kAddStatefulEvent = 'S',
+  kClearAllStatefulEvents = 's',
+};
+
+void AppendUint32(std::string* s, uint32 value) {
+  for (int i = 0; i < 4; ++i)
+    s->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+}
+
+uint32 ReadUint32(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return u[0] | (u[1] << 8) | (u[2] << 16) | (static_cast<uint32>(u[3]) << 24);
+}
+
+std::string EncodeInt64(int64 value) {
+  std::string s;
+  AppendUint32(&s, static_cast<uint32>(value));
+  AppendUint32(&s, static_cast<uint32>(static_cast<uint64>(value) >> 32));
+  return s;
+}
+
+int64 DecodeInt64(const char* p) {
+  return static_cast<int64>(ReadUint32(p) |
+                            static_cast<uint64>(ReadUint32(p + 4)) << 32);
+}
+
+std::string EncodePayload(char op, const std::string& brand, int id,
+                          const std::string& value) {
+  DCHECK_LE(brand.size(), kMaxBrandSize);
+  std::string payload;
+  payload.push_back(op);
+  payload.push_back(static_cast<char>(brand.size()));
+  payload.append(brand);
+  payload.push_back(static_cast<char>(id));
+  payload.append(value);
+  return payload;
+}
+
+// Appends |payload| with its record header to |log|.
+void AppendRecord(std::string* log, const std::string& payload) {
+  AppendUint32(log, static_cast<uint32>(payload.size()));
+  AppendUint32(log, static_cast<uint32>(Crc32(
+      reinterpret_cast<const unsigned char*>(payload.data()),
+      static_cast<int>(payload.size()))));
+  log->append(payload);
+}
+
+std::string LogHeader() {
+  std::string header(kLogMagic, 4);
+  AppendUint32(&header, kLogVersion);
+  return header;
+}
+
+// Writes |data| to |path| with the open |flags|, and syncs it to disk.
+bool WriteAndSync(const FilePath& path, int flags, const std::string& data) {
+  int fd = HANDLE_EINTR(open(path.value().c_str(), flags | O_CLOEXEC));
+  if (fd == -1)
+    return false;
+
+  int size = static_cast<int>(data.size());
+  bool written =
+      file_util::WriteFileDescriptor(fd, data.data(), size) == size &&
+      HANDLE_EINTR(fdatasync(fd)) == 0;
+  ignore_result(HANDLE_EINTR(close(fd)));
+  return written;
+}
+
+// Writes |data| to |path| through a temporary file that is renamed over
+// |path|, so that a crash never leaves a partially written log behind.
+bool WriteLogFile(const FilePath& path, const std::string& data) {
+  FilePath temp_path;
+  if (!file_util::CreateTemporaryFileInDir(path.DirName(), &temp_path))
+    return false;
+
+  if (!WriteAndSync(temp_path, O_WRONLY | O_TRUNC, data) ||
+      !file_util::ReplaceFile(temp_path, path)) {
+    file_util::Delete(temp_path, false);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+bool RlzValueStoreLog::BrandState::empty() const {
+  if (!access_point_rlzs.empty())
+    return false;
+  for (std::map<Product, ProductState>::const_iterator i = products.begin();
+       i != products.end(); ++i) {
+    if (i->second.has_ping_time || !i->second.events.empty() ||
+        !i->second.stateful_events.empty())
+      return false;
+  }
+  return true;
+}
+
+// static
+RlzValueStoreLog* RlzValueStoreLog::Open(const FilePath& directory) {
+  const char kRlzFile[] = "RlzStore.log";
+  FilePath log_path = directory.Append(kRlzFile);
+
+  std::string log;
+  if (!file_util::PathExists(log_path) ||
+      (file_util::ReadFileToString(log_path, &log) &&
+       (log.size() < kLogHeaderSize ||
+        log.compare(0, 4, kLogMagic, 4) != 0 ||
+        ReadUint32(log.data() + 4) != kLogVersion))) {
+    if (!log.empty())
+      LOG(WARNING) << "Resetting invalid rlz log " << log_path.value();
+    log = LogHeader();
+    if (!WriteLogFile(log_path, log))
+      log.clear();
+  }
+
+  VERIFY(!log.empty());
+  if (log.empty())
+    return NULL;
+
+  RlzValueStoreLog* store = new RlzValueStoreLog(log_path, kLogHeaderSize);
+  size_t offset = kLogHeaderSize;
+  while (log.size() - offset >= kRecordHeaderSize) {
+    const char* record = log.data() + offset;
+    uint32 size = ReadUint32(record);
+    if (size > log.size() - offset - kRecordHeaderSize)
+      break;
+
+    const char* payload = record + kRecordHeaderSize;
+    uint32 crc = static_cast<uint32>(Crc32(
+        reinterpret_cast<const unsigned char*>(payload), size));
+    if (crc != ReadUint32(record + 4) || !store->ApplyRecord(payload, size))
+      break;
+
+    offset += kRecordHeaderSize + size;
+  }
+
+  // Drop a torn tail so that new records are appended to valid ones.
+  if (offset != log.size()) {
+    LOG(WARNING) << "Dropping " << log.size() - offset
+                 << " bytes from the end of " << log_path.value();
+    if (HANDLE_EINTR(truncate(log_path.value().c_str(), offset)) != 0) {
+      delete store;
+      return NULL;
+    }
+  }
+  store->log_size_ = offset;
+  return store;
+}
+
+RlzValueStoreLog::RlzValueStoreLog(const FilePath& log_path, int64 log_size)
+  : log_path_(log_path), log_size_(log_size), compact_requested_(false) {
+}
+
+RlzValueStoreLog::~RlzValueStoreLog() {
+}
+
+bool RlzValueStoreLog::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:  return access(log_path_.value().c_str(), R_OK) == 0;
+    case kWriteAccess: return access(log_path_.value().c_str(), W_OK) == 0;
+  }
+  return false;
+}
+
+bool RlzValueStoreLog::WritePingTime(Product product, int64 time) {
+  return AddRecord(kSetPingTime, product, EncodeInt64(time));
+}
+
+bool RlzValueStoreLog::ReadPingTime(Product product, int64* time) {
+  const ProductState* state = FindProduct(product);
+  if (!state || !state->has_ping_time)
+    return false;
+  *time = state->ping_time;
+  return true;
+}
+
+bool RlzValueStoreLog::ClearPingTime(Product product) {
+  return AddRecord(kClearPingTime, product, std::string());
+}
+
+
+bool RlzValueStoreLog::WriteAccessPointRlz(AccessPoint access_point,
+                                           const char* new_rlz) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  return AddRecord(kSetAccessPointRlz, access_point, new_rlz);
+}
+
+bool RlzValueStoreLog::ReadAccessPointRlz(AccessPoint access_point,
+                                          char* rlz,
+                                          size_t rlz_size) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  // Reading a non-existent access point counts as success.
+  const BrandState* brand = FindWorkingBrand();
+  const std::string* value = NULL;
+  if (brand) {
+    std::map<AccessPoint, std::string>::const_iterator i =
+        brand->access_point_rlzs.find(access_point);
+    if (i != brand->access_point_rlzs.end())
+      value = &i->second;
+  }
+  if (!value) {
+    if (rlz_size > 0)
+      rlz[0] = '\0';
+    return true;
+  }
+
+  if (value->size() >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  strncpy(rlz, value->c_str(), rlz_size);
+  return true;
+}
+
+bool RlzValueStoreLog::ClearAccessPointRlz(AccessPoint access_point) {
+  if (!GetAccessPointName(access_point))
+    return false;
+
+  return AddRecord(kClearAccessPointRlz, access_point, std::string());
+}
+
+
+bool RlzValueStoreLog::AddProductEvent(Product product,
+                                       const char* event_rlz) {
+  return AddRecord(kAddProductEvent, product, event_rlz);
+}
+
+bool RlzValueStoreLog::ReadProductEvents(Product product,
+                                         std::vector<std::string>* events) {
+  if (const ProductState* state = FindProduct(product))
+    events->insert(events->end(), state->events.begin(), state->events.end());
+  return true;
+}
+
+bool RlzValueStoreLog::ClearProductEvent(Product product,
+                                         const char* event_rlz) {
+  return AddRecord(kClearProductEvent, product, event_rlz);
+}
+
+bool RlzValueStoreLog::ClearAllProductEvents(Product product) {
+  return AddRecord(kClearAllProductEvents, product, std::string());
+}
+
+
+bool RlzValueStoreLog::AddStatefulEvent(Product product,
+                                        const char* event_rlz) {
+  return AddRecord(kAddStatefulEvent, product, event_rlz);
+}
+
+bool RlzValueStoreLog::IsStatefulEvent(Product product,
+                                       const char* event_rlz) {
+  const ProductState* state = FindProduct(product);
+  return state && state->stateful_events.count(event_rlz) > 0;
+}
+
+bool RlzValueStoreLog::ClearAllStatefulEvents(Product product) {
+  return AddRecord(kClearAllStatefulEvents, product, std::string());
+}
+
+
+void RlzValueStoreLog::CollectGarbage() {
+  for (BrandMap::iterator i = brands_.begin(); i != brands_.end(); ) {
+    if (i->second.empty())
+      brands_.erase(i++);
+    else
+      ++i;
+  }
+  compact_requested_ = true;
+}
+
+bool RlzValueStoreLog::Persist() {
+  if (!pending_.empty()) {
+    if (!WriteAndSync(log_path_, O_WRONLY | O_APPEND, pending_))
+      return false;
+    log_size_ += pending_.size();
+    pending_.clear();
+  }
+
+  if (!compact_requested_ && log_size_ <= kCompactionThreshold)
+    return true;
+
+  // Only compact if that at least halves the log. Otherwise a store whose
+  // live data is larger than the threshold would be rewritten every time.
+  std::string snapshot = Snapshot();
+  if (!compact_requested_ &&
+      log_size_ <= 2 * static_cast<int64>(snapshot.size()))
+    return true;
+
+  if (!WriteLogFile(log_path_, snapshot))
+    return false;
+  log_size_ = snapshot.size();
+  compact_requested_ = false;
+  return true;
+}
+
+bool RlzValueStoreLog::ApplyRecord(const char* payload, size_t size) {
+  if (size < 3)
+    return false;
+  char op = payload[0];
+  size_t brand_size = static_cast<unsigned char>(payload[1]);
+  if (size < 3 + brand_size)
+    return false;
+  std::string brand(payload + 2, brand_size);
+  int id = static_cast<unsigned char>(payload[2 + brand_size]);
+  std::string value(payload + 3 + brand_size, size - 3 - brand_size);
+
+  BrandState& state = brands_[brand];
+  switch (op) {
+    case kSetAccessPointRlz:
+      state.access_point_rlzs[static_cast<AccessPoint>(id)] = value;
+      return true;
+    case kClearAccessPointRlz:
+      state.access_point_rlzs.erase(static_cast<AccessPoint>(id));
+      return true;
+  }
+
+  ProductState& product = state.products[static_cast<Product>(id)];
+  switch (op) {
+    case kSetPingTime:
+      if (value.size() != 8)
+        return false;
+      product.has_ping_time = true;
+      product.ping_time = DecodeInt64(value.data());
+      return true;
+    case kClearPingTime:
+      product.has_ping_time = false;
+      return true;
+    case kAddProductEvent:
+      product.events.insert(value);
+      return true;
+    case kClearProductEvent:
+      product.events.erase(value);
+      return true;
+    case kClearAllProductEvents:
+      product.events.clear();
+      return true;
+    case kAddStatefulEvent:
+      product.stateful_events.insert(value);
+      return true;
+    case kClearAllStatefulEvents:
+      product.stateful_events.clear();
+      return true;
+  }
+  return false;
+}
+
+bool RlzValueStoreLog::AddRecord(char op, int id, const std::string& value) {
+  const std::string& brand = SupplementaryBranding::GetBrand();
+  if (brand.size() > kMaxBrandSize) {
+    ASSERT_STRING("RlzValueStoreLog: Brand too long");
+    return false;
+  }
+
+  std::string payload = EncodePayload(op, brand, id, value);
+  VERIFY(ApplyRecord(payload.data(), payload.size()));
+  AppendRecord(&pending_, payload);
+  return true;
+}
+
+std::string RlzValueStoreLog::Snapshot() const {
+  std::string log = LogHeader();
+  for (BrandMap::const_iterator b = brands_.begin(); b != brands_.end(); ++b) {
+    const std::string& brand = b->first;
+    const BrandState& state = b->second;
+
+    for (std::map<AccessPoint, std::string>::const_iterator i =
+             state.access_point_rlzs.begin();
+         i != state.access_point_rlzs.end(); ++i) {
+      AppendRecord(&log, EncodePayload(kSetAccessPointRlz, brand, i->first,
+                                       i->second));
+    }
+
+    for (std::map<Product, ProductState>::const_iterator p =
+             state.products.begin();
+         p != state.products.end(); ++p) {
+      const ProductState& product = p->second;
+      if (product.has_ping_time) {
+        AppendRecord(&log, EncodePayload(kSetPingTime, brand, p->first,
+                                         EncodeInt64(product.ping_time)));
+      }
+      for (std::set<std::string>::const_iterator e = product.events.begin();
+           e != product.events.end(); ++e) {
+        AppendRecord(&log, EncodePayload(kAddProductEvent, brand, p->first,
+                                         *e));
+      }
+      for (std::set<std::string>::const_iterator e =
+               product.stateful_events.begin();
+           e != product.stateful_events.end(); ++e) {
+        AppendRecord(&log, EncodePayload(kAddStatefulEvent, brand, p->first,
+                                         *e));
+      }
+    }
+  }
+  return log;
+}
+
+const RlzValueStoreLog::BrandState*
+RlzValueStoreLog::FindWorkingBrand() const {
+  BrandMap::const_iterator i = brands_.find(SupplementaryBranding::GetBrand());
+  return i == brands_.end() ? NULL : &i->second;
+}
+
+const RlzValueStoreLog::ProductState* RlzValueStoreLog::FindProduct(
+    Product product) const {
+  const BrandState* brand = FindWorkingBrand();
+  if (!brand)
+    return NULL;
+  std::map<Product, ProductState>::const_iterator i =
+      brand->products.find(product);
+  return i == brand->products.end() ? NULL : &i->second;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,121 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_LOG_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_LOG_H_
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+// An implementation of RlzValueStore for linux that keeps its data in an
+// append-only log. Every mutation is recorded as one checksummed record, so
+// the cost of a write is proportional to the record, not to the whole store.
+// The in-memory state is rebuilt by replaying the log when the store is
+// opened. Once the log grows past a threshold, or when CollectGarbage() is
+// called, it is compacted into a snapshot holding one record per live value.
+class RlzValueStoreLog : public RlzValueStore {
+ public:
+  // Replays the log in |directory|, creating an empty one if it doesn't exist
+  // yet. A truncated or corrupt tail, as left behind by a crash during an
+  // append, is dropped. Returns NULL if the log can't be read. Must be called
+  // with the store's cross-process lock held.
+  static RlzValueStoreLog* Open(const FilePath& directory);
+  virtual ~RlzValueStoreLog();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  // Drops supplementary brands without data and compacts the log.
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Appends the records of all mutations made through this object to the
+  // log, and compacts the log if it got too large. Called when the outermost
+  // ScopedRlzValueStoreLock goes away.
+  bool Persist();
+
+ private:
+  struct ProductState {
+    ProductState() : has_ping_time(false), ping_time(0) {}
+
+    bool has_ping_time;
+    int64 ping_time;
+    std::set<std::string> events;
+    std::set<std::string> stateful_events;
+  };
+
+  struct BrandState {
+    bool empty() const;
+
+    std::map<AccessPoint, std::string> access_point_rlzs;
+    std::map<Product, ProductState> products;
+  };
+
+  typedef std::map<std::string, BrandState> BrandMap;
+
+  // |log_path| is the log file, |log_size| the number of valid bytes in it.
+  RlzValueStoreLog(const FilePath& log_path, int64 log_size);
+
+  // Applies the record |payload| of |size| bytes to the in-memory state.
+  // Returns false if the record can't be parsed.
+  bool ApplyRecord(const char* payload, size_t size);
+
+  // Encodes a record, applies it to the in-memory state and queues it for
+  // the next Persist(). |id| is a Product or an AccessPoint, depending on
+  // |op|. Returns false if the working brand is too long to be recorded.
+  bool AddRecord(char op, int id, const std::string& value);
+
+  // Serializes the live state as a complete log, including the file header.
+  std::string Snapshot() const;
+
+  // Return the state of the working brand, or of |product| in it, or NULL
+  // if there is none. Reads don't add entries.
+  const BrandState* FindWorkingBrand() const;
+  const ProductState* FindProduct(Product product) const;
+
+  BrandMap brands_;
+  FilePath log_path_;
+  int64 log_size_;
+
+  // Set by CollectGarbage() to compact the log on the next Persist().
+  bool compact_requested_;
+
+  // Encoded records that haven't been appended to the log yet.
+  std::string pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreLog);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_LOG_H_
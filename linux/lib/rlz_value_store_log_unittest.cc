@@ -0,0 +1,237 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the log store. They use the store directly, independent of
+// the store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_log.h"
+
+#include <algorithm>
+#include <string>
+
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzValueStoreLogTest : public RlzLibTestNoMachineState {
+ protected:
+  rlz_lib::RlzValueStoreLog* OpenStore() {
+    return rlz_lib::RlzValueStoreLog::Open(temp_dir_.path());
+  }
+
+  FilePath LogPath() {
+    return temp_dir_.path().Append("RlzStore.log");
+  }
+
+  int64 LogSize() {
+    int64 size = -1;
+    file_util::GetFileSize(LogPath(), &size);
+    return size;
+  }
+};
+
+TEST_F(RlzValueStoreLogTest, ReplaysLog) {
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "TbRlzValue"));
+    EXPECT_TRUE(store->WritePingTime(rlz_lib::TOOLBAR_NOTIFIER,
+                                     1234567890123LL));
+    EXPECT_TRUE(store->AddProductEvent(rlz_lib::TOOLBAR_NOTIFIER, "I7S"));
+    EXPECT_TRUE(store->AddProductEvent(rlz_lib::TOOLBAR_NOTIFIER, "W1I"));
+    EXPECT_TRUE(store->ClearProductEvent(rlz_lib::TOOLBAR_NOTIFIER, "I7S"));
+    EXPECT_TRUE(store->AddStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER, "C1F"));
+    EXPECT_TRUE(store->Persist());
+  }
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::TOOLBAR_NOTIFIER, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  EXPECT_FALSE(store->ReadPingTime(rlz_lib::CHROME, &time));
+
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::TOOLBAR_NOTIFIER, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("W1I", events[0]);
+
+  EXPECT_TRUE(store->IsStatefulEvent(rlz_lib::TOOLBAR_NOTIFIER, "C1F"));
+  EXPECT_FALSE(store->IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+}
+
+TEST_F(RlzValueStoreLogTest, AppendsRecords) {
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "C1I"));
+    EXPECT_TRUE(store->Persist());
+  }
+  int64 size_after_one_event = LogSize();
+
+  // A second event only adds its own record to the log.
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "C2I"));
+    EXPECT_TRUE(store->Persist());
+  }
+  int64 size_after_two_events = LogSize();
+  EXPECT_GT(size_after_two_events, size_after_one_event);
+  EXPECT_LT(size_after_two_events - size_after_one_event, 32);
+}
+
+TEST_F(RlzValueStoreLogTest, DropsTornTail) {
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "First"));
+    EXPECT_TRUE(store->Persist());
+  }
+  int64 good_size = LogSize();
+
+  // Simulate a crash in the middle of appending a record.
+  const char kPartialRecord[] = "\x20\0\0\0garbage";
+  ASSERT_EQ(static_cast<int>(sizeof(kPartialRecord)),
+            file_util::AppendToFile(LogPath(), kPartialRecord,
+                                    sizeof(kPartialRecord)));
+
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_EQ(good_size, LogSize());
+
+    char rlz[rlz_lib::kMaxRlzLength + 1];
+    EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                          rlz, arraysize(rlz)));
+    EXPECT_STREQ("First", rlz);
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "Second"));
+    EXPECT_TRUE(store->Persist());
+  }
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("Second", rlz);
+}
+
+TEST_F(RlzValueStoreLogTest, ResetsInvalidFile) {
+  const char kGarbage[] = "not a log file";
+  ASSERT_EQ(static_cast<int>(arraysize(kGarbage)),
+            file_util::WriteFile(LogPath(), kGarbage, arraysize(kGarbage)));
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+}
+
+TEST_F(RlzValueStoreLogTest, Compacts) {
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "C1I"));
+      EXPECT_TRUE(store->ClearProductEvent(rlz_lib::CHROME, "C1I"));
+    }
+    EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 42));
+    EXPECT_TRUE(store->Persist());
+  }
+  int64 uncompacted_size = LogSize();
+
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    store->CollectGarbage();
+    EXPECT_TRUE(store->Persist());
+  }
+  EXPECT_LT(LogSize(), uncompacted_size / 10);
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(42, time);
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::CHROME, &events));
+  EXPECT_TRUE(events.empty());
+}
+
+TEST_F(RlzValueStoreLogTest, SupplementaryBrands) {
+  // Don't run this test if a supplementary brand is already in place.  That
+  // way we can control the branding.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                           "NoBrand"));
+    {
+      rlz_lib::SupplementaryBranding branding("TEST");
+      EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                             "Branded"));
+    }
+    EXPECT_TRUE(store->Persist());
+  }
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("NoBrand", rlz);
+
+  rlz_lib::SupplementaryBranding branding("TEST");
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("Branded", rlz);
+}
+
+TEST_F(RlzValueStoreLogTest, RejectsLongBrands) {
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  std::string longest_brand(255, 'B');
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+    ASSERT_TRUE(store.get());
+    {
+      rlz_lib::SupplementaryBranding branding(longest_brand.c_str());
+      EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 42));
+    }
+    {
+      // The brand length doesn't fit the record.
+      std::string brand = longest_brand + "B";
+      rlz_lib::SupplementaryBranding branding(brand.c_str());
+      rlz_lib::SetExpectedAssertion("RlzValueStoreLog: Brand too long");
+      EXPECT_FALSE(store->WritePingTime(rlz_lib::CHROME, 43));
+      rlz_lib::SetExpectedAssertion("");
+    }
+    EXPECT_TRUE(store->Persist());
+  }
+
+  scoped_ptr<rlz_lib::RlzValueStoreLog> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  rlz_lib::SupplementaryBranding branding(longest_brand.c_str());
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(42, time);
+}
@@ -0,0 +1,407 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/store_keys.h"
+#include "rlz/linux/lib/slot_file.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The process-wide mapping of the slot file. Only used while the store's
+// cross-process lock is held, which also serializes the threads of this
+// process.
+class SlotFileMapping {
+ public:
+  SlotFileMapping() : file_(NULL), writable_(false) {}
+
+  // Maps |path|, replacing any previous mapping.
+  bool Map(const FilePath& path);
+
+  const FilePath& path() const { return path_; }
+  SlotFile* file() const { return file_; }
+  bool writable() const { return writable_; }
+
+ private:
+  void Unmap();
+
+  FilePath path_;
+  SlotFile* file_;
+  bool writable_;
+};
+
+void SlotFileMapping::Unmap() {
+  if (file_)
+    munmap(file_, sizeof(SlotFile));
+  file_ = NULL;
+  writable_ = false;
+  path_ = FilePath();
+}
+
+bool SlotFileMapping::Map(const FilePath& path) {
+  Unmap();
+
+  bool writable = true;
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (fd == -1) {
+    writable = false;
+    fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+  }
+  if (fd == -1) {
+    PLOG(ERROR) << "open " << path.value();
+    return false;
+  }
+
+  // A file of the wrong size is recreated zero-filled.
+  struct stat info;
+  bool resized = false;
+  if (fstat(fd, &info) == 0 && info.st_size != sizeof(SlotFile)) {
+    resized = writable &&
+        HANDLE_EINTR(ftruncate(fd, 0)) == 0 &&
+        HANDLE_EINTR(ftruncate(fd, sizeof(SlotFile))) == 0;
+    if (!resized) {
+      ignore_result(HANDLE_EINTR(close(fd)));
+      return false;
+    }
+  }
+
+  void* memory = mmap(NULL, sizeof(SlotFile),
+                      PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED,
+                      fd, 0);
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "mmap " << path.value();
+    return false;
+  }
+
+  SlotFile* file = static_cast<SlotFile*>(memory);
+  if (!IsValidSlotFile(*file)) {
+    if (!writable) {
+      munmap(memory, sizeof(SlotFile));
+      return false;
+    }
+    if (!resized)
+      LOG(WARNING) << "Resetting RLZ store " << path.value();
+    ResetSlotFile(file);
+  }
+
+  path_ = path;
+  file_ = file;
+  writable_ = writable;
+  return true;
+}
+
+base::LazyInstance<SlotFileMapping>::Leaky g_mapping;
+
+ProductSlot* GetProductSlot(BrandSlot* slot, Product product) {
+  if (!slot || product <= 0 || product >= kProductSlots)
+    return NULL;
+  return &slot->products[product];
+}
+
+// Converts an event rlz such as "I7S" (access point name followed by event
+// name) into its bit index in the event bitmaps.
+bool GetEventIndex(const char* event_rlz, int* index) {
+  AccessPoint point = NO_ACCESS_POINT;
+  Event event = INVALID_EVENT;
+  if (!FindEventKey(event_rlz, &point, &event))
+    return false;
+
+  *index = point * kEventSlots + event;
+  return true;
+}
+
+bool IsBitSet(const uint64* bitmap, int index) {
+  return (bitmap[index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+void SetBit(uint64* bitmap, int index) {
+  bitmap[index / 64] |= 1ULL << (index % 64);
+}
+
+void ClearBit(uint64* bitmap, int index) {
+  bitmap[index / 64] &= ~(1ULL << (index % 64));
+}
+
+bool IsBrandSlotEmpty(const BrandSlot& slot) {
+  for (int i = 0; i < kAccessPointSlots; ++i) {
+    if (slot.access_point_rlzs[i][0])
+      return false;
+  }
+  for (int i = 0; i < kProductSlots; ++i) {
+    const ProductSlot& product = slot.products[i];
+    if (product.has_ping_time)
+      return false;
+    for (int j = 0; j < kEventBitmapWords; ++j) {
+      if (product.events[j] || product.stateful_events[j])
+        return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+// static
+RlzValueStoreMmap* RlzValueStoreMmap::Open(const FilePath& directory) {
+  const char kSlotFileName[] = "RlzStore.slots";
+  FilePath path = directory.Append(kSlotFileName);
+
+  SlotFileMapping& mapping = g_mapping.Get();
+  if (!mapping.file() || mapping.path() != path) {
+    if (!mapping.Map(path))
+      return NULL;
+  }
+  return new RlzValueStoreMmap(mapping.file(), mapping.writable());
+}
+
+RlzValueStoreMmap::RlzValueStoreMmap(SlotFile* file, bool writable)
+  : file_(file), writable_(writable) {
+}
+
+RlzValueStoreMmap::~RlzValueStoreMmap() {
+}
+
+bool RlzValueStoreMmap::HasAccess(AccessType type) {
+  switch (type) {
+    case kReadAccess:  return true;
+    case kWriteAccess: return writable_;
+  }
+  return false;
+}
+
+bool RlzValueStoreMmap::WritePingTime(Product product, int64 time) {
+  ProductSlot* slot = writable_ ?
+      GetProductSlot(WorkingSlot(true), product) : NULL;
+  if (!slot)
+    return false;
+
+  slot->ping_time = time;
+  slot->has_ping_time = 1;
+  return true;
+}
+
+bool RlzValueStoreMmap::ReadPingTime(Product product, int64* time) {
+  ProductSlot* slot = GetProductSlot(WorkingSlot(false), product);
+  if (!slot || !slot->has_ping_time)
+    return false;
+
+  *time = slot->ping_time;
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearPingTime(Product product) {
+  if (!writable_)
+    return false;
+
+  if (ProductSlot* slot = GetProductSlot(WorkingSlot(false), product)) {
+    slot->has_ping_time = 0;
+    slot->ping_time = 0;
+  }
+  return true;
+}
+
+
+bool RlzValueStoreMmap::WriteAccessPointRlz(AccessPoint access_point,
+                                            const char* new_rlz) {
+  if (!writable_ || access_point <= NO_ACCESS_POINT ||
+      access_point >= LAST_ACCESS_POINT) {
+    return false;
+  }
+
+  if (strlen(new_rlz) > static_cast<size_t>(kMaxRlzLength)) {
+    ASSERT_STRING("WriteAccessPointRlz: RLZ too long for its slot");
+    return false;
+  }
+
+  BrandSlot* slot = WorkingSlot(true);
+  if (!slot)
+    return false;
+
+  // strncpy() zero-fills the rest of the slot.
+  strncpy(slot->access_point_rlzs[access_point], new_rlz, kMaxRlzLength + 1);
+  return true;
+}
+
+bool RlzValueStoreMmap::ReadAccessPointRlz(AccessPoint access_point,
+                                           char* rlz,
+                                           size_t rlz_size) {
+  if (access_point <= NO_ACCESS_POINT || access_point >= LAST_ACCESS_POINT)
+    return false;
+
+  // Reading a non-existent access point counts as success.
+  BrandSlot* slot = WorkingSlot(false);
+  const char* value = slot ? slot->access_point_rlzs[access_point] : "";
+  size_t length = strnlen(value, kMaxRlzLength + 1);
+  if (length > static_cast<size_t>(kMaxRlzLength))
+    length = 0;  // Not terminated, treat as empty.
+
+  if (length >= rlz_size) {
+    rlz[0] = 0;
+    ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
+    return false;
+  }
+  memcpy(rlz, value, length);
+  rlz[length] = '\0';
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearAccessPointRlz(AccessPoint access_point) {
+  if (!writable_ || access_point <= NO_ACCESS_POINT ||
+      access_point >= LAST_ACCESS_POINT) {
+    return false;
+  }
+
+  if (BrandSlot* slot = WorkingSlot(false)) {
+    memset(slot->access_point_rlzs[access_point], 0,
+           sizeof(slot->access_point_rlzs[access_point]));
+  }
+  return true;
+}
+
+
+bool RlzValueStoreMmap::AddProductEvent(Product product,
+                                        const char* event_rlz) {
+  int index;
+  ProductSlot* slot = writable_ ?
+      GetProductSlot(WorkingSlot(true), product) : NULL;
+  if (!slot || !GetEventIndex(event_rlz, &index))
+    return false;
+
+  SetBit(slot->events, index);
+  return true;
+}
+
+bool RlzValueStoreMmap::ReadProductEvents(Product product,
+                                          std::vector<std::string>* events) {
+  ProductSlot* slot = GetProductSlot(WorkingSlot(false), product);
+  if (!slot)
+    return true;
+
+  for (int word = 0; word < kEventBitmapWords; ++word) {
+    if (!slot->events[word])
+      continue;
+    for (int bit = 0; bit < 64; ++bit) {
+      int index = word * 64 + bit;
+      if (!IsBitSet(slot->events, index))
+        continue;
+
+      AccessPoint point = static_cast<AccessPoint>(index / kEventSlots);
+      Event event = static_cast<Event>(index % kEventSlots);
+      if (point >= LAST_ACCESS_POINT || event >= LAST_EVENT)
+        continue;
+      if (const StoreKey* key = GetEventKey(point, event))
+        events->push_back(key->name);
+    }
+  }
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearProductEvent(Product product,
+                                          const char* event_rlz) {
+  int index;
+  if (!writable_ || !GetEventIndex(event_rlz, &index))
+    return false;
+
+  if (ProductSlot* slot = GetProductSlot(WorkingSlot(false), product))
+    ClearBit(slot->events, index);
+  return true;
+}
+
+bool RlzValueStoreMmap::ClearAllProductEvents(Product product) {
+  if (!writable_)
+    return false;
+
+  if (ProductSlot* slot = GetProductSlot(WorkingSlot(false), product))
+    memset(slot->events, 0, sizeof(slot->events));
+  return true;
+}
+
+
+bool RlzValueStoreMmap::AddStatefulEvent(Product product,
+                                         const char* event_rlz) {
+  int index;
+  ProductSlot* slot = writable_ ?
+      GetProductSlot(WorkingSlot(true), product) : NULL;
+  if (!slot || !GetEventIndex(event_rlz, &index))
+    return false;
+
+  SetBit(slot->stateful_events, index);
+  return true;
+}
+
+bool RlzValueStoreMmap::IsStatefulEvent(Product product,
+                                        const char* event_rlz) {
+  int index;
+  ProductSlot* slot = GetProductSlot(WorkingSlot(false), product);
+  return slot && GetEventIndex(event_rlz, &index) &&
+      IsBitSet(slot->stateful_events, index);
+}
+
+bool RlzValueStoreMmap::ClearAllStatefulEvents(Product product) {
+  if (!writable_)
+    return false;
+
+  if (ProductSlot* slot = GetProductSlot(WorkingSlot(false), product))
+    memset(slot->stateful_events, 0, sizeof(slot->stateful_events));
+  return true;
+}
+
+
+void RlzValueStoreMmap::CollectGarbage() {
+  if (!writable_)
+    return;
+
+  for (int i = 1; i < kBrandSlots; ++i) {
+    BrandSlot* slot = &file_->brands[i];
+    if (slot->in_use && IsBrandSlotEmpty(*slot))
+      memset(slot, 0, sizeof(*slot));
+  }
+}
+
+BrandSlot* RlzValueStoreMmap::WorkingSlot(bool create) {
+  const std::string& brand = SupplementaryBranding::GetBrand();
+  if (brand.empty())
+    return &file_->brands[0];
+
+  BrandSlot* free_slot = NULL;
+  for (int i = 1; i < kBrandSlots; ++i) {
+    BrandSlot* slot = &file_->brands[i];
+    if (!slot->in_use) {
+      if (!free_slot)
+        free_slot = slot;
+    } else if (brand == slot->brand) {
+      return slot;
+    }
+  }
+
+  if (!create)
+    return NULL;
+
+  if (!free_slot || brand.size() > static_cast<size_t>(kMaxBrandLength)) {
+    ASSERT_STRING("RlzValueStoreMmap: No slot left for supplementary brand");
+    return NULL;
+  }
+
+  memset(free_slot, 0, sizeof(*free_slot));
+  strncpy(free_slot->brand, brand.c_str(), kMaxBrandLength);
+  free_slot->in_use = 1;
+  return free_slot;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,87 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
+
+#include "base/compiler_specific.h"
+#include "rlz/lib/rlz_value_store.h"
+
+class FilePath;
+
+namespace rlz_lib {
+
+struct BrandSlot;
+struct SlotFile;
+
+// An implementation of RlzValueStore for linux that keeps all data in fixed
+// size slots of a memory mapped file. Every access point has a
+// kMaxRlzLength + 1 byte slot, every product a ping time slot and a bitmap of
+// (access point, event) pairs for its product events and stateful events.
+// Slots are indexed directly by the AccessPoint, Product and Event enums, so
+// ReadAccessPointRlz() and ReadPingTime() are plain memory reads, and writes
+// only dirty the page they touch. The mapping is shared by all processes
+// through the page cache; the kernel writes it back to disk.
+class RlzValueStoreMmap : public RlzValueStore {
+ public:
+  // Maps the slot file in |directory|, creating it if it doesn't exist yet
+  // and resetting it if it doesn't hold a slot file of the current layout.
+  // Returns NULL on failure. The mapping is kept for the lifetime of the
+  // process, so this is cheap after the first call for a given directory.
+  // Must be called with the store's cross-process lock held.
+  static RlzValueStoreMmap* Open(const FilePath& directory);
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  // Releases the slots of supplementary brands that no longer hold any data.
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Called when the outermost ScopedRlzValueStoreLock goes away. Writes are
+  // already visible in the shared mapping, so there is nothing to do.
+  bool Persist() { return true; }
+
+ private:
+  RlzValueStoreMmap(SlotFile* file, bool writable);
+  virtual ~RlzValueStoreMmap();
+  friend class FileStoreFactory;
+  friend class ShmStoreFactory;
+
+  // Returns the slot of the current supplementary brand. If there is none
+  // and |create| is true, a free slot is claimed for the brand. Returns NULL
+  // if the brand has no slot.
+  BrandSlot* WorkingSlot(bool create);
+
+  SlotFile* file_;
+  bool writable_;
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreMmap);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_MMAP_H_
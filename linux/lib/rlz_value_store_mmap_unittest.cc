@@ -0,0 +1,155 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the memory mapped slot store. They use the store directly,
+// independent of the store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+
+#include <algorithm>
+
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzValueStoreMmapTest : public RlzLibTestNoMachineState {
+ protected:
+  rlz_lib::RlzValueStore* OpenStore() {
+    return rlz_lib::RlzValueStoreMmap::Open(temp_dir_.path());
+  }
+};
+
+TEST_F(RlzValueStoreMmapTest, AccessPointRlz) {
+  scoped_ptr<rlz_lib::RlzValueStore> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  char small_rlz[4];
+  EXPECT_FALSE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         small_rlz, arraysize(small_rlz)));
+
+  // Values are shared through the mapping.
+  scoped_ptr<rlz_lib::RlzValueStore> other_store(OpenStore());
+  EXPECT_TRUE(other_store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                              rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+
+  EXPECT_TRUE(store->ClearAccessPointRlz(rlz_lib::IETB_SEARCH_BOX));
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+
+  std::string too_long(rlz_lib::kMaxRlzLength + 1, 'x');
+  EXPECT_FALSE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                          too_long.c_str()));
+}
+
+TEST_F(RlzValueStoreMmapTest, PingTime) {
+  scoped_ptr<rlz_lib::RlzValueStore> store(OpenStore());
+  ASSERT_TRUE(store.get());
+
+  int64 time = 0;
+  EXPECT_FALSE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  EXPECT_FALSE(store->ReadPingTime(rlz_lib::DESKTOP, &time));
+
+  EXPECT_TRUE(store->ClearPingTime(rlz_lib::CHROME));
+  EXPECT_FALSE(store->ReadPingTime(rlz_lib::CHROME, &time));
+}
+
+TEST_F(RlzValueStoreMmapTest, Events) {
+  scoped_ptr<rlz_lib::RlzValueStore> store(OpenStore());
+  ASSERT_TRUE(store.get());
+
+  EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "W1I"));
+  EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "I7S"));
+  EXPECT_FALSE(store->AddProductEvent(rlz_lib::CHROME, "Bogus"));
+  EXPECT_FALSE(store->AddProductEvent(rlz_lib::CHROME, "I7"));
+
+  std::vector<std::string> events;
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::CHROME, &events));
+  std::sort(events.begin(), events.end());
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ("I7S", events[0]);
+  EXPECT_EQ("W1I", events[1]);
+
+  EXPECT_TRUE(store->ClearProductEvent(rlz_lib::CHROME, "I7S"));
+  events.clear();
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::CHROME, &events));
+  ASSERT_EQ(1u, events.size());
+  EXPECT_EQ("W1I", events[0]);
+
+  EXPECT_TRUE(store->ClearAllProductEvents(rlz_lib::CHROME));
+  events.clear();
+  EXPECT_TRUE(store->ReadProductEvents(rlz_lib::CHROME, &events));
+  EXPECT_TRUE(events.empty());
+
+  EXPECT_FALSE(store->IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_TRUE(store->AddStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_TRUE(store->IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+  EXPECT_FALSE(store->IsStatefulEvent(rlz_lib::DESKTOP, "C1F"));
+  EXPECT_TRUE(store->ClearAllStatefulEvents(rlz_lib::CHROME));
+  EXPECT_FALSE(store->IsStatefulEvent(rlz_lib::CHROME, "C1F"));
+}
+
+TEST_F(RlzValueStoreMmapTest, ResetsInvalidFile) {
+  const char kGarbage[] = "not a slot file";
+  FilePath path = temp_dir_.path().Append("RlzStore.slots");
+  ASSERT_EQ(static_cast<int>(arraysize(kGarbage)),
+            file_util::WriteFile(path, kGarbage, arraysize(kGarbage)));
+
+  scoped_ptr<rlz_lib::RlzValueStore> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("", rlz);
+}
+
+TEST_F(RlzValueStoreMmapTest, SupplementaryBrands) {
+  // Don't run this test if a supplementary brand is already in place.  That
+  // way we can control the branding.
+  if (!rlz_lib::SupplementaryBranding::GetBrand().empty())
+    return;
+
+  scoped_ptr<rlz_lib::RlzValueStore> store(OpenStore());
+  ASSERT_TRUE(store.get());
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "NoBrand"));
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  {
+    rlz_lib::SupplementaryBranding branding("TEST");
+    EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                          rlz, arraysize(rlz)));
+    EXPECT_STREQ("", rlz);
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                           "Branded"));
+    EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                          rlz, arraysize(rlz)));
+    EXPECT_STREQ("Branded", rlz);
+
+    // Once the brand holds no data, garbage collection releases its slot.
+    EXPECT_TRUE(store->ClearAccessPointRlz(rlz_lib::CHROME_OMNIBOX));
+    store->CollectGarbage();
+  }
+
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("NoBrand", rlz);
+}
@@ -0,0 +1,268 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_sharded.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/lib_values.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+#include "rlz/linux/lib/store_watcher_linux.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The shard names are part of the file names and should not be changed.
+const char kAccessPointShardName[] = "accessPoints";
+
+// Takes the flock() |operation| on |fd|, giving up at GetStoreLockDeadline().
+// flock() can't time out, so a busy lock is polled, backing off from
+// kMinPollMicroseconds to kMaxPollMicroseconds.
+bool LockShardFile(int fd, int operation) {
+  const int kMinPollMicroseconds = 100;
+  const int kMaxPollMicroseconds = 10000;
+
+  base::TimeTicks deadline = GetStoreLockDeadline();
+  int poll_microseconds = kMinPollMicroseconds;
+  while (HANDLE_EINTR(flock(fd, operation | LOCK_NB)) != 0) {
+    if (errno != EWOULDBLOCK)
+      return false;
+    base::TimeDelta remaining = deadline - base::TimeTicks::Now();
+    if (remaining <= base::TimeDelta()) {
+      ScopedLockTimeout::SetLockBusy();
+      return false;
+    }
+    usleep(std::min<int64>(poll_microseconds,
+                           remaining.InMicroseconds() + 1));
+    poll_microseconds = std::min(kMaxPollMicroseconds, poll_microseconds * 2);
+  }
+  return true;
+}
+
+}  // namespace
+
+RlzValueStoreSharded::RlzValueStoreSharded() {
+}
+
+RlzValueStoreSharded::~RlzValueStoreSharded() {
+  for (int i = 0; i < kShardCount; ++i) {
+    delete shards_[i].store;
+    if (shards_[i].lock_fd != -1) {
+      flock(shards_[i].lock_fd, LOCK_UN);
+      ignore_result(HANDLE_EINTR(close(shards_[i].lock_fd)));
+    }
+  }
+}
+
+bool RlzValueStoreSharded::HasAccess(AccessType type) {
+  bool has_shard = false;
+  for (int i = 0; i < kShardCount; ++i) {
+    if (!shards_[i].store)
+      continue;
+    if (!shards_[i].store->HasAccess(type))
+      return false;
+    has_shard = true;
+  }
+  return has_shard;
+}
+
+bool RlzValueStoreSharded::WritePingTime(Product product, int64 time) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->WritePingTime(product, time);
+}
+
+bool RlzValueStoreSharded::ReadPingTime(Product product, int64* time) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ReadPingTime(product, time);
+}
+
+bool RlzValueStoreSharded::ClearPingTime(Product product) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ClearPingTime(product);
+}
+
+
+bool RlzValueStoreSharded::WriteAccessPointRlz(AccessPoint access_point,
+                                               const char* new_rlz) {
+  RlzValueStoreLinux* store = AccessPointShard();
+  return store && store->WriteAccessPointRlz(access_point, new_rlz);
+}
+
+bool RlzValueStoreSharded::ReadAccessPointRlz(AccessPoint access_point,
+                                              char* rlz,
+                                              size_t rlz_size) {
+  RlzValueStoreLinux* store = AccessPointShard();
+  return store && store->ReadAccessPointRlz(access_point, rlz, rlz_size);
+}
+
+bool RlzValueStoreSharded::ClearAccessPointRlz(AccessPoint access_point) {
+  RlzValueStoreLinux* store = AccessPointShard();
+  return store && store->ClearAccessPointRlz(access_point);
+}
+
+
+bool RlzValueStoreSharded::AddProductEvent(Product product,
+                                           const char* event_rlz) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->AddProductEvent(product, event_rlz);
+}
+
+bool RlzValueStoreSharded::ReadProductEvents(
+    Product product, std::vector<std::string>* events) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ReadProductEvents(product, events);
+}
+
+bool RlzValueStoreSharded::ClearProductEvent(Product product,
+                                             const char* event_rlz) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ClearProductEvent(product, event_rlz);
+}
+
+bool RlzValueStoreSharded::ClearAllProductEvents(Product product) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ClearAllProductEvents(product);
+}
+
+
+bool RlzValueStoreSharded::AddStatefulEvent(Product product,
+                                            const char* event_rlz) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->AddStatefulEvent(product, event_rlz);
+}
+
+bool RlzValueStoreSharded::IsStatefulEvent(Product product,
+                                           const char* event_rlz) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->IsStatefulEvent(product, event_rlz);
+}
+
+bool RlzValueStoreSharded::ClearAllStatefulEvents(Product product) {
+  RlzValueStoreLinux* store = ProductShard(product);
+  return store && store->ClearAllStatefulEvents(product);
+}
+
+
+void RlzValueStoreSharded::CollectGarbage() {
+  for (int i = 0; i < kShardCount; ++i) {
+    if (shards_[i].store)
+      shards_[i].store->CollectGarbage();
+  }
+}
+
+bool RlzValueStoreSharded::Persist() {
+  bool result = true;
+  for (int i = 0; i < kShardCount; ++i) {
+    if (shards_[i].store)
+      result &= shards_[i].store->Persist();
+  }
+  return result;
+}
+
+bool RlzValueStoreSharded::OpenShard(const FilePath& directory, int index,
+                                     const char* name, AccessType access) {
+  Shard& shard = shards_[index];
+  DCHECK_EQ(-1, shard.lock_fd);
+
+  FilePath lock_path = directory.Append(std::string("lockfile.") + name);
+  shard.lock_fd = HANDLE_EINTR(open(lock_path.value().c_str(),
+                                    O_RDWR | O_CREAT, 0666));
+  if (shard.lock_fd == -1) {
+    PLOG(ERROR) << "open " << lock_path.value();
+    return false;
+  }
+  int operation = access == kReadAccess ? LOCK_SH : LOCK_EX;
+  if (!LockShardFile(shard.lock_fd, operation)) {
+    PLOG(ERROR) << "flock " << lock_path.value();
+    ignore_result(HANDLE_EINTR(close(shard.lock_fd)));
+    shard.lock_fd = -1;
+    return false;
+  }
+
+  shard.store = RlzValueStoreLinux::OpenFile(
+      directory.Append(std::string("RlzStore.") + name + ".json"));
+  return shard.store != NULL;
+}
+
+RlzValueStoreLinux* RlzValueStoreSharded::ProductShard(Product product) {
+  if (product <= 0 || product >= kShardCount || !shards_[product].store) {
+    ASSERT_STRING("RlzValueStoreSharded: product shard isn't locked");
+    return NULL;
+  }
+  return shards_[product].store;
+}
+
+RlzValueStoreLinux* RlzValueStoreSharded::AccessPointShard() {
+  if (!shards_[0].store) {
+    ASSERT_STRING("RlzValueStoreSharded: access point shard isn't locked");
+    return NULL;
+  }
+  return shards_[0].store;
+}
+
+
+ShardedStoreFactory::ShardedStoreFactory(const FilePath& directory)
+  : directory_(directory) {
+}
+
+ShardedStoreFactory::~ShardedStoreFactory() {
+}
+
+RlzValueStore* ShardedStoreFactory::AcquireStore(
+    const StoreShards& shards, RlzValueStore::AccessType access) {
+  FilePath directory = directory_;
+  if (directory.empty())
+    directory = GetRlzStoreDirectory();
+  else
+    file_util::CreateDirectory(directory);
+
+  // Shards are always locked in index order, so that processes locking
+  // overlapping sets of shards can't deadlock.
+  scoped_ptr<RlzValueStoreSharded> store(new RlzValueStoreSharded);
+  if (shards.HasAccessPoints() &&
+      !store->OpenShard(directory, 0, kAccessPointShardName, access)) {
+    return NULL;
+  }
+  for (int i = 1; i < RlzValueStoreSharded::kShardCount; ++i) {
+    Product product = static_cast<Product>(i);
+    if (shards.HasProduct(product) &&
+        !store->OpenShard(directory, i, GetProductName(product), access)) {
+      return NULL;
+    }
+  }
+  return store.release();
+}
+
+void ShardedStoreFactory::ReleaseStore(RlzValueStore* store,
+                                       RlzValueStore::AccessType access,
+                                       bool modified) {
+  scoped_ptr<RlzValueStoreSharded> sharded_store(
+      static_cast<RlzValueStoreSharded*>(store));
+  if (modified) {
+    VERIFY(sharded_store->Persist());
+    // Notify while the shards are still locked.
+    NotifyStoreChanged(directory_.empty() ? GetRlzStoreDirectory() :
+                                            directory_);
+  }
+}
+
+RlzValueStoreFactory::ReaderLocking ShardedStoreFactory::GetReaderLocking() {
+  // Every store has its own lock files, and nothing else is shared. Readers
+  // still lock their shards, so that a read of several shards is consistent.
+  return kSharedReaders;
+}
+
+}  // namespace rlz_lib
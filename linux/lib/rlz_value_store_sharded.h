@@ -0,0 +1,111 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHARDED_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHARDED_H_
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+class RlzValueStoreLinux;
+
+// An implementation of RlzValueStore for linux that keeps every store shard
+// in its own JSON file with its own lock file: RlzStore.accessPoints.json for
+// the access point RLZs, and RlzStore.<product name>.json for each product.
+// Only the shards a ScopedRlzValueStoreLock asks for are locked and loaded,
+// so processes working on different products don't wait for each other, and
+// readers of a shard only wait for its writers. Accessing a shard that isn't
+// locked fails.
+class RlzValueStoreSharded : public RlzValueStore {
+ public:
+  virtual ~RlzValueStoreSharded();
+
+  virtual bool HasAccess(AccessType type) OVERRIDE;
+
+  virtual bool WritePingTime(Product product, int64 time) OVERRIDE;
+  virtual bool ReadPingTime(Product product, int64* time) OVERRIDE;
+  virtual bool ClearPingTime(Product product) OVERRIDE;
+
+  virtual bool WriteAccessPointRlz(AccessPoint access_point,
+                                   const char* new_rlz) OVERRIDE;
+  virtual bool ReadAccessPointRlz(AccessPoint access_point,
+                                  char* rlz,
+                                  size_t rlz_size) OVERRIDE;
+  virtual bool ClearAccessPointRlz(AccessPoint access_point) OVERRIDE;
+
+  virtual bool AddProductEvent(Product product, const char* event_rlz) OVERRIDE;
+  virtual bool ReadProductEvents(Product product,
+                                 std::vector<std::string>* events) OVERRIDE;
+  virtual bool ClearProductEvent(Product product,
+                                 const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllProductEvents(Product product) OVERRIDE;
+
+  virtual bool AddStatefulEvent(Product product,
+                                const char* event_rlz) OVERRIDE;
+  virtual bool IsStatefulEvent(Product product,
+                               const char* event_rlz) OVERRIDE;
+  virtual bool ClearAllStatefulEvents(Product product) OVERRIDE;
+
+  virtual void CollectGarbage() OVERRIDE;
+
+  // Writes all locked shards back to disk.
+  bool Persist();
+
+ private:
+  // Index 0 is the access point shard, index p the shard of product p.
+  static const int kShardCount = PARTNER + 1;
+
+  struct Shard {
+    Shard() : lock_fd(-1), store(NULL) {}
+
+    int lock_fd;
+    RlzValueStoreLinux* store;
+  };
+
+  RlzValueStoreSharded();
+  friend class ShardedStoreFactory;
+
+  // Locks and loads shard |index|, which is named |name| on disk. Readers
+  // share the lock of a shard.
+  bool OpenShard(const FilePath& directory,
+                 int index,
+                 const char* name,
+                 AccessType access);
+
+  // Returns the store of the shard for |product| or for the access points,
+  // or NULL if that shard isn't locked.
+  RlzValueStoreLinux* ProductShard(Product product);
+  RlzValueStoreLinux* AccessPointShard();
+
+  Shard shards_[kShardCount];
+
+  DISALLOW_COPY_AND_ASSIGN(RlzValueStoreSharded);
+};
+
+// Hands out RlzValueStoreSharded objects for the shards in |directory|. An
+// empty |directory| means the default location, ~/.rlz.
+class ShardedStoreFactory : public RlzValueStoreFactory {
+ public:
+  explicit ShardedStoreFactory(const FilePath& directory);
+  virtual ~ShardedStoreFactory();
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE;
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE;
+  virtual ReaderLocking GetReaderLocking() OVERRIDE;
+
+ private:
+  FilePath directory_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedStoreFactory);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHARDED_H_
@@ -0,0 +1,122 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the sharded store. They use the factory directly,
+// independent of the store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_sharded.h"
+
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzValueStoreShardedTest : public RlzLibTestNoMachineState {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    RlzLibTestNoMachineState::SetUp();
+    factory_.reset(new rlz_lib::ShardedStoreFactory(temp_dir_.path()));
+  }
+
+  bool ShardExists(const char* name) {
+    return file_util::PathExists(
+        temp_dir_.path().Append(std::string("RlzStore.") + name + ".json"));
+  }
+
+  scoped_ptr<rlz_lib::ShardedStoreFactory> factory_;
+};
+
+TEST_F(RlzValueStoreShardedTest, OnlyLocksRequestedShards) {
+  rlz_lib::RlzValueStore* store = factory_->AcquireStore(
+      rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME),
+      rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store->AddProductEvent(rlz_lib::CHROME, "W1I"));
+
+  // Shards that aren't locked can't be used.
+  rlz_lib::SetExpectedAssertion(
+      "RlzValueStoreSharded: product shard isn't locked");
+  EXPECT_FALSE(store->WritePingTime(rlz_lib::DESKTOP, 1234567890123LL));
+  rlz_lib::SetExpectedAssertion(
+      "RlzValueStoreSharded: access point shard isn't locked");
+  EXPECT_FALSE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                          "TbRlzValue"));
+  rlz_lib::SetExpectedAssertion("");
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+
+  EXPECT_TRUE(ShardExists("C"));
+  EXPECT_FALSE(ShardExists("D"));
+  EXPECT_FALSE(ShardExists("accessPoints"));
+}
+
+TEST_F(RlzValueStoreShardedTest, ShardsArePersistedSeparately) {
+  rlz_lib::RlzValueStore* store = factory_->AcquireStore(
+      rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME) |
+      rlz_lib::StoreShards::AccessPoints(),
+      rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+
+  store = factory_->AcquireStore(rlz_lib::StoreShards::AccessPoints(),
+                                 rlz_lib::RlzValueStore::kReadAccess);
+  ASSERT_TRUE(store);
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kReadAccess, false);
+
+  store = factory_->AcquireStore(
+      rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME),
+      rlz_lib::RlzValueStore::kReadAccess);
+  ASSERT_TRUE(store);
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(1234567890123LL, time);
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kReadAccess, false);
+}
+
+TEST_F(RlzValueStoreShardedTest, ReadersShareShards) {
+  EXPECT_EQ(rlz_lib::RlzValueStoreFactory::kSharedReaders,
+            factory_->GetReaderLocking());
+
+  // A second reader of the same shard doesn't wait for the first one.
+  rlz_lib::StoreShards chrome =
+      rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME);
+  rlz_lib::RlzValueStore* store =
+      factory_->AcquireStore(chrome, rlz_lib::RlzValueStore::kReadAccess);
+  ASSERT_TRUE(store);
+  rlz_lib::RlzValueStore* other_store =
+      factory_->AcquireStore(chrome, rlz_lib::RlzValueStore::kReadAccess);
+  ASSERT_TRUE(other_store);
+  int64 time = 0;
+  EXPECT_FALSE(other_store->ReadPingTime(rlz_lib::CHROME, &time));
+  factory_->ReleaseStore(other_store, rlz_lib::RlzValueStore::kReadAccess,
+                         false);
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kReadAccess, false);
+
+  store = factory_->AcquireStore(chrome, rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  factory_->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, false);
+}
+
+TEST_F(RlzValueStoreShardedTest, StoreShards) {
+  rlz_lib::StoreShards chrome =
+      rlz_lib::StoreShards::ForProduct(rlz_lib::CHROME);
+  rlz_lib::StoreShards both = chrome | rlz_lib::StoreShards::AccessPoints();
+
+  EXPECT_TRUE(chrome.HasProduct(rlz_lib::CHROME));
+  EXPECT_FALSE(chrome.HasProduct(rlz_lib::DESKTOP));
+  EXPECT_FALSE(chrome.HasAccessPoints());
+  EXPECT_TRUE(both.Contains(chrome));
+  EXPECT_FALSE(chrome.Contains(both));
+  EXPECT_TRUE(rlz_lib::StoreShards::All().Contains(both));
+}
@@ -0,0 +1,343 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/rlz_value_store_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "base/logging.h"
+#include "base/stringprintf.h"
+#include "base/time.h"
+#include "rlz/lib/assert.h"
+#include "rlz/lib/crc32.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+#include "rlz/linux/lib/rlz_value_store_mmap.h"
+#include "rlz/linux/lib/slot_file.h"
+#include "rlz/linux/lib/store_watcher_linux.h"
+
+namespace rlz_lib {
+
+const uint32 kShmSegmentMagic = 0x4d485352;  // "RSHM"
+const uint32 kShmSegmentVersion = 2;
+
+// How many factories can be attached to a segment at the same time.
+const int kMaxShmAttachments = 128;
+
+// The layout of the shared memory segment. Only processes of the same build
+// share a segment, so unlike SlotFile this isn't an on-disk format.
+struct ShmSegment {
+  // Set last by the process that creates the segment.
+  uint32 magic;
+  uint32 version;
+
+  // Robust and process-shared. Guards |last_flush_time| and |data|.
+  pthread_mutex_t mutex;
+
+  // The pids of the processes that attached, once per attached factory, or
+  // 0. Guarded by the flock on the attach lock file. Entries of processes
+  // that exit or crash without detaching are dropped when other processes
+  // attach or detach, see PruneAttachments().
+  pid_t attachments[kMaxShmAttachments];
+
+  // When the segment was last written to disk, in base::Time internal units.
+  int64 last_flush_time;
+
+  SlotFile data;
+};
+
+namespace {
+
+const char kSlotFileName[] = "RlzStore.slots";
+
+// Locks the robust mutex of |segment|, giving up at GetStoreLockDeadline().
+// Takes over the mutex if its owner died while holding it.
+bool LockSegment(ShmSegment* segment) {
+  base::TimeTicks deadline = GetStoreLockDeadline();
+  struct timeval realtime =
+      (base::Time::Now() + (deadline - base::TimeTicks::Now())).ToTimeVal();
+  struct timespec realtime_deadline = {
+    realtime.tv_sec,
+    realtime.tv_usec * base::Time::kNanosecondsPerMicrosecond
+  };
+
+  int result = pthread_mutex_timedlock(&segment->mutex, &realtime_deadline);
+  if (result == EOWNERDEAD) {
+    // Slot writes are small, so the data is usable even if the owner died in
+    // the middle of one.
+    LOG(WARNING) << "Recovering RLZ shared memory lock from a dead process";
+    result = pthread_mutex_consistent(&segment->mutex);
+  }
+  if (result == ETIMEDOUT)
+    ScopedLockTimeout::SetLockBusy();
+  if (result != 0) {
+    LOG(ERROR) << "Failed to lock RLZ shared memory: " << result;
+    return false;
+  }
+  return true;
+}
+
+void UnlockSegment(ShmSegment* segment) {
+  pthread_mutex_unlock(&segment->mutex);
+}
+
+// Drops the attachments of processes that no longer exist, and returns the
+// number of the others.
+int PruneAttachments(ShmSegment* segment) {
+  int count = 0;
+  for (int i = 0; i < kMaxShmAttachments; ++i) {
+    pid_t pid = segment->attachments[i];
+    if (!pid)
+      continue;
+    if (kill(pid, 0) == -1 && errno == ESRCH)
+      segment->attachments[i] = 0;
+    else
+      ++count;
+  }
+  return count;
+}
+
+// Records an attachment of |pid|. Returns false if the table is full.
+bool AddAttachment(ShmSegment* segment, pid_t pid) {
+  for (int i = 0; i < kMaxShmAttachments; ++i) {
+    if (!segment->attachments[i]) {
+      segment->attachments[i] = pid;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Removes one attachment of |pid|.
+void RemoveAttachment(ShmSegment* segment, pid_t pid) {
+  for (int i = 0; i < kMaxShmAttachments; ++i) {
+    if (segment->attachments[i] == pid) {
+      segment->attachments[i] = 0;
+      return;
+    }
+  }
+}
+
+// The factory that DetachAtExit() was called for.
+ShmStoreFactory* g_detach_at_exit = NULL;
+
+void DetachFactoryAtExit() {
+  g_detach_at_exit->Detach(false);
+}
+
+}  // namespace
+
+ShmStoreFactory::ShmStoreFactory(const FilePath& directory,
+                                 base::TimeDelta flush_interval)
+  : directory_(directory),
+    flush_interval_(flush_interval),
+    segment_(NULL),
+    detached_(false) {
+}
+
+ShmStoreFactory::~ShmStoreFactory() {
+  Detach(true);
+}
+
+void ShmStoreFactory::DetachAtExit() {
+  CHECK(!g_detach_at_exit);
+  g_detach_at_exit = this;
+  atexit(&DetachFactoryAtExit);
+}
+
+RlzValueStore* ShmStoreFactory::AcquireStore(
+    const StoreShards& shards, RlzValueStore::AccessType access) {
+  if (!segment_ && !Attach())
+    return NULL;
+  if (!LockSegment(segment_))
+    return NULL;
+  return new RlzValueStoreMmap(&segment_->data, true);
+}
+
+void ShmStoreFactory::ReleaseStore(RlzValueStore* store,
+                                   RlzValueStore::AccessType access,
+                                   bool modified) {
+  delete store;
+
+  base::Time now = base::Time::Now();
+  base::Time last_flush =
+      base::Time::FromInternalValue(segment_->last_flush_time);
+  if (now - last_flush >= flush_interval_ || now < last_flush)
+    VERIFY(Flush());
+
+  // Changes are visible in the segment right away, flushed or not.
+  if (modified)
+    NotifyStoreChanged(directory_);
+
+  UnlockSegment(segment_);
+}
+
+bool ShmStoreFactory::Attach() {
+  if (directory_.empty())
+    directory_ = GetRlzStoreDirectory();
+  else
+    file_util::CreateDirectory(directory_);
+
+  // Segment names are global, so they include the user and the directory.
+  const std::string& path = directory_.value();
+  name_ = base::StringPrintf(
+      "/rlz-%d-%08x", static_cast<int>(getuid()),
+      static_cast<uint32>(Crc32(
+          reinterpret_cast<const unsigned char*>(path.data()),
+          static_cast<int>(path.size()))));
+
+  int attach_lock = LockAttachFile();
+  if (attach_lock == -1)
+    return false;
+
+  int fd = HANDLE_EINTR(shm_open(name_.c_str(), O_RDWR | O_CREAT, 0600));
+  if (fd == -1) {
+    PLOG(ERROR) << "shm_open " << name_;
+    UnlockAttachFile(attach_lock);
+    return false;
+  }
+
+  // The segment is created with size 0, so that is how the first process
+  // recognizes that it has to initialize it.
+  struct stat info;
+  bool created = fstat(fd, &info) == 0 && info.st_size == 0;
+  if (created && HANDLE_EINTR(ftruncate(fd, sizeof(ShmSegment))) != 0) {
+    PLOG(ERROR) << "ftruncate " << name_;
+    ignore_result(HANDLE_EINTR(close(fd)));
+    UnlockAttachFile(attach_lock);
+    return false;
+  }
+
+  void* memory = mmap(NULL, sizeof(ShmSegment), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (memory == MAP_FAILED) {
+    PLOG(ERROR) << "mmap " << name_;
+    UnlockAttachFile(attach_lock);
+    return false;
+  }
+  ShmSegment* segment = static_cast<ShmSegment*>(memory);
+
+  // Without a magic, the creator died before it finished initializing.
+  if (segment->magic == 0)
+    created = true;
+
+  if (created) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&segment->mutex, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    // Start from the persisted data, if there is any.
+    std::string data;
+    if (file_util::ReadFileToString(directory_.Append(kSlotFileName), &data) &&
+        data.size() == sizeof(SlotFile) &&
+        IsValidSlotFile(*reinterpret_cast<const SlotFile*>(data.data()))) {
+      memcpy(&segment->data, data.data(), sizeof(SlotFile));
+    } else {
+      ResetSlotFile(&segment->data);
+    }
+    memset(segment->attachments, 0, sizeof(segment->attachments));
+    segment->last_flush_time = base::Time::Now().ToInternalValue();
+    segment->version = kShmSegmentVersion;
+    segment->magic = kShmSegmentMagic;
+  } else if (segment->magic != kShmSegmentMagic ||
+             segment->version != kShmSegmentVersion) {
+    LOG(ERROR) << "Incompatible RLZ shared memory segment " << name_;
+    munmap(memory, sizeof(ShmSegment));
+    UnlockAttachFile(attach_lock);
+    return false;
+  }
+
+  PruneAttachments(segment);
+  if (!AddAttachment(segment, getpid())) {
+    LOG(ERROR) << "Too many processes attached to " << name_;
+    munmap(memory, sizeof(ShmSegment));
+    UnlockAttachFile(attach_lock);
+    return false;
+  }
+  segment_ = segment;
+  UnlockAttachFile(attach_lock);
+  return true;
+}
+
+void ShmStoreFactory::Detach(bool unmap) {
+  if (!segment_)
+    return;
+
+  if (!detached_) {
+    int attach_lock = LockAttachFile();
+    RemoveAttachment(segment_, getpid());
+    if (PruneAttachments(segment_) == 0) {
+      // The last process persists the segment and removes it.
+      if (LockSegment(segment_)) {
+        VERIFY(Flush());
+        UnlockSegment(segment_);
+      }
+      shm_unlink(name_.c_str());
+    }
+    if (attach_lock != -1)
+      UnlockAttachFile(attach_lock);
+    detached_ = true;
+  }
+
+  if (unmap) {
+    munmap(segment_, sizeof(ShmSegment));
+    segment_ = NULL;
+    detached_ = false;
+  }
+}
+
+bool ShmStoreFactory::Flush() {
+  FilePath path = directory_.Append(kSlotFileName);
+  FilePath temp_path;
+  if (!file_util::CreateTemporaryFileInDir(directory_, &temp_path))
+    return false;
+
+  const int size = sizeof(SlotFile);
+  if (file_util::WriteFile(temp_path, reinterpret_cast<const char*>(
+          &segment_->data), size) != size ||
+      !file_util::ReplaceFile(temp_path, path)) {
+    file_util::Delete(temp_path, false);
+    return false;
+  }
+  segment_->last_flush_time = base::Time::Now().ToInternalValue();
+  return true;
+}
+
+int ShmStoreFactory::LockAttachFile() {
+  const char kAttachLockFile[] = "shmlock";
+  FilePath path = directory_.Append(kAttachLockFile);
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDWR | O_CREAT, 0666));
+  if (fd == -1) {
+    PLOG(ERROR) << "open " << path.value();
+    return -1;
+  }
+  if (HANDLE_EINTR(flock(fd, LOCK_EX)) != 0) {
+    PLOG(ERROR) << "flock " << path.value();
+    ignore_result(HANDLE_EINTR(close(fd)));
+    return -1;
+  }
+  return fd;
+}
+
+void ShmStoreFactory::UnlockAttachFile(int fd) {
+  flock(fd, LOCK_UN);
+  ignore_result(HANDLE_EINTR(close(fd)));
+}
+
+}  // namespace rlz_lib
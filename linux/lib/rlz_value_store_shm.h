@@ -0,0 +1,86 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#ifndef RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHM_H_
+#define RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHM_H_
+
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_path.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_value_store.h"
+
+namespace rlz_lib {
+
+struct ShmSegment;
+
+// How often ShmStoreFactory persists the segment by default.
+const int kDefaultShmFlushSeconds = 30;
+
+// A factory for a store that lives in a POSIX shared memory segment, shared
+// by all processes of the user that use the same |directory|. The segment
+// holds the slot layout of RlzValueStoreMmap, so store access costs memory
+// operations only. It is guarded by a robust process-shared mutex in the
+// segment itself, which a crashed owner can't leave locked.
+//
+// The first process to attach loads the segment from RlzStore.slots in
+// |directory|. Releasing the store writes the segment back to that file if
+// |flush_interval| has passed since the last write, and the last process to
+// detach writes it back and removes the segment. Factories detach when they
+// are destroyed, or at exit after DetachAtExit(). Processes that crash are
+// no longer counted once another process attaches or detaches, so the last
+// one to detach still persists the segment.
+class ShmStoreFactory : public RlzValueStoreFactory {
+ public:
+  // An empty |directory| means the default location, ~/.rlz.
+  ShmStoreFactory(const FilePath& directory, base::TimeDelta flush_interval);
+  virtual ~ShmStoreFactory();
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE;
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE;
+
+  // Detaches the factory when the process exits, for a factory that is never
+  // destroyed, like the default one. At most one factory per process can be
+  // detached this way.
+  void DetachAtExit();
+
+  // Removes this factory's attachment, persisting and removing the segment
+  // if it is the last one. The segment stays mapped unless |unmap| is true,
+  // since stores in other threads may still use it at exit.
+  void Detach(bool unmap);
+
+ private:
+  // Maps the segment, creating and loading it if this is the first process
+  // to attach.
+  bool Attach();
+
+  // Writes the segment to RlzStore.slots. Must be called with the segment's
+  // mutex held.
+  bool Flush();
+
+  // Serializes attaching and detaching across processes, with an flock on a
+  // file next to the store. Returns the descriptor or -1.
+  int LockAttachFile();
+  void UnlockAttachFile(int fd);
+
+  FilePath directory_;
+  base::TimeDelta flush_interval_;
+
+  // The name of the segment, derived from |directory_|.
+  std::string name_;
+  ShmSegment* segment_;
+
+  // Set when Detach() left the segment mapped.
+  bool detached_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmStoreFactory);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_RLZ_VALUE_STORE_SHM_H_
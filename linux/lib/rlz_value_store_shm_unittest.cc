@@ -0,0 +1,145 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for the shared memory store. They use the factory directly,
+// independent of the store the library is built with.
+
+#include "rlz/linux/lib/rlz_value_store_shm.h"
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzValueStoreShmTest : public RlzLibTestNoMachineState {
+ protected:
+  rlz_lib::ShmStoreFactory* CreateFactory(base::TimeDelta flush_interval) {
+    return new rlz_lib::ShmStoreFactory(temp_dir_.path(), flush_interval);
+  }
+
+  FilePath SlotFilePath() {
+    return temp_dir_.path().Append("RlzStore.slots");
+  }
+
+  // Writes a ping time for CHROME through |factory|. Returns false on
+  // failure. Doesn't use gtest assertions, so children can call it.
+  bool WritePingTime(rlz_lib::ShmStoreFactory* factory, int64 time) {
+    rlz_lib::RlzValueStore* store = factory->AcquireStore(
+        rlz_lib::StoreShards::All(), rlz_lib::RlzValueStore::kWriteAccess);
+    if (!store)
+      return false;
+    bool written = store->WritePingTime(rlz_lib::CHROME, time);
+    factory->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+    return written;
+  }
+
+  // Waits for the child |pid| and returns whether it exited with 0.
+  bool WaitForChild(pid_t pid) {
+    int status = 0;
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+           WEXITSTATUS(status) == 0;
+  }
+};
+
+TEST_F(RlzValueStoreShmTest, SharedBetweenFactories) {
+  const base::TimeDelta kNever = base::TimeDelta::FromDays(1);
+  scoped_ptr<rlz_lib::ShmStoreFactory> factory(CreateFactory(kNever));
+  scoped_ptr<rlz_lib::ShmStoreFactory> other_factory(CreateFactory(kNever));
+
+  rlz_lib::RlzValueStore* store = factory->AcquireStore(
+      rlz_lib::StoreShards::All(), rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->HasAccess(rlz_lib::RlzValueStore::kWriteAccess));
+  EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                         "TbRlzValue"));
+  factory->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+
+  // The data is visible through the segment, but not yet flushed.
+  store = other_factory->AcquireStore(rlz_lib::StoreShards::All(),
+                                      rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  other_factory->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess,
+                              true);
+  EXPECT_FALSE(file_util::PathExists(SlotFilePath()));
+
+  // The last detach persists the segment.
+  factory.reset();
+  EXPECT_FALSE(file_util::PathExists(SlotFilePath()));
+  other_factory.reset();
+  EXPECT_TRUE(file_util::PathExists(SlotFilePath()));
+
+  // A new segment starts from the persisted data.
+  factory.reset(CreateFactory(kNever));
+  store = factory->AcquireStore(rlz_lib::StoreShards::All(),
+                                rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+  factory->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+}
+
+TEST_F(RlzValueStoreShmTest, FlushesOnInterval) {
+  scoped_ptr<rlz_lib::ShmStoreFactory> factory(
+      CreateFactory(base::TimeDelta()));
+
+  rlz_lib::RlzValueStore* store = factory->AcquireStore(
+      rlz_lib::StoreShards::All(), rlz_lib::RlzValueStore::kWriteAccess);
+  ASSERT_TRUE(store);
+  EXPECT_TRUE(store->WritePingTime(rlz_lib::CHROME, 1234567890123LL));
+  factory->ReleaseStore(store, rlz_lib::RlzValueStore::kWriteAccess, true);
+
+  EXPECT_TRUE(file_util::PathExists(SlotFilePath()));
+}
+
+TEST_F(RlzValueStoreShmTest, IgnoresCrashedProcesses) {
+  const base::TimeDelta kNever = base::TimeDelta::FromDays(1);
+  scoped_ptr<rlz_lib::ShmStoreFactory> factory(CreateFactory(kNever));
+  ASSERT_TRUE(WritePingTime(factory.get(), 1));
+
+  // The child attaches and dies without detaching.
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    rlz_lib::ShmStoreFactory* child_factory = CreateFactory(kNever);
+    _exit(WritePingTime(child_factory, 2) ? 0 : 1);
+  }
+  ASSERT_TRUE(WaitForChild(pid));
+
+  // This is the last live process, so its detach persists the segment.
+  factory.reset();
+  EXPECT_TRUE(file_util::PathExists(SlotFilePath()));
+}
+
+TEST_F(RlzValueStoreShmTest, DetachesAtExit) {
+  const base::TimeDelta kNever = base::TimeDelta::FromDays(1);
+  pid_t pid = fork();
+  ASSERT_NE(-1, pid);
+  if (pid == 0) {
+    // Never destroyed, like the default factory.
+    rlz_lib::ShmStoreFactory* child_factory = CreateFactory(kNever);
+    child_factory->DetachAtExit();
+    exit(WritePingTime(child_factory, 3) ? 0 : 1);
+  }
+  ASSERT_TRUE(WaitForChild(pid));
+  EXPECT_TRUE(file_util::PathExists(SlotFilePath()));
+
+  scoped_ptr<rlz_lib::ShmStoreFactory> factory(CreateFactory(kNever));
+  rlz_lib::RlzValueStore* store = factory->AcquireStore(
+      rlz_lib::StoreShards::All(), rlz_lib::RlzValueStore::kReadAccess);
+  ASSERT_TRUE(store);
+  int64 time = 0;
+  EXPECT_TRUE(store->ReadPingTime(rlz_lib::CHROME, &time));
+  EXPECT_EQ(3, time);
+  factory->ReleaseStore(store, rlz_lib::RlzValueStore::kReadAccess, false);
+}
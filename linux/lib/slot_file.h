@@ -0,0 +1,80 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// The fixed size slot layout shared by RlzValueStoreMmap and the shared
+// memory segment of ShmStoreFactory.
+
+#ifndef RLZ_LINUX_LIB_SLOT_FILE_H_
+#define RLZ_LINUX_LIB_SLOT_FILE_H_
+
+#include <string.h>
+
+#include "base/basictypes.h"
+#include "rlz/lib/rlz_lib.h"
+
+namespace rlz_lib {
+
+// The structures below are the on-disk format and should not be changed
+// without bumping kSlotFileVersion. Slots are indexed by enum value; the slot
+// counts leave room for enum values that get added later.
+const uint32 kSlotFileMagic = 0x534c5a52;  // "RZLS"
+const uint32 kSlotFileVersion = 1;
+
+const int kAccessPointSlots = 128;
+const int kProductSlots = 32;
+const int kEventSlots = 8;
+const int kBrandSlots = 16;
+const int kMaxBrandLength = 15;
+
+// One bit per (access point, event) pair.
+const int kEventBitmapWords = kAccessPointSlots * kEventSlots / 64;
+
+COMPILE_ASSERT(LAST_ACCESS_POINT <= kAccessPointSlots, too_many_access_points);
+COMPILE_ASSERT(LAST_EVENT <= kEventSlots, too_many_events);
+COMPILE_ASSERT(PARTNER < kProductSlots, too_many_products);
+
+struct ProductSlot {
+  int64 ping_time;
+  uint64 has_ping_time;
+  uint64 events[kEventBitmapWords];
+  uint64 stateful_events[kEventBitmapWords];
+};
+
+struct BrandSlot {
+  // The supplementary brand using this slot. The slot at index 0 holds the
+  // data used when no supplementary brand is set.
+  char brand[kMaxBrandLength + 1];
+  uint64 in_use;
+  char access_point_rlzs[kAccessPointSlots][kMaxRlzLength + 1];
+  ProductSlot products[kProductSlots];
+};
+
+struct SlotFile {
+  uint32 magic;
+  uint32 version;
+  uint32 size;
+  uint32 reserved;
+  BrandSlot brands[kBrandSlots];
+};
+
+COMPILE_ASSERT(sizeof(BrandSlot) % sizeof(uint64) == 0, brand_slot_padding);
+
+
+// Returns true if |file| holds a slot file of the current layout.
+inline bool IsValidSlotFile(const SlotFile& file) {
+  return file.magic == kSlotFileMagic && file.version == kSlotFileVersion &&
+      file.size == sizeof(SlotFile);
+}
+
+// Clears |file| to an empty slot file of the current layout.
+inline void ResetSlotFile(SlotFile* file) {
+  memset(file, 0, sizeof(*file));
+  file->version = kSlotFileVersion;
+  file->size = sizeof(SlotFile);
+  file->magic = kSlotFileMagic;
+}
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_SLOT_FILE_H_
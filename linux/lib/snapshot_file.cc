@@ -0,0 +1,110 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/snapshot_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/synchronization/lock.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The most recently mapped snapshot. Each process only reads one store, so
+// one entry is enough.
+struct SnapshotCache {
+  base::Lock lock;
+  FilePath path;
+  scoped_refptr<SnapshotFile> snapshot;
+};
+
+base::LazyInstance<SnapshotCache>::Leaky g_cache = LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+// static
+bool SnapshotFile::Get(const FilePath& path,
+                       scoped_refptr<SnapshotFile>* snapshot) {
+  *snapshot = NULL;
+
+  struct stat info;
+  if (stat(path.value().c_str(), &info) != 0) {
+    if (errno == ENOENT)
+      return true;
+    PLOG(ERROR) << "stat " << path.value();
+    return false;
+  }
+
+  SnapshotCache& cache = g_cache.Get();
+  {
+    base::AutoLock auto_lock(cache.lock);
+    if (cache.snapshot && cache.path == path &&
+        cache.snapshot->IsCurrent(info)) {
+      *snapshot = cache.snapshot;
+      return true;
+    }
+  }
+
+  // The file changed. Map the new one without holding the cache lock, so
+  // that readers of the old snapshot don't wait for the disk.
+  int fd = HANDLE_EINTR(open(path.value().c_str(), O_RDONLY));
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return true;
+    PLOG(ERROR) << "open " << path.value();
+    return false;
+  }
+
+  // A writer may have replaced the file since the stat() above, so describe
+  // the file that was actually opened.
+  void* data = NULL;
+  bool mapped = fstat(fd, &info) == 0;
+  if (mapped && info.st_size > 0) {
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    mapped = data != MAP_FAILED;
+  }
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (!mapped) {
+    PLOG(ERROR) << "mmap " << path.value();
+    return false;
+  }
+
+  *snapshot = new SnapshotFile(static_cast<const char*>(data), info);
+
+  base::AutoLock auto_lock(cache.lock);
+  cache.path = path;
+  cache.snapshot = *snapshot;
+  return true;
+}
+
+SnapshotFile::SnapshotFile(const char* data, const struct stat& info)
+    : data_(data),
+      size_(info.st_size),
+      device_(info.st_dev),
+      inode_(info.st_ino),
+      modified_(info.st_mtime) {
+}
+
+SnapshotFile::~SnapshotFile() {
+  if (data_)
+    munmap(const_cast<char*>(data_), size_);
+}
+
+bool SnapshotFile::IsCurrent(const struct stat& info) const {
+  // Size and modification time catch files that were changed in place by
+  // something other than rlz.
+  return info.st_dev == device_ && info.st_ino == inode_ &&
+      static_cast<size_t>(info.st_size) == size_ &&
+      info.st_mtime == modified_;
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,62 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Lock-free read access to store files that writers only ever replace
+// atomically.
+
+#ifndef RLZ_LINUX_LIB_SNAPSHOT_FILE_H_
+#define RLZ_LINUX_LIB_SNAPSHOT_FILE_H_
+
+#include <sys/stat.h>
+
+#include "base/basictypes.h"
+#include "base/memory/ref_counted.h"
+#include "base/string_piece.h"
+
+class FilePath;
+
+namespace rlz_lib {
+
+// A read-only mapping of a file that is never changed in place. Writers
+// write a new file and rename it over the old one, so a mapped file stays
+// unchanged even after it has been replaced, and readers can use it without
+// any lock: they see either the old or the new contents.
+class SnapshotFile : public base::RefCountedThreadSafe<SnapshotFile> {
+ public:
+  // Sets |snapshot| to the file |path| currently refers to, or to NULL if
+  // |path| doesn't exist. Returns false if the file can't be mapped. The
+  // mapping is cached per process and reused for as long as |path| still
+  // refers to the same file, so reading an unchanged file costs one stat().
+  static bool Get(const FilePath& path, scoped_refptr<SnapshotFile>* snapshot);
+
+  base::StringPiece data() const {
+    return base::StringPiece(data_, size_);
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<SnapshotFile>;
+
+  // Takes ownership of the mapping at |data|, of the file described by
+  // |info|.
+  SnapshotFile(const char* data, const struct stat& info);
+  ~SnapshotFile();
+
+  // Returns whether |info| still describes the mapped file.
+  bool IsCurrent(const struct stat& info) const;
+
+  const char* data_;
+  size_t size_;
+
+  // The identity of the mapped file. While it is mapped, its inode can't be
+  // reused for a new file.
+  dev_t device_;
+  ino_t inode_;
+  time_t modified_;
+
+  DISALLOW_COPY_AND_ASSIGN(SnapshotFile);
+};
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_SNAPSHOT_FILE_H_
@@ -0,0 +1,73 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for SnapshotFile.
+
+#include "rlz/linux/lib/snapshot_file.h"
+
+#include <string>
+
+#include "base/file_util.h"
+#include "base/scoped_temp_dir.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+// Replaces the file at |path| the way writers of snapshots do.
+bool WriteSnapshot(const FilePath& path, const std::string& data) {
+  FilePath temp_path;
+  if (!file_util::CreateTemporaryFileInDir(path.DirName(), &temp_path))
+    return false;
+  int size = static_cast<int>(data.size());
+  return file_util::WriteFile(temp_path, data.data(), size) == size &&
+      file_util::ReplaceFile(temp_path, path);
+}
+
+}  // namespace
+
+TEST(SnapshotFileTest, MissingFile) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+
+  scoped_refptr<rlz_lib::SnapshotFile> snapshot;
+  EXPECT_TRUE(rlz_lib::SnapshotFile::Get(temp_dir.path().Append("store"),
+                                         &snapshot));
+  EXPECT_FALSE(snapshot);
+}
+
+TEST(SnapshotFileTest, EmptyFile) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath path = temp_dir.path().Append("store");
+  ASSERT_TRUE(WriteSnapshot(path, ""));
+
+  scoped_refptr<rlz_lib::SnapshotFile> snapshot;
+  EXPECT_TRUE(rlz_lib::SnapshotFile::Get(path, &snapshot));
+  ASSERT_TRUE(snapshot);
+  EXPECT_TRUE(snapshot->data().empty());
+}
+
+TEST(SnapshotFileTest, ReusesUnchangedFile) {
+  ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  FilePath path = temp_dir.path().Append("store");
+  ASSERT_TRUE(WriteSnapshot(path, "old data"));
+
+  scoped_refptr<rlz_lib::SnapshotFile> old_snapshot;
+  EXPECT_TRUE(rlz_lib::SnapshotFile::Get(path, &old_snapshot));
+  ASSERT_TRUE(old_snapshot);
+  EXPECT_EQ("old data", old_snapshot->data().as_string());
+
+  scoped_refptr<rlz_lib::SnapshotFile> snapshot;
+  EXPECT_TRUE(rlz_lib::SnapshotFile::Get(path, &snapshot));
+  EXPECT_EQ(old_snapshot.get(), snapshot.get());
+
+  // A replaced file is mapped again, and the old snapshot stays readable.
+  ASSERT_TRUE(WriteSnapshot(path, "new data"));
+  EXPECT_TRUE(rlz_lib::SnapshotFile::Get(path, &snapshot));
+  ASSERT_TRUE(snapshot);
+  EXPECT_NE(old_snapshot.get(), snapshot.get());
+  EXPECT_EQ("new data", snapshot->data().as_string());
+  EXPECT_EQ("old data", old_snapshot->data().as_string());
+}
@@ -0,0 +1,128 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/store_watcher_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/logging.h"
+#include "base/time.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_linux.h"
+
+namespace rlz_lib {
+
+namespace {
+
+// The file that NotifyStoreChanged() closes for writers. It stays empty.
+const char kChangesFile[] = "changes";
+
+}  // namespace
+
+void NotifyStoreChanged(const FilePath& directory) {
+  FilePath path = directory.Append(kChangesFile);
+  int fd = HANDLE_EINTR(open(path.value().c_str(),
+                             O_WRONLY | O_CREAT | O_CLOEXEC, 0666));
+  if (fd == -1) {
+    PLOG(ERROR) << "open " << path.value();
+    return;
+  }
+  ignore_result(HANDLE_EINTR(close(fd)));
+}
+
+RlzStoreWatcher::RlzStoreWatcher() : fd_(-1) {
+}
+
+RlzStoreWatcher::~RlzStoreWatcher() {
+  if (fd_ != -1)
+    ignore_result(HANDLE_EINTR(close(fd_)));
+}
+
+bool RlzStoreWatcher::Init() {
+  DCHECK_EQ(-1, fd_);
+  fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd_ == -1) {
+    PLOG(ERROR) << "inotify_init1";
+    return false;
+  }
+
+  FilePath directory = GetRlzStoreDirectory();
+  if (inotify_add_watch(fd_, directory.value().c_str(),
+                        IN_CLOSE_WRITE | IN_ONLYDIR) == -1) {
+    PLOG(ERROR) << "inotify_add_watch " << directory.value();
+    ignore_result(HANDLE_EINTR(close(fd_)));
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+bool RlzStoreWatcher::ConsumeChanges() {
+  if (fd_ == -1)
+    return false;
+
+  // Large enough for an event with the longest name.
+  union {
+    struct inotify_event event;
+    char bytes[sizeof(struct inotify_event) + NAME_MAX + 1];
+  } buffer;
+
+  bool changed = false;
+  while (true) {
+    ssize_t size = HANDLE_EINTR(read(fd_, &buffer, sizeof(buffer)));
+    if (size <= 0) {
+      if (size < 0 && errno != EAGAIN)
+        PLOG(ERROR) << "read inotify";
+      break;
+    }
+
+    ssize_t offset = 0;
+    while (offset < size) {
+      const struct inotify_event* event =
+          reinterpret_cast<const struct inotify_event*>(buffer.bytes + offset);
+      // Lost events and a removed directory may hide changes.
+      if ((event->mask & (IN_Q_OVERFLOW | IN_IGNORED)) ||
+          (event->len > 0 && strcmp(event->name, kChangesFile) == 0)) {
+        changed = true;
+      }
+      offset += sizeof(*event) + event->len;
+    }
+  }
+  return changed;
+}
+
+bool RlzStoreWatcher::WaitForChange(int timeout_ms) {
+  if (fd_ == -1)
+    return false;
+
+  base::TimeTicks deadline =
+      base::TimeTicks::Now() + base::TimeDelta::FromMilliseconds(timeout_ms);
+  while (true) {
+    // Other files in the directory wake the watcher too.
+    int remaining_ms = std::max<int64>(
+        0, (deadline - base::TimeTicks::Now()).InMilliseconds());
+    struct pollfd poll_fd = { fd_, POLLIN, 0 };
+    int result = HANDLE_EINTR(poll(&poll_fd, 1, remaining_ms));
+    if (result < 0) {
+      PLOG(ERROR) << "poll inotify";
+      return false;
+    }
+    if (ConsumeChanges())
+      return true;
+    if (result == 0 || remaining_ms == 0)
+      return false;
+  }
+}
+
+}  // namespace rlz_lib
@@ -0,0 +1,24 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Change notifications for the stores on linux, see RlzStoreWatcher in
+// rlz_lib.h.
+
+#ifndef RLZ_LINUX_LIB_STORE_WATCHER_LINUX_H_
+#define RLZ_LINUX_LIB_STORE_WATCHER_LINUX_H_
+
+class FilePath;
+
+namespace rlz_lib {
+
+// Tells the RlzStoreWatchers of the store in |directory| that it changed.
+// Stores change their files in different ways, some of them in place through
+// a mapping, which inotify doesn't see. So every factory calls this after it
+// persisted a modified store, with the store's lock still held, and it closes
+// a file opened for writing in |directory|, which inotify reports.
+void NotifyStoreChanged(const FilePath& directory);
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_STORE_WATCHER_LINUX_H_
@@ -0,0 +1,71 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for RlzStoreWatcher. Changes are made through the public API, so
+// they go to the store the library is built with.
+
+#include "rlz/linux/lib/store_watcher_linux.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "base/eintr_wrapper.h"
+#include "base/file_util.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/test/rlz_test_helpers.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+class RlzStoreWatcherTest : public RlzLibTestNoMachineState {
+};
+
+TEST_F(RlzStoreWatcherTest, ReportsChanges) {
+  rlz_lib::RlzStoreWatcher watcher;
+  ASSERT_TRUE(watcher.Init());
+  EXPECT_NE(-1, watcher.fd());
+  EXPECT_FALSE(watcher.ConsumeChanges());
+
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "RlzValue"));
+  EXPECT_TRUE(watcher.WaitForChange(1000));
+  EXPECT_FALSE(watcher.ConsumeChanges());
+
+  EXPECT_TRUE(rlz_lib::RecordProductEvent(rlz_lib::CHROME,
+                                          rlz_lib::CHROME_OMNIBOX,
+                                          rlz_lib::FIRST_SEARCH));
+  EXPECT_TRUE(watcher.ConsumeChanges());
+
+  // Reads and writes of unchanged values aren't changes.
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::CHROME_OMNIBOX, rlz,
+                                         arraysize(rlz)));
+  EXPECT_TRUE(rlz_lib::SetAccessPointRlz(rlz_lib::CHROME_OMNIBOX, "RlzValue"));
+  EXPECT_FALSE(watcher.WaitForChange(50));
+
+  // Neither are other files in the directory.
+  ASSERT_EQ(3, file_util::WriteFile(temp_dir_.path().Append("other"),
+                                    "abc", 3));
+  EXPECT_FALSE(watcher.ConsumeChanges());
+}
+
+TEST_F(RlzStoreWatcherTest, ReportsChangesOfOtherProcesses) {
+  rlz_lib::RlzStoreWatcher watcher;
+  ASSERT_TRUE(watcher.Init());
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    bool set = rlz_lib::SetAccessPointRlz(rlz_lib::CHROME_OMNIBOX,
+                                          "ChildValue");
+    _exit(set ? 0 : 1);
+  }
+  ASSERT_NE(-1, pid);
+
+  EXPECT_TRUE(watcher.WaitForChange(5000));
+  int status = 0;
+  ASSERT_EQ(pid, HANDLE_EINTR(waitpid(pid, &status, 0)));
+  EXPECT_EQ(0, status);
+
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(rlz_lib::GetAccessPointRlz(rlz_lib::CHROME_OMNIBOX, rlz,
+                                         arraysize(rlz)));
+  EXPECT_STREQ("ChildValue", rlz);
+}
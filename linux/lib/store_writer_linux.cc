@@ -0,0 +1,832 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+
+#include "rlz/linux/lib/store_writer_linux.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "base/atomicops.h"
+#include "base/eintr_wrapper.h"
+#include "base/file_path.h"
+#include "base/file_util.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "rlz/lib/rlz_lib.h"
+
+#if defined(RLZ_USE_IO_URING)
+#include <linux/version.h>
+// The headers of older kernels lack IORING_OP_RENAMEAT and
+// IORING_REGISTER_PROBE.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#include <linux/io_uring.h>
+#else
+#undef RLZ_USE_IO_URING
+#endif
+#endif
+
+namespace rlz_lib {
+
+namespace {
+
+// The operations of each write, linked in this order. See Submit().
+enum WriteOp {
+  kWriteOp,
+  kRenameOp,
+  kSyncFileOp,
+  kSyncDirectoryOp,
+  kWriteOps
+};
+
+// The result of operations whose completion wasn't reaped yet.
+const int kNotCompleted = INT_MIN;
+
+const unsigned kRingEntries = 64;
+
+// Writes whose syncs are outstanding at most, so that the completions of
+// all their operations always fit the completion queue, which holds twice
+// as many entries as the submission queue.
+const size_t kMaxWritesInFlight = kRingEntries / kWriteOps;
+
+#if defined(RLZ_USE_IO_URING)
+
+// A minimal io_uring, for the few operations of writing a file. Not
+// thread-safe, except that Wait() may be called while another thread uses
+// the ring.
+class IoRing {
+ public:
+  // Returns NULL if io_uring or one of the operations isn't available.
+  static IoRing* Create();
+
+  ~IoRing();
+
+  // Queues the operations of replacing |path| with |data| through
+  // |temp_path|, see StoreWriter::ReplaceWithRing(). Their completions carry
+  // |user_data| plus their WriteOp. |data| must be kept until the write
+  // completed, the strings until they were submitted.
+  void QueueReplace(uint64 user_data, int fd, const std::string& data,
+                    const std::string& temp_path, const FilePath& path,
+                    int directory_fd);
+
+  // Submits the queued entries. Returns how many of them the kernel
+  // consumed. If that's fewer, the others are dropped.
+  uint32 Submit();
+
+  // Waits until there are completions to pop.
+  bool Wait();
+
+  // Pops a completion. Returns false if there is none.
+  bool PopCompletion(uint64* user_data, int* result);
+
+  // The process that set up the ring. A forked child must not use it.
+  pid_t pid() const { return pid_; }
+
+ private:
+  IoRing();
+
+  // Maps the rings that |params| describe.
+  bool Map(const struct io_uring_params& params);
+
+  // Returns whether |opcode| is supported.
+  bool Supports(const struct io_uring_probe& probe, int opcode);
+
+  // Returns the next free submission queue entry, cleared. Must be submitted
+  // with Submit() before the queue is full.
+  struct io_uring_sqe* NextEntry();
+
+  int fd_;
+  pid_t pid_;
+
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  struct io_uring_sqe* entries_;
+  size_t entries_size_;
+
+  // Pointers into the rings. The kernel moves the submission head and the
+  // completion tail.
+  volatile base::subtle::Atomic32* sq_head_;
+  volatile base::subtle::Atomic32* sq_tail_;
+  uint32 sq_mask_;
+  uint32* sq_array_;
+  volatile base::subtle::Atomic32* cq_head_;
+  volatile base::subtle::Atomic32* cq_tail_;
+  uint32 cq_mask_;
+  struct io_uring_cqe* completions_;
+
+  // Entries returned by NextEntry() but not submitted yet.
+  uint32 unsubmitted_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoRing);
+};
+
+template <typename T>
+T* RingPointer(void* ring, uint32 offset) {
+  return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+// static
+IoRing* IoRing::Create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  scoped_ptr<IoRing> ring(new IoRing);
+  ring->fd_ = syscall(__NR_io_uring_setup, kRingEntries, &params);
+  if (ring->fd_ == -1) {
+    // Old kernels, and sandboxes that filter io_uring.
+    if (errno != ENOSYS && errno != EPERM)
+      PLOG(ERROR) << "io_uring_setup";
+    return NULL;
+  }
+
+  const int kProbeOps = 256;
+  std::vector<char> buffer(sizeof(struct io_uring_probe) +
+                           kProbeOps * sizeof(struct io_uring_probe_op));
+  struct io_uring_probe* probe =
+      reinterpret_cast<struct io_uring_probe*>(&buffer[0]);
+  if (syscall(__NR_io_uring_register, ring->fd_, IORING_REGISTER_PROBE,
+              probe, kProbeOps) != 0 ||
+      !ring->Supports(*probe, IORING_OP_WRITE) ||
+      !ring->Supports(*probe, IORING_OP_RENAMEAT) ||
+      !ring->Supports(*probe, IORING_OP_FSYNC)) {
+    return NULL;
+  }
+
+  if (!ring->Map(params))
+    return NULL;
+  return ring.release();
+}
+
+IoRing::IoRing()
+    : fd_(-1),
+      pid_(getpid()),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      entries_(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      entries_size_(0),
+      sq_head_(NULL),
+      sq_tail_(NULL),
+      sq_mask_(0),
+      sq_array_(NULL),
+      cq_head_(NULL),
+      cq_tail_(NULL),
+      cq_mask_(0),
+      completions_(NULL),
+      unsubmitted_(0) {
+}
+
+IoRing::~IoRing() {
+  if (entries_ != MAP_FAILED)
+    munmap(entries_, entries_size_);
+  if (cq_ring_ != MAP_FAILED)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+  if (fd_ != -1)
+    ignore_result(HANDLE_EINTR(close(fd_)));
+}
+
+bool IoRing::Map(const struct io_uring_params& params) {
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32);
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  cq_ring_size_ = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+  cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  entries_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  entries_ = static_cast<struct io_uring_sqe*>(
+      mmap(NULL, entries_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+  if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+      entries_ == MAP_FAILED) {
+    PLOG(ERROR) << "mmap io_uring";
+    return false;
+  }
+
+  sq_head_ = RingPointer<base::subtle::Atomic32>(sq_ring_, params.sq_off.head);
+  sq_tail_ = RingPointer<base::subtle::Atomic32>(sq_ring_, params.sq_off.tail);
+  sq_mask_ = *RingPointer<uint32>(sq_ring_, params.sq_off.ring_mask);
+  sq_array_ = RingPointer<uint32>(sq_ring_, params.sq_off.array);
+  cq_head_ = RingPointer<base::subtle::Atomic32>(cq_ring_, params.cq_off.head);
+  cq_tail_ = RingPointer<base::subtle::Atomic32>(cq_ring_, params.cq_off.tail);
+  cq_mask_ = *RingPointer<uint32>(cq_ring_, params.cq_off.ring_mask);
+  completions_ = RingPointer<struct io_uring_cqe>(cq_ring_,
+                                                  params.cq_off.cqes);
+  return true;
+}
+
+bool IoRing::Supports(const struct io_uring_probe& probe, int opcode) {
+  return opcode <= probe.last_op &&
+      (probe.ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+struct io_uring_sqe* IoRing::NextEntry() {
+  uint32 tail = *sq_tail_ + unsubmitted_;
+  uint32 head = base::subtle::Acquire_Load(sq_head_);
+  CHECK_LT(tail - head, sq_mask_ + 1);
+
+  uint32 index = tail & sq_mask_;
+  struct io_uring_sqe* entry = &entries_[index];
+  memset(entry, 0, sizeof(*entry));
+  sq_array_[index] = index;
+  ++unsubmitted_;
+  return entry;
+}
+
+void IoRing::QueueReplace(uint64 user_data, int fd, const std::string& data,
+                          const std::string& temp_path, const FilePath& path,
+                          int directory_fd) {
+  // Other processes read the store as soon as the lock is released, so the
+  // rename can't wait for the syncs. The file is synced after it was
+  // renamed instead, then the directory that holds the new name. An
+  // operation that fails normally cancels the ones after it.
+  struct io_uring_sqe* entry = NextEntry();
+  entry->opcode = IORING_OP_WRITE;
+  entry->flags = IOSQE_IO_LINK;
+  entry->fd = fd;
+  entry->addr = reinterpret_cast<uint64>(data.data());
+  entry->len = data.size();
+  entry->off = 0;
+  entry->user_data = user_data + kWriteOp;
+
+  entry = NextEntry();
+  entry->opcode = IORING_OP_RENAMEAT;
+  entry->flags = IOSQE_IO_LINK;
+  entry->fd = AT_FDCWD;
+  entry->addr = reinterpret_cast<uint64>(temp_path.c_str());
+  entry->len = AT_FDCWD;
+  entry->addr2 = reinterpret_cast<uint64>(path.value().c_str());
+  entry->user_data = user_data + kRenameOp;
+
+  entry = NextEntry();
+  entry->opcode = IORING_OP_FSYNC;
+  entry->flags = IOSQE_IO_LINK;
+  entry->fd = fd;
+  entry->fsync_flags = IORING_FSYNC_DATASYNC;
+  entry->user_data = user_data + kSyncFileOp;
+
+  entry = NextEntry();
+  entry->opcode = IORING_OP_FSYNC;
+  entry->fd = directory_fd;
+  entry->user_data = user_data + kSyncDirectoryOp;
+}
+
+uint32 IoRing::Submit() {
+  uint32 count = unsubmitted_;
+  unsubmitted_ = 0;
+  uint32 tail = *sq_tail_ + count;
+  base::subtle::Release_Store(sq_tail_, tail);
+
+  // Entries that the kernel can't start complete with an error, so this
+  // normally fails only if no entry was consumed. Once some were, the
+  // operations they link to are consumed too if possible.
+  uint32 left = count;
+  while (left > 0) {
+    int submitted = HANDLE_EINTR(syscall(__NR_io_uring_enter, fd_, left, 0,
+                                         0, NULL, 0));
+    if (submitted == -1) {
+      PLOG(ERROR) << "io_uring_enter";
+      // The kernel consumed the entries in order, so the others are dropped
+      // by moving the tail back to them.
+      base::subtle::Release_Store(sq_tail_, tail - left);
+      break;
+    }
+    left -= submitted;
+  }
+  return count - left;
+}
+
+bool IoRing::Wait() {
+  if (HANDLE_EINTR(syscall(__NR_io_uring_enter, fd_, 0, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0)) == -1) {
+    PLOG(ERROR) << "io_uring_enter";
+    return false;
+  }
+  return true;
+}
+
+bool IoRing::PopCompletion(uint64* user_data, int* result) {
+  uint32 head = *cq_head_;
+  if (head == static_cast<uint32>(base::subtle::Acquire_Load(cq_tail_)))
+    return false;
+
+  const struct io_uring_cqe& completion = completions_[head & cq_mask_];
+  *user_data = completion.user_data;
+  *result = completion.res;
+  base::subtle::Release_Store(cq_head_, head + 1);
+  return true;
+}
+
+#else  // defined(RLZ_USE_IO_URING)
+
+// Without io_uring, there is never a ring, and writes are synchronous.
+class IoRing {
+ public:
+  static IoRing* Create() { return NULL; }
+
+  void QueueReplace(uint64 user_data, int fd, const std::string& data,
+                    const std::string& temp_path, const FilePath& path,
+                    int directory_fd) {}
+  uint32 Submit() { return 0; }
+  bool Wait() { return false; }
+  bool PopCompletion(uint64* user_data, int* result) { return false; }
+  pid_t pid() const { return 0; }
+};
+
+#endif  // defined(RLZ_USE_IO_URING)
+
+// A write that was submitted to the ring, until all its operations
+// completed.
+struct PendingWrite {
+  PendingWrite() : fd(-1), directory_fd(-1), size(0), ops_left(kWriteOps),
+                   writer_waiting(true) {
+    std::fill(results, results + kWriteOps, kNotCompleted);
+  }
+
+  int fd;
+  int directory_fd;
+  std::string temp_path;
+  int size;
+  int results[kWriteOps];
+  int ops_left;
+
+  // Whether ReplaceStoreFile() still waits for the rename. It removes the
+  // write itself then.
+  bool writer_waiting;
+};
+
+// Creates a temporary file next to |path|, and sets |temp_path| to its
+// name. Returns its descriptor, or -1.
+int CreateTempFile(const FilePath& path, std::string* temp_path) {
+  *temp_path = path.DirName().Append(".RlzStore.XXXXXX").value();
+  int fd = mkostemp(&(*temp_path)[0], O_CLOEXEC);
+  if (fd == -1)
+    PLOG(ERROR) << "mkostemp " << *temp_path;
+  return fd;
+}
+
+// Opens the directory of |path|, for syncing it. Returns -1 on failure.
+int OpenDirectory(const FilePath& path) {
+  int fd = HANDLE_EINTR(open(path.DirName().value().c_str(),
+                             O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (fd == -1)
+    PLOG(ERROR) << "open " << path.DirName().value();
+  return fd;
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  int size = static_cast<int>(data.size());
+  return file_util::WriteFileDescriptor(fd, data.data(), size) == size;
+}
+
+// Replaces store files, and keeps track of the ones that were submitted to
+// the ring until they are synced. Thread-safe.
+class StoreWriter {
+ public:
+  StoreWriter()
+      : completed_(&lock_),
+        async_(false),
+        io_uring_disabled_(false),
+        ring_tried_(false),
+        ring_failed_(false),
+        reaping_(false),
+        last_token_(0) {
+  }
+
+  bool SetAsync(bool enabled);
+  void SetIoUringDisabled(bool disabled);
+
+  bool Replace(const FilePath& path, const std::string& data);
+
+  int64 LastToken();
+  bool WaitForSynced(int64 token, bool wait);
+
+ private:
+  // Writes |data| to |fd| and renames |temp_path| over |path|. Syncs the
+  // file and the directory first if |token| isn't 0.
+  bool ReplaceNow(const FilePath& path, const std::string& data, int fd,
+                  const std::string& temp_path, int64 token);
+
+  // Like ReplaceNow(), through the ring, and sets |replaced|. Takes |*fd|,
+  // and sets it to -1 if it was closed. Returns false if the ring failed
+  // before the write was synced, so that it must be written without the
+  // ring. Called with |lock_| held.
+  bool ReplaceWithRing(const FilePath& path, const std::string& data,
+                       int* fd, const std::string& temp_path, int64 token,
+                       bool* replaced);
+
+  // Returns the ring, or NULL if writes don't go through one. Called with
+  // |lock_| held.
+  IoRing* Ring();
+
+  // Whether there is a ring that this process set up. Called with |lock_|
+  // held.
+  bool OwnsRing();
+
+  // Waits until completions of the ring were reaped, by this thread or by
+  // another one. Called with |lock_| held.
+  void WaitForCompletions();
+
+  // Reaps all completions of the ring. Called with |lock_| held.
+  void ReapCompletions();
+
+  // Closes the files of |write|, whose operations all completed, and records
+  // whether it was synced. Called with |lock_| held.
+  void FinishWrite(int64 token, PendingWrite* write);
+
+  // Gives up on the writes in flight, after the ring couldn't be waited for.
+  // Their operations that didn't complete count as failed, and later writes
+  // don't use the ring. Called with |lock_| held.
+  void AbandonWrites();
+
+  // Records that the write of |token| is on disk, and so are the earlier
+  // writes of the same file. Called with |lock_| held.
+  void MarkSynced(int64 token);
+
+  // Whether writes up to |token| completed. Called with |lock_| held.
+  bool IsCompleted(int64 token);
+
+  // The number of writes whose operations didn't all complete. Called with
+  // |lock_| held.
+  size_t WritesInFlight();
+
+  base::Lock lock_;
+
+  // Signaled when a thread reaped completions.
+  base::ConditionVariable completed_;
+
+  bool async_;
+  bool io_uring_disabled_;
+
+  // Whether the ring was set up, and the ring if that worked. Kept once set
+  // up, because turning async persistence off and on again is rare. If a
+  // submission or a wait failed, the ring is only used to reap the writes
+  // submitted before.
+  bool ring_tried_;
+  bool ring_failed_;
+  scoped_ptr<IoRing> ring_;
+
+  // Whether a thread waits for completions in the kernel. The others wait
+  // for it on |completed_|.
+  bool reaping_;
+
+  // The token of the last write with async persistence.
+  int64 last_token_;
+
+  // The paths of the writes with async persistence that aren't known to be
+  // on disk, by token: those in progress, and those whose sync failed until
+  // a later write of the same file is synced.
+  std::map<int64, std::string> unsynced_;
+
+  // The writes that were submitted to the ring, by token.
+  std::map<int64, PendingWrite> pending_;
+
+  DISALLOW_COPY_AND_ASSIGN(StoreWriter);
+};
+
+bool StoreWriter::SetAsync(bool enabled) {
+  base::AutoLock auto_lock(lock_);
+  async_ = enabled;
+  if (enabled)
+    return Ring() != NULL;
+
+  // Nothing reaps the outstanding syncs once the ring isn't used anymore.
+  while (OwnsRing() && WritesInFlight() > 0)
+    WaitForCompletions();
+  return false;
+}
+
+void StoreWriter::SetIoUringDisabled(bool disabled) {
+  base::AutoLock auto_lock(lock_);
+  io_uring_disabled_ = disabled;
+}
+
+bool StoreWriter::Replace(const FilePath& path, const std::string& data) {
+  std::string temp_path;
+  int fd = CreateTempFile(path, &temp_path);
+  if (fd == -1)
+    return false;
+
+  int64 token = 0;
+  {
+    base::AutoLock auto_lock(lock_);
+    if (async_) {
+      token = ++last_token_;
+      unsynced_[token] = path.value();
+      bool replaced = false;
+      if (Ring() &&
+          ReplaceWithRing(path, data, &fd, temp_path, token, &replaced)) {
+        return replaced;
+      }
+    }
+  }
+
+  if (fd == -1) {
+    // The ring failed with the first temporary file.
+    fd = CreateTempFile(path, &temp_path);
+    if (fd == -1)
+      return false;
+  }
+  bool replaced = ReplaceNow(path, data, fd, temp_path, token);
+  if (replaced && token) {
+    base::AutoLock auto_lock(lock_);
+    MarkSynced(token);
+  }
+  return replaced;
+}
+
+bool StoreWriter::ReplaceNow(const FilePath& path, const std::string& data,
+                             int fd, const std::string& temp_path,
+                             int64 token) {
+  bool replaced = WriteAll(fd, data) &&
+      (!token || HANDLE_EINTR(fdatasync(fd)) == 0);
+  ignore_result(HANDLE_EINTR(close(fd)));
+  if (!replaced || rename(temp_path.c_str(), path.value().c_str()) != 0) {
+    PLOG(ERROR) << "Can't replace " << path.value();
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (!token)
+    return true;
+
+  // The rename is only durable once the directory is synced.
+  int directory_fd = OpenDirectory(path);
+  if (directory_fd == -1)
+    return false;
+  bool synced = HANDLE_EINTR(fsync(directory_fd)) == 0;
+  ignore_result(HANDLE_EINTR(close(directory_fd)));
+  return synced;
+}
+
+bool StoreWriter::ReplaceWithRing(const FilePath& path,
+                                  const std::string& data, int* fd,
+                                  const std::string& temp_path, int64 token,
+                                  bool* replaced) {
+  *replaced = false;
+  int directory_fd = OpenDirectory(path);
+  if (directory_fd == -1) {
+    ignore_result(HANDLE_EINTR(close(*fd)));
+    *fd = -1;
+    unlink(temp_path.c_str());
+    return true;
+  }
+
+  while (WritesInFlight() >= kMaxWritesInFlight && !ring_failed_)
+    WaitForCompletions();
+  if (ring_failed_) {
+    ignore_result(HANDLE_EINTR(close(directory_fd)));
+    return false;
+  }
+
+  PendingWrite& write = pending_[token];
+  write.fd = *fd;
+  write.directory_fd = directory_fd;
+  write.temp_path = temp_path;
+  write.size = static_cast<int>(data.size());
+  ring_->QueueReplace(token * kWriteOps, write.fd, data, write.temp_path,
+                      path, directory_fd);
+  uint32 submitted = ring_->Submit();
+  if (submitted == 0) {
+    // Write this store and all later ones synchronously.
+    ring_failed_ = true;
+    pending_.erase(token);
+    ignore_result(HANDLE_EINTR(close(directory_fd)));
+    return false;
+  }
+  *fd = -1;
+
+  // Operations the kernel didn't consume never complete. The ones it did
+  // still use the file and |data|, so they are waited for before the store
+  // is written again without the ring.
+  bool partial = submitted < kWriteOps;
+  if (partial) {
+    ring_failed_ = true;
+    std::fill(write.results + submitted, write.results + kWriteOps,
+              -ECANCELED);
+    write.ops_left = submitted;
+  }
+
+  // The write and the rename only touch the page cache, so this doesn't
+  // wait for the disk. The write's memory is in use until it completed,
+  // which it did before the rename.
+  while (write.results[kRenameOp] == kNotCompleted ||
+         (partial && write.ops_left > 0)) {
+    WaitForCompletions();
+  }
+
+  *replaced = write.results[kWriteOp] == write.size &&
+      write.results[kRenameOp] == 0;
+  bool fall_back = partial || (ring_failed_ && !*replaced);
+  if (!*replaced) {
+    if (!fall_back) {
+      LOG(ERROR) << "Can't replace " << path.value() << ": "
+                 << strerror(-std::min(write.results[kWriteOp],
+                                       write.results[kRenameOp]));
+    }
+    unlink(temp_path.c_str());
+  }
+  write.writer_waiting = false;
+  if (write.ops_left == 0)
+    pending_.erase(token);
+  return !fall_back;
+}
+
+IoRing* StoreWriter::Ring() {
+  if (io_uring_disabled_ || ring_failed_)
+    return NULL;
+  if (!ring_tried_) {
+    ring_tried_ = true;
+    ring_.reset(IoRing::Create());
+  }
+  return OwnsRing() ? ring_.get() : NULL;
+}
+
+bool StoreWriter::OwnsRing() {
+  // A forked child shares the ring's memory with its parent, so it must not
+  // even reap completions.
+  return ring_.get() && ring_->pid() == getpid();
+}
+
+void StoreWriter::WaitForCompletions() {
+  if (reaping_) {
+    completed_.Wait();
+    return;
+  }
+
+  reaping_ = true;
+  bool waited;
+  {
+    base::AutoUnlock unlock(lock_);
+    waited = ring_->Wait();
+  }
+  reaping_ = false;
+  ReapCompletions();
+  if (!waited)
+    AbandonWrites();
+  completed_.Broadcast();
+}
+
+void StoreWriter::ReapCompletions() {
+  uint64 user_data;
+  int result;
+  while (ring_->PopCompletion(&user_data, &result)) {
+    // Writes that were given up on may still complete.
+    std::map<int64, PendingWrite>::iterator it =
+        pending_.find(user_data / kWriteOps);
+    DCHECK(ring_failed_ || it != pending_.end());
+    if (it == pending_.end() || it->second.ops_left == 0)
+      continue;
+
+    PendingWrite& write = it->second;
+    int op = user_data % kWriteOps;
+    write.results[op] = result;
+    if ((op == kSyncFileOp || op == kSyncDirectoryOp) && result < 0 &&
+        result != -ECANCELED) {
+      LOG(ERROR) << "Can't sync rlz store: " << strerror(-result);
+    }
+    if (--write.ops_left > 0)
+      continue;
+
+    FinishWrite(it->first, &write);
+    if (!write.writer_waiting)
+      pending_.erase(it);
+  }
+}
+
+void StoreWriter::FinishWrite(int64 token, PendingWrite* write) {
+  ignore_result(HANDLE_EINTR(close(write->fd)));
+  ignore_result(HANDLE_EINTR(close(write->directory_fd)));
+  // Not all kernels cancel the syncs when the rename failed.
+  if (write->results[kWriteOp] == write->size &&
+      write->results[kRenameOp] == 0 && write->results[kSyncFileOp] == 0 &&
+      write->results[kSyncDirectoryOp] == 0) {
+    MarkSynced(token);
+  }
+}
+
+void StoreWriter::AbandonWrites() {
+  LOG(ERROR) << "Can't wait for rlz store writes, writing synchronously";
+  ring_failed_ = true;
+  for (std::map<int64, PendingWrite>::iterator it = pending_.begin();
+       it != pending_.end();) {
+    PendingWrite& write = it->second;
+    if (write.ops_left == 0) {
+      ++it;
+      continue;
+    }
+
+    for (int op = 0; op < kWriteOps; ++op) {
+      if (write.results[op] == kNotCompleted)
+        write.results[op] = -ECANCELED;
+    }
+    write.ops_left = 0;
+    FinishWrite(it->first, &write);
+    if (write.writer_waiting)
+      ++it;
+    else
+      pending_.erase(it++);
+  }
+}
+
+void StoreWriter::MarkSynced(int64 token) {
+  std::map<int64, std::string>::iterator synced = unsynced_.find(token);
+  if (synced == unsynced_.end())
+    return;
+
+  // A later write of the same file contains the changes of earlier ones.
+  std::string path = synced->second;
+  for (std::map<int64, std::string>::iterator it = unsynced_.begin();
+       it != unsynced_.end() && it->first <= token;) {
+    if (it->second == path)
+      unsynced_.erase(it++);
+    else
+      ++it;
+  }
+}
+
+size_t StoreWriter::WritesInFlight() {
+  size_t writes = 0;
+  for (std::map<int64, PendingWrite>::iterator it = pending_.begin();
+       it != pending_.end(); ++it) {
+    if (it->second.ops_left > 0)
+      ++writes;
+  }
+  return writes;
+}
+
+bool StoreWriter::IsCompleted(int64 token) {
+  for (std::map<int64, PendingWrite>::iterator it = pending_.begin();
+       it != pending_.end() && it->first <= token; ++it) {
+    if (it->second.ops_left > 0)
+      return false;
+  }
+  return true;
+}
+
+int64 StoreWriter::LastToken() {
+  base::AutoLock auto_lock(lock_);
+  return last_token_;
+}
+
+bool StoreWriter::WaitForSynced(int64 token, bool wait) {
+  base::AutoLock auto_lock(lock_);
+  // A forked child can't wait for the writes of its parent.
+  if (OwnsRing()) {
+    ReapCompletions();
+    while (wait && !IsCompleted(token))
+      WaitForCompletions();
+  }
+  return token <= last_token_ && unsynced_.find(token) == unsynced_.end();
+}
+
+base::LazyInstance<StoreWriter>::Leaky g_store_writer =
+    LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+bool ReplaceStoreFile(const FilePath& path, const std::string& data) {
+  return g_store_writer.Get().Replace(path, data);
+}
+
+bool SetAsyncPersistence(bool enabled) {
+  return g_store_writer.Get().SetAsync(enabled);
+}
+
+int64 GetPersistToken() {
+  return g_store_writer.Get().LastToken();
+}
+
+bool IsPersisted(int64 token) {
+  return g_store_writer.Get().WaitForSynced(token, false);
+}
+
+bool WaitForPersisted(int64 token) {
+  return g_store_writer.Get().WaitForSynced(token, true);
+}
+
+namespace testing {
+
+void SetIoUringDisabled(bool disabled) {
+  g_store_writer.Get().SetIoUringDisabled(disabled);
+}
+
+}  // namespace testing
+
+}  // namespace rlz_lib
@@ -0,0 +1,44 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Writes the store files that are replaced as a whole, optionally through
+// io_uring. See SetAsyncPersistence() in rlz_lib.h.
+
+#ifndef RLZ_LINUX_LIB_STORE_WRITER_LINUX_H_
+#define RLZ_LINUX_LIB_STORE_WRITER_LINUX_H_
+
+#include <string>
+
+#include "base/basictypes.h"
+
+class FilePath;
+
+namespace rlz_lib {
+
+// Replaces the file |path| with |data|. The data is written to a temporary
+// file in the same directory that is renamed over |path|, so that a crash
+// never leaves a partially written store behind, and readers that mapped the
+// old file keep seeing it. Returns false if |path| wasn't replaced.
+//
+// Without async persistence, nothing is synced to disk. With it, the file
+// and its directory are synced too, and the write gets the next token of
+// GetPersistToken(). When io_uring is available, the write, the rename and
+// the syncs are submitted together, and only the rename is waited for.
+// Otherwise they are done one after the other before this returns, as they
+// are for this and all later writes once submitting to or waiting for the
+// ring failed. Builds without RLZ_USE_IO_URING, see rlz_use_io_uring in
+// rlz.gyp, never use io_uring.
+bool ReplaceStoreFile(const FilePath& path, const std::string& data);
+
+namespace testing {
+
+// Makes ReplaceStoreFile() write synchronously even if io_uring is
+// available, like it does where it isn't.
+void SetIoUringDisabled(bool disabled);
+
+}  // namespace testing
+
+}  // namespace rlz_lib
+
+#endif  // RLZ_LINUX_LIB_STORE_WRITER_LINUX_H_
@@ -0,0 +1,170 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+// Use of this source code is governed by an Apache-style license that can be
+// found in the COPYING file.
+//
+// Unit tests for ReplaceStoreFile() and async persistence. Each test runs
+// with io_uring, where it is available, and with the synchronous fallback.
+
+#include "rlz/linux/lib/store_writer_linux.h"
+
+#include <dirent.h>
+#include <string.h>
+
+#include <string>
+
+#include "base/compiler_specific.h"
+#include "base/file_util.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/scoped_temp_dir.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/linux/lib/rlz_value_store_binary.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace {
+
+class StoreWriterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() OVERRIDE {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    path_ = temp_dir_.path().Append("store");
+  }
+
+  virtual void TearDown() OVERRIDE {
+    rlz_lib::SetAsyncPersistence(false);
+    rlz_lib::testing::SetIoUringDisabled(false);
+  }
+
+  // Returns the number of files in the temp directory.
+  int CountFiles() {
+    DIR* dir = opendir(temp_dir_.path().value().c_str());
+    if (!dir)
+      return -1;
+    int files = 0;
+    while (struct dirent* entry = readdir(dir)) {
+      if (entry->d_name[0] != '.' || strlen(entry->d_name) > 2)
+        ++files;
+    }
+    closedir(dir);
+    return files;
+  }
+
+  void ExpectContents(const std::string& expected) {
+    std::string data;
+    EXPECT_TRUE(file_util::ReadFileToString(path_, &data));
+    EXPECT_EQ(expected, data);
+  }
+
+  ScopedTempDir temp_dir_;
+  FilePath path_;
+};
+
+}  // namespace
+
+TEST_F(StoreWriterTest, ReplacesFile) {
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    rlz_lib::testing::SetIoUringDisabled(!io_uring);
+    for (int async = 0; async < 2; ++async) {
+      rlz_lib::SetAsyncPersistence(async != 0);
+
+      std::string data(10000, 'a' + io_uring * 2 + async);
+      EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, data));
+      ExpectContents(data);
+
+      // Empty files, and files with one byte, are written too.
+      EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, ""));
+      ExpectContents("");
+      EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, "x"));
+      ExpectContents("x");
+
+      // No temporary file is left behind.
+      EXPECT_EQ(1, CountFiles());
+    }
+  }
+}
+
+TEST_F(StoreWriterTest, FailsWithoutDirectory) {
+  FilePath path = temp_dir_.path().Append("missing").Append("store");
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    rlz_lib::testing::SetIoUringDisabled(!io_uring);
+    rlz_lib::SetAsyncPersistence(true);
+    EXPECT_FALSE(rlz_lib::ReplaceStoreFile(path, "data"));
+  }
+
+  // Replacing a directory fails after the file was written.
+  ASSERT_TRUE(file_util::CreateDirectory(path_));
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    rlz_lib::testing::SetIoUringDisabled(!io_uring);
+    rlz_lib::SetAsyncPersistence(true);
+    EXPECT_FALSE(rlz_lib::ReplaceStoreFile(path_, "data"));
+    EXPECT_EQ(1, CountFiles());
+  }
+}
+
+TEST_F(StoreWriterTest, TracksPersistence) {
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    rlz_lib::testing::SetIoUringDisabled(!io_uring);
+
+    // Writes without async persistence get no token.
+    rlz_lib::SetAsyncPersistence(false);
+    int64 token = rlz_lib::GetPersistToken();
+    EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, "data"));
+    EXPECT_EQ(token, rlz_lib::GetPersistToken());
+
+    rlz_lib::SetAsyncPersistence(true);
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, "data"));
+      EXPECT_EQ(token + i + 1, rlz_lib::GetPersistToken());
+    }
+    token = rlz_lib::GetPersistToken();
+    EXPECT_TRUE(rlz_lib::WaitForPersisted(token));
+    EXPECT_TRUE(rlz_lib::IsPersisted(token));
+    EXPECT_TRUE(rlz_lib::IsPersisted(token - 1));
+    EXPECT_FALSE(rlz_lib::IsPersisted(token + 1));
+  }
+}
+
+TEST_F(StoreWriterTest, TracksPersistencePerFile) {
+  // Replacing a directory fails after the write got a token.
+  FilePath directory = temp_dir_.path().Append("directory");
+  ASSERT_TRUE(file_util::CreateDirectory(directory));
+  for (int io_uring = 0; io_uring < 2; ++io_uring) {
+    rlz_lib::testing::SetIoUringDisabled(!io_uring);
+    rlz_lib::SetAsyncPersistence(true);
+
+    EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, "data"));
+    int64 token = rlz_lib::GetPersistToken();
+    EXPECT_FALSE(rlz_lib::ReplaceStoreFile(directory, "data"));
+    int64 failed_token = rlz_lib::GetPersistToken();
+    EXPECT_EQ(token + 1, failed_token);
+    EXPECT_FALSE(rlz_lib::WaitForPersisted(failed_token));
+
+    // A later write of another file doesn't persist the failed one.
+    EXPECT_TRUE(rlz_lib::ReplaceStoreFile(path_, "data"));
+    EXPECT_TRUE(rlz_lib::WaitForPersisted(rlz_lib::GetPersistToken()));
+    EXPECT_TRUE(rlz_lib::IsPersisted(token));
+    EXPECT_FALSE(rlz_lib::IsPersisted(failed_token));
+  }
+}
+
+TEST_F(StoreWriterTest, PersistsStores) {
+  rlz_lib::SetAsyncPersistence(true);
+  int64 token = rlz_lib::GetPersistToken();
+  {
+    scoped_ptr<rlz_lib::RlzValueStoreBinary> store(
+        rlz_lib::RlzValueStoreBinary::Open(temp_dir_.path(), false));
+    ASSERT_TRUE(store.get());
+    EXPECT_TRUE(store->WriteAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                           "TbRlzValue"));
+    EXPECT_TRUE(store->Persist());
+  }
+  EXPECT_LT(token, rlz_lib::GetPersistToken());
+  EXPECT_TRUE(rlz_lib::WaitForPersisted(rlz_lib::GetPersistToken()));
+
+  scoped_ptr<rlz_lib::RlzValueStoreBinary> store(
+      rlz_lib::RlzValueStoreBinary::Open(temp_dir_.path(), false));
+  ASSERT_TRUE(store.get());
+  char rlz[rlz_lib::kMaxRlzLength + 1];
+  EXPECT_TRUE(store->ReadAccessPointRlz(rlz_lib::IETB_SEARCH_BOX,
+                                        rlz, arraysize(rlz)));
+  EXPECT_STREQ("TbRlzValue", rlz);
+}
@@ -15,7 +15,9 @@
 namespace rlz_lib {
 
 // An implementation of RlzValueStore for mac. It stores information in a
-// plist file in the user's Application Support folder.
+// plist file in the user's Application Support folder. The methods that only
+// read never change the backing dictionary, so several stores can share one
+// dictionary for reading.
 class RlzValueStoreMac : public RlzValueStore {
  public:
   virtual bool HasAccess(AccessType type) OVERRIDE;
@@ -47,11 +49,11 @@ class RlzValueStoreMac : public RlzValueStore {
   virtual void CollectGarbage() OVERRIDE;
 
  private:
-  // |dict| is the dictionary that backs all data. plist_path is the name of the
-  // plist file, used solely for implementing HasAccess().
+  // |dict| is the dictionary that backs all data, read from the plist file
+  // |plist_path|. The path is used solely for implementing HasAccess().
   RlzValueStoreMac(NSMutableDictionary* dict, NSString* plist_path);
   virtual ~RlzValueStoreMac();
-  friend class ScopedRlzValueStoreLock;
+  friend class PlistStoreFactory;
 
   // Returns the backing dictionary that should be written to disk.
   NSDictionary* dictionary();
@@ -69,6 +71,11 @@ class RlzValueStoreMac : public RlzValueStore {
   // product p.
   NSMutableDictionary* ProductDict(Product p);
 
+  // Like |WorkingDict()| and |ProductDict()|, but return nil instead of
+  // creating the dictionary if it doesn't exist.
+  NSDictionary* ExistingWorkingDict();
+  NSDictionary* ExistingProductDict(Product p);
+
   scoped_nsobject<NSMutableDictionary> dict_;
   scoped_nsobject<NSString> plist_path_;
 
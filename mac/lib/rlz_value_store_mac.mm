@@ -6,14 +6,21 @@
 
 #include "base/mac/foundation_util.h"
 #include "base/file_path.h"
+#include "base/lazy_instance.h"
 #include "base/logging.h"
+#include "base/synchronization/lock.h"
 #include "base/sys_string_conversions.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/lib_values.h"
+#include "rlz/lib/recursive_cross_process_lock_posix.h"
 #include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/store_generation_posix.h"
+#include "rlz/lib/store_keys.h"
 
 #import <Foundation/Foundation.h>
-#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 using base::mac::ObjCCast;
 
@@ -27,12 +34,23 @@ NSString* const kStatefulEventKey = @"statefulEvents";
 
 namespace {
 
+// The names below are interned, and toll-free bridged from their keys.
 NSString* GetNSProductName(Product product) {
-  return base::SysUTF8ToNSString(GetProductName(product));
+  const StoreKey* key = GetProductKey(product);
+  return key ? (NSString*)key->native_name : @"";
 }
 
 NSString* GetNSAccessPointName(AccessPoint p) {
-  return base::SysUTF8ToNSString(GetAccessPointName(p));
+  const StoreKey* key = GetAccessPointKey(p);
+  return key ? (NSString*)key->native_name : @"";
+}
+
+// Returns |event_rlz| interned if it is the name of an event, and converted
+// otherwise.
+NSString* GetNSEventName(const char* event_rlz) {
+  if (const StoreKey* key = FindEventKey(event_rlz, NULL, NULL))
+    return (NSString*)key->native_name;
+  return base::SysUTF8ToNSString(event_rlz);
 }
 
 // Retrieves a subdictionary in |p| for key |k|, creating it if necessary.
@@ -59,10 +77,13 @@ RlzValueStoreMac::~RlzValueStoreMac() {
 }
 
 bool RlzValueStoreMac::HasAccess(AccessType type) {
-  NSFileManager* manager = [NSFileManager defaultManager];
   switch (type) {
-    case kReadAccess:  return [manager isReadableFileAtPath:plist_path_];
-    case kWriteAccess: return [manager isWritableFileAtPath:plist_path_];
+    case kReadAccess:
+      // The store was read when it was created, or is the empty snapshot of
+      // a store that doesn't exist yet.
+      return true;
+    case kWriteAccess:
+      return [[NSFileManager defaultManager] isWritableFileAtPath:plist_path_];
   }
 }
 
@@ -73,8 +94,8 @@ bool RlzValueStoreMac::WritePingTime(Product product, int64 time) {
 }
 
 bool RlzValueStoreMac::ReadPingTime(Product product, int64* time) {
-  if (NSNumber* n =
-      ObjCCast<NSNumber>([ProductDict(product) objectForKey:kPingTimeKey])) {
+  if (NSNumber* n = ObjCCast<NSNumber>(
+      [ExistingProductDict(product) objectForKey:kPingTimeKey])) {
     *time = [n longLongValue];
     return true;
   }
@@ -100,7 +121,7 @@ bool RlzValueStoreMac::ReadAccessPointRlz(AccessPoint access_point,
                                           size_t rlz_size) {
   // Reading a non-existent access point counts as success.
   if (NSDictionary* d = ObjCCast<NSDictionary>(
-        [WorkingDict() objectForKey:kAccessPointKey])) {
+        [ExistingWorkingDict() objectForKey:kAccessPointKey])) {
     NSString* val = ObjCCast<NSString>(
         [d objectForKey:GetNSAccessPointName(access_point)]);
     if (!val) {
@@ -136,14 +157,14 @@ bool RlzValueStoreMac::AddProductEvent(Product product,
                                        const char* event_rlz) {
   [GetOrCreateDict(ProductDict(product), kProductEventKey)
       setObject:[NSNumber numberWithBool:YES]
-      forKey:base::SysUTF8ToNSString(event_rlz)];
+      forKey:GetNSEventName(event_rlz)];
   return true;
 }
 
 bool RlzValueStoreMac::ReadProductEvents(Product product,
                                          std::vector<std::string>* events) {
   if (NSDictionary* d = ObjCCast<NSDictionary>(
-      [ProductDict(product) objectForKey:kProductEventKey])) {
+      [ExistingProductDict(product) objectForKey:kProductEventKey])) {
     for (NSString* s in d)
       events->push_back(base::SysNSStringToUTF8(s));
     return true;
@@ -155,7 +176,7 @@ bool RlzValueStoreMac::ClearProductEvent(Product product,
                                          const char* event_rlz) {
   if (NSMutableDictionary* d = ObjCCast<NSMutableDictionary>(
       [ProductDict(product) objectForKey:kProductEventKey])) {
-    [d removeObjectForKey:base::SysUTF8ToNSString(event_rlz)];
+    [d removeObjectForKey:GetNSEventName(event_rlz)];
     return true;
   }
   return false;
@@ -171,15 +192,15 @@ bool RlzValueStoreMac::AddStatefulEvent(Product product,
                                         const char* event_rlz) {
   [GetOrCreateDict(ProductDict(product), kStatefulEventKey)
       setObject:[NSNumber numberWithBool:YES]
-      forKey:base::SysUTF8ToNSString(event_rlz)];
+      forKey:GetNSEventName(event_rlz)];
   return true;
 }
 
 bool RlzValueStoreMac::IsStatefulEvent(Product product,
                                        const char* event_rlz) {
   if (NSDictionary* d = ObjCCast<NSDictionary>(
-        [ProductDict(product) objectForKey:kStatefulEventKey])) {
-    return [d objectForKey:base::SysUTF8ToNSString(event_rlz)] != nil;
+        [ExistingProductDict(product) objectForKey:kStatefulEventKey])) {
+    return [d objectForKey:GetNSEventName(event_rlz)] != nil;
   }
   return false;
 }
@@ -213,111 +234,34 @@ NSMutableDictionary* RlzValueStoreMac::ProductDict(Product p) {
   return GetOrCreateDict(WorkingDict(), GetNSProductName(p));
 }
 
+NSDictionary* RlzValueStoreMac::ExistingWorkingDict() {
+  std::string brand(SupplementaryBranding::GetBrand());
+  if (brand.empty())
+    return dict_;
 
-namespace {
-
-// Creating a recursive cross-process mutex on windows is one line. On mac,
-// there's no primitve for that, so this lock is emulated by an in-process
-// mutex to get the recursive part, followed by a cross-process lock for the
-// cross-process part.
-
-// This is a struct so that it doesn't need a static initializer.
-struct RecursiveCrossProcessLock {
-  // Tries to acquire a recursive cross-process lock. Note that this _always_
-  // acquires the in-process lock (if it wasn't already acquired). The parent
-  // directory of |lock_file| must exist.
-  bool TryGetCrossProcessLock(NSString* lock_filename);
-
-  // Releases the lock. Should always be called, even if
-  // TryGetCrossProcessLock() returns false.
-  void ReleaseLock();
-
-  pthread_mutex_t recursive_lock_;
-  pthread_t locking_thread_;
-
-  NSDistributedLock* file_lock_;
-} g_recursive_lock = {
-  // PTHREAD_RECURSIVE_MUTEX_INITIALIZER doesn't exist before 10.7 and is buggy
-  // on 10.7 (http://gcc.gnu.org/bugzilla/show_bug.cgi?id=51906#c34), so emulate
-  // recursive locking with a normal non-recursive mutex.
-  PTHREAD_MUTEX_INITIALIZER
-};
-
-bool RecursiveCrossProcessLock::TryGetCrossProcessLock(
-    NSString* lock_filename) {
-  bool just_got_lock = false;
-
-  // Emulate a recursive mutex with a non-recursive one.
-  if (pthread_mutex_trylock(&recursive_lock_) == EBUSY) {
-    if (pthread_equal(pthread_self(), locking_thread_) == 0) {
-      // Some other thread has the lock, wait for it.
-      pthread_mutex_lock(&recursive_lock_);
-      CHECK(locking_thread_ == 0);
-      just_got_lock = true;
-    }
-  } else {
-    just_got_lock = true;
-  }
-
-  locking_thread_ = pthread_self();
-
-  // Try to acquire file lock.
-  if (just_got_lock) {
-    const int kMaxTimeoutMS = 5000;  // Matches windows.
-    const int kSleepPerTryMS = 200;
-
-    CHECK(!file_lock_);
-    file_lock_ = [[NSDistributedLock alloc] initWithPath:lock_filename];
+  NSString* brand_ns =
+      [@"brand_" stringByAppendingString:base::SysUTF8ToNSString(brand)];
 
-    BOOL got_file_lock = NO;
-    int elapsedMS = 0;
-    while (!(got_file_lock = [file_lock_ tryLock]) &&
-           elapsedMS < kMaxTimeoutMS) {
-      usleep(kSleepPerTryMS * 1000);
-      elapsedMS += kSleepPerTryMS;
-    }
+  return ObjCCast<NSDictionary>([dict_ objectForKey:brand_ns]);
+}
 
-    if (!got_file_lock) {
-      [file_lock_ release];
-      file_lock_ = nil;
-      return false;
-    }
-    return true;
-  } else {
-    return file_lock_ != nil;
-  }
+NSDictionary* RlzValueStoreMac::ExistingProductDict(Product p) {
+  return ObjCCast<NSDictionary>(
+      [ExistingWorkingDict() objectForKey:GetNSProductName(p)]);
 }
 
-void RecursiveCrossProcessLock::ReleaseLock() {
-  if (file_lock_) {
-    [file_lock_ unlock];
-    [file_lock_ release];
-    file_lock_ = nil;
-  }
 
-  locking_thread_ = 0;
-  pthread_mutex_unlock(&recursive_lock_);
-}
+namespace {
 
+RecursiveCrossProcessLock g_recursive_lock =
+    RECURSIVE_CROSS_PROCESS_LOCK_INITIALIZER;
 
 // This is set during test execution, to write RLZ files into a temporary
 // directory instead of the user's Application Support folder.
 NSString* g_test_folder;
 
-// RlzValueStoreMac keeps its data in memory and only writes it to disk when
-// ScopedRlzValueStoreLock goes out of scope. Hence, if several
-// ScopedRlzValueStoreLocks are nested, they all need to use the same store
-// object.
-
-// This counts the nesting depth.
-int g_lock_depth = 0;
-
-// This is the store object that might be shared. Only set if g_lock_depth > 0.
-RlzValueStoreMac* g_store_object = NULL;
-
-
-NSString* CreateRlzDirectory() {
-  NSFileManager* manager = [NSFileManager defaultManager];
+// Returns the folder the RLZ files live in, without creating it.
+NSString* RlzDirectory() {
   NSArray* paths = NSSearchPathForDirectoriesInDomains(
       NSApplicationSupportDirectory, NSUserDomainMask, /*expandTilde=*/YES);
   NSString* folder = nil;
@@ -329,102 +273,292 @@ NSString* CreateRlzDirectory() {
 
   if (g_test_folder)
     folder = [g_test_folder stringByAppendingPathComponent:folder];
+  return folder;
+}
 
-  [manager createDirectoryAtPath:folder
-     withIntermediateDirectories:YES
-                      attributes:nil
-                           error:nil];
+NSString* CreateRlzDirectory() {
+  NSString* folder = RlzDirectory();
+  [[NSFileManager defaultManager] createDirectoryAtPath:folder
+                            withIntermediateDirectories:YES
+                                             attributes:nil
+                                                  error:nil];
   return folder;
 }
 
+NSString* const kRlzPlistFile = @"RlzStore.plist";
+
 // Returns the path of the rlz plist store, also creates the parent directory
 // path if it doesn't exist.
 NSString* RlzPlistFilename() {
-  NSString* const kRlzFile = @"RlzStore.plist";
-  return [CreateRlzDirectory() stringByAppendingPathComponent:kRlzFile];
+  return [CreateRlzDirectory() stringByAppendingPathComponent:kRlzPlistFile];
 }
 
 // Returns the path of the rlz lock file, also creates the parent directory
-// path if it doesn't exist.
-NSString* RlzLockFilename() {
-  NSString* const kRlzFile = @"lockfile";
-  return [CreateRlzDirectory() stringByAppendingPathComponent:kRlzFile];
+// path if it doesn't exist. This isn't "lockfile", which older versions used
+// as an NSDistributedLock directory.
+FilePath RlzLockFilename() {
+  NSString* const kRlzFile = @"flockfile";
+  NSString* path =
+      [CreateRlzDirectory() stringByAppendingPathComponent:kRlzFile];
+  return FilePath([path fileSystemRepresentation]);
+}
+
+// Older versions lock the store with an NSDistributedLock on "lockfile"
+// instead of |g_recursive_lock|. Writers wait until no older version holds
+// it, after taking |g_recursive_lock|, by taking it and releasing it right
+// away. It isn't held while writing, because it is a directory that outlives
+// a crashed holder. For the same reason, a lock that was taken longer ago
+// than the default lock timeout is broken. Returns false if it stays busy
+// until the store's lock deadline.
+bool WaitForLegacyLock() {
+  const int kMinPollMicroseconds = 1000;
+  const int kMaxPollMicroseconds = 200000;
+
+  NSString* path =
+      [CreateRlzDirectory() stringByAppendingPathComponent:@"lockfile"];
+  scoped_nsobject<NSDistributedLock> lock(
+      [[NSDistributedLock alloc] initWithPath:path]);
+
+  // It can only be polled. Older versions hold it rarely, so a busy lock is
+  // polled with the interval they use, backing off from a shorter one.
+  base::TimeTicks deadline = GetStoreLockDeadline();
+  int poll_microseconds = kMinPollMicroseconds;
+  while (![lock tryLock]) {
+    NSDate* lock_date = [lock lockDate];
+    if (lock_date &&
+        [lock_date timeIntervalSinceNow] * -1000 > kDefaultLockTimeoutMs) {
+      LOG(WARNING) << "Breaking stale " << [path UTF8String];
+      [lock breakLock];
+      continue;
+    }
+    if (base::TimeTicks::Now() >= deadline) {
+      ScopedLockTimeout::SetLockBusy();
+      LOG(ERROR) << "Timed out waiting for " << [path UTF8String];
+      return false;
+    }
+    usleep(std::min<int64>(
+        poll_microseconds,
+        (deadline - base::TimeTicks::Now()).InMicroseconds() + 1));
+    poll_microseconds = std::min(kMaxPollMicroseconds, poll_microseconds * 2);
+  }
+  [lock unlock];
+  return true;
+}
+
+// Returns the path of the file with the generation of the plist in |folder|.
+// Older versions don't bump it, and must not write the plist while newer ones
+// use it.
+FilePath RlzGenerationFilename(NSString* folder) {
+  NSString* const kRlzFile = @"generation";
+  NSString* path = [folder stringByAppendingPathComponent:kRlzFile];
+  return FilePath([path fileSystemRepresentation]);
+}
+
+// Returns a copy of |dict| that can be changed without changing |dict|.
+NSMutableDictionary* MutableDeepCopy(NSDictionary* dict) {
+  CFPropertyListRef copy = CFPropertyListCreateDeepCopy(
+      kCFAllocatorDefault, dict, kCFPropertyListMutableContainers);
+  return [static_cast<NSMutableDictionary*>(const_cast<void*>(copy))
+      autorelease];
 }
 
 }  // namespace
 
-ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
-  bool got_distributed_lock =
-      g_recursive_lock.TryGetCrossProcessLock(RlzLockFilename());
-  // At this point, we hold the in-process lock, no matter the value of
-  // |got_distributed_lock|.
+// Hands out RlzValueStoreMac objects, guarded by |g_recursive_lock|.
+// RlzValueStoreMac keeps its data in memory and only writes it to disk when
+// the store is released. The plist is always written atomically, so readers
+// load a snapshot of it without taking the lock.
+//
+// The factory keeps the last dictionary it read or wrote, along with the
+// StoreGeneration it had. Every writer bumps the generation, so while it is
+// unchanged, readers share the kept dictionary instead of reading and parsing
+// the plist again, and writers start from a copy of it.
+class PlistStoreFactory : public RlzValueStoreFactory {
+ public:
+  PlistStoreFactory() : generation_open_(false), cached_generation_(0) {}
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE {
+    if (access == RlzValueStore::kReadAccess)
+      return OpenSnapshot();
+
+    if (!g_recursive_lock.TryGetCrossProcessLock(RlzLockFilename()) ||
+        !WaitForLegacyLock()) {
+      g_recursive_lock.ReleaseLock();
+      return NULL;
+    }
 
-  ++g_lock_depth;
+    NSString* folder = CreateRlzDirectory();
+    NSString* plist = [folder stringByAppendingPathComponent:kRlzPlistFile];
 
-  if (!got_distributed_lock) {
-    // Give up. |store_| isn't set, which signals to callers that acquiring
-    // the lock failed. |g_recursive_lock| will be released by the
-    // destructor.
-    CHECK(!g_store_object);
-    return;
-  }
+    // Create an empty file if none exists yet.
+    NSFileManager* manager = [NSFileManager defaultManager];
+    if (![manager fileExistsAtPath:plist isDirectory:NULL])
+      [[NSDictionary dictionary] writeToFile:plist atomically:YES];
 
-  if (g_lock_depth > 1) {
-    // Reuse the already existing store object.
-    CHECK(g_store_object);
-    store_.reset(g_store_object);
-    return;
+    NSMutableDictionary* dict = nil;
+    {
+      base::AutoLock auto_lock(cache_lock_);
+      uint32 generation;
+      if (GetGeneration(folder, &generation) && IsCached(plist, generation))
+        dict = MutableDeepCopy(cached_dict_);
+    }
+    if (!dict)
+      dict = [NSMutableDictionary dictionaryWithContentsOfFile:plist];
+    VERIFY(dict);
+    if (!dict) {
+      g_recursive_lock.ReleaseLock();
+      return NULL;
+    }
+    return new RlzValueStoreMac(dict, plist);
   }
 
-  CHECK(!g_store_object);
-
-  NSString* plist = RlzPlistFilename();
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+    // The store's destructor is private to this factory, so the store is
+    // deleted here rather than by a scoped_ptr.
+    RlzValueStoreMac* mac_store = static_cast<RlzValueStoreMac*>(store);
+    if (access == RlzValueStore::kReadAccess) {
+      delete store;
+      return;
+    }
 
-  // Create an empty file if none exists yet.
-  NSFileManager* manager = [NSFileManager defaultManager];
-  if (![manager fileExistsAtPath:plist isDirectory:NULL])
-    [[NSDictionary dictionary] writeToFile:plist atomically:YES];
+    if (modified) {
+      NSString* plist = RlzPlistFilename();
+      bool written = [mac_store->dictionary() writeToFile:plist
+                                               atomically:YES];
+      VERIFY(written);
+
+      // Bump the generation even if the write failed, in case it got far
+      // enough to replace the plist. The dictionary isn't changed after the
+      // store is released, so it can be kept as is.
+      base::AutoLock auto_lock(cache_lock_);
+      uint32 generation;
+      if (generation_open_ && generation_.Increment(&generation)) {
+        if (written)
+          Cache(plist, generation, mac_store->dictionary());
+        else
+          cached_dict_.reset();
+      } else {
+        LOG(ERROR) << "Failed to bump the generation of " << [plist UTF8String];
+        cached_dict_.reset();
+      }
+    }
+    delete store;
 
-  NSMutableDictionary* dict =
-      [NSMutableDictionary dictionaryWithContentsOfFile:plist];
-  VERIFY(dict);
+    CHECK_NE(-1, g_recursive_lock.file_lock_);
+    g_recursive_lock.ReleaseLock();
+  }
 
-  if (dict) {
-    store_.reset(new RlzValueStoreMac(dict, plist));
-    g_store_object = (RlzValueStoreMac*)store_.get();
+  virtual ReaderLocking GetReaderLocking() OVERRIDE {
+    return kSnapshotReaders;
   }
-}
 
-ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
-  --g_lock_depth;
-  CHECK(g_lock_depth >= 0);
+ private:
+  // Returns a store for reading. It shares the kept dictionary if the plist
+  // didn't change, and otherwise reads the plist without any lock. A plist
+  // that doesn't exist yet reads as empty.
+  RlzValueStore* OpenSnapshot() {
+    // Don't create the directory, so that an unchanged store is read without
+    // touching the disk.
+    NSString* folder = RlzDirectory();
+    NSString* plist = [folder stringByAppendingPathComponent:kRlzPlistFile];
+
+    // The generation is read first, so that the plist is at least as new.
+    uint32 generation = 0;
+    bool has_generation;
+    {
+      base::AutoLock auto_lock(cache_lock_);
+      has_generation = GetGeneration(folder, &generation);
+      if (has_generation && IsCached(plist, generation))
+        return new RlzValueStoreMac(cached_dict_, plist);
+    }
 
-  if (g_lock_depth > 0) {
-    // Other locks are still using store_, don't free it yet.
-    ignore_result(store_.release());
-    return;
+    NSData* data = [NSData dataWithContentsOfFile:plist
+                                          options:NSDataReadingMappedIfSafe
+                                            error:NULL];
+    NSMutableDictionary* dict = nil;
+    if (data) {
+      id value = [NSPropertyListSerialization
+          propertyListWithData:data
+                       options:NSPropertyListMutableContainers
+                        format:NULL
+                         error:NULL];
+      // NSPropertyListMutableContainers makes the dictionary mutable.
+      if ([value isKindOfClass:[NSDictionary class]])
+        dict = static_cast<NSMutableDictionary*>(value);
+    } else if (![[NSFileManager defaultManager] fileExistsAtPath:plist]) {
+      dict = [NSMutableDictionary dictionary];
+    }
+    VERIFY(dict);
+    if (!dict)
+      return NULL;
+
+    if (has_generation) {
+      base::AutoLock auto_lock(cache_lock_);
+      // Don't replace a dictionary that a writer kept in the meantime.
+      if (!IsCached(plist, generation_.Get()))
+        Cache(plist, generation, dict);
+    }
+    return new RlzValueStoreMac(dict, plist);
   }
 
-  if (store_.get()) {
-    g_store_object = NULL;
+  // Sets |generation| to the generation of the plist in |folder|. Returns
+  // false if it can't be read. Must be called with |cache_lock_| held.
+  bool GetGeneration(NSString* folder, uint32* generation) {
+    cache_lock_.AssertAcquired();
+    FilePath path = RlzGenerationFilename(folder);
+    if (!generation_open_ || generation_.path() != path) {
+      cached_dict_.reset();
+      generation_open_ = generation_.Open(path);
+    }
+    if (!generation_open_)
+      return false;
+    *generation = generation_.Get();
+    return true;
+  }
 
-    NSDictionary* dict =
-        static_cast<RlzValueStoreMac*>(store_.get())->dictionary();
-    VERIFY([dict writeToFile:RlzPlistFilename() atomically:YES]);
+  // Returns whether the kept dictionary is |plist| at |generation|. Must be
+  // called with |cache_lock_| held.
+  bool IsCached(NSString* plist, uint32 generation) {
+    cache_lock_.AssertAcquired();
+    return cached_dict_ && cached_generation_ == generation &&
+        [cached_plist_ isEqualToString:plist];
   }
 
-  // Check that "store_ set" => "file_lock acquired". The converse isn't true,
-  // for example if the rlz data file can't be read.
-  if (store_.get())
-    CHECK(g_recursive_lock.file_lock_);
-  if (!g_recursive_lock.file_lock_)
-    CHECK(!store_.get());
+  // Keeps |dict|, which must not be changed anymore, as |plist| at
+  // |generation|. Must be called with |cache_lock_| held.
+  void Cache(NSString* plist, uint32 generation, NSDictionary* dict) {
+    cache_lock_.AssertAcquired();
+    cached_plist_.reset([plist copy]);
+    cached_generation_ = generation;
+    cached_dict_.reset([static_cast<NSMutableDictionary*>(dict) retain]);
+  }
 
-  g_recursive_lock.ReleaseLock();
-}
+  // Guards the members below. Readers use them on several threads.
+  base::Lock cache_lock_;
+
+  StoreGeneration generation_;
+  bool generation_open_;
+
+  // The kept dictionary, which no store changes, and where it came from.
+  scoped_nsobject<NSString> cached_plist_;
+  uint32 cached_generation_;
+  scoped_nsobject<NSMutableDictionary> cached_dict_;
+
+  DISALLOW_COPY_AND_ASSIGN(PlistStoreFactory);
+};
+
+namespace {
+
+base::LazyInstance<PlistStoreFactory>::Leaky g_default_factory =
+    LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
 
-RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
-  return store_.get();
+RlzValueStoreFactory* GetDefaultRlzValueStoreFactory() {
+  return g_default_factory.Pointer();
 }
 
 namespace testing {
@@ -10,8 +10,19 @@
       # of win inet.
       'force_rlz_use_chrome_net%': 0,
     },
+    # The store used on linux: 'json' keeps the data in a JSON file, 'mmap' in
+    # fixed size slots of a memory mapped file, 'log' in an append-only log,
+    # 'shm' in a shared memory segment that is flushed to disk periodically,
+    # 'sharded' in one JSON file and lock per product, 'binary' in a file in
+    # the binary store format, 'compressed' in the same format compressed
+    # with zlib.
+    'rlz_linux_store%': 'json',
+    # Set rlz_use_io_uring to 0 to never write the store through io_uring on
+    # linux. Builds with kernel headers older than linux 5.11 don't use it
+    # either.
+    'rlz_use_io_uring%': 1,
     'conditions': [
-      ['force_rlz_use_chrome_net or OS=="mac"', {
+      ['force_rlz_use_chrome_net or OS!="win"', {
         'rlz_use_chrome_net%': 1,
       }, {
         'rlz_use_chrome_net%': 0,
@@ -39,6 +50,10 @@
         'lib/crc32_wrapper.cc',
         'lib/crc8.h',
         'lib/crc8.cc',
+        'lib/dirty_tracking_store.cc',
+        'lib/dirty_tracking_store.h',
+        'lib/event_buffer.cc',
+        'lib/event_buffer.h',
         'lib/financial_ping.cc',
         'lib/financial_ping.h',
         'lib/lib_values.cc',
@@ -49,9 +64,46 @@
         'lib/rlz_lib.h',
         'lib/rlz_lib_clear.cc',
         'lib/lib_values.h',
+        'lib/lock_metrics.cc',
+        'lib/lock_metrics.h',
+        'lib/recursive_cross_process_lock_posix.cc',
+        'lib/recursive_cross_process_lock_posix.h',
+        'lib/rlz_value_store.cc',
         'lib/rlz_value_store.h',
+        'lib/rlz_value_store_memory.cc',
+        'lib/rlz_value_store_memory.h',
+        'lib/store_codec.cc',
+        'lib/store_codec.h',
+        'lib/store_compression.cc',
+        'lib/store_compression.h',
+        'lib/store_keys.cc',
+        'lib/store_keys.h',
+        'lib/store_generation_posix.cc',
+        'lib/store_generation_posix.h',
         'lib/string_utils.cc',
         'lib/string_utils.h',
+        'linux/lib/event_ring_linux.cc',
+        'linux/lib/event_ring_linux.h',
+        'linux/lib/machine_id_linux.cc',
+        'linux/lib/rlz_value_store_binary.cc',
+        'linux/lib/rlz_value_store_binary.h',
+        'linux/lib/rlz_value_store_linux.cc',
+        'linux/lib/rlz_value_store_linux.h',
+        'linux/lib/rlz_value_store_log.cc',
+        'linux/lib/rlz_value_store_log.h',
+        'linux/lib/rlz_value_store_mmap.cc',
+        'linux/lib/rlz_value_store_mmap.h',
+        'linux/lib/rlz_value_store_sharded.cc',
+        'linux/lib/rlz_value_store_sharded.h',
+        'linux/lib/rlz_value_store_shm.cc',
+        'linux/lib/rlz_value_store_shm.h',
+        'linux/lib/slot_file.h',
+        'linux/lib/snapshot_file.cc',
+        'linux/lib/snapshot_file.h',
+        'linux/lib/store_watcher_linux.cc',
+        'linux/lib/store_watcher_linux.h',
+        'linux/lib/store_writer_linux.cc',
+        'linux/lib/store_writer_linux.h',
         'mac/lib/machine_id_mac.cc',
         'mac/lib/rlz_value_store_mac.mm',
         'mac/lib/rlz_value_store_mac.h',
@@ -71,6 +123,49 @@
         'win/lib/vista_winnt.h',
       ],
       'conditions': [
+        ['OS=="linux" and rlz_use_io_uring==1', {
+          'defines': [
+            'RLZ_USE_IO_URING',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="mmap"', {
+          'defines': [
+            'RLZ_LINUX_STORE_MMAP',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="log"', {
+          'defines': [
+            'RLZ_LINUX_STORE_LOG',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="shm"', {
+          'defines': [
+            'RLZ_LINUX_STORE_SHM',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="sharded"', {
+          'defines': [
+            'RLZ_LINUX_STORE_SHARDED',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="binary"', {
+          'defines': [
+            'RLZ_LINUX_STORE_BINARY',
+          ],
+        }],
+        ['OS=="linux" and rlz_linux_store=="compressed"', {
+          'defines': [
+            'RLZ_LINUX_STORE_COMPRESSED',
+          ],
+        }],
+        ['OS=="linux"', {
+          'link_settings': {
+            'libraries': [
+              # For shm_open().
+              '-lrt',
+            ],
+          },
+        }],
         ['rlz_use_chrome_net==1', {
           'defines': [
             'RLZ_NETWORK_IMPLEMENTATION_CHROME_NET',
@@ -110,11 +205,30 @@
       'sources': [
         'lib/crc32_unittest.cc',
         'lib/crc8_unittest.cc',
+        'lib/dirty_tracking_store_unittest.cc',
+        'lib/event_buffer_unittest.cc',
         'lib/financial_ping_test.cc',
         'lib/lib_values_unittest.cc',
+        'lib/lock_metrics_unittest.cc',
         'lib/machine_id_unittest.cc',
+        'lib/recursive_cross_process_lock_posix_unittest.cc',
         'lib/rlz_lib_test.cc',
+        'lib/rlz_value_store_memory_unittest.cc',
+        'lib/rlz_value_store_unittest.cc',
+        'lib/store_codec_unittest.cc',
+        'lib/store_compression_unittest.cc',
+        'lib/store_keys_unittest.cc',
+        'lib/store_generation_posix_unittest.cc',
         'lib/string_utils_unittest.cc',
+        'linux/lib/event_ring_linux_unittest.cc',
+        'linux/lib/rlz_value_store_binary_unittest.cc',
+        'linux/lib/rlz_value_store_log_unittest.cc',
+        'linux/lib/rlz_value_store_mmap_unittest.cc',
+        'linux/lib/rlz_value_store_sharded_unittest.cc',
+        'linux/lib/rlz_value_store_shm_unittest.cc',
+        'linux/lib/snapshot_file_unittest.cc',
+        'linux/lib/store_watcher_linux_unittest.cc',
+        'linux/lib/store_writer_linux_unittest.cc',
         'test/rlz_test_helpers.cc',
         'test/rlz_test_helpers.h',
         'test/rlz_unittest_main.cc',
@@ -128,6 +242,38 @@
         }]
       ],
     },
+    {
+      'target_name': 'rlz_perftests',
+      'type': 'executable',
+      'include_dirs': [],
+      'dependencies': [
+        ':rlz_lib',
+        '../base/base.gyp:base',
+        '../base/base.gyp:test_support_perf',
+        '../testing/gtest.gyp:gtest',
+        '../third_party/zlib/zlib.gyp:zlib',
+      ],
+      'sources': [
+        'lib/rlz_value_store_perftest.cc',
+        'lib/store_codec_perftest.cc',
+        'test/rlz_test_helpers.cc',
+        'test/rlz_test_helpers.h',
+      ],
+      'conditions': [
+        ['OS!="win"', {
+          'sources': [
+            'lib/recursive_cross_process_lock_posix_perftest.cc',
+          ],
+        }],
+        ['OS=="mac"', {
+          'link_settings': {
+            'libraries': [
+              '$(SDKROOT)/System/Library/Frameworks/CoreFoundation.framework',
+            ],
+          },
+        }],
+      ],
+    },
   ],
   'conditions': [
     ['OS=="win"', {
@@ -13,7 +13,7 @@
 #include <shlwapi.h>
 #include "base/win/registry.h"
 #include "rlz/win/lib/rlz_lib.h"
-#elif defined(OS_MACOSX)
+#elif defined(OS_POSIX)
 #include "base/file_path.h"
 #include "rlz/lib/rlz_value_store.h"
 #endif
@@ -63,8 +63,10 @@ void UndoOverrideRegistryHives() {
 void RlzLibTestNoMachineState::SetUp() {
 #if defined(OS_WIN)
   OverrideRegistryHives();
-#elif defined(OS_MACOSX)
+#elif defined(OS_POSIX)
+#if defined(OS_MACOSX)
   base::mac::ScopedNSAutoreleasePool pool;
+#endif
   ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
   rlz_lib::testing::SetRlzStoreDirectory(temp_dir_.path());
 #endif  // defined(OS_WIN)
@@ -73,7 +75,7 @@ void RlzLibTestNoMachineState::SetUp() {
 void RlzLibTestNoMachineState::TearDown() {
 #if defined(OS_WIN)
   UndoOverrideRegistryHives();
-#elif defined(OS_MACOSX)
+#elif defined(OS_POSIX)
   rlz_lib::testing::SetRlzStoreDirectory(FilePath());
 #endif  // defined(OS_WIN)
 }
@@ -10,7 +10,7 @@
 #include "base/compiler_specific.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
-#if defined(OS_MACOSX)
+#if defined(OS_POSIX)
 #include "base/scoped_temp_dir.h"
 #endif
 
@@ -20,7 +20,7 @@ class RlzLibTestNoMachineState : public ::testing::Test {
   virtual void TearDown() OVERRIDE;
 
 
-#if defined(OS_MACOSX)
+#if defined(OS_POSIX)
  ScopedTempDir temp_dir_;
 #endif
 };
@@ -10,8 +10,13 @@
 #include <Sddl.h>    // For SDDL_REVISION_1, ConvertStringSecurityDescript..
 #include <Aclapi.h>  // For SetSecurityInfo
 
+#include <algorithm>
+
 #include "base/logging.h"
+#include "base/time.h"
 #include "base/win/windows_version.h"
+#include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/rlz_value_store.h"
 
 namespace {
 
@@ -55,7 +60,12 @@ LibMutex::LibMutex() : acquired_(false), mutex_(NULL) {
   mutex_ = CreateMutex(NULL, false, kMutexName);
   bool result = SetObjectToLowIntegrity(mutex_);
   if (result) {
-    acquired_ = (WAIT_OBJECT_0 == WaitForSingleObject(mutex_, 5000L));
+    int64 timeout_ms = std::max<int64>(
+        0, (GetStoreLockDeadline() - base::TimeTicks::Now()).InMilliseconds());
+    DWORD wait = WaitForSingleObject(mutex_, static_cast<DWORD>(timeout_ms));
+    acquired_ = (WAIT_OBJECT_0 == wait);
+    if (wait == WAIT_TIMEOUT)
+      ScopedLockTimeout::SetLockBusy();
   }
 }
 
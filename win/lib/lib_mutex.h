@@ -11,6 +11,8 @@
 
 namespace rlz_lib {
 
+// Waits for the mutex until GetStoreLockDeadline(), and reports a timeout
+// with ScopedLockTimeout::SetLockBusy().
 class LibMutex {
  public:
   LibMutex();
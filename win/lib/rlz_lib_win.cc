@@ -16,6 +16,7 @@
 #include "base/win/windows_version.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/rlz_value_store.h"
+#include "rlz/win/lib/lib_mutex.h"
 #include "rlz/win/lib/machine_deal.h"
 #include "rlz/win/lib/rlz_value_store_registry.h"
 
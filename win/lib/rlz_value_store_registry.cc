@@ -4,13 +4,17 @@
 
 #include "rlz/win/lib/rlz_value_store_registry.h"
 
+#include "base/lazy_instance.h"
+#include "base/memory/scoped_ptr.h"
 #include "base/win/registry.h"
 #include "base/stringprintf.h"
 #include "base/utf_string_conversions.h"
 #include "rlz/lib/assert.h"
 #include "rlz/lib/lib_values.h"
 #include "rlz/lib/rlz_lib.h"
+#include "rlz/lib/store_keys.h"
 #include "rlz/lib/string_utils.h"
+#include "rlz/win/lib/lib_mutex.h"
 #include "rlz/win/lib/registry_util.h"
 
 namespace rlz_lib {
@@ -44,8 +48,20 @@ const char kEventsSubkeyName[]         = "Events";
 const char kStatefulEventsSubkeyName[] = "StatefulEvents";
 const char kPingTimesSubkeyName[]      = "PTimes";
 
-std::wstring GetWideProductName(Product product) {
-  return ASCIIToWide(GetProductName(product));
+// Returns the interned wide name of |product|, which is empty if there is no
+// such product.
+const wchar_t* GetWideProductName(Product product) {
+  const StoreKey* key = GetProductKey(product);
+  return key ? key->wide_name : L"";
+}
+
+// Returns the wide form of |event_rlz|: interned if it is the name of an
+// event, and converted into |buffer| otherwise.
+const wchar_t* GetWideEventName(const char* event_rlz, std::wstring* buffer) {
+  if (const StoreKey* key = FindEventKey(event_rlz, NULL, NULL))
+    return key->wide_name;
+  *buffer = ASCIIToWide(event_rlz);
+  return buffer->c_str();
 }
 
 void AppendBrandToString(std::string* str) {
@@ -86,11 +102,11 @@ bool GetEventsRegKey(const char* event_type,
   AppendBrandToString(&key_location);
 
   if (product != NULL) {
-    std::string product_name = GetProductName(*product);
-    if (product_name.empty())
+    const StoreKey* product_key = GetProductKey(*product);
+    if (!product_key)
       return false;
 
-    base::StringAppendF(&key_location, "\\%s", product_name.c_str());
+    base::StringAppendF(&key_location, "\\%s", product_key->name);
   }
 
   LONG ret = ERROR_SUCCESS;
@@ -110,17 +126,17 @@ bool GetAccessPointRlzsRegKey(REGSAM access, base::win::RegKey* key) {
 }
 
 bool ClearAllProductEventValues(rlz_lib::Product product, const char* key) {
-  std::wstring product_name = GetWideProductName(product);
-  if (product_name.empty())
+  const wchar_t* product_name = GetWideProductName(product);
+  if (!product_name[0])
     return false;
 
   base::win::RegKey reg_key;
   GetEventsRegKey(key, NULL, KEY_WRITE, &reg_key);
-  reg_key.DeleteKey(product_name.c_str());
+  reg_key.DeleteKey(product_name);
 
   // Verify that the value no longer exists.
   base::win::RegKey product_events(
-      reg_key.Handle(), product_name.c_str(), KEY_READ);
+      reg_key.Handle(), product_name, KEY_READ);
   if (product_events.Valid()) {
     ASSERT_STRING("ClearAllProductEvents: Key deletion failed");
     return false;
@@ -167,31 +183,31 @@ bool RlzValueStoreRegistry::HasAccess(AccessType type) {
 
 bool RlzValueStoreRegistry::WritePingTime(Product product, int64 time) {
   base::win::RegKey key;
-  std::wstring product_name = GetWideProductName(product);
+  const wchar_t* product_name = GetWideProductName(product);
   return GetPingTimesRegKey(KEY_WRITE, &key) &&
-      key.WriteValue(product_name.c_str(), &time, sizeof(time),
+      key.WriteValue(product_name, &time, sizeof(time),
                      REG_QWORD) == ERROR_SUCCESS;
 }
 
 bool RlzValueStoreRegistry::ReadPingTime(Product product, int64* time) {
   base::win::RegKey key;
-  std::wstring product_name = GetWideProductName(product);
+  const wchar_t* product_name = GetWideProductName(product);
   return GetPingTimesRegKey(KEY_READ, &key) &&
-      key.ReadInt64(product_name.c_str(), time) == ERROR_SUCCESS;
+      key.ReadInt64(product_name, time) == ERROR_SUCCESS;
 }
 
 bool RlzValueStoreRegistry::ClearPingTime(Product product) {
   base::win::RegKey key;
   GetPingTimesRegKey(KEY_WRITE, &key);
 
-  std::wstring product_name = GetWideProductName(product);
-  key.DeleteValue(product_name.c_str());
+  const wchar_t* product_name = GetWideProductName(product);
+  key.DeleteValue(product_name);
 
   // Verify deletion.
   uint64 value;
   DWORD size = sizeof(value);
   if (key.ReadValue(
-        product_name.c_str(), &value, &size, NULL) == ERROR_SUCCESS) {
+        product_name, &value, &size, NULL) == ERROR_SUCCESS) {
     ASSERT_STRING("RlzValueStoreRegistry::ClearPingTime: Failed to delete.");
     return false;
   }
@@ -201,15 +217,14 @@ bool RlzValueStoreRegistry::ClearPingTime(Product product) {
 
 bool RlzValueStoreRegistry::WriteAccessPointRlz(AccessPoint access_point,
                                                 const char* new_rlz) {
-  const char* access_point_name = GetAccessPointName(access_point);
-  if (!access_point_name)
+  const StoreKey* access_point_key = GetAccessPointKey(access_point);
+  if (!access_point_key)
     return false;
 
-  std::wstring access_point_name_wide(ASCIIToWide(access_point_name));
   base::win::RegKey key;
   GetAccessPointRlzsRegKey(KEY_WRITE, &key);
 
-  if (!RegKeyWriteValue(key, access_point_name_wide.c_str(), new_rlz)) {
+  if (!RegKeyWriteValue(key, access_point_key->wide_name, new_rlz)) {
     ASSERT_STRING("SetAccessPointRlz: Could not write the new RLZ value");
     return false;
   }
@@ -219,15 +234,14 @@ bool RlzValueStoreRegistry::WriteAccessPointRlz(AccessPoint access_point,
 bool RlzValueStoreRegistry::ReadAccessPointRlz(AccessPoint access_point,
                                                char* rlz,
                                                size_t rlz_size) {
-  const char* access_point_name = GetAccessPointName(access_point);
-  if (!access_point_name)
+  const StoreKey* access_point_key = GetAccessPointKey(access_point);
+  if (!access_point_key)
     return false;
 
   size_t size = rlz_size;
   base::win::RegKey key;
   GetAccessPointRlzsRegKey(KEY_READ, &key);
-  if (!RegKeyReadValue(key, ASCIIToWide(access_point_name).c_str(),
-                       rlz, &size)) {
+  if (!RegKeyReadValue(key, access_point_key->wide_name, rlz, &size)) {
     rlz[0] = 0;
     if (size > rlz_size) {
       ASSERT_STRING("GetAccessPointRlz: Insufficient buffer size");
@@ -238,20 +252,18 @@ bool RlzValueStoreRegistry::ReadAccessPointRlz(AccessPoint access_point,
 }
 
 bool RlzValueStoreRegistry::ClearAccessPointRlz(AccessPoint access_point) {
-  const char* access_point_name = GetAccessPointName(access_point);
-  if (!access_point_name)
+  const StoreKey* access_point_key = GetAccessPointKey(access_point);
+  if (!access_point_key)
     return false;
 
-  std::wstring access_point_name_wide(ASCIIToWide(access_point_name));
   base::win::RegKey key;
   GetAccessPointRlzsRegKey(KEY_WRITE, &key);
 
-  key.DeleteValue(access_point_name_wide.c_str());
+  key.DeleteValue(access_point_key->wide_name);
 
   // Verify deletion.
   DWORD value;
-  if (key.ReadValueDW(access_point_name_wide.c_str(), &value) ==
-      ERROR_SUCCESS) {
+  if (key.ReadValueDW(access_point_key->wide_name, &value) == ERROR_SUCCESS) {
     ASSERT_STRING("SetAccessPointRlz: Could not clear the RLZ value.");
     return false;
   }
@@ -260,10 +272,11 @@ bool RlzValueStoreRegistry::ClearAccessPointRlz(AccessPoint access_point) {
 
 bool RlzValueStoreRegistry::AddProductEvent(Product product,
                                             const char* event_rlz) {
-  std::wstring event_rlz_wide(ASCIIToWide(event_rlz));
+  std::wstring buffer;
+  const wchar_t* event_rlz_wide = GetWideEventName(event_rlz, &buffer);
   base::win::RegKey reg_key;
   GetEventsRegKey(kEventsSubkeyName, &product, KEY_WRITE, &reg_key);
-  if (reg_key.WriteValue(event_rlz_wide.c_str(), 1) != ERROR_SUCCESS) {
+  if (reg_key.WriteValue(event_rlz_wide, 1) != ERROR_SUCCESS) {
     ASSERT_STRING("AddProductEvent: Could not write the new event value");
     return false;
   }
@@ -299,14 +312,15 @@ bool RlzValueStoreRegistry::ReadProductEvents(Product product,
 
 bool RlzValueStoreRegistry::ClearProductEvent(Product product,
                                               const char* event_rlz) {
-  std::wstring event_rlz_wide(ASCIIToWide(event_rlz));
+  std::wstring buffer;
+  const wchar_t* event_rlz_wide = GetWideEventName(event_rlz, &buffer);
   base::win::RegKey key;
   GetEventsRegKey(kEventsSubkeyName, &product, KEY_WRITE, &key);
-  key.DeleteValue(event_rlz_wide.c_str());
+  key.DeleteValue(event_rlz_wide);
 
   // Verify deletion.
   DWORD value;
-  if (key.ReadValueDW(event_rlz_wide.c_str(), &value) == ERROR_SUCCESS) {
+  if (key.ReadValueDW(event_rlz_wide, &value) == ERROR_SUCCESS) {
     ASSERT_STRING("ClearProductEvent: Could not delete the event value.");
     return false;
   }
@@ -321,9 +335,10 @@ bool RlzValueStoreRegistry::ClearAllProductEvents(Product product) {
 bool RlzValueStoreRegistry::AddStatefulEvent(Product product,
                                              const char* event_rlz) {
   base::win::RegKey key;
-  std::wstring event_rlz_wide(ASCIIToWide(event_rlz));
+  std::wstring buffer;
+  const wchar_t* event_rlz_wide = GetWideEventName(event_rlz, &buffer);
   if (!GetEventsRegKey(kStatefulEventsSubkeyName, &product, KEY_WRITE, &key) ||
-      key.WriteValue(event_rlz_wide.c_str(), 1) != ERROR_SUCCESS) {
+      key.WriteValue(event_rlz_wide, 1) != ERROR_SUCCESS) {
     ASSERT_STRING(
         "AddStatefulEvent: Could not write the new stateful event");
     return false;
@@ -337,8 +352,9 @@ bool RlzValueStoreRegistry::IsStatefulEvent(Product product,
   DWORD value;
   base::win::RegKey key;
   GetEventsRegKey(kStatefulEventsSubkeyName, &product, KEY_READ, &key);
-  std::wstring event_rlz_wide(ASCIIToWide(event_rlz));
-  return key.ReadValueDW(event_rlz_wide.c_str(), &value) == ERROR_SUCCESS;
+  std::wstring buffer;
+  const wchar_t* event_rlz_wide = GetWideEventName(event_rlz, &buffer);
+  return key.ReadValueDW(event_rlz_wide, &value) == ERROR_SUCCESS;
 }
 
 bool RlzValueStoreRegistry::ClearAllStatefulEvents(Product product) {
@@ -369,16 +385,45 @@ void RlzValueStoreRegistry::CollectGarbage() {
   VERIFY(DeleteKeyIfEmpty(HKEY_CURRENT_USER, kGoogleKeyName));
 }
 
-ScopedRlzValueStoreLock::ScopedRlzValueStoreLock() {
-  if (!lock_.failed())
-    store_.reset(new RlzValueStoreRegistry);
-}
+// Hands out RlzValueStoreRegistry objects, guarded by the global LibMutex.
+// The mutex has no shared mode, so readers take it exclusively too.
+class RegistryStoreFactory : public RlzValueStoreFactory {
+ public:
+  RegistryStoreFactory() {}
+
+  virtual RlzValueStore* AcquireStore(
+      const StoreShards& shards, RlzValueStore::AccessType access) OVERRIDE {
+    lock_.reset(new LibMutex);
+    if (lock_->failed()) {
+      lock_.reset();
+      return NULL;
+    }
+    return new RlzValueStoreRegistry;
+  }
 
-ScopedRlzValueStoreLock::~ScopedRlzValueStoreLock() {
-}
+  virtual void ReleaseStore(RlzValueStore* store,
+                            RlzValueStore::AccessType access,
+                            bool modified) OVERRIDE {
+    // The registry store writes through, there is nothing to persist.
+    delete store;
+    lock_.reset();
+  }
+
+ private:
+  scoped_ptr<LibMutex> lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(RegistryStoreFactory);
+};
+
+namespace {
+
+base::LazyInstance<RegistryStoreFactory>::Leaky g_default_factory =
+    LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
 
-RlzValueStore* ScopedRlzValueStoreLock::GetStore() {
-  return store_.get();
+RlzValueStoreFactory* GetDefaultRlzValueStoreFactory() {
+  return g_default_factory.Pointer();
 }
 
 }  // namespace rlz_lib
@@ -46,7 +46,7 @@ class RlzValueStoreRegistry : public RlzValueStore {
  private:
   RlzValueStoreRegistry() {}
   DISALLOW_COPY_AND_ASSIGN(RlzValueStoreRegistry);
-  friend class ScopedRlzValueStoreLock;
+  friend class RegistryStoreFactory;
 };
 
 }  // namespace rlz_lib